@@ -0,0 +1,66 @@
+// Measures an admission check: the token bucket of an address or a user
+// looked up in its table, refilled and taken from. With a few clients their
+// buckets stay cached; with many more than the table holds, every check
+// evicts one. Neither should allocate. The baseline is a std::unordered_map
+// of buckets keyed by the address text, as a straightforward limiter would,
+// without the clock read; it grows with every new client and never shrinks.
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "admission.h"
+#include "bench.h"
+
+int main() {
+  using namespace glimpse;
+
+  // Every check passes, so they all do the same work
+  AdmissionOptions options{.address = {.perSecond = 1e9, .burst = 1e9},
+                           .user = {.perSecond = 1e9, .burst = 1e9},
+                           .tableSize = 8192};
+
+  for (std::size_t clients : {1000, 100000}) {
+    std::vector<std::string> addresses;
+    std::vector<Id> users;
+    for (std::size_t i = 0; i < clients; ++i) {
+      addresses.push_back("::ffff:10." + std::to_string(i >> 16 & 255) + "." +
+                          std::to_string(i >> 8 & 255) + "." +
+                          std::to_string(i & 255));
+      users.push_back(randomId());
+    }
+    std::printf("%zu clients, %zu buckets of each kind\n", clients,
+                options.tableSize);
+
+    std::unordered_map<std::string, std::pair<double, int64_t>> map;
+    std::size_t next = 0;
+    bench::run("  std::unordered_map by address", 2000000, [&]() {
+      auto& bucket = map[addresses[next++ % clients]];
+      bucket.first += 1;
+      bucket.second = next;
+      bench::doNotOptimize(bucket);
+    });
+
+    Admission admission(options);
+    next = 0;
+    bench::run("  Admission::admitAddress", 2000000, [&]() {
+      bench::doNotOptimize(admission.admitAddress(addresses[next++ % clients]));
+    });
+    next = 0;
+    bench::run("  Admission::admitUser", 2000000, [&]() {
+      bench::doNotOptimize(admission.admitUser(users[next++ % clients]));
+    });
+  }
+
+  // A client in a loop gets its burst, then the sustained rate
+  Admission strict({.address = {.perSecond = 10, .burst = 20},
+                    .user = {.perSecond = 0, .burst = 0},
+                    .tableSize = 8192});
+  std::size_t admitted = 0;
+  for (int i = 0; i < 1000; ++i) {
+    admitted += strict.admitAddress("::ffff:192.0.2.1") ? 1 : 0;
+  }
+  std::printf("1000 requests at once, burst 20: %zu admitted\n", admitted);
+  return 0;
+}
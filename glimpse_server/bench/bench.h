@@ -0,0 +1,74 @@
+#pragma once
+
+// Minimal helpers shared by the micro-benchmarks. Include from exactly one
+// translation unit per benchmark executable, it replaces the global
+// operator new to count heap allocations.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string_view>
+
+namespace glimpse::bench {
+
+inline std::atomic<std::size_t> allocations{0};
+
+struct Result {
+  double nsPerOp;
+  double allocationsPerOp;
+};
+
+// Keeps the compiler from optimizing away a computed value
+template <typename T>
+void doNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+template <typename Fn>
+Result run(std::string_view name, std::size_t iterations, Fn&& fn) {
+  for (std::size_t i = 0; i < iterations / 10 + 1; ++i) {
+    fn();
+  }
+
+  auto allocationsBefore = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; ++i) {
+    fn();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  Result result = {
+      .nsPerOp = std::chrono::duration<double, std::nano>(elapsed).count() /
+                 static_cast<double>(iterations),
+      .allocationsPerOp =
+          static_cast<double>(allocations.load() - allocationsBefore) /
+          static_cast<double>(iterations),
+  };
+  std::printf("%-56.*s %12.1f ns/op %8.2f allocs/op\n",
+              static_cast<int>(name.size()), name.data(), result.nsPerOp,
+              result.allocationsPerOp);
+  return result;
+}
+}  // namespace glimpse::bench
+
+// Kept out of line so the compiler does not pair the inlined free() with the
+// allocation site and warn about mismatched new/delete
+__attribute__((noinline)) void* operator new(std::size_t size) {
+  glimpse::bench::allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr,
+                                               std::size_t) noexcept {
+  std::free(ptr);
+}
@@ -0,0 +1,84 @@
+// Compares the former string ids (a boost::uuids::random_generator per call,
+// rendered to a std::string key) with the 128-bit Id for minting, room table
+// lookups and a room's create/erase cycle.
+
+#include <boost/uuid/random_generator.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bench.h"
+#include "id.h"
+
+namespace {
+constexpr std::size_t ROOM_COUNT = 10000;
+constexpr std::size_t SHARD_COUNT = 4;
+
+std::string newStringId() {
+  return boost::uuids::to_string(boost::uuids::random_generator()());
+}
+
+// Stands in for Room, only the key type differs between the two tables
+struct Entry {
+  uint64_t payload[4];
+};
+}  // namespace
+
+int main() {
+  using glimpse::Id;
+
+  // Round trip through the text form
+  auto minted = glimpse::newShardedId(3, SHARD_COUNT);
+  if (Id::parse(minted.toString()) != minted or
+      glimpse::shardOfId(minted, SHARD_COUNT) != 3) {
+    std::fprintf(stderr, "id text round trip failed\n");
+    return 1;
+  }
+
+  std::printf("Minting\n");
+  glimpse::bench::run("  boost random_generator()() + to_string", 20000, []() {
+    auto id = newStringId();
+    glimpse::bench::doNotOptimize(id.data());
+  });
+  glimpse::bench::run("  newShardedId()", 1000000, []() {
+    auto id = glimpse::newShardedId(1, SHARD_COUNT);
+    glimpse::bench::doNotOptimize(id);
+  });
+
+  std::vector<std::string> stringIds;
+  std::vector<Id> ids;
+  std::unordered_map<std::string, Entry> stringRooms;
+  std::unordered_map<Id, Entry, glimpse::IdHash> rooms;
+  for (std::size_t i = 0; i < ROOM_COUNT; ++i) {
+    ids.push_back(glimpse::newShardedId(0, SHARD_COUNT));
+    stringIds.push_back(ids.back().toString());
+    stringRooms.try_emplace(stringIds.back());
+    rooms.try_emplace(ids.back());
+  }
+
+  std::printf("Lookup among %zu rooms\n", ROOM_COUNT);
+  std::size_t next = 0;
+  glimpse::bench::run("  unordered_map<std::string>::find", 1000000, [&]() {
+    auto it = stringRooms.find(stringIds[next++ % ROOM_COUNT]);
+    glimpse::bench::doNotOptimize(it);
+  });
+  glimpse::bench::run("  unordered_map<Id>::find", 1000000, [&]() {
+    auto it = rooms.find(ids[next++ % ROOM_COUNT]);
+    glimpse::bench::doNotOptimize(it);
+  });
+
+  std::printf("Create and erase a room among %zu\n", ROOM_COUNT);
+  glimpse::bench::run("  std::string key", 20000, [&]() {
+    auto id = newStringId();
+    stringRooms.try_emplace(id);
+    stringRooms.erase(id);
+  });
+  glimpse::bench::run("  Id key", 1000000, [&]() {
+    auto id = glimpse::newShardedId(0, SHARD_COUNT);
+    rooms.try_emplace(id);
+    rooms.erase(id);
+  });
+  return 0;
+}
@@ -0,0 +1,72 @@
+// Measures what one log record costs the event-loop thread that writes it.
+// The baseline is the former setup: the message formatted into a temporary
+// string, then written through a synchronous logger. Records go to a sink
+// that takes 5 us per write, about what a terminal or a pipe with a slow
+// reader costs.
+
+#include <spdlog/async.h>
+#include <spdlog/sinks/base_sink.h>
+#include <spdlog/spdlog.h>
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "bench.h"
+#include "id.h"
+#include "logging.h"
+
+namespace {
+class SlowSink : public spdlog::sinks::base_sink<std::mutex> {
+ protected:
+  void sink_it_(const spdlog::details::log_msg& msg) override {
+    spdlog::memory_buf_t formatted;
+    formatter_->format(msg, formatted);
+    auto until =
+        std::chrono::steady_clock::now() + std::chrono::microseconds(5);
+    while (std::chrono::steady_clock::now() < until) {
+    }
+    glimpse::bench::doNotOptimize(formatted);
+  }
+  void flush_() override {}
+};
+}  // namespace
+
+int main() {
+  using namespace glimpse;
+  auto userId = randomId();
+  auto roomId = randomId();
+
+  std::printf("Log one failed request\n");
+  auto sync = std::make_shared<spdlog::logger>("sync",
+                                               std::make_shared<SlowSink>());
+  bench::run("  fmt::format, then synchronous logger", 100000, [&]() {
+    auto message = fmt::format("Could not exchange sdp: {} (user={}, id={})",
+                               "room does not exist", userId, roomId);
+    sync->error(message);
+  });
+  bench::run("  synchronous logger", 100000, [&]() {
+    sync->error("Could not exchange sdp: {} (user={}, id={})",
+                "room does not exist", userId, roomId);
+  });
+
+  spdlog::init_thread_pool(8192, 1);
+  auto async = spdlog::create_async_nb<SlowSink>("async");
+  bench::run("  asynchronous logger, overrun oldest", 1000000, [&]() {
+    async->error("Could not exchange sdp: {} (user={}, id={})",
+                 "room does not exist", userId, roomId);
+  });
+
+  std::printf("Log one failed request past its rate limit\n");
+  spdlog::set_default_logger(async);
+  logging::RateLimit limit;
+  bench::run("  logging::limited, suppressed", 10000000, [&]() {
+    logging::limited(limit, spdlog::level::err,
+                     "Could not exchange sdp: {} (user={}, id={})",
+                     "room does not exist", userId, roomId);
+  });
+  spdlog::shutdown();
+  return 0;
+}
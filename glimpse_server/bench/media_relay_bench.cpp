@@ -0,0 +1,153 @@
+// Measures the media relay over loopback: packets relayed per second from
+// one side of a session to the other, with the sender writing and the
+// receiver reading in batches, how many packets each recvmmsg of the relay
+// carried and the heap allocations per relayed packet, which should be
+// none. The relay binds UDP ports 17401 and 17402.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "media_relay.h"
+
+namespace {
+// A client socket on an ephemeral loopback port
+int clientSocket() {
+  int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  int bufferSize = 4 << 20;
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof bufferSize);
+  timeval timeout = {.tv_sec = 0, .tv_usec = 100000};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  return fd;
+}
+
+// STUN Binding request with `token` as its USERNAME, which binds a relay
+// port to the socket it is sent from
+std::string bindingRequest(const std::string& token) {
+  auto padded = (token.size() + 3) & ~std::size_t(3);
+  std::string request(20 + 4 + padded, '\0');
+  auto store16 = [&request](std::size_t at, uint16_t value) {
+    value = htons(value);
+    std::memcpy(&request[at], &value, sizeof value);
+  };
+  store16(0, 0x0001);
+  store16(2, static_cast<uint16_t>(4 + padded));
+  uint32_t cookie = htonl(0x2112A442);
+  std::memcpy(&request[4], &cookie, sizeof cookie);
+  store16(20, 0x0006);
+  store16(22, static_cast<uint16_t>(token.size()));
+  std::memcpy(&request[24], token.data(), token.size());
+  return request;
+}
+
+sockaddr_in loopback(uint16_t port) {
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return address;
+}
+}  // namespace
+
+int main() {
+  using namespace glimpse;
+  constexpr std::size_t BATCH = 64;
+  constexpr std::size_t ROUNDS = 20000;
+  // About the size of a video RTP packet
+  constexpr std::size_t PACKET_SIZE = 1200;
+
+  MediaRelay relay({.host = "127.0.0.1",
+                    .minPort = 17401,
+                    .maxPort = 17402,
+                    .threads = 1,
+                    .batchSize = BATCH,
+                    .roomByteRate = 0});
+  relay.start();
+  auto ports = relay.open(Id(1, 1), Id(2, 1), Id(2, 2));
+
+  // Each side binds its port with its token, the relay answers
+  int sender = clientSocket();
+  int receiver = clientSocket();
+  auto toPeer = loopback(ports.port);
+  auto toUser = loopback(ports.peerPort);
+  char answer[128];
+  auto bindReceiver = bindingRequest(ports.peerToken);
+  ::sendto(receiver, bindReceiver.data(), bindReceiver.size(), 0,
+           reinterpret_cast<sockaddr*>(&toUser), sizeof toUser);
+  ::recv(receiver, answer, sizeof answer, 0);
+  auto bindSender = bindingRequest(ports.token);
+  ::sendto(sender, bindSender.data(), bindSender.size(), 0,
+           reinterpret_cast<sockaddr*>(&toPeer), sizeof toPeer);
+  ::recv(sender, answer, sizeof answer, 0);
+
+  std::string packet(PACKET_SIZE, 'x');
+  std::vector<char> incoming(BATCH * PACKET_SIZE);
+  std::vector<iovec> packetVectors(BATCH);
+  std::vector<iovec> incomingVectors(BATCH);
+  std::vector<mmsghdr> packets(BATCH);
+  std::vector<mmsghdr> received(BATCH);
+  for (std::size_t i = 0; i < BATCH; ++i) {
+    packetVectors[i] = {.iov_base = packet.data(), .iov_len = packet.size()};
+    packets[i].msg_hdr.msg_name = &toPeer;
+    packets[i].msg_hdr.msg_namelen = sizeof toPeer;
+    packets[i].msg_hdr.msg_iov = &packetVectors[i];
+    packets[i].msg_hdr.msg_iovlen = 1;
+    incomingVectors[i] = {.iov_base = &incoming[i * PACKET_SIZE],
+                          .iov_len = PACKET_SIZE};
+    received[i].msg_hdr.msg_iov = &incomingVectors[i];
+    received[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  std::printf("Loopback, %zu byte packets, %zu per sendmmsg\n", PACKET_SIZE,
+              BATCH);
+  auto before = relay.stats();
+  auto allocationsBefore = bench::allocations.load();
+  std::size_t relayed = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t round = 0; round < ROUNDS; ++round) {
+    auto sent = ::sendmmsg(sender, packets.data(), BATCH, 0);
+    // Waits for the batch, a lost packet ends the wait at the timeout
+    for (std::size_t got = 0; sent > 0 and got < std::size_t(sent);) {
+      auto result = ::recvmmsg(receiver, received.data(), BATCH,
+                               MSG_WAITFORONE, nullptr);
+      if (result <= 0) {
+        break;
+      }
+      got += static_cast<std::size_t>(result);
+      relayed += static_cast<std::size_t>(result);
+    }
+  }
+  auto elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start);
+  auto allocations = bench::allocations.load() - allocationsBefore;
+  auto after = relay.stats();
+
+  std::printf("  %-54s %12.0f packets/s\n", "relayed",
+              static_cast<double>(relayed) / elapsed.count());
+  std::printf("  %-54s %12.1f MB/s\n", "relayed",
+              static_cast<double>(relayed * PACKET_SIZE) / elapsed.count() /
+                  1e6);
+  std::printf("  %-54s %12.1f packets\n", "per relay recvmmsg",
+              static_cast<double>(after.packets - before.packets) /
+                  static_cast<double>(after.batches - before.batches));
+  std::printf("  %-54s %12.4f\n", "allocations per packet",
+              static_cast<double>(allocations) /
+                  static_cast<double>(std::max<std::size_t>(1, relayed)));
+  std::printf("  %-54s %12zu of %zu\n", "lost", ROUNDS * BATCH - relayed,
+              ROUNDS * BATCH);
+
+  ::close(sender);
+  ::close(receiver);
+  relay.closeRoom(Id(1, 1));
+  relay.stop();
+  return 0;
+}
@@ -0,0 +1,40 @@
+// Measures what instrumentation adds to a request: bumping a counter,
+// recording a latency, and the clock reads of a ScopedTimer. The baseline is
+// a shared counter incremented with fetch_add, as a global registry would.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "bench.h"
+#include "metrics.h"
+
+int main() {
+  using namespace glimpse;
+
+  std::printf("Count one event\n");
+  std::atomic<uint64_t> shared{0};
+  bench::run("  shared std::atomic, fetch_add", 10000000,
+             [&]() { shared.fetch_add(1, std::memory_order_relaxed); });
+  bench::run("  metrics::messageReceived", 10000000,
+             []() { metrics::messageReceived(WsMessage::SDP); });
+
+  std::printf("Record one latency\n");
+  std::size_t next = 0;
+  bench::run("  metrics::record, precomputed duration", 10000000, [&]() {
+    metrics::record(metrics::Latency::WS_SEND,
+                    std::chrono::nanoseconds(next++ & 0xffff));
+  });
+  bench::run("  metrics::ScopedTimer, two clock reads", 10000000, []() {
+    metrics::ScopedTimer timer(metrics::Latency::JSON_PARSE);
+  });
+
+  std::printf("Scrape\n");
+  bench::run("  metrics::writePrometheus", 1000, []() {
+    std::string out;
+    metrics::writePrometheus(out);
+    bench::doNotOptimize(out);
+  });
+  return 0;
+}
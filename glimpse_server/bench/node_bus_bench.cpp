@@ -0,0 +1,86 @@
+// Measures the links between cluster nodes: what queuing a frame costs the
+// calling thread, and the throughput of a burst from one node to another
+// over loopback, with how many frames each write carries. Both nodes run in
+// this process on ports 17101 and 17102.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "hash_ring.h"
+#include "node_bus.h"
+#include "wire.h"
+
+int main() {
+  using namespace glimpse;
+  constexpr std::size_t FRAME_COUNT = 1000000;
+  // About the size of a forwarded ICE candidate
+  const std::string payload(160, 'x');
+  std::vector<std::string> members = {"127.0.0.1:17101", "127.0.0.1:17102"};
+
+  std::atomic<uint64_t> received = 0;
+  NodeBusHandler sender = {
+      .greet = [](std::size_t, std::string&) {},
+      .receive = [](std::size_t, std::string) {},
+      .linkDown = [](std::size_t, uint64_t) {},
+      .peerDown = [](std::size_t) {},
+  };
+  NodeBusHandler receiver = sender;
+  receiver.receive = [&received](std::size_t, std::string frames) {
+    uint64_t count = 0;
+    NodeBus::forEachFrame(frames, [&count](std::string_view) { ++count; });
+    received.fetch_add(count, std::memory_order_release);
+  };
+
+  NodeBus a(std::make_shared<HashRing>(members, 0), {}, sender);
+  NodeBus b(std::make_shared<HashRing>(members, 1), {}, receiver);
+  a.start();
+  b.start();
+  while (a.stats().connectedLinks == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  auto send = [&]() {
+    return a.send(1, [&payload](std::string& out) {
+      wire::putString(out, payload);
+    });
+  };
+
+  std::printf("Queue a %zu byte frame\n", payload.size());
+  bench::run("  NodeBus::send", 100000,
+             [&]() { bench::doNotOptimize(send()); });
+  while (received.load(std::memory_order_acquire) < a.stats().framesSent) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::printf("Burst of %zu frames to the other node\n", FRAME_COUNT);
+  auto before = a.stats();
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < FRAME_COUNT; ++i) {
+    // Dropped past maxQueuedBytes, the bus is the bottleneck then
+    while (send() == 0) {
+      std::this_thread::yield();
+    }
+  }
+  auto target = before.framesSent + FRAME_COUNT;
+  while (received.load(std::memory_order_acquire) < target) {
+    std::this_thread::yield();
+  }
+  auto elapsed = std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start);
+  auto after = a.stats();
+  std::printf("  %-54s %12.1f ns/frame\n", "sent and received",
+              elapsed.count() / FRAME_COUNT);
+  std::printf("  %-54s %12.1f frames\n", "per write",
+              static_cast<double>(after.framesSent - before.framesSent) /
+                  static_cast<double>(after.writes - before.writes));
+
+  a.stop();
+  b.stop();
+  return 0;
+}
@@ -0,0 +1,81 @@
+// Measures what it takes to receive a small POST and hand its parsed payload
+// to the handler, the way Controller::handlePost() sets up its uWS
+// callbacks. The baseline is the previous pipeline: a shared_ptr'd flag and
+// body string per request, the handler wrapped in a std::function, and an
+// onData callback capturing all of them. The pooled pipeline keeps its body
+// in a PostBodyPool and its callbacks within the inline storage of
+// uWS::MoveOnlyFunction, so in steady state it should not allocate.
+
+#include <uwebsockets/MoveOnlyFunction.h>
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "bench.h"
+#include "controller.h"
+#include "post_body.h"
+
+namespace {
+constexpr std::string_view REQUEST =
+    R"({"userId":"9b2f1d3e-6c4a-4e8b-a1f0-5d7c3b2a1e90",)"
+    R"("roomId":"0000002a-6c4a-4e8b-a1f0-5d7c3b2a1e90",)"
+    R"("ice":"{\"candidate\":\"candidate:1 1 udp 2122260223 )"
+    R"(192.168.1.20 54400 typ host generation 0\",\"sdpMid\":\"0\",)"
+    R"(\"sdpMLineIndex\":0}"})";
+}  // namespace
+
+int main() {
+  using namespace glimpse;
+
+  std::printf("ICE POST, %zu byte body in one chunk\n", REQUEST.size());
+  std::size_t handled = 0;
+
+  bench::run("  shared_ptr body, std::function handler", 1000000, [&]() {
+    auto isAborted = std::make_shared<bool>(false);
+    auto body = std::make_shared<std::string>();
+    body->reserve(REQUEST.size());
+    std::function<void(std::shared_ptr<std::string>, std::shared_ptr<bool>)>
+        bodyHandler = [&handled](auto body, auto) {
+          auto payload = parseJsonInPlace<ICEExchangePayload>(*body);
+          handled += payload.ice.size();
+        };
+    uWS::MoveOnlyFunction<void()> onAborted(
+        [isAborted]() { *isAborted = true; });
+    uWS::MoveOnlyFunction<void(std::string_view, bool)> onData(
+        [body, isAborted, bodyHandler](std::string_view chunk, bool isLast) {
+          body->append(chunk);
+          if (isLast and not *isAborted) {
+            bodyHandler(body, isAborted);
+          }
+        });
+    onData(REQUEST, true);
+  });
+
+  auto& bodies = PostBodyPool::local();
+  bench::run("  PostBodyPool, inline callbacks", 1000000, [&]() {
+    auto handler = [&handled](PostBody& body) {
+      auto payload = parseJsonInPlace<ICEExchangePayload>(body.data);
+      handled += payload.ice.size();
+    };
+    auto* body = bodies.acquire(nullptr);
+    body->data.reserve(REQUEST.size());
+    uWS::MoveOnlyFunction<void()> onAborted([body]() {
+      body->aborted = true;
+    });
+    uWS::MoveOnlyFunction<void(std::string_view, bool)> onData(
+        [body, handler](std::string_view chunk, bool isLast) {
+          if (not PostBodyPool::append(*body, chunk, isLast)) {
+            return;
+          }
+          handler(*body);
+          PostBodyPool::local().release(body);
+        });
+    onData(REQUEST, true);
+  });
+
+  bench::doNotOptimize(handled);
+  return 0;
+}
@@ -0,0 +1,62 @@
+// Measures what logging a frame for session resume adds to every frame sent
+// to a resumable session: taking the session's mutex and copying the frame
+// into its ResumeLog. The frames are a call's worth of candidates with an
+// offer now and then. The baseline keeps the same frames as strings in a
+// std::deque bounded the same way, which allocates for every frame.
+// Replaying after a reconnect is measured separately.
+
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "resume_log.h"
+
+int main() {
+  using namespace glimpse;
+
+  ResumeOptions options;
+  std::vector<std::string> frames;
+  for (int i = 0; i < 16; ++i) {
+    // An offer every 16 frames, about 4 KB, and 250 byte candidates
+    frames.push_back(i == 0 ? std::string(4000, 'o') : std::string(250, 'c'));
+  }
+  std::printf("%zu frame ring of %zu bytes\n", options.maxFrames,
+              options.maxBytes);
+
+  std::size_t next = 0;
+  std::deque<std::string> deque;
+  std::size_t dequeBytes = 0;
+  std::mutex dequeMutex;
+  bench::run("  std::deque of strings", 1000000, [&]() {
+    const auto& frame = frames[next++ % frames.size()];
+    std::lock_guard lock(dequeMutex);
+    deque.push_back(frame);
+    dequeBytes += frame.size();
+    while (deque.size() > options.maxFrames or dequeBytes > options.maxBytes) {
+      dequeBytes -= deque.front().size();
+      deque.pop_front();
+    }
+  });
+
+  ResumeState state(randomId(), options);
+  bench::run("  ResumeLog", 1000000, [&]() {
+    const auto& frame = frames[next++ % frames.size()];
+    std::lock_guard lock(state.mutex);
+    state.log.append(WsMessage::ICE, frame);
+  });
+
+  std::size_t replayed = 0;
+  bench::run("  replay of the last 10 frames", 100000, [&]() {
+    state.log.replayAfter(state.log.lastSeq() - 10,
+                          [&replayed](auto, std::string_view frame) {
+                            replayed += frame.size();
+                          });
+  });
+
+  bench::doNotOptimize(replayed);
+  bench::doNotOptimize(dequeBytes);
+  return 0;
+}
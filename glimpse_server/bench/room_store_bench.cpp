@@ -0,0 +1,78 @@
+// Measures what persisting rooms costs: recording mutations on the event
+// loop, against writing them to the journal there and then, and how long a
+// restart takes to rebuild the rooms. Files go to a temporary directory.
+// The writer thread's work counts too when it shares the core.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+#include "bench.h"
+#include "id.h"
+#include "room_store.h"
+
+int main() {
+  using namespace glimpse;
+  constexpr std::size_t ROOM_COUNT = 100000;
+  char directoryTemplate[] = "/tmp/glimpse_room_store_benchXXXXXX";
+  std::filesystem::path directory = ::mkdtemp(directoryTemplate);
+  auto host = User{.id = randomId(), .name = "host"};
+  auto guest = User{.id = randomId(), .name = "guest"};
+
+  std::printf("Record a room created and closed\n");
+  {
+    auto path = directory / "sync.journal";
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    std::string record(96, 'x');
+    bench::run("  write() to the journal", 100000, [&]() {
+      bench::doNotOptimize(::write(fd, record.data(), record.size()));
+    });
+    bench::run("  write() and fdatasync()", 1000, [&]() {
+      bench::doNotOptimize(::write(fd, record.data(), record.size()));
+      ::fdatasync(fd);
+    });
+    ::close(fd);
+  }
+  {
+    RoomStore store({.directory = directory / "store"}, 1);
+    store.load();
+    store.start();
+    bench::run("  RoomJournal, batched by the writer thread", 1000000, [&]() {
+      auto roomId = newShardedId(0, 1);
+      store.journal(0).roomCreated(roomId, host);
+      store.journal(0).roomClosed(roomId);
+    });
+  }
+
+  std::printf("Restart with %zu rooms of two\n", ROOM_COUNT);
+  {
+    RoomStore store({.directory = directory / "restart"}, 4);
+    store.load();
+    store.start();
+    for (std::size_t i = 0; i < ROOM_COUNT; ++i) {
+      auto shard = i % 4;
+      auto roomId = newShardedId(shard, 4);
+      store.journal(shard).roomCreated(roomId, host);
+      store.journal(shard).participantAdded(roomId, guest);
+    }
+  }
+  // Each load leaves a snapshot and an empty journal behind
+  for (auto source : {"journals", "snapshots"}) {
+    auto start = std::chrono::steady_clock::now();
+    RoomStore store({.directory = directory / "restart"}, 4);
+    auto stored = store.load();
+    auto elapsed = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start);
+    bench::doNotOptimize(stored);
+    std::printf("  RoomStore::load, from the %-29s %12.1f ms\n", source,
+                elapsed.count());
+  }
+
+  std::filesystem::remove_all(directory);
+  return 0;
+}
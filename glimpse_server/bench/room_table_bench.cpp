@@ -0,0 +1,138 @@
+// Measures the room resolution RoomManager does for every relayed SDP/ICE
+// message, and a room's create/erase cycle. The baseline is the former
+// table: std::unordered_map keyed by UUID strings, a contains() followed by
+// several at() calls, and Room getters returning std::string copies.
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bench.h"
+#include "id.h"
+#include "id_table.h"
+#include "room.h"
+#include "user.h"
+
+namespace {
+constexpr std::size_t ROOM_COUNT = 10000;
+
+struct LegacyUser {
+  std::string id;
+  std::string name;
+};
+
+class LegacyRoom {
+ public:
+  LegacyRoom(const std::string& id, const LegacyUser& host)
+      : id_(id), host_(host) {}
+
+  std::string getId() { return id_; }
+  std::string getHostId() { return host_.id; }
+  std::string getGuestId() { return guest_.id; }
+  void setGuest(const LegacyUser& user) { guest_ = user; }
+
+ private:
+  std::string id_;
+  LegacyUser host_;
+  LegacyUser guest_;
+};
+
+// The checks of the former exchangeSDPMessage(), up to picking the peer
+const std::string* legacyResolvePeer(
+    std::unordered_map<std::string, LegacyRoom>& rooms,
+    const std::string& roomId, const std::string& fromUserId) {
+  if (not rooms.contains(roomId)) {
+    return nullptr;
+  }
+  if (fromUserId != rooms.at(roomId).getHostId() and
+      fromUserId != rooms.at(roomId).getGuestId()) {
+    return nullptr;
+  }
+  thread_local std::string toUserId;
+  toUserId = fromUserId == rooms.at(roomId).getHostId()
+                 ? rooms.at(roomId).getGuestId()
+                 : rooms.at(roomId).getHostId();
+  return &toUserId;
+}
+
+// The same checks against IdTable, resolving the room once
+const glimpse::Id* resolvePeer(glimpse::IdTable<glimpse::Room>& rooms,
+                               const glimpse::Id& roomId,
+                               const glimpse::Id& fromUserId) {
+  auto* room = rooms.find(roomId);
+  if (room == nullptr or not room->hasParticipant(fromUserId)) {
+    return nullptr;
+  }
+  auto participants = room->getParticipants();
+  return fromUserId == participants[0].id ? &participants[1].id
+                                          : &participants[0].id;
+}
+}  // namespace
+
+int main() {
+  using glimpse::Id;
+
+  struct Participants {
+    Id room;
+    Id host;
+    Id guest;
+  };
+  std::vector<Participants> participants;
+  std::unordered_map<std::string, LegacyRoom> legacyRooms;
+  std::unordered_map<Id, glimpse::Room, glimpse::IdHash> nodeRooms;
+  glimpse::IdTable<glimpse::Room> rooms;
+  for (std::size_t i = 0; i < ROOM_COUNT; ++i) {
+    Participants p = {glimpse::newShardedId(0, 1), glimpse::randomId(),
+                      glimpse::randomId()};
+    participants.push_back(p);
+
+    auto [legacy, legacyCreated] = legacyRooms.try_emplace(
+        p.room.toString(), p.room.toString(),
+        LegacyUser{p.host.toString(), "host"});
+    legacy->second.setGuest({p.guest.toString(), "guest"});
+
+    auto [room, created] = rooms.tryEmplace(p.room, p.room,
+                                            glimpse::User{p.host, "host"});
+    room->addParticipant({p.guest, "guest"});
+    nodeRooms.try_emplace(p.room, *room);
+  }
+
+  // The legacy path is fed the text forms, as it received them
+  std::vector<std::string> roomTexts;
+  std::vector<std::string> guestTexts;
+  for (const auto& p : participants) {
+    roomTexts.push_back(p.room.toString());
+    guestTexts.push_back(p.guest.toString());
+  }
+
+  std::printf("Resolve room and peer of a relayed message, %zu rooms\n",
+              ROOM_COUNT);
+  std::size_t next = 0;
+  glimpse::bench::run("  unordered_map<std::string>, string getters", 1000000,
+                      [&]() {
+                        auto i = next++ % ROOM_COUNT;
+                        auto* peer = legacyResolvePeer(
+                            legacyRooms, roomTexts[i], guestTexts[i]);
+                        glimpse::bench::doNotOptimize(peer);
+                      });
+  glimpse::bench::run("  IdTable<Room>, single lookup", 1000000, [&]() {
+    auto i = next++ % ROOM_COUNT;
+    const auto& p = participants[i];
+    auto* peer = resolvePeer(rooms, p.room, p.guest);
+    glimpse::bench::doNotOptimize(peer);
+  });
+
+  std::printf("Create and erase a room among %zu\n", ROOM_COUNT);
+  glimpse::bench::run("  unordered_map<Id, Room>", 1000000, [&]() {
+    auto id = glimpse::newShardedId(0, 1);
+    nodeRooms.try_emplace(id, id, glimpse::User{id, "host"});
+    nodeRooms.erase(id);
+  });
+  glimpse::bench::run("  IdTable<Room>", 1000000, [&]() {
+    auto id = glimpse::newShardedId(0, 1);
+    rooms.tryEmplace(id, id, glimpse::User{id, "host"});
+    rooms.erase(id);
+  });
+  return 0;
+}
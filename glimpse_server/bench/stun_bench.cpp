@@ -0,0 +1,140 @@
+// Measures the embedded STUN server: answering one request, on the fast
+// path and with a FINGERPRINT to check and compute, and binding requests
+// answered per second over loopback, with the client sending and reading
+// in batches. The server binds UDP port 17301.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "stun_server.h"
+
+namespace {
+void put16(std::string& out, uint16_t value) {
+  value = htons(value);
+  out.append(reinterpret_cast<const char*>(&value), sizeof value);
+}
+
+void put32(std::string& out, uint32_t value) {
+  value = htonl(value);
+  out.append(reinterpret_cast<const char*>(&value), sizeof value);
+}
+
+// A Binding request, with SOFTWARE and FINGERPRINT if `attributes`
+std::string bindingRequest(bool attributes) {
+  std::string request;
+  put16(request, 0x0001);
+  put16(request, attributes ? 20 : 0);
+  put32(request, 0x2112A442);
+  request.append("transaction!");
+  if (attributes) {
+    put16(request, 0x8022);
+    put16(request, 8);
+    request.append("glimpse!");
+    auto crc = ::crc32(0, reinterpret_cast<const Bytef*>(request.data()),
+                       static_cast<uInt>(request.size()));
+    put16(request, 0x8028);
+    put16(request, 4);
+    put32(request, static_cast<uint32_t>(crc) ^ 0x5354554e);
+  }
+  return request;
+}
+}  // namespace
+
+int main() {
+  using namespace glimpse;
+  constexpr uint16_t PORT = 17301;
+  constexpr std::size_t BATCH = 64;
+  constexpr std::size_t ROUNDS = 20000;
+
+  sockaddr_storage from{};
+  auto& client = reinterpret_cast<sockaddr_in&>(from);
+  client.sin_family = AF_INET;
+  client.sin_port = htons(40000);
+  client.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  char response[STUN_MAX_RESPONSE_SIZE];
+
+  std::printf("Answer a binding request\n");
+  for (bool attributes : {false, true}) {
+    auto request = bindingRequest(attributes);
+    bench::run(attributes ? "  answerStunRequest, SOFTWARE and FINGERPRINT"
+                          : "  answerStunRequest, no attributes",
+               10000000, [&]() {
+                 bench::doNotOptimize(answerStunRequest(
+                     request.data(), request.size(), from, response));
+               });
+  }
+
+  std::printf("Loopback, %zu requests per sendmmsg\n", BATCH);
+  StunServer server({.port = PORT, .batchSize = BATCH});
+  server.start();
+
+  int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  int bufferSize = 4 << 20;
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof bufferSize);
+  timeval timeout = {.tv_sec = 0, .tv_usec = 100000};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  sockaddr_in to{};
+  to.sin_family = AF_INET;
+  to.sin_port = htons(PORT);
+  to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  auto request = bindingRequest(false);
+  std::vector<char> answers(BATCH * STUN_MAX_RESPONSE_SIZE);
+  std::vector<iovec> requestVectors(BATCH);
+  std::vector<iovec> answerVectors(BATCH);
+  std::vector<mmsghdr> requests(BATCH);
+  std::vector<mmsghdr> received(BATCH);
+  for (std::size_t i = 0; i < BATCH; ++i) {
+    requestVectors[i] = {.iov_base = request.data(),
+                         .iov_len = request.size()};
+    requests[i].msg_hdr.msg_name = &to;
+    requests[i].msg_hdr.msg_namelen = sizeof to;
+    requests[i].msg_hdr.msg_iov = &requestVectors[i];
+    requests[i].msg_hdr.msg_iovlen = 1;
+    answerVectors[i] = {.iov_base = &answers[i * STUN_MAX_RESPONSE_SIZE],
+                        .iov_len = STUN_MAX_RESPONSE_SIZE};
+    received[i].msg_hdr.msg_iov = &answerVectors[i];
+    received[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  std::size_t answered = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t round = 0; round < ROUNDS; ++round) {
+    auto sent = ::sendmmsg(fd, requests.data(), BATCH, 0);
+    // Waits for the batch, a lost datagram ends the wait at the timeout
+    for (std::size_t got = 0; sent > 0 and got < std::size_t(sent);) {
+      auto result = ::recvmmsg(fd, received.data(), BATCH, MSG_WAITFORONE,
+                               nullptr);
+      if (result <= 0) {
+        break;
+      }
+      got += static_cast<std::size_t>(result);
+      answered += static_cast<std::size_t>(result);
+    }
+  }
+  auto elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start);
+  auto stats = server.stats();
+  std::printf("  %-54s %12.0f requests/s\n", "answered",
+              static_cast<double>(answered) / elapsed.count());
+  std::printf("  %-54s %12.1f requests\n", "per server recvmmsg",
+              static_cast<double>(stats.requests) /
+                  static_cast<double>(stats.batches));
+  std::printf("  %-54s %12zu of %zu\n", "lost", ROUNDS * BATCH - answered,
+              ROUNDS * BATCH);
+
+  ::close(fd);
+  server.stop();
+  return 0;
+}
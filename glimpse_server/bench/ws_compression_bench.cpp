@@ -0,0 +1,147 @@
+// Deflates SDP offers and candidate frames the way permessage-deflate does:
+// each frame on its own like uWS::SHARED_COMPRESSOR, and with a sliding
+// window kept across the frames of one socket like a dedicated compressor,
+// a socket getting a few offers over a group call.
+// Prints the time per frame and the compressed size, which is what
+// GLIMPSE_WS_COMPRESSION and GLIMPSE_WS_COMPRESS_MIN_BYTES trade.
+
+#include <zlib.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+
+namespace {
+// An SDP offer of roughly `size` bytes as relayed to the peer, with the
+// session-specific lines varying with `session`
+std::string makeSdpFrame(std::size_t size, int session) {
+  std::string sdp =
+      "v=0\\r\\no=- 46117314004300513" + std::to_string(session) +
+      " 2 IN IP4 127.0.0.1\\r\\ns=-\\r\\nt=0 0\\r\\n"
+      "a=group:BUNDLE 0 1\\r\\na=extmap-allow-mixed\\r\\n";
+  for (int line = 0; sdp.size() < size; ++line) {
+    switch (line % 5) {
+      case 0:
+        sdp +=
+            "m=video 9 UDP/TLS/RTP/SAVPF 96 97 102 103 104 105 106 107\\r\\n";
+        break;
+      case 1:
+        sdp += "a=ice-ufrag:N" + std::to_string(session % 997) +
+               "\\r\\na=ice-pwd:ZkW1Rj2G7g3j7mRS1Bf" +
+               std::to_string(session) + "\\r\\n";
+        break;
+      case 2:
+        sdp +=
+            "a=fingerprint:sha-256 7B:8B:F0:65:5F:78:E2:51:3B:AC:6F:F3:3F:"
+            "46:1B:35:DC:B8:5F:64:1A:24:C2:43:F0:A1:58:D0:A1:2C:19:" +
+            std::to_string(session % 90 + 10) + "\\r\\n";
+        break;
+      case 3:
+        sdp +=
+            "a=rtpmap:96 VP8/90000\\r\\na=rtcp-fb:96 goog-remb\\r\\n"
+            "a=rtcp-fb:96 transport-cc\\r\\na=rtcp-fb:96 ccm fir\\r\\n";
+        break;
+      default:
+        sdp +=
+            "a=fmtp:102 level-asymmetry-allowed=1;packetization-mode=1;"
+            "profile-level-id=42001f\\r\\n";
+    }
+  }
+  return R"({"type":"sdp","payload":{"roomId":"0000000100000001",)"
+         R"("userId":"0000000200000001","sdp":")" +
+         sdp + "\"}}";
+}
+
+std::string makeIceFrame(int session) {
+  return R"({"type":"ice","payload":{"roomId":"0000000100000001",)"
+         R"("userId":"0000000200000001","candidate":"candidate:)" +
+         std::to_string(session) +
+         R"( 1 udp 2122260223 192.168.1.20 54400 typ host generation 0",)"
+         R"("sdpMid":"0","sdpMLineIndex":0}})";
+}
+
+// Raw deflate with sync flushes, as permessage-deflate frames are. The
+// window carries over from one frame to the next until reset().
+class Deflater {
+ public:
+  Deflater() {
+    deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                 Z_DEFAULT_STRATEGY);
+  }
+  ~Deflater() { deflateEnd(&stream_); }
+
+  // Compressed size of `frame`
+  std::size_t deflate(const std::string& frame) {
+    output_.resize(deflateBound(&stream_, frame.size()) + 16);
+    stream_.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(frame.data()));
+    stream_.avail_in = static_cast<uInt>(frame.size());
+    stream_.next_out = reinterpret_cast<Bytef*>(output_.data());
+    stream_.avail_out = static_cast<uInt>(output_.size());
+    ::deflate(&stream_, Z_SYNC_FLUSH);
+    // permessage-deflate leaves out the empty block ending a sync flush
+    return output_.size() - stream_.avail_out - 4;
+  }
+
+  void reset() { deflateReset(&stream_); }
+
+ private:
+  z_stream stream_{};
+  std::vector<char> output_;
+};
+
+constexpr int SESSIONS = 64;
+// Frames a dedicated compressor's window carries over
+constexpr int FRAMES_PER_SOCKET = 4;
+
+void measure(const char* kind, const std::vector<std::string>& frames) {
+  std::size_t raw = 0;
+  for (const auto& frame : frames) {
+    raw += frame.size();
+  }
+  for (int framesPerSocket : {1, FRAMES_PER_SOCKET}) {
+    Deflater deflater;
+    int next = 0;
+    std::size_t compressed = 0;
+    auto deflate = [&] {
+      compressed += deflater.deflate(frames[next]);
+      next = (next + 1) % SESSIONS;
+      if (next % framesPerSocket == 0) {
+        deflater.reset();
+      }
+    };
+    char name[96];
+    std::snprintf(name, sizeof name, "%s, %zu bytes, %s", kind,
+                  raw / frames.size(),
+                  framesPerSocket == 1 ? "shared" : "dedicated");
+    glimpse::bench::run(name, 20000, deflate);
+    // Each session's frame once
+    deflater.reset();
+    compressed = 0;
+    for (int i = 0; i < SESSIONS; ++i) {
+      deflate();
+    }
+    std::printf("  %-54s %12.2f\n", "ratio",
+                static_cast<double>(raw) / static_cast<double>(compressed));
+  }
+}
+}  // namespace
+
+int main() {
+  for (std::size_t size : {2 * 1024, 4 * 1024, 8 * 1024}) {
+    std::vector<std::string> frames;
+    for (int session = 0; session < SESSIONS; ++session) {
+      frames.push_back(makeSdpFrame(size, session));
+    }
+    measure("sdp", frames);
+  }
+
+  std::vector<std::string> candidates;
+  for (int session = 0; session < SESSIONS; ++session) {
+    candidates.push_back(makeIceFrame(session));
+  }
+  measure("ice", candidates);
+  return 0;
+}
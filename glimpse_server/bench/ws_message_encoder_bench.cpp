@@ -0,0 +1,82 @@
+// Compares the nlohmann::json DOM path with encodeWsMessage() for relayed SDP
+// payloads of realistic sizes.
+
+#include <cstdio>
+#include <nlohmann/json.hpp>
+#include <string>
+
+#include "bench.h"
+#include "ws_message.h"
+#include "ws_message_encoder.h"
+
+namespace {
+// Builds an SDP offer of roughly `size` bytes, wrapped the way the web client
+// sends it: JSON.stringify(RTCSessionDescription)
+std::string makeSdpPayload(std::size_t size) {
+  std::string sdp =
+      "v=0\r\no=- 4611731400430051336 2 IN IP4 127.0.0.1\r\ns=-\r\nt=0 0\r\n"
+      "a=group:BUNDLE 0 1\r\na=extmap-allow-mixed\r\n"
+      "a=msid-semantic: WMS 9a4b7c0e-5b7e-4b8a-9d55-1f3c2e6b8d11\r\n";
+  for (int line = 0; sdp.size() < size; ++line) {
+    switch (line % 6) {
+      case 0:
+        sdp += "m=video 9 UDP/TLS/RTP/SAVPF 96 97 102 103 104 105 106 107\r\n";
+        break;
+      case 1:
+        sdp += "c=IN IP4 0.0.0.0\r\na=rtcp:9 IN IP4 0.0.0.0\r\n";
+        break;
+      case 2:
+        sdp +=
+            "a=ice-ufrag:Ns3u\r\na=ice-pwd:ZkW1Rj2G7g3j7mRS1BfXh2bq\r\n"
+            "a=ice-options:trickle\r\n";
+        break;
+      case 3:
+        sdp +=
+            "a=fingerprint:sha-256 7B:8B:F0:65:5F:78:E2:51:3B:AC:6F:F3:3F:46:"
+            "1B:35:DC:B8:5F:64:1A:24:C2:43:F0:A1:58:D0:A1:2C:19:08\r\n";
+        break;
+      case 4:
+        sdp +=
+            "a=rtpmap:96 VP8/90000\r\na=rtcp-fb:96 goog-remb\r\n"
+            "a=rtcp-fb:96 transport-cc\r\na=rtcp-fb:96 ccm fir\r\n";
+        break;
+      default:
+        sdp +=
+            "a=fmtp:102 level-asymmetry-allowed=1;packetization-mode=1;"
+            "profile-level-id=42001f\r\n";
+    }
+  }
+  return nlohmann::json{{"type", "offer"}, {"sdp", sdp}}.dump();
+}
+}  // namespace
+
+int main() {
+  using glimpse::WsMessage;
+
+  for (std::size_t size : {4 * 1024, 8 * 1024, 16 * 1024}) {
+    auto payload = makeSdpPayload(size);
+
+    // Both paths must produce the same document
+    std::string encoded;
+    glimpse::encodeWsMessage(encoded, WsMessage::SDP, payload);
+    WsMessage message = {.type = WsMessage::SDP, .payload = payload};
+    if (nlohmann::json::parse(encoded) != nlohmann::json(message)) {
+      std::fprintf(stderr, "encoder output differs for %zu bytes\n", size);
+      return 1;
+    }
+
+    std::printf("SDP payload: %zu bytes\n", payload.size());
+    glimpse::bench::run("  nlohmann::json(WsMessage).dump()", 20000, [&]() {
+      WsMessage message = {.type = WsMessage::SDP, .payload = payload};
+      auto frame = nlohmann::json(message).dump();
+      glimpse::bench::doNotOptimize(frame.data());
+    });
+    glimpse::bench::run("  encodeWsMessage(threadEncodeBuffer())", 20000,
+                        [&]() {
+                          auto& frame = glimpse::threadEncodeBuffer();
+                          glimpse::encodeWsMessage(frame, WsMessage::SDP,
+                                                   payload);
+                          glimpse::bench::doNotOptimize(frame.data());
+                        });
+  }
+}
@@ -0,0 +1,508 @@
+#include "connection.h"
+
+#include <arpa/inet.h>
+#include <fmt/format.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+namespace glimpse::loadgen {
+namespace {
+constexpr std::string_view HEADER_END = "\r\n\r\n";
+// Any key works, the server only echoes a hash of it
+constexpr std::string_view WS_KEY = "dGhlIHNhbXBsZSBub25jZQ==";
+
+constexpr uint8_t OPCODE_CONTINUATION = 0x0;
+constexpr uint8_t OPCODE_TEXT = 0x1;
+constexpr uint8_t OPCODE_BINARY = 0x2;
+constexpr uint8_t OPCODE_CLOSE = 0x8;
+constexpr uint8_t OPCODE_PING = 0x9;
+constexpr uint8_t OPCODE_PONG = 0xa;
+
+std::string errnoMessage(std::string_view context) {
+  return fmt::format("{}: {}", context, std::strerror(errno));
+}
+
+// Content-Length of a response, 0 if `head` has none
+std::size_t contentLength(std::string_view head) {
+  constexpr std::string_view NAME = "\r\ncontent-length:";
+  auto it = std::search(head.begin(), head.end(), NAME.begin(), NAME.end(),
+                        [](char a, char b) {
+                          return std::tolower(static_cast<unsigned char>(a)) ==
+                                 b;
+                        });
+  if (it == head.end()) {
+    return 0;
+  }
+  std::size_t length = 0;
+  for (it += NAME.size(); it != head.end() and *it == ' '; ++it) {
+  }
+  for (; it != head.end() and std::isdigit(static_cast<unsigned char>(*it));
+       ++it) {
+    length = length * 10 + static_cast<std::size_t>(*it - '0');
+  }
+  return length;
+}
+
+int statusOf(std::string_view head) {
+  // "HTTP/1.1 200 OK"
+  if (head.size() < 12) {
+    return 0;
+  }
+  int status = 0;
+  for (auto c : head.substr(9, 3)) {
+    status = status * 10 + (c - '0');
+  }
+  return status;
+}
+
+uint32_t maskKey() {
+  thread_local std::mt19937 engine(std::random_device{}());
+  return static_cast<uint32_t>(engine());
+}
+}  // namespace
+
+EventLoop::EventLoop() : epoll_(epoll_create1(EPOLL_CLOEXEC)) {
+  if (epoll_ < 0) {
+    throw std::runtime_error(errnoMessage("epoll_create1"));
+  }
+}
+
+EventLoop::~EventLoop() { ::close(epoll_); }
+
+void EventLoop::poll(std::chrono::milliseconds timeout) {
+  std::array<epoll_event, 256> events;
+  auto count = epoll_wait(epoll_, events.data(),
+                          static_cast<int>(events.size()),
+                          static_cast<int>(timeout.count()));
+  for (int i = 0; i < count; ++i) {
+    static_cast<Connection*>(events[i].data.ptr)
+        ->handleEvents(events[i].events);
+  }
+
+  auto failed = std::move(failed_);
+  failed_.clear();
+  for (auto [connection, generation] : failed) {
+    // Skip connections reused since, their error is stale
+    if (connection->generation_ == generation and connection->onError_) {
+      connection->onError_(connection->error_);
+    }
+  }
+}
+
+Connection::Connection(EventLoop& loop, const sockaddr_in& server)
+    : loop_(loop), server_(server) {
+  std::array<char, INET_ADDRSTRLEN> address{};
+  inet_ntop(AF_INET, &server_.sin_addr, address.data(), address.size());
+  host_ = fmt::format("{}:{}", address.data(), ntohs(server_.sin_port));
+}
+
+Connection::~Connection() {
+  closeSocket();
+  std::erase_if(loop_.failed_,
+                [this](const auto& entry) { return entry.first == this; });
+}
+
+void Connection::setErrorHandler(ErrorHandler onError) {
+  onError_ = std::move(onError);
+}
+
+void Connection::post(std::string_view path, std::string_view body,
+                      ResponseHandler onResponse) {
+  requests_.push_back(
+      {fmt::format("POST {} HTTP/1.1\r\nHost: {}\r\n"
+                   "Content-Type: application/json\r\n"
+                   "Content-Length: {}\r\n\r\n{}",
+                   path, host_, body.size(), body),
+       std::move(onResponse)});
+  if (state_ == State::CLOSED) {
+    connect(State::HTTP);
+  }
+  sendNextRequest();
+}
+
+void Connection::openWebSocket(std::string_view target, EventHandler onOpen,
+                               MessageHandler onMessage,
+                               EventHandler onClosed) {
+  closeSocket();
+  onOpen_ = std::move(onOpen);
+  onMessage_ = std::move(onMessage);
+  onClosed_ = std::move(onClosed);
+  out_ = fmt::format(
+      "GET {} HTTP/1.1\r\nHost: {}\r\nUpgrade: websocket\r\n"
+      "Connection: Upgrade\r\nSec-WebSocket-Key: {}\r\n"
+      "Sec-WebSocket-Version: 13\r\n\r\n",
+      target, host_, WS_KEY);
+  connect(State::WS_UPGRADING);
+}
+
+void Connection::closeWebSocket() {
+  if (state_ == State::WS_OPEN) {
+    // 1000, normal closure
+    sendFrame(OPCODE_CLOSE, "\x03\xe8");
+    state_ = State::WS_CLOSING;
+  } else if (state_ != State::WS_CLOSING) {
+    closeSocket();
+  }
+}
+
+void Connection::close() { closeSocket(); }
+
+void Connection::connect(State connectedState) {
+  connectedState_ = connectedState;
+  fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    fail(errnoMessage("socket"));
+    return;
+  }
+  int one = 1;
+  setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  state_ = State::CONNECTING;
+
+  if (::connect(fd_, reinterpret_cast<const sockaddr*>(&server_),
+                sizeof(server_)) < 0 and
+      errno != EINPROGRESS) {
+    fail(errnoMessage("connect"));
+    return;
+  }
+  epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data = {.ptr = this}};
+  if (epoll_ctl(loop_.epoll_, EPOLL_CTL_ADD, fd_, &event) < 0) {
+    fail(errnoMessage("epoll_ctl"));
+    return;
+  }
+  wantsWrite_ = true;
+}
+
+void Connection::closeSocket() {
+  if (fd_ >= 0) {
+    // Closing the descriptor also removes it from the epoll set
+    ::close(fd_);
+    fd_ = -1;
+  }
+  state_ = State::CLOSED;
+  ++generation_;
+  wantsWrite_ = false;
+  in_.clear();
+  out_.clear();
+  requests_.clear();
+  requestInFlight_ = false;
+  fragments_.clear();
+}
+
+void Connection::handleEvents(uint32_t events) {
+  auto generation = generation_;
+  if (state_ == State::CLOSED) {
+    return;
+  }
+  if (state_ == State::CONNECTING) {
+    handleConnected();
+    if (generation != generation_ or state_ == State::CONNECTING) {
+      return;
+    }
+  }
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    handleReadable();
+    if (generation != generation_) {
+      return;
+    }
+  }
+  if (events & EPOLLOUT) {
+    flush();
+  }
+}
+
+void Connection::handleConnected() {
+  int error = 0;
+  socklen_t length = sizeof(error);
+  getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &length);
+  if (error != 0) {
+    errno = error;
+    fail(errnoMessage("connect"));
+    return;
+  }
+  // The event may be left over from an earlier socket of this connection
+  sockaddr_in peer;
+  socklen_t peerLength = sizeof(peer);
+  if (getpeername(fd_, reinterpret_cast<sockaddr*>(&peer), &peerLength) < 0) {
+    return;
+  }
+  state_ = connectedState_;
+  flush();
+}
+
+void Connection::handleReadable() {
+  bool endOfStream = false;
+  std::array<char, 16384> buffer;
+  for (;;) {
+    auto n = ::recv(fd_, buffer.data(), buffer.size(), 0);
+    if (n > 0) {
+      in_.append(buffer.data(), static_cast<std::size_t>(n));
+    } else if (n == 0) {
+      endOfStream = true;
+      break;
+    } else if (errno == EAGAIN or errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      fail(errnoMessage("recv"));
+      return;
+    }
+  }
+
+  auto generation = generation_;
+  switch (state_) {
+    case State::HTTP:
+      while (parseHttpResponse()) {
+      }
+      break;
+    case State::WS_UPGRADING:
+      if (parseUpgradeResponse()) {
+        while (parseFrame()) {
+        }
+      }
+      break;
+    case State::WS_OPEN:
+    case State::WS_CLOSING:
+      while (parseFrame()) {
+      }
+      break;
+    default:
+      break;
+  }
+  if (endOfStream and generation == generation_) {
+    handleEndOfStream();
+  }
+}
+
+void Connection::handleEndOfStream() {
+  switch (state_) {
+    case State::WS_CLOSING: {
+      auto onClosed = onClosed_;
+      closeSocket();
+      onClosed();
+      break;
+    }
+    case State::HTTP:
+      // Idle keep-alive connection closed by the server, reconnect on the
+      // next request
+      if (not requestInFlight_) {
+        closeSocket();
+        break;
+      }
+      [[fallthrough]];
+    default:
+      fail("connection closed by the server");
+  }
+}
+
+void Connection::sendNextRequest() {
+  if (requestInFlight_ or requests_.empty()) {
+    return;
+  }
+  out_ += requests_.front().data;
+  requestInFlight_ = true;
+  if (state_ == State::HTTP) {
+    flush();
+  }
+}
+
+void Connection::flush() {
+  while (not out_.empty()) {
+    auto n = ::send(fd_, out_.data(), out_.size(), MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno != EINTR) {
+        fail(errnoMessage("send"));
+        return;
+      }
+      continue;
+    }
+    out_.erase(0, static_cast<std::size_t>(n));
+  }
+  updateInterest();
+}
+
+void Connection::updateInterest() {
+  bool wantsWrite = not out_.empty() or state_ == State::CONNECTING;
+  if (wantsWrite == wantsWrite_) {
+    return;
+  }
+  epoll_event event = {
+      .events = EPOLLIN | (wantsWrite ? uint32_t{EPOLLOUT} : 0),
+      .data = {.ptr = this}};
+  epoll_ctl(loop_.epoll_, EPOLL_CTL_MOD, fd_, &event);
+  wantsWrite_ = wantsWrite;
+}
+
+void Connection::fail(std::string_view error) {
+  // Reported from the loop rather than here, callers of post() and
+  // openWebSocket() never see their handlers run under them
+  closeSocket();
+  error_ = error;
+  loop_.failed_.emplace_back(this, generation_);
+}
+
+bool Connection::parseHttpResponse() {
+  auto end = in_.find(HEADER_END);
+  if (end == std::string::npos) {
+    return false;
+  }
+  std::string_view head(in_.data(), end);
+  auto bodyStart = end + HEADER_END.size();
+  auto length = contentLength(head);
+  if (in_.size() < bodyStart + length) {
+    return false;
+  }
+  if (not requestInFlight_) {
+    fail("response without a request");
+    return false;
+  }
+
+  auto status = statusOf(head);
+  auto body = in_.substr(bodyStart, length);
+  in_.erase(0, bodyStart + length);
+  auto onResponse = std::move(requests_.front().onResponse);
+  requests_.pop_front();
+  requestInFlight_ = false;
+  sendNextRequest();
+
+  auto generation = generation_;
+  onResponse(status, body);
+  return generation == generation_ and state_ == State::HTTP;
+}
+
+bool Connection::parseUpgradeResponse() {
+  auto end = in_.find(HEADER_END);
+  if (end == std::string::npos) {
+    return false;
+  }
+  if (statusOf(in_) != 101) {
+    fail(fmt::format("upgrade refused: {}", in_.substr(0, in_.find('\r'))));
+    return false;
+  }
+  in_.erase(0, end + HEADER_END.size());
+  state_ = State::WS_OPEN;
+
+  auto generation = generation_;
+  auto onOpen = onOpen_;
+  onOpen();
+  return generation == generation_;
+}
+
+bool Connection::parseFrame() {
+  auto* bytes = reinterpret_cast<const uint8_t*>(in_.data());
+  if (in_.size() < 2) {
+    return false;
+  }
+  bool fin = bytes[0] & 0x80;
+  uint8_t opcode = bytes[0] & 0x0f;
+  bool masked = bytes[1] & 0x80;
+  uint64_t length = bytes[1] & 0x7f;
+  std::size_t header = 2;
+  if (length == 126) {
+    header = 4;
+  } else if (length == 127) {
+    header = 10;
+  }
+  if (in_.size() < header + (masked ? 4 : 0)) {
+    return false;
+  }
+  if (header > 2) {
+    length = 0;
+    for (std::size_t i = 2; i < header; ++i) {
+      length = (length << 8) | bytes[i];
+    }
+  }
+  std::array<uint8_t, 4> mask{};
+  if (masked) {
+    std::copy_n(bytes + header, mask.size(), mask.begin());
+    header += mask.size();
+  }
+  if (in_.size() < header + length) {
+    return false;
+  }
+
+  auto payload = in_.substr(header, length);
+  in_.erase(0, header + length);
+  if (masked) {
+    for (std::size_t i = 0; i < payload.size(); ++i) {
+      payload[i] = static_cast<char>(payload[i] ^ mask[i % 4]);
+    }
+  }
+
+  switch (opcode) {
+    case OPCODE_CONTINUATION:
+      fragments_ += payload;
+      if (not fin) {
+        return true;
+      }
+      payload = std::move(fragments_);
+      fragments_.clear();
+      break;
+    case OPCODE_TEXT:
+    case OPCODE_BINARY:
+      if (not fin) {
+        fragments_ = std::move(payload);
+        return true;
+      }
+      break;
+    case OPCODE_CLOSE:
+      if (state_ == State::WS_OPEN) {
+        // Echo the status code, the server closes the connection next
+        sendFrame(OPCODE_CLOSE, std::string_view(payload).substr(0, 2));
+        state_ = State::WS_CLOSING;
+      }
+      return true;
+    case OPCODE_PING:
+      sendFrame(OPCODE_PONG, payload);
+      return true;
+    case OPCODE_PONG:
+    default:
+      return true;
+  }
+
+  if (state_ != State::WS_OPEN) {
+    return true;
+  }
+  auto generation = generation_;
+  auto onMessage = onMessage_;
+  onMessage(payload);
+  return generation == generation_;
+}
+
+void Connection::sendFrame(uint8_t opcode, std::string_view payload) {
+  // Frames from clients are masked
+  out_ += static_cast<char>(0x80 | opcode);
+  if (payload.size() < 126) {
+    out_ += static_cast<char>(0x80 | payload.size());
+  } else if (payload.size() <= 0xffff) {
+    out_ += static_cast<char>(0x80 | 126);
+    out_ += static_cast<char>(payload.size() >> 8);
+    out_ += static_cast<char>(payload.size() & 0xff);
+  } else {
+    out_ += static_cast<char>(0x80 | 127);
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      out_ += static_cast<char>((payload.size() >> shift) & 0xff);
+    }
+  }
+
+  auto key = maskKey();
+  std::array<char, 4> mask;
+  std::memcpy(mask.data(), &key, mask.size());
+  out_.append(mask.data(), mask.size());
+  for (std::size_t i = 0; i < payload.size(); ++i) {
+    out_ += static_cast<char>(payload[i] ^ mask[i % 4]);
+  }
+  flush();
+}
+}  // namespace glimpse::loadgen
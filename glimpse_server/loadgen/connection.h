@@ -0,0 +1,138 @@
+#pragma once
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace glimpse::loadgen {
+
+class Connection;
+
+// epoll instance driving the connections of one worker thread
+class EventLoop {
+ public:
+  EventLoop();
+  ~EventLoop();
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // Waits up to `timeout` for socket events and dispatches them, then
+  // reports the connections that failed since the last call
+  void poll(std::chrono::milliseconds timeout);
+
+ private:
+  friend class Connection;
+
+  int epoll_;
+  // Failed connections with the generation they failed in, see
+  // Connection::fail()
+  std::vector<std::pair<Connection*, uint64_t>> failed_;
+};
+
+// Client end of one TCP connection to the server, either an HTTP/1.1
+// keep-alive connection or a WebSocket. Handlers run on the loop thread and
+// may close or reuse the connection, including the one they are called for.
+//
+// Only what the server speaks is supported: responses with Content-Length,
+// unextended WebSocket frames.
+class Connection {
+ public:
+  using ResponseHandler = std::function<void(int status, std::string_view)>;
+  using MessageHandler = std::function<void(std::string_view)>;
+  using EventHandler = std::function<void()>;
+  using ErrorHandler = std::function<void(std::string_view)>;
+
+  Connection(EventLoop& loop, const sockaddr_in& server);
+  ~Connection();
+
+  Connection(const Connection&) = delete;
+  Connection& operator=(const Connection&) = delete;
+
+  // Called from EventLoop::poll() when the connection failed, after it was
+  // closed. Pending requests are dropped without their handlers being
+  // called.
+  void setErrorHandler(ErrorHandler onError);
+
+  // Sends a JSON POST once the requests queued before it are answered,
+  // connecting first if needed
+  void post(std::string_view path, std::string_view body,
+            ResponseHandler onResponse);
+
+  // Opens a new connection and upgrades it to a WebSocket on `target`
+  void openWebSocket(std::string_view target, EventHandler onOpen,
+                     MessageHandler onMessage, EventHandler onClosed);
+  // Starts the closing handshake, `onClosed` runs once the server closed
+  void closeWebSocket();
+
+  // Drops the connection without calling any handler
+  void close();
+
+ private:
+  friend class EventLoop;
+
+  enum class State {
+    CLOSED,
+    CONNECTING,
+    HTTP,
+    WS_UPGRADING,
+    WS_OPEN,
+    WS_CLOSING,
+  };
+
+  struct Request {
+    std::string data;
+    ResponseHandler onResponse;
+  };
+
+  void connect(State connectedState);
+  void closeSocket();
+  void handleEvents(uint32_t events);
+  void handleConnected();
+  void handleReadable();
+  void handleEndOfStream();
+  void sendNextRequest();
+  void flush();
+  void updateInterest();
+  void fail(std::string_view error);
+
+  // Each returns false once it consumed all it could or the connection
+  // was closed or reused by a handler
+  bool parseHttpResponse();
+  bool parseUpgradeResponse();
+  bool parseFrame();
+
+  void sendFrame(uint8_t opcode, std::string_view payload);
+
+  EventLoop& loop_;
+  sockaddr_in server_;
+  std::string host_;
+  int fd_ = -1;
+  State state_ = State::CLOSED;
+  // State entered once the TCP connection is established
+  State connectedState_ = State::HTTP;
+  // Bumped on every close, lets a caller notice that a handler closed the
+  // connection under it
+  uint64_t generation_ = 0;
+  bool wantsWrite_ = false;
+
+  std::string in_;
+  std::string out_;
+  std::deque<Request> requests_;
+  bool requestInFlight_ = false;
+  std::string fragments_;
+  std::string error_;
+
+  ErrorHandler onError_;
+  EventHandler onOpen_;
+  MessageHandler onMessage_;
+  EventHandler onClosed_;
+};
+}  // namespace glimpse::loadgen
@@ -0,0 +1,293 @@
+// glimpse_loadgen: runs host/guest pairs through the full signaling flow
+// against a server on this machine and reports session throughput, setup
+// latency percentiles and the server's resident memory over time.
+//
+//   glimpse_loadgen --pairs 2000 --threads 4 --duration 30 --server-pid PID
+
+#include <arpa/inet.h>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "connection.h"
+#include "pair.h"
+
+namespace {
+using glimpse::loadgen::Clock;
+
+struct Options {
+  std::string host = "127.0.0.1";
+  std::size_t port = 8080;
+  std::size_t pairs = 100;
+  std::size_t threads = 1;
+  std::size_t duration = 10;
+  // Seconds over which the pairs start, the listen backlog would overflow
+  // if thousands connected at once
+  std::size_t rampUp = 2;
+  std::size_t serverPid = 0;
+  glimpse::loadgen::PairOptions pair;
+};
+
+constexpr std::string_view USAGE =
+    "Usage: glimpse_loadgen [options]\n"
+    "  --host ADDRESS     server IPv4 address (127.0.0.1)\n"
+    "  --port N           server port (8080)\n"
+    "  --pairs N          concurrent host/guest pairs (100)\n"
+    "  --threads N        client threads (1)\n"
+    "  --duration S       seconds to run (10)\n"
+    "  --ramp-up S        seconds over which pairs start (2)\n"
+    "  --ice N            ICE candidates sent by each side (8)\n"
+    "  --sdp-size BYTES   size of offers and answers (2048)\n"
+    "  --server-pid PID   server process to sample RSS from\n";
+
+std::optional<std::size_t> parseSize(std::string_view text) {
+  std::size_t value = 0;
+  auto [ptr, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  if (ec != std::errc() or ptr != text.data() + text.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+std::optional<Options> parseOptions(int argc, char** argv) {
+  Options options;
+  std::size_t ice = options.pair.iceCandidates;
+  std::size_t sdpSize = options.pair.sdpSize;
+  const std::pair<std::string_view, std::size_t*> sizes[] = {
+      {"--port", &options.port},
+      {"--pairs", &options.pairs},
+      {"--threads", &options.threads},
+      {"--duration", &options.duration},
+      {"--ramp-up", &options.rampUp},
+      {"--ice", &ice},
+      {"--sdp-size", &sdpSize},
+      {"--server-pid", &options.serverPid},
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    std::string_view name = argv[i];
+    if (i + 1 == argc) {
+      return std::nullopt;
+    }
+    std::string_view value = argv[++i];
+    if (name == "--host") {
+      options.host = value;
+      continue;
+    }
+    auto option = std::find_if(std::begin(sizes), std::end(sizes),
+                               [name](auto& o) { return o.first == name; });
+    auto parsed = parseSize(value);
+    if (option == std::end(sizes) or not parsed) {
+      return std::nullopt;
+    }
+    *option->second = *parsed;
+  }
+  if (options.pairs == 0 or options.threads == 0 or options.port > 0xffff) {
+    return std::nullopt;
+  }
+  options.threads = std::min(options.threads, options.pairs);
+  options.pair.iceCandidates = ice;
+  options.pair.sdpSize = sdpSize;
+  return options;
+}
+
+// Every pair holds four sockets
+void raiseFileLimit(std::size_t pairs) {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    return;
+  }
+  auto needed = static_cast<rlim_t>(pairs * 4 + 64);
+  if (limit.rlim_cur < needed) {
+    limit.rlim_cur = std::min(needed, limit.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (limit.rlim_cur < needed) {
+    spdlog::warn("Open file limit {} is below the {} sockets needed",
+                 limit.rlim_cur, needed);
+  }
+}
+
+// VmRSS of `pid` in KiB, nullopt if it cannot be read
+std::optional<std::size_t> residentKiB(std::size_t pid) {
+  std::ifstream status(fmt::format("/proc/{}/status", pid));
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.starts_with("VmRSS:")) {
+      auto digits = line.find_first_of("0123456789");
+      auto end = line.find(' ', digits);
+      if (digits != std::string::npos) {
+        return parseSize(std::string_view(line).substr(digits, end - digits));
+      }
+    }
+  }
+  return std::nullopt;
+}
+
+std::string formatRss(std::optional<std::size_t> kib) {
+  return kib ? fmt::format("{:.1f} MiB", static_cast<double>(*kib) / 1024)
+             : std::string("-");
+}
+
+void runWorker(const Options& options, const sockaddr_in& server,
+               std::size_t pairCount, std::size_t firstPair,
+               glimpse::loadgen::WorkerStats& stats,
+               const std::atomic<bool>& stopping) {
+  glimpse::loadgen::EventLoop loop;
+  std::vector<std::unique_ptr<glimpse::loadgen::Pair>> pairs;
+  auto start = Clock::now();
+  auto rampUp = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::seconds(options.rampUp));
+  for (std::size_t i = 0; i < pairCount; ++i) {
+    auto& pair = pairs.emplace_back(std::make_unique<glimpse::loadgen::Pair>(
+        loop, server, options.pair, stats));
+    auto offset = rampUp * static_cast<int64_t>(firstPair + i) /
+                  static_cast<int64_t>(options.pairs);
+    pair->start(start + offset);
+  }
+
+  while (not stopping.load(std::memory_order_relaxed)) {
+    loop.poll(std::chrono::milliseconds(10));
+    auto now = Clock::now();
+    for (auto& pair : pairs) {
+      pair->tick(now);
+    }
+  }
+  for (auto& pair : pairs) {
+    pair->stop();
+  }
+}
+
+// Nearest-rank percentile of sorted `values`
+uint32_t percentile(const std::vector<uint32_t>& values, double p) {
+  auto rank = static_cast<std::size_t>(p * static_cast<double>(values.size()));
+  return values[std::min(rank, values.size() - 1)];
+}
+
+std::string formatMicroseconds(uint32_t us) {
+  return us >= 10000 ? fmt::format("{:.1f} ms", us / 1000.0)
+                     : fmt::format("{} us", us);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  auto options = parseOptions(argc, argv);
+  if (not options) {
+    std::fputs(USAGE.data(), stderr);
+    return 2;
+  }
+
+  sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_port = htons(static_cast<uint16_t>(options->port));
+  if (inet_pton(AF_INET, options->host.c_str(), &server.sin_addr) != 1) {
+    fmt::print(stderr, "Invalid IPv4 address: {}\n", options->host);
+    return 2;
+  }
+  raiseFileLimit(options->pairs);
+
+  fmt::print("{} pairs on {} threads against {}:{} for {} s, {} ICE "
+             "candidates per side\n",
+             options->pairs, options->threads, options->host, options->port,
+             options->duration, options->pair.iceCandidates);
+
+  std::atomic<bool> stopping{false};
+  std::vector<glimpse::loadgen::WorkerStats> stats(options->threads);
+  std::vector<std::thread> threads;
+  std::size_t firstPair = 0;
+  for (std::size_t t = 0; t < options->threads; ++t) {
+    auto count = options->pairs / options->threads +
+                 (t < options->pairs % options->threads ? 1 : 0);
+    threads.emplace_back(runWorker, std::cref(*options), std::cref(server),
+                         count, firstPair, std::ref(stats[t]),
+                         std::cref(stopping));
+    firstPair += count;
+  }
+
+  struct Totals {
+    uint64_t sessions = 0;
+    uint64_t errors = 0;
+    uint64_t throttled = 0;
+  };
+  auto totals = [&stats]() {
+    Totals sum;
+    for (const auto& worker : stats) {
+      sum.sessions += worker.sessions.load(std::memory_order_relaxed);
+      sum.errors += worker.errors.load(std::memory_order_relaxed);
+      sum.throttled += worker.throttled.load(std::memory_order_relaxed);
+    }
+    return sum;
+  };
+
+  // One line per second
+  auto start = Clock::now();
+  std::optional<std::size_t> rssStart;
+  std::optional<std::size_t> rssPeak;
+  if (options->serverPid != 0) {
+    rssStart = residentKiB(options->serverPid);
+    rssPeak = rssStart;
+  }
+  fmt::print("{:>6} {:>12} {:>10} {:>10} {:>14}\n", "time", "sessions/s",
+             "errors", "throttled", "server RSS");
+  uint64_t lastSessions = 0;
+  for (std::size_t second = 1; second <= options->duration; ++second) {
+    std::this_thread::sleep_until(start + std::chrono::seconds(second));
+    auto [sessions, errors, throttled] = totals();
+    std::optional<std::size_t> rss;
+    if (options->serverPid != 0) {
+      rss = residentKiB(options->serverPid);
+      if (rss) {
+        rssPeak = std::max(rssPeak.value_or(0), *rss);
+      }
+    }
+    fmt::print("{:>5}s {:>12} {:>10} {:>10} {:>14}\n", second,
+               sessions - lastSessions, errors, throttled, formatRss(rss));
+    std::fflush(stdout);
+    lastSessions = sessions;
+  }
+
+  stopping = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  auto [sessions, errors, throttled] = totals();
+  std::vector<uint32_t> setup;
+  for (auto& worker : stats) {
+    setup.insert(setup.end(), worker.setupMicroseconds.begin(),
+                 worker.setupMicroseconds.end());
+  }
+  std::sort(setup.begin(), setup.end());
+
+  fmt::print("\nsessions   {} completed, {} failed, {} throttled, {:.1f}/s\n",
+             sessions, errors, throttled,
+             static_cast<double>(sessions) / elapsed);
+  if (not setup.empty()) {
+    fmt::print("setup      p50 {}  p99 {}  p999 {}  max {}\n",
+               formatMicroseconds(percentile(setup, 0.5)),
+               formatMicroseconds(percentile(setup, 0.99)),
+               formatMicroseconds(percentile(setup, 0.999)),
+               formatMicroseconds(setup.back()));
+  }
+  if (options->serverPid != 0) {
+    fmt::print("server RSS start {}, peak {}\n", formatRss(rssStart),
+               formatRss(rssPeak));
+  }
+  return errors == 0 ? 0 : 1;
+}
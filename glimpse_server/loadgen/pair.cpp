@@ -0,0 +1,279 @@
+#include "pair.h"
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <limits>
+#include <nlohmann/json.hpp>
+#include <utility>
+
+#include "id.h"
+#include "ws_message.h"
+
+namespace glimpse::loadgen {
+namespace {
+// Only the first errors are logged, a server that went away would
+// otherwise flood the terminal
+constexpr uint64_t LOGGED_ERRORS = 10;
+std::atomic<uint64_t> loggedErrors{0};
+
+constexpr std::chrono::milliseconds MIN_BACKOFF{100};
+constexpr std::chrono::milliseconds MAX_BACKOFF{5000};
+}  // namespace
+
+Pair::User::User(EventLoop& loop, const sockaddr_in& server)
+    : http(loop, server), ws(loop, server) {}
+
+Pair::Pair(EventLoop& loop, const sockaddr_in& server,
+           const PairOptions& options, WorkerStats& stats)
+    : options_(options),
+      stats_(stats),
+      host_(loop, server),
+      guest_(loop, server),
+      sdp_(std::max<std::size_t>(options.sdpSize, 3), 'x') {
+  sdp_.replace(0, 3, "v=0");
+  for (auto* user : {&host_, &guest_}) {
+    user->http.setErrorHandler([this](auto error) { fail(error); });
+    user->ws.setErrorHandler([this](auto error) { fail(error); });
+  }
+}
+
+void Pair::start(Clock::time_point at) {
+  state_ = State::WAITING;
+  nextSession_ = at;
+}
+
+void Pair::stop() {
+  state_ = State::STOPPED;
+  closeConnections();
+}
+
+void Pair::tick(Clock::time_point now) {
+  switch (state_) {
+    case State::STOPPED:
+      break;
+    case State::WAITING:
+      if (now >= nextSession_) {
+        startSession();
+      }
+      break;
+    default:
+      if (now - sessionStart_ > options_.sessionTimeout) {
+        fail("session timed out");
+      }
+  }
+}
+
+void Pair::startSession() {
+  state_ = State::CREATING_ROOM;
+  sessionStart_ = Clock::now();
+  for (auto* user : {&host_, &guest_}) {
+    user->id = randomId().toString();
+    user->wsOpen = false;
+    user->sdpReceived = false;
+    user->candidatesReceived = 0;
+  }
+
+  post(host_, "/room",
+       fmt::format(R"({{"userId":"{}","username":"host"}})", host_.id),
+       [this](std::string_view body) { handleRoomCreated(body); });
+}
+
+void Pair::handleRoomCreated(std::string_view body) {
+  auto response = nlohmann::json::parse(body, nullptr, false);
+  if (not response.is_object() or not response.contains("roomId")) {
+    fail(fmt::format("POST /room: unexpected response {}", body));
+    return;
+  }
+  roomId_ = response["roomId"].get<std::string>();
+
+  state_ = State::OPENING_SOCKETS;
+  for (auto* user : {&host_, &guest_}) {
+    auto target = fmt::format("/ws?userId={}&username={}", user->id,
+                              user == &host_ ? "host" : "guest");
+    user->ws.openWebSocket(
+        target, [this, user]() { handleSocketOpen(*user); },
+        [this, user](auto text) { handleMessage(*user, text); },
+        [this, user]() { handleSocketClosed(*user); });
+  }
+}
+
+void Pair::handleSocketOpen(User& user) {
+  user.wsOpen = true;
+  if (not host_.wsOpen or not guest_.wsOpen) {
+    return;
+  }
+  // The host must be connected to hear about the join request
+  state_ = State::JOINING;
+  post(guest_, "/room/join",
+       fmt::format(R"({{"userId":"{}","username":"guest","roomId":"{}"}})",
+                   guest_.id, roomId_));
+}
+
+void Pair::handleMessage(User& user, std::string_view text) {
+  bool isHost = &user == &host_;
+  try {
+    auto message = nlohmann::json::parse(text);
+    const auto& payload = message["payload"];
+    switch (message.at("type").get<int>()) {
+      case WsMessage::REQUEST_JOIN_ROOM:
+        post(host_, "/room/join/approve",
+             fmt::format(R"({{"userId":"{}","requestId":"{}"}})", host_.id,
+                         payload.at("requestId").get<std::string>()));
+        break;
+      case WsMessage::ROOM_READY:
+        if (isHost) {
+          state_ = State::NEGOTIATING;
+          sendDescription(host_);
+        }
+        break;
+      case WsMessage::SDP:
+        user.sdpReceived = true;
+        // The guest answers the offer, each side trickles its candidates
+        // once it knows the remote description
+        if (not isHost) {
+          sendDescription(guest_);
+        }
+        sendCandidates(user);
+        checkSetup();
+        break;
+      case WsMessage::ICE:
+        ++user.candidatesReceived;
+        checkSetup();
+        break;
+      case WsMessage::ICE_BATCH:
+        user.candidatesReceived += payload.size();
+        checkSetup();
+        break;
+      case WsMessage::ROOM_END:
+        handleRoomEnd(user);
+        break;
+      case WsMessage::DENY_JOIN_ROOM:
+        fail("join request denied");
+        break;
+      case WsMessage::ERROR:
+        fail(fmt::format("ERROR message: {}", payload.dump()));
+        break;
+      default:
+        break;
+    }
+  } catch (const nlohmann::json::exception& e) {
+    fail(fmt::format("Invalid message {}: {}", text, e.what()));
+  }
+}
+
+void Pair::handleRoomEnd(User& user) {
+  if (state_ != State::ENDING) {
+    fail("room ended by the server");
+    return;
+  }
+  user.ws.closeWebSocket();
+}
+
+void Pair::handleSocketClosed(User& user) {
+  user.wsOpen = false;
+  if (state_ != State::ENDING) {
+    fail("WebSocket closed by the server");
+    return;
+  }
+  if (host_.wsOpen or guest_.wsOpen) {
+    return;
+  }
+  stats_.sessions.fetch_add(1, std::memory_order_relaxed);
+  backoff_ = {};
+  startSession();
+}
+
+void Pair::checkSetup() {
+  if (state_ != State::NEGOTIATING) {
+    return;
+  }
+  for (const auto* user : {&host_, &guest_}) {
+    if (not user->sdpReceived or
+        user->candidatesReceived < options_.iceCandidates) {
+      return;
+    }
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - sessionStart_);
+  stats_.setupMicroseconds.push_back(static_cast<uint32_t>(std::min<int64_t>(
+      elapsed.count(), std::numeric_limits<uint32_t>::max())));
+
+  state_ = State::ENDING;
+  post(host_, "/room/end",
+       fmt::format(R"({{"userId":"{}","roomId":"{}"}})", host_.id, roomId_));
+}
+
+void Pair::post(User& user, std::string_view path, std::string_view body,
+                std::function<void(std::string_view)> onSuccess) {
+  user.http.post(path, body,
+                 [this, path, onSuccess = std::move(onSuccess)](
+                     int status, std::string_view response) {
+                   if (status == 429) {
+                     throttle();
+                     return;
+                   }
+                   if (status != 200) {
+                     fail(fmt::format("POST {}: {} {}", path, status,
+                                      response));
+                     return;
+                   }
+                   if (onSuccess) {
+                     onSuccess(response);
+                   }
+                 });
+}
+
+void Pair::sendDescription(User& user) {
+  post(user, "/room/sdp",
+       fmt::format(R"({{"userId":"{}","roomId":"{}","sdp":"{}"}})", user.id,
+                   roomId_, sdp_));
+}
+
+void Pair::sendCandidates(User& user) {
+  for (std::size_t i = 0; i < options_.iceCandidates; ++i) {
+    post(user, "/room/ice",
+         fmt::format(R"({{"userId":"{}","roomId":"{}","ice":"candidate:{} 1 )"
+                     R"(udp 2122260223 127.0.0.1 {} typ host"}})",
+                     user.id, roomId_, i, 50000 + i));
+  }
+}
+
+void Pair::fail(std::string_view error) {
+  if (state_ == State::STOPPED or state_ == State::WAITING) {
+    return;
+  }
+  stats_.errors.fetch_add(1, std::memory_order_relaxed);
+  auto logged = loggedErrors.fetch_add(1, std::memory_order_relaxed);
+  if (logged < LOGGED_ERRORS) {
+    spdlog::warn("Session failed: {}", error);
+  } else if (logged == LOGGED_ERRORS) {
+    spdlog::warn("Session failed: {}, not logging further errors", error);
+  }
+
+  closeConnections();
+  state_ = State::WAITING;
+  nextSession_ = Clock::now() + options_.retryDelay;
+}
+
+void Pair::throttle() {
+  if (state_ == State::STOPPED or state_ == State::WAITING) {
+    return;
+  }
+  stats_.throttled.fetch_add(1, std::memory_order_relaxed);
+  closeConnections();
+  backoff_ = std::clamp(backoff_ * 2, MIN_BACKOFF, MAX_BACKOFF);
+  state_ = State::WAITING;
+  nextSession_ = Clock::now() + backoff_;
+}
+
+void Pair::closeConnections() {
+  for (auto* user : {&host_, &guest_}) {
+    user->http.close();
+    user->ws.close();
+    user->wsOpen = false;
+  }
+}
+}  // namespace glimpse::loadgen
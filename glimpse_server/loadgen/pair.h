@@ -0,0 +1,125 @@
+#pragma once
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "connection.h"
+
+namespace glimpse::loadgen {
+
+using Clock = std::chrono::steady_clock;
+
+struct PairOptions {
+  // Candidates each side trickles after the SDP exchange
+  std::size_t iceCandidates = 8;
+  std::size_t sdpSize = 2048;
+  // A session that takes longer counts as an error
+  std::chrono::milliseconds sessionTimeout{10000};
+  // Wait after an error before the next session
+  std::chrono::milliseconds retryDelay{1000};
+};
+
+// Counters of one worker thread. The atomics are read by the reporting
+// thread while the worker runs; setupMicroseconds only after it stopped.
+struct WorkerStats {
+  std::atomic<uint64_t> sessions{0};
+  std::atomic<uint64_t> errors{0};
+  // Sessions the server's rate limits turned away with 429, retried after a
+  // backoff instead of counting as errors
+  std::atomic<uint64_t> throttled{0};
+  std::vector<uint32_t> setupMicroseconds;
+};
+
+// A host and a guest running signaling sessions back to back, as the web
+// client does:
+//
+//   host   POST /room, opens /ws
+//   guest  opens /ws, POST /room/join
+//   host   REQUEST_JOIN_ROOM -> POST /room/join/approve
+//   host   ROOM_READY -> POST /room/sdp (offer)
+//   guest  SDP -> POST /room/sdp (answer), then its ICE candidates
+//   host   SDP -> its ICE candidates
+//   both   all candidates of the peer received: the session is set up
+//   host   POST /room/end, both close their sockets on ROOM_END
+//
+// Setup latency runs from POST /room until both sides have received every
+// candidate of their peer. Each user keeps its HTTP connection across
+// sessions and opens a new WebSocket per session, with fresh user ids.
+class Pair {
+ public:
+  Pair(EventLoop& loop, const sockaddr_in& server, const PairOptions& options,
+       WorkerStats& stats);
+
+  Pair(const Pair&) = delete;
+  Pair& operator=(const Pair&) = delete;
+
+  // Starts the first session at `at`, the pair then runs until stop()
+  void start(Clock::time_point at);
+  void stop();
+
+  // Starts a due session and fails one past its timeout, call regularly
+  void tick(Clock::time_point now);
+
+ private:
+  enum class State {
+    STOPPED,
+    WAITING,
+    CREATING_ROOM,
+    OPENING_SOCKETS,
+    JOINING,
+    NEGOTIATING,
+    ENDING,
+  };
+
+  struct User {
+    User(EventLoop& loop, const sockaddr_in& server);
+
+    Connection http;
+    Connection ws;
+    std::string id;
+    bool wsOpen = false;
+    bool sdpReceived = false;
+    std::size_t candidatesReceived = 0;
+  };
+
+  void startSession();
+  void handleRoomCreated(std::string_view body);
+  void handleSocketOpen(User& user);
+  void handleMessage(User& user, std::string_view text);
+  void handleRoomEnd(User& user);
+  void handleSocketClosed(User& user);
+  // Ends the session once both sides have everything of their peer
+  void checkSetup();
+
+  // POSTs `body` for `user`, failing the session unless the server answers
+  // 200, or backing off on 429. `onSuccess` gets the response body.
+  void post(User& user, std::string_view path, std::string_view body,
+            std::function<void(std::string_view)> onSuccess = {});
+  void sendDescription(User& user);
+  void sendCandidates(User& user);
+  void fail(std::string_view error);
+  // Abandons the session and starts the next one after a backoff that
+  // doubles while the server keeps throttling
+  void throttle();
+  void closeConnections();
+
+  const PairOptions& options_;
+  WorkerStats& stats_;
+  User host_;
+  User guest_;
+  State state_ = State::STOPPED;
+  std::string roomId_;
+  std::string sdp_;
+  Clock::time_point sessionStart_;
+  Clock::time_point nextSession_;
+  std::chrono::milliseconds backoff_{};
+};
+}  // namespace glimpse::loadgen
@@ -0,0 +1,107 @@
+#include "acceptor.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#include "logging.h"
+
+namespace glimpse {
+namespace {
+logging::RateLimit acceptErrorLog;
+
+// Out of descriptors or memory: the pending connection stays in the
+// backlog, wait a bit for some to be released instead of spinning on it
+constexpr std::chrono::milliseconds ACCEPT_BACKOFF{10};
+}  // namespace
+
+Acceptor::Acceptor(int fd, std::size_t loopCount)
+    : fd_(fd),
+      wakeFd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      targets_(loopCount),
+      attached_(static_cast<std::ptrdiff_t>(loopCount)) {}
+
+Acceptor::~Acceptor() {
+  stop();
+  ::close(fd_);
+  ::close(wakeFd_);
+}
+
+void Acceptor::attach(std::size_t loopIndex, uWS::TemplatedApp<false>* app) {
+  auto& target = targets_.at(loopIndex);
+  target.loop = uWS::Loop::get();
+  target.app = app;
+  target.keepAlive =
+      us_create_timer(reinterpret_cast<us_loop_t*>(target.loop), 0, 0);
+  attached_.count_down();
+}
+
+void Acceptor::start() {
+  stopping_.store(false);
+  thread_ = std::thread([this]() { run(); });
+}
+
+void Acceptor::stop() {
+  stopping_.store(true);
+  uint64_t one = 1;
+  [[maybe_unused]] auto written = ::write(wakeFd_, &one, sizeof one);
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  uint64_t count = 0;
+  [[maybe_unused]] auto read = ::read(wakeFd_, &count, sizeof count);
+}
+
+void Acceptor::close() {
+  for (const auto& target : targets_) {
+    target.loop->defer([target]() {
+      us_timer_close(target.keepAlive);
+      target.app->close();
+    });
+  }
+}
+
+void Acceptor::run() {
+  attached_.wait();
+  std::array<pollfd, 2> watched{};
+  watched[0] = {.fd = fd_, .events = POLLIN, .revents = 0};
+  watched[1] = {.fd = wakeFd_, .events = POLLIN, .revents = 0};
+  while (not stopping_.load()) {
+    ::poll(watched.data(), watched.size(), -1);
+
+    while (not stopping_.load()) {
+      int client = ::accept4(fd_, nullptr, nullptr,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client < 0) {
+        if (errno == EMFILE or errno == ENFILE or errno == ENOBUFS or
+            errno == ENOMEM) {
+          logging::limited(acceptErrorLog, spdlog::level::err,
+                           "Could not accept a connection: {}",
+                           std::strerror(errno));
+          std::this_thread::sleep_for(ACCEPT_BACKOFF);
+        } else if (errno == EINTR or errno == ECONNABORTED) {
+          continue;
+        }
+        break;
+      }
+      int one = 1;
+      ::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+      const auto& target = targets_[next_];
+      next_ = (next_ + 1) % targets_.size();
+      auto* app = target.app;
+      target.loop->defer([app, client]() { app->adoptSocket(client); });
+    }
+  }
+}
+}  // namespace glimpse
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <libusockets.h>
+#include <uwebsockets/App.h>
+#include <uwebsockets/Loop.h>
+
+#include <atomic>
+#include <cstddef>
+#include <latch>
+#include <thread>
+#include <vector>
+
+namespace glimpse {
+
+// Accepts the connections of one listening socket for every event loop. uWS
+// only listens on sockets it creates itself, each loop its own, so a socket
+// that must survive the process, see Handoff, is accepted from here
+// instead: one thread accepts and the loops adopt the connections into
+// their app, taking turns.
+class Acceptor {
+ public:
+  // Takes ownership of `fd`, a listening TCP socket
+  Acceptor(int fd, std::size_t loopCount);
+  ~Acceptor();
+
+  Acceptor(const Acceptor&) = delete;
+  Acceptor& operator=(const Acceptor&) = delete;
+
+  // Must be called once from each event-loop thread with its app. The loop
+  // then keeps running without connections, it has no listen socket of its
+  // own, until close().
+  void attach(std::size_t loopIndex, uWS::TemplatedApp<false>* app);
+
+  // Starts or restarts the accepting thread, which waits for every loop to
+  // attach first
+  void start();
+  // Stops it, connections then wait in the socket's backlog
+  void stop();
+  // Closes every loop's app and its connections, letting the loops end. May
+  // be called from any thread once stopped.
+  void close();
+
+  // The listening socket, handed to the process replacing this one
+  int fd() const { return fd_; }
+
+ private:
+  struct Target {
+    uWS::Loop* loop = nullptr;
+    uWS::TemplatedApp<false>* app = nullptr;
+    // Not fallthrough, keeps the loop running
+    us_timer_t* keepAlive = nullptr;
+  };
+
+  void run();
+
+  int fd_;
+  int wakeFd_;
+  std::vector<Target> targets_;
+  std::latch attached_;
+  std::size_t next_ = 0;
+  std::thread thread_;
+  std::atomic<bool> stopping_ = false;
+};
+}  // namespace glimpse
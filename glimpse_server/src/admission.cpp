@@ -0,0 +1,97 @@
+#include "admission.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <bit>
+
+#include "metrics.h"
+
+namespace glimpse {
+namespace {
+// Finalizer of splitmix64, spreads every input bit over the result
+uint64_t mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// FNV-1a starting from `seed`
+uint64_t hashText(std::string_view text, uint64_t seed) {
+  uint64_t hash = seed ^ 0xcbf29ce484222325;
+  for (unsigned char c : text) {
+    hash = (hash ^ c) * 0x100000001b3;
+  }
+  return mix(hash);
+}
+
+int64_t coarseNow() {
+  timespec now;
+  ::clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return std::max<int64_t>(1, int64_t(now.tv_sec) * 1000000000 + now.tv_nsec);
+}
+}  // namespace
+
+RateTable::RateTable(TokenBucketRate rate, std::size_t size)
+    : rate_(rate),
+      slots_(enabled() ? std::bit_ceil(std::max(size, WAYS)) : 0),
+      setMask_(slots_.size() / WAYS - 1) {}
+
+bool RateTable::take(uint64_t key, int64_t now) {
+  if (not enabled()) {
+    return true;
+  }
+  auto* set = &slots_[(key & setMask_) * WAYS];
+  auto* slot = set;
+  for (std::size_t i = 0; i < WAYS; ++i) {
+    if (set[i].refilled != 0 and set[i].key == key) {
+      slot = &set[i];
+      break;
+    }
+    if (set[i].refilled < slot->refilled) {
+      slot = &set[i];
+    }
+  }
+  if (slot->refilled == 0 or slot->key != key) {
+    *slot = {.key = key, .refilled = now, .tokens = rate_.burst};
+  } else {
+    auto elapsed = static_cast<double>(now - slot->refilled) / 1e9;
+    slot->tokens =
+        std::min(rate_.burst, slot->tokens + elapsed * rate_.perSecond);
+    slot->refilled = now;
+  }
+  if (slot->tokens < 1) {
+    return false;
+  }
+  slot->tokens -= 1;
+  return true;
+}
+
+Admission::Admission(const AdmissionOptions& options)
+    : seed_(randomId().low()),
+      addresses_(options.address, options.tableSize),
+      users_(options.user, options.tableSize) {}
+
+bool Admission::admitAddress(std::string_view address) {
+  if (not addresses_.enabled()) {
+    return true;
+  }
+  if (addresses_.take(hashText(address, seed_), coarseNow())) {
+    return true;
+  }
+  metrics::add(metrics::Counter::THROTTLED_BY_ADDRESS);
+  return false;
+}
+
+bool Admission::admitUser(const Id& userId) {
+  if (not users_.enabled() or userId.isNil()) {
+    return true;
+  }
+  auto key = mix(userId.high() ^ seed_) ^ mix(userId.low());
+  if (users_.take(key, coarseNow())) {
+    return true;
+  }
+  metrics::add(metrics::Counter::THROTTLED_BY_USER);
+  return false;
+}
+}  // namespace glimpse
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "id.h"
+
+namespace glimpse {
+
+// Sustained rate and burst of a token bucket. A rate of 0 lets everything
+// through.
+struct TokenBucketRate {
+  double perSecond = 0;
+  double burst = 0;
+};
+
+struct AdmissionOptions {
+  // Requests and WebSocket upgrades from one remote address
+  TokenBucketRate address{.perSecond = 50, .burst = 200};
+  // Requests and WebSocket upgrades naming one user
+  TokenBucketRate user{.perSecond = 20, .burst = 60};
+  // Buckets kept of each kind, rounded up to a multiple of RateTable::WAYS
+  std::size_t tableSize = 8192;
+};
+
+// Token buckets keyed by a 64-bit hash in a table of fixed size, for one
+// thread. The table is set associative: a key can only live in the
+// WAYS slots of its set, so a check costs the same however many clients
+// there are and never allocates. A new key takes the slot of its set that
+// was used longest ago.
+//
+// Nothing has to expire explicitly. A bucket left alone refills, and a full
+// bucket is the same as none; evicting it loses nothing. Only when more
+// clients are active at once than the table holds do the oldest of them
+// start over with a full bucket.
+class RateTable {
+ public:
+  static constexpr std::size_t WAYS = 4;
+
+  RateTable(TokenBucketRate rate, std::size_t size);
+
+  // Takes a token from the bucket of `key`, false if it is empty. `now` is
+  // in nanoseconds of a monotonic clock, never 0.
+  bool take(uint64_t key, int64_t now);
+
+  bool enabled() const { return rate_.perSecond > 0; }
+
+ private:
+  struct Slot {
+    uint64_t key = 0;
+    // When the bucket was last refilled, 0 for a free slot
+    int64_t refilled = 0;
+    double tokens = 0;
+  };
+
+  TokenBucketRate rate_;
+  std::vector<Slot> slots_;
+  std::size_t setMask_;
+};
+
+// Admission control of one event loop: every HTTP request and WebSocket
+// upgrade takes a token from the bucket of its remote address, and once
+// its body or query is parsed, from the bucket of the user it names. Used
+// only from the loop's thread, so the limits apply to the connections that
+// thread accepted.
+//
+// Buckets refill by CLOCK_MONOTONIC_COARSE, which is a few milliseconds
+// coarse but costs a fraction of a precise clock read.
+class Admission {
+ public:
+  explicit Admission(const AdmissionOptions& options = {});
+
+  // `address` as uWS formats it. Counts the rejections.
+  bool admitAddress(std::string_view address);
+  // The nil id, which names nobody, is always admitted
+  bool admitUser(const Id& userId);
+
+ private:
+  // Keys are salted so that clients cannot pick addresses or ids that
+  // collide in the table
+  uint64_t seed_;
+  RateTable addresses_;
+  RateTable users_;
+};
+}  // namespace glimpse
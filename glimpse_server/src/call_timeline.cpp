@@ -0,0 +1,84 @@
+#include "call_timeline.h"
+
+#include <algorithm>
+
+namespace glimpse {
+
+void CallTimeline::mark(Event event, metrics::Clock::time_point now) {
+  if (event == LAST_CANDIDATE or not has(event)) {
+    at[event] = now;
+  }
+}
+
+std::optional<metrics::Clock::duration> CallTimeline::duration(
+    metrics::SetupPhase phase) const {
+  auto between = [this](Event from, Event to)
+      -> std::optional<metrics::Clock::duration> {
+    if (not has(from) or not has(to)) {
+      return std::nullopt;
+    }
+    return at[to] - at[from];
+  };
+  switch (phase) {
+    case metrics::SetupPhase::JOIN_REQUEST:
+      return between(CREATED, JOIN_REQUESTED);
+    case metrics::SetupPhase::APPROVAL:
+      return between(JOIN_REQUESTED, APPROVED);
+    case metrics::SetupPhase::ROOM_READY:
+      return between(APPROVED, ROOM_READY);
+    case metrics::SetupPhase::OFFER:
+      return between(ROOM_READY, OFFER);
+    case metrics::SetupPhase::ANSWER:
+      return between(OFFER, ANSWER);
+    case metrics::SetupPhase::CANDIDATES: {
+      if (not completed()) {
+        return std::nullopt;
+      }
+      // Candidates that all came before the answer added nothing
+      auto after = has(LAST_CANDIDATE) ? at[LAST_CANDIDATE] - at[ANSWER]
+                                        : metrics::Clock::duration::zero();
+      return std::max(after, metrics::Clock::duration::zero());
+    }
+    case metrics::SetupPhase::TOTAL: {
+      auto total = between(JOIN_REQUESTED, ANSWER);
+      if (total and has(LAST_CANDIDATE)) {
+        total = std::max(*total, at[LAST_CANDIDATE] - at[JOIN_REQUESTED]);
+      }
+      return total;
+    }
+    case metrics::SetupPhase::COUNT:
+      break;
+  }
+  return std::nullopt;
+}
+
+void CallTimeline::record() const {
+  for (std::size_t i = 0; i < metrics::SETUP_PHASE_COUNT; ++i) {
+    auto phase = static_cast<metrics::SetupPhase>(i);
+    if (auto length = duration(phase)) {
+      metrics::recordSetupPhase(phase, *length);
+    }
+  }
+}
+
+void SetupLog::push(const CallTimeline& timeline) {
+  if (timelines_.empty()) {
+    return;
+  }
+  timelines_[next_] = timeline;
+  next_ = (next_ + 1) % timelines_.size();
+  size_ = std::min(size_ + 1, timelines_.size());
+}
+
+void SetupLog::collectSlow(metrics::Clock::duration atLeast,
+                           std::vector<CallTimeline>& out) const {
+  for (std::size_t i = 1; i <= size_; ++i) {
+    const auto& timeline =
+        timelines_[(next_ + timelines_.size() - i) % timelines_.size()];
+    auto total = timeline.duration(metrics::SetupPhase::TOTAL);
+    if (not total or *total >= atLeast) {
+      out.push_back(timeline);
+    }
+  }
+}
+}  // namespace glimpse
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+#include "id.h"
+#include "metrics.h"
+
+namespace glimpse {
+
+// When the steps of setting up a room's call happened, on the monotonic
+// clock of the shard owning the room. The call is the one with the room's
+// first guest: later guests join a call that is already running.
+struct CallTimeline {
+  enum Event : std::size_t {
+    CREATED,
+    JOIN_REQUESTED,
+    APPROVED,
+    ROOM_READY,
+    OFFER,
+    ANSWER,
+    LAST_CANDIDATE,
+    EVENT_COUNT,
+  };
+
+  Id roomId;
+  // Sender of the offer, the answer is the first SDP from anyone else
+  Id offerer{};
+  // The epoch for events that did not happen
+  std::array<metrics::Clock::time_point, EVENT_COUNT> at{};
+
+  bool has(Event event) const {
+    return at[event] != metrics::Clock::time_point();
+  }
+  // Records `event` the first time it happens, LAST_CANDIDATE every time
+  void mark(Event event, metrics::Clock::time_point now);
+  // Whether the answer arrived
+  bool completed() const { return has(ANSWER); }
+  // Nullopt unless both ends of `phase` happened
+  std::optional<metrics::Clock::duration> duration(
+      metrics::SetupPhase phase) const;
+  // Records the phases that happened in their histograms
+  void record() const;
+};
+
+// The most recently finished timelines of one shard in a ring allocated up
+// front, the oldest is overwritten. Only used from the shard's thread.
+class SetupLog {
+ public:
+  explicit SetupLog(std::size_t capacity) : timelines_(capacity) {}
+
+  void push(const CallTimeline& timeline);
+
+  // Appends to `out` the timelines whose SetupPhase::TOTAL took at least
+  // `atLeast`, and those that never got an answer, newest first
+  void collectSlow(metrics::Clock::duration atLeast,
+                   std::vector<CallTimeline>& out) const;
+
+ private:
+  std::vector<CallTimeline> timelines_;
+  std::size_t next_ = 0;
+  std::size_t size_ = 0;
+};
+}  // namespace glimpse
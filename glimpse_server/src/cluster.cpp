@@ -0,0 +1,472 @@
+#include "cluster.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <utility>
+
+#include "logging.h"
+#include "shard.h"
+#include "wire.h"
+#include "ws_manager.h"
+
+namespace glimpse {
+namespace {
+using wire::put;
+using wire::putId;
+using wire::putString;
+
+enum FrameKind : uint8_t {
+  // Users connected to the sending node, count then ids
+  USERS_ONLINE = 1,
+  USER_OFFLINE,
+  // A message for one user connected to the receiving node
+  DELIVER,
+  // A room broadcast for members connected to the receiving node
+  PUBLISH,
+  UNSUBSCRIBE,
+  // A RoomCall for the receiving node to run, and its result
+  CALL,
+  RESULT,
+};
+
+// Ids per USERS_ONLINE frame of a greeting
+constexpr std::size_t PRESENCE_BATCH = 4096;
+
+// A result lost with a node that stalls or drops the call without its link
+// breaking must not leave the request unanswered
+constexpr std::chrono::seconds CALL_TIMEOUT{10};
+constexpr std::chrono::seconds CALL_SWEEP{1};
+
+logging::RateLimit frameErrorLog;
+
+void putMembers(std::string& out, std::span<const Id> members) {
+  put(out, static_cast<uint32_t>(members.size()));
+  for (const auto& member : members) {
+    putId(out, member);
+  }
+}
+
+std::vector<User> getMembers(wire::Reader& frame) {
+  auto count = frame.get<uint32_t>();
+  std::vector<User> members;
+  for (uint32_t i = 0; i < count and frame.ok(); ++i) {
+    members.push_back({.id = frame.getId(), .name = {}});
+  }
+  return members;
+}
+
+void putCall(std::string& out, const RoomCall& call) {
+  put(out, static_cast<uint8_t>(call.operation));
+  putId(out, call.subject);
+  wire::putUser(out, call.user);
+  putId(out, call.toUserId);
+  putString(out, call.text);
+}
+
+// `text` is a view into the frame
+RoomCall getCall(wire::Reader& frame) {
+  auto operation = static_cast<metrics::Operation>(frame.get<uint8_t>());
+  auto subject = frame.getId();
+  auto user = frame.getUser();
+  auto toUserId = frame.getId();
+  if (operation >= metrics::Operation::COUNT) {
+    operation = metrics::Operation::END_ROOM;
+  }
+  return {.operation = operation,
+          .subject = subject,
+          .user = std::move(user),
+          .toUserId = toUserId,
+          .text = frame.getStringView()};
+}
+}  // namespace
+
+RoomCallResult runRoomCall(RoomManager& roomManager, const RoomCall& call) {
+  try {
+    return {.succeeded = true, .id = roomManager.execute(call)};
+  } catch (std::exception& err) {
+    return {.succeeded = false, .error = err.what()};
+  }
+}
+
+Cluster::Cluster(std::shared_ptr<const HashRing> ring, NodeBusOptions options,
+                 std::shared_ptr<WsManager> wsManager,
+                 std::shared_ptr<ShardRouter> router)
+    : ring_(ring),
+      wsManager_(wsManager),
+      router_(router),
+      calls_(router->size()) {
+  NodeBusHandler handler = {
+      .greet = [this](std::size_t node,
+                      std::string& out) { greet(node, out); },
+      .receive =
+          [this](std::size_t node, std::string frames) {
+            router_->run(loopOf(node),
+                         [this, node, frames = std::move(frames)]() {
+                           receive(node, frames);
+                         });
+          },
+      .linkDown = [this](std::size_t node,
+                         uint64_t generation) { linkDown(node, generation); },
+      .peerDown = [this](std::size_t node) { peerDown(node); },
+  };
+  bus_ = std::make_unique<NodeBus>(ring, options, std::move(handler));
+}
+
+void Cluster::start() {
+  spdlog::info("Cluster node {} of {} ({})", ring_->self(), ring_->size(),
+               ring_->member(ring_->self()));
+  bus_->start();
+}
+
+void Cluster::stop() { bus_->stop(); }
+
+std::size_t Cluster::loopOf(std::size_t node) const {
+  return node % router_->size();
+}
+
+Cluster::RemoteStripe& Cluster::stripeOf(const Id& userId) const {
+  return remote_[IdHash{}(userId) % REMOTE_STRIPES];
+}
+
+void Cluster::sessionOpened(const Id& userId) {
+  std::lock_guard presence(presenceMutex_);
+  {
+    std::lock_guard lock(localMutex_);
+    if (localUsers_[userId]++ > 0) {
+      return;
+    }
+  }
+  // A link coming up in between greets with the user already, hearing of
+  // it twice is harmless
+  std::array<Id, 1> users = {userId};
+  for (std::size_t node = 0; node < ring_->size(); ++node) {
+    if (node != ring_->self()) {
+      bus_->send(node, [&users](std::string& out) {
+        put(out, USERS_ONLINE);
+        putMembers(out, users);
+      });
+    }
+  }
+}
+
+void Cluster::sessionClosed(const Id& userId) {
+  std::lock_guard presence(presenceMutex_);
+  {
+    std::lock_guard lock(localMutex_);
+    auto it = localUsers_.find(userId);
+    if (it == localUsers_.end() or --it->second > 0) {
+      return;
+    }
+    localUsers_.erase(it);
+  }
+  for (std::size_t node = 0; node < ring_->size(); ++node) {
+    if (node != ring_->self()) {
+      bus_->send(node, [&userId](std::string& out) {
+        put(out, USER_OFFLINE);
+        putId(out, userId);
+      });
+    }
+  }
+}
+
+std::optional<std::size_t> Cluster::nodeOf(const Id& userId) const {
+  auto& stripe = stripeOf(userId);
+  std::lock_guard lock(stripe.mutex);
+  auto it = stripe.nodes.find(userId);
+  if (it == stripe.nodes.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+bool Cluster::sendMessage(const Id& userId, const WsMessage& message) {
+  auto node = nodeOf(userId);
+  if (not node) {
+    return false;
+  }
+  return bus_->send(*node, [&](std::string& out) {
+    put(out, DELIVER);
+    putId(out, userId);
+    wire::putMessage(out, message);
+  }) != 0;
+}
+
+std::vector<std::pair<std::size_t, std::vector<Id>>> Cluster::groupByNode(
+    std::span<const Id> users) const {
+  // Nodes in order of first appearance, a room spans only a few
+  std::vector<std::pair<std::size_t, std::vector<Id>>> nodes;
+  for (const auto& userId : users) {
+    auto node = nodeOf(userId);
+    if (not node) {
+      continue;
+    }
+    auto it = std::ranges::find(nodes, *node,
+                                &decltype(nodes)::value_type::first);
+    if (it == nodes.end()) {
+      it = nodes.insert(it, {*node, {}});
+    }
+    it->second.push_back(userId);
+  }
+  return nodes;
+}
+
+void Cluster::publish(const Id& roomId, std::span<const Id> members,
+                      const WsMessage& message) {
+  for (const auto& [node, nodeMembers] : groupByNode(members)) {
+    bus_->send(node, [&](std::string& out) {
+      put(out, PUBLISH);
+      putId(out, roomId);
+      putMembers(out, nodeMembers);
+      wire::putMessage(out, message);
+    });
+  }
+}
+
+void Cluster::unsubscribe(const Id& roomId, std::span<const Id> members) {
+  for (const auto& [node, nodeMembers] : groupByNode(members)) {
+    bus_->send(node, [&](std::string& out) {
+      put(out, UNSUBSCRIBE);
+      putId(out, roomId);
+      putMembers(out, nodeMembers);
+    });
+  }
+}
+
+void Cluster::call(const RoomCall& call,
+                   std::function<void(RoomCallResult)> done) {
+  auto node = ring_->ownerOf(call.subject);
+  auto shard = router_->current();
+  auto& loopCalls = calls_[shard];
+  // The calling loop is in the id, the result goes back to it
+  auto callId = loopCalls.next++ * router_->size() + shard;
+  auto generation = bus_->send(node, [&](std::string& out) {
+    put(out, CALL);
+    put(out, callId);
+    putCall(out, call);
+  });
+  if (generation == 0) {
+    done({.succeeded = false, .error = "cluster node is unreachable"});
+    return;
+  }
+  loopCalls.pending.emplace(
+      callId,
+      PendingCall{.node = node,
+                  .generation = generation,
+                  .deadline = std::chrono::steady_clock::now() + CALL_TIMEOUT,
+                  .done = std::move(done)});
+  if (not loopCalls.sweep) {
+    loopCalls.sweep = std::make_unique<LoopTimer>(
+        uWS::Loop::get(), [this, shard]() { sweepCalls(shard); });
+  }
+  if (not loopCalls.sweep->isPending()) {
+    loopCalls.sweep->start(CALL_SWEEP, CALL_SWEEP);
+  }
+}
+
+void Cluster::sweepCalls(std::size_t shard) {
+  auto& loopCalls = calls_[shard];
+  auto now = std::chrono::steady_clock::now();
+  std::vector<std::function<void(RoomCallResult)>> expired;
+  std::erase_if(loopCalls.pending, [&](auto& entry) {
+    auto& call = entry.second;
+    if (call.deadline > now) {
+      return false;
+    }
+    expired.push_back(std::move(call.done));
+    return true;
+  });
+  if (loopCalls.pending.empty()) {
+    loopCalls.sweep->stop();
+  }
+  // A late result finds nothing to complete
+  for (auto& done : expired) {
+    done({.succeeded = false, .error = "timeout"});
+  }
+}
+
+void Cluster::greet(std::size_t node, std::string& out) {
+  std::vector<Id> users;
+  {
+    std::lock_guard lock(localMutex_);
+    users.reserve(localUsers_.size());
+    for (const auto& [userId, sockets] : localUsers_) {
+      users.push_back(userId);
+    }
+  }
+  for (std::size_t i = 0; i < users.size(); i += PRESENCE_BATCH) {
+    auto batch = std::span<const Id>(users).subspan(
+        i, std::min(PRESENCE_BATCH, users.size() - i));
+    NodeBus::appendFrame(out, [&batch](std::string& frame) {
+      put(frame, USERS_ONLINE);
+      putMembers(frame, batch);
+    });
+  }
+  spdlog::info("Sent {} connected users to cluster node {}", users.size(),
+               node);
+}
+
+void Cluster::receive(std::size_t node, std::string_view frames) {
+  NodeBus::forEachFrame(frames, [this, node](std::string_view body) {
+    handleFrame(node, body);
+  });
+}
+
+void Cluster::handleFrame(std::size_t node, std::string_view body) {
+  wire::Reader frame(body.data(), body.data() + body.size());
+  auto kind = frame.get<FrameKind>();
+  switch (kind) {
+    case USERS_ONLINE: {
+      auto count = frame.get<uint32_t>();
+      for (uint32_t i = 0; i < count and frame.ok(); ++i) {
+        auto userId = frame.getId();
+        auto& stripe = stripeOf(userId);
+        std::lock_guard lock(stripe.mutex);
+        stripe.nodes[userId] = node;
+      }
+      break;
+    }
+    case USER_OFFLINE: {
+      auto userId = frame.getId();
+      auto& stripe = stripeOf(userId);
+      std::lock_guard lock(stripe.mutex);
+      // The user may have moved to another node meanwhile
+      auto it = stripe.nodes.find(userId);
+      if (it != stripe.nodes.end() and it->second == node) {
+        stripe.nodes.erase(it);
+      }
+      break;
+    }
+    case DELIVER: {
+      auto userId = frame.getId();
+      auto message = frame.getMessage();
+      if (frame.ok()) {
+        wsManager_->sendLocalMessage(userId, message);
+      }
+      break;
+    }
+    case PUBLISH: {
+      auto roomId = frame.getId();
+      auto members = getMembers(frame);
+      auto message = frame.getMessage();
+      if (frame.ok()) {
+        wsManager_->publishLocal(roomId, members, message);
+      }
+      break;
+    }
+    case UNSUBSCRIBE: {
+      auto roomId = frame.getId();
+      auto members = getMembers(frame);
+      if (frame.ok()) {
+        wsManager_->unsubscribeLocal(roomId, members);
+      }
+      break;
+    }
+    case CALL: {
+      auto callId = frame.get<uint64_t>();
+      auto call = getCall(frame);
+      if (frame.ok()) {
+        runCall(node, callId, call);
+      }
+      break;
+    }
+    case RESULT: {
+      auto callId = frame.get<uint64_t>();
+      RoomCallResult result = {.succeeded = frame.get<uint8_t>() != 0};
+      result.id = frame.getId();
+      result.error = frame.getString();
+      if (frame.ok()) {
+        router_->run(callId % router_->size(),
+                     [this, callId, result = std::move(result)]() mutable {
+                       complete(callId, std::move(result));
+                     });
+      }
+      break;
+    }
+    default:
+      logging::limited(frameErrorLog, spdlog::level::err,
+                       "Ignoring a frame of unknown kind {} from cluster "
+                       "node {}",
+                       static_cast<int>(kind), node);
+      return;
+  }
+  if (not frame.ok()) {
+    logging::limited(frameErrorLog, spdlog::level::err,
+                     "Ignoring a malformed frame of kind {} from cluster "
+                     "node {}",
+                     static_cast<int>(kind), node);
+  }
+}
+
+void Cluster::runCall(std::size_t node, uint64_t callId,
+                      const RoomCall& call) {
+  auto shard = call.operation == metrics::Operation::CREATE_ROOM
+                   ? router_->current()
+                   : router_->shardOf(call.subject);
+  // The frame is gone by the time the shard runs the call
+  router_->post(shard, [this, node, callId, call = call,
+                        text = std::string(call.text)](
+                           RoomManager& roomManager) mutable {
+    call.text = text;
+    auto result = runRoomCall(roomManager, call);
+    bus_->send(node, [&](std::string& out) {
+      put(out, RESULT);
+      put(out, callId);
+      put(out, static_cast<uint8_t>(result.succeeded));
+      putId(out, result.id);
+      putString(out, result.error);
+    });
+  });
+}
+
+void Cluster::complete(uint64_t callId, RoomCallResult result) {
+  auto& pending = calls_[router_->current()].pending;
+  auto it = pending.find(callId);
+  // Already failed when its link broke or it timed out
+  if (it == pending.end()) {
+    return;
+  }
+  auto done = std::move(it->second.done);
+  pending.erase(it);
+  done(std::move(result));
+}
+
+void Cluster::linkDown(std::size_t node, uint64_t generation) {
+  // Calls sent on the broken link will not be answered, each loop fails its
+  // own
+  for (std::size_t shard = 0; shard < router_->size(); ++shard) {
+    router_->run(shard, [this, node, generation, shard]() {
+      auto& pending = calls_[shard].pending;
+      std::vector<std::function<void(RoomCallResult)>> failed;
+      std::erase_if(pending, [&](auto& entry) {
+        auto& call = entry.second;
+        if (call.node != node or call.generation > generation) {
+          return false;
+        }
+        failed.push_back(std::move(call.done));
+        return true;
+      });
+      for (auto& done : failed) {
+        done({.succeeded = false, .error = "lost the link to cluster node"});
+      }
+    });
+  }
+}
+
+void Cluster::peerDown(std::size_t node) {
+  // After the frames the node sent before, see loopOf()
+  router_->run(loopOf(node), [this, node]() {
+    std::size_t removed = 0;
+    for (auto& stripe : remote_) {
+      std::lock_guard lock(stripe.mutex);
+      removed += std::erase_if(stripe.nodes, [node](const auto& entry) {
+        return entry.second == node;
+      });
+    }
+    spdlog::info("Forgot {} users connected to cluster node {}", removed,
+                 node);
+  });
+}
+}  // namespace glimpse
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hash_ring.h"
+#include "id.h"
+#include "loop_timer.h"
+#include "node_bus.h"
+#include "room_manager.h"
+#include "user.h"
+#include "ws_message.h"
+
+namespace glimpse {
+
+class ShardRouter;
+class WsManager;
+
+// Outcome of a RoomCall run on another node
+struct RoomCallResult {
+  bool succeeded;
+  // What RoomManager::execute() returned
+  Id id{};
+  // what() of the exception it threw
+  std::string error{};
+};
+
+// Runs `call` on the calling shard, catching what it throws
+RoomCallResult runRoomCall(RoomManager& roomManager, const RoomCall& call);
+
+// Lets the participants of a room be connected to different servers.
+//
+// Rooms and join requests belong to the node the HashRing assigns their id
+// to; a node only mints ids it owns, so the owner of any id is known
+// everywhere without asking. Requests about a room held by another node
+// are forwarded to it as a RoomCall and answered over the same links.
+//
+// Each node tells the others which users are connected to it. A message
+// for a user connected elsewhere is forwarded to that node, which delivers
+// it like one of its own, and a room broadcast is forwarded once per node
+// with the members connected there.
+//
+// Frames from one node are handled in order on one event loop of the
+// receiving node, see loopOf(), so that forwarded messages keep their
+// order.
+class Cluster {
+ public:
+  // Listens for links from the other members, throws NodeBusError if it
+  // cannot
+  Cluster(std::shared_ptr<const HashRing> ring, NodeBusOptions options,
+          std::shared_ptr<WsManager> wsManager,
+          std::shared_ptr<ShardRouter> router);
+
+  // Must be called once every event loop is attached, see
+  // ShardRouter::attach()
+  void start();
+  void stop();
+
+  const HashRing& ring() const { return *ring_; }
+  NodeBusStats stats() const { return bus_->stats(); }
+
+  // Presence, called by WsManager whenever a user's socket opens or closes.
+  // A user is online until the last of their sockets on this node closes.
+  void sessionOpened(const Id& userId);
+  void sessionClosed(const Id& userId);
+  // The node `userId` is connected to, if another one
+  std::optional<std::size_t> nodeOf(const Id& userId) const;
+
+  // Forwards to the node `userId` is connected to. Returns false if it is
+  // not connected to any other node.
+  bool sendMessage(const Id& userId, const WsMessage& message);
+  // Forwards to every node with a member connected, see
+  // WsManager::publish(). Members not connected anywhere are skipped.
+  void publish(const Id& roomId, std::span<const Id> members,
+               const WsMessage& message);
+  void unsubscribe(const Id& roomId, std::span<const Id> members);
+
+  // Runs `call` on the node that owns `call.subject`. `done` is called on
+  // the calling event loop with the result, or a failure if the node
+  // cannot be reached or does not answer within CALL_TIMEOUT.
+  void call(const RoomCall& call, std::function<void(RoomCallResult)> done);
+
+ private:
+  struct PendingCall {
+    std::size_t node;
+    uint64_t generation;
+    std::chrono::steady_clock::time_point deadline;
+    std::function<void(RoomCallResult)> done;
+  };
+
+  // Calls waiting for their result, only used by the loop that made them
+  struct alignas(64) LoopCalls {
+    uint64_t next = 0;
+    std::unordered_map<uint64_t, PendingCall> pending;
+    // Fails the calls past their deadline while any is pending, created by
+    // the first call
+    std::unique_ptr<LoopTimer> sweep;
+  };
+
+  struct alignas(64) RemoteStripe {
+    mutable std::mutex mutex;
+    std::unordered_map<Id, std::size_t, IdHash> nodes;
+  };
+
+  static constexpr std::size_t REMOTE_STRIPES = 16;
+
+  // Event loop that handles the frames of `node`
+  std::size_t loopOf(std::size_t node) const;
+  RemoteStripe& stripeOf(const Id& userId) const;
+  // The users connected to other nodes, by node
+  std::vector<std::pair<std::size_t, std::vector<Id>>> groupByNode(
+      std::span<const Id> users) const;
+
+  // Bus handlers
+  void greet(std::size_t node, std::string& out);
+  void receive(std::size_t node, std::string_view frames);
+  void linkDown(std::size_t node, uint64_t generation);
+  void peerDown(std::size_t node);
+
+  void handleFrame(std::size_t node, std::string_view body);
+  void runCall(std::size_t node, uint64_t callId, const RoomCall& call);
+  void complete(uint64_t callId, RoomCallResult result);
+  void sweepCalls(std::size_t shard);
+
+  std::shared_ptr<const HashRing> ring_;
+  std::shared_ptr<WsManager> wsManager_;
+  std::shared_ptr<ShardRouter> router_;
+  std::unique_ptr<NodeBus> bus_;
+
+  // Serializes presence changes with their announcement, so that the other
+  // nodes hear of them in the order they happened. Never taken by the bus
+  // thread.
+  std::mutex presenceMutex_;
+  // Users connected to this node and their number of sockets, sent to every
+  // node that connects
+  std::mutex localMutex_;
+  std::unordered_map<Id, uint32_t, IdHash> localUsers_;
+  // Users connected to other nodes
+  mutable std::array<RemoteStripe, REMOTE_STRIPES> remote_;
+  std::vector<LoopCalls> calls_;
+};
+}  // namespace glimpse
@@ -2,51 +2,203 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <array>
 #include <charconv>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <exception>
 #include <memory>
 #include <nlohmann/json_fwd.hpp>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
 
+#include "call_timeline.h"
+#include "logging.h"
+#include "metrics.h"
 #include "user.h"
+#include "ws_message.h"
 
 namespace glimpse {
+namespace {
+// A client sending garbage or retrying a failing request in a loop must not
+// flood the log, each kind is logged a few times a second at most
+logging::RateLimit invalidRequestLog;
+logging::RateLimit failedRequestLog;
+
+// Ids from clients that are not UUIDs cannot name anything that exists, they
+// become the nil id and fail lookups like any unknown id
+Id parseIdOrNil(std::string_view text) {
+  return Id::parse(text).value_or(Id());
+}
+
+template <typename T>
+T parsePayload(std::string &body) {
+  metrics::ScopedTimer timer(metrics::Latency::JSON_PARSE);
+  return parseJsonInPlace<T>(body);
+}
+
+template <typename T>
+std::string serializePayload(const T &payload) {
+  metrics::ScopedTimer timer(metrics::Latency::JSON_SERIALIZE);
+  return nlohmann::json(payload).dump();
+}
+
+// Requests over the WebSocket are labeled by their message type
+metrics::Operation operationOf(WsMessage::Type type) {
+  switch (type) {
+    case WsMessage::JOIN_ROOM:
+      return metrics::Operation::JOIN_ROOM;
+    case WsMessage::APPROVE_JOIN_REQUEST:
+      return metrics::Operation::APPROVE_JOIN_REQUEST;
+    case WsMessage::DENY_JOIN_REQUEST:
+      return metrics::Operation::DENY_JOIN_REQUEST;
+    case WsMessage::SDP:
+      return metrics::Operation::SDP;
+    case WsMessage::ICE:
+      return metrics::Operation::ICE;
+    case WsMessage::OPEN_RELAY:
+      return metrics::Operation::OPEN_RELAY;
+    default:
+      return metrics::Operation::END_ROOM;
+  }
+}
+
+// Body of the answer to a successful HTTP request, {"roomId":"..."} for a
+// new room and {"requestId":"..."} for a join request, written into
+// `buffer`
+std::string_view responseBody(metrics::Operation operation, const Id &id,
+                              std::array<char, 64> &buffer) {
+  std::string_view prefix;
+  switch (operation) {
+    case metrics::Operation::CREATE_ROOM:
+      prefix = R"({"roomId":")";
+      break;
+    case metrics::Operation::JOIN_ROOM:
+      prefix = R"({"requestId":")";
+      break;
+    default:
+      return "{}";
+  }
+  auto text = id.text();
+  auto *end = std::copy(prefix.begin(), prefix.end(), buffer.begin());
+  end = std::copy(text.begin(), text.end(), end);
+  end = std::copy_n(R"("})", 2, end);
+  return {buffer.data(), static_cast<std::size_t>(end - buffer.data())};
+}
+
+// Query parameter `name` as a number, `fallback` if it is missing or invalid
+std::size_t queryNumber(uWS::HttpRequest *req, std::string_view name,
+                        std::size_t fallback) {
+  auto text = req->getQuery(name);
+  std::size_t value;
+  auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+  if (result.ec != std::errc() or result.ptr != text.data() + text.size()) {
+    return fallback;
+  }
+  return value;
+}
+
+// Setups collected from the shards for one GET /debug/setups, only touched
+// on the thread that received it
+struct SetupsRequest {
+  uWS::HttpResponse<false> *res;
+  std::size_t limit;
+  std::size_t pendingShards;
+  bool aborted = false;
+  std::vector<CallTimeline> setups{};
+};
+
+nlohmann::json setupJson(const CallTimeline &setup,
+                         metrics::Clock::time_point now) {
+  using Seconds = std::chrono::duration<double>;
+  auto phases = nlohmann::json::object();
+  for (std::size_t i = 0; i < metrics::SETUP_PHASE_COUNT; ++i) {
+    auto phase = static_cast<metrics::SetupPhase>(i);
+    if (auto duration = setup.duration(phase)) {
+      phases[std::string(metrics::setupPhaseName(phase))] =
+          std::chrono::duration_cast<Seconds>(*duration).count();
+    }
+  }
+  auto started = setup.at[CallTimeline::JOIN_REQUESTED];
+  return {
+      {"roomId", setup.roomId},
+      {"completed", setup.completed()},
+      {"startedSecondsAgo",
+       std::chrono::duration_cast<Seconds>(now - started).count()},
+      {"phases", std::move(phases)},
+  };
+}
 
-void Controller::handlePost(
-    uWS::HttpResponse<false> *res, uWS::HttpRequest *req,
-    std::function<void(uWS::HttpResponse<false> *res, uWS::HttpRequest *req,
-                       std::shared_ptr<std::string> body)>
-        bodyHandler) {
+void respondSetups(SetupsRequest &request) {
+  auto &setups = request.setups;
+  std::sort(setups.begin(), setups.end(), [](const auto &a, const auto &b) {
+    return a.at[CallTimeline::JOIN_REQUESTED] >
+           b.at[CallTimeline::JOIN_REQUESTED];
+  });
+  setups.resize(std::min(setups.size(), request.limit));
+  auto now = metrics::Clock::now();
+  auto list = nlohmann::json::array();
+  for (const auto &setup : setups) {
+    list.push_back(setupJson(setup, now));
+  }
+  auto body = nlohmann::json{{"setups", std::move(list)}}.dump();
+  auto *res = request.res;
+  res->cork([res, &body]() {
+    res->writeHeader("Content-Type", "application/json")->end(body);
+  });
+}
+}  // namespace
+
+PostBody *Controller::beginPost(uWS::HttpResponse<false> *res,
+                                uWS::HttpRequest *req) {
+  if (admission_ and
+      not admission_->admitAddress(res->getRemoteAddressAsText())) {
+    respondThrottled(res);
+    return nullptr;
+  }
   uint32_t contentLength = 0;
   auto lengthStr = req->getHeader("content-length");
   auto result = std::from_chars(
       lengthStr.data(), lengthStr.data() + lengthStr.size(), contentLength);
   if (result.ec == std::errc::invalid_argument) {
-    spdlog::error("Could not convert content length to int");
-  }
-  auto isAborted = std::make_shared<bool>(false);
-  auto body = std::make_shared<std::string>();
-  body->reserve(contentLength);
-  res->onAborted([isAborted]() { *isAborted = true; });
-  res->onData([res, req, body, isAborted, bodyHandler](std::string_view chunk,
-                                                       bool isLast) {
-    body->append(chunk);
-    if (isLast and not *isAborted) {
-      bodyHandler(res, req, body);
-    }
-  });
+    logging::limited(invalidRequestLog, spdlog::level::err,
+                     "Could not convert content length to int");
+  }
+  if (contentLength > MAX_POST_BODY_SIZE) {
+    respondTooLarge(res);
+    return nullptr;
+  }
+  auto *body = PostBodyPool::local().acquire(res);
+  body->data.reserve(contentLength);
+  return body;
 }
 
 void Controller::respondError(uWS::HttpResponse<false> *res,
                               const std::string &errorMessage) {
   ErrorResponsePayload response = {.message = errorMessage};
-  nlohmann::json responseJ = response;
   res->writeStatus(HTTP_STATUS_400)
       ->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
-      ->end(responseJ.dump());
+      ->end(serializePayload(response));
+}
+
+void Controller::respondThrottled(uWS::HttpResponse<false> *res) {
+  res->writeStatus(HTTP_STATUS_429)
+      ->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
+      ->writeHeader("Retry-After", "1")
+      ->end(THROTTLED_BODY);
+}
+
+void Controller::respondTooLarge(uWS::HttpResponse<false> *res) {
+  res->writeStatus(HTTP_STATUS_413)
+      ->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
+      ->end(TOO_LARGE_BODY);
 }
 
 void RootController::handleGet(uWS::HttpResponse<false> *res,
@@ -62,217 +214,768 @@ void RootController::handleOption(uWS::HttpResponse<false> *res,
       ->end();
 }
 
-RoomController::RoomController(std::shared_ptr<RoomManager> roomManager)
-    : roomManager_(roomManager) {}
+MetricsController::MetricsController(std::shared_ptr<WsManager> wsManager,
+                                     std::shared_ptr<Cluster> cluster,
+                                     std::shared_ptr<StunServer> stunServer,
+                                     std::shared_ptr<MediaRelay> relay)
+    : wsManager_(wsManager),
+      cluster_(cluster),
+      stunServer_(stunServer),
+      relay_(relay) {}
+
+void MetricsController::handleGet(uWS::HttpResponse<false> *res,
+                                  uWS::HttpRequest *) {
+  std::string body;
+  metrics::writePrometheus(body);
+
+  auto sample = [&body](std::string_view name, std::string_view type,
+                        std::string_view help, auto value) {
+    metrics::writePrometheusSample(body, name, type, help,
+                                   static_cast<double>(value));
+  };
+  auto queue = wsManager_->sendQueueStats();
+  sample("glimpse_ws_sessions", "gauge", "Connected users",
+         wsManager_->sessionCount());
+  sample("glimpse_ws_send_queue_messages", "gauge",
+         "Messages waiting for backpressure to clear", queue.queuedMessages);
+  sample("glimpse_ws_send_queue_bytes", "gauge",
+         "Bytes waiting for backpressure to clear", queue.queuedBytes);
+  sample("glimpse_ws_coalesced_messages_total", "counter",
+         "Queued messages replaced by a newer one", queue.coalescedMessages);
+  sample("glimpse_ws_dropped_messages_total", "counter",
+         "Messages dropped under backpressure", queue.droppedMessages);
+  sample("glimpse_ws_closed_slow_sessions_total", "counter",
+         "Sessions closed for exceeding the send queue limit",
+         queue.closedSessions);
+  sample("glimpse_log_dropped_records_total", "counter",
+         "Log records overwritten in the full async queue",
+         logging::droppedRecords());
+  sample("glimpse_log_suppressed_records_total", "counter",
+         "Log records held back by rate limits", logging::suppressedRecords());
+  if (cluster_) {
+    auto bus = cluster_->stats();
+    sample("glimpse_cluster_connected_links", "gauge",
+           "Links to other cluster nodes that are up", bus.connectedLinks);
+    sample("glimpse_cluster_frames_sent_total", "counter",
+           "Frames queued for other cluster nodes", bus.framesSent);
+    sample("glimpse_cluster_bytes_sent_total", "counter",
+           "Bytes written to other cluster nodes", bus.bytesSent);
+    sample("glimpse_cluster_writes_total", "counter",
+           "Write syscalls to other cluster nodes", bus.writes);
+    sample("glimpse_cluster_frames_received_total", "counter",
+           "Frames received from other cluster nodes", bus.framesReceived);
+    sample("glimpse_cluster_dropped_frames_total", "counter",
+           "Frames dropped because a cluster node was unreachable",
+           bus.droppedFrames);
+  }
+  if (stunServer_) {
+    auto stun = stunServer_->stats();
+    sample("glimpse_stun_requests_total", "counter",
+           "STUN binding requests answered", stun.requests);
+    sample("glimpse_stun_requests_per_second", "gauge",
+           "STUN binding requests answered during the last second",
+           stun.requestsPerSecond);
+    sample("glimpse_stun_errors_total", "counter",
+           "STUN requests answered with an error", stun.errors);
+    sample("glimpse_stun_ignored_total", "counter",
+           "Datagrams on the STUN port that were not binding requests",
+           stun.ignored);
+    sample("glimpse_stun_batches_total", "counter",
+           "recvmmsg calls that returned datagrams", stun.batches);
+  }
+  if (relay_) {
+    auto relay = relay_->stats();
+    sample("glimpse_relay_sessions", "gauge", "Open media relay sessions",
+           relay.sessions);
+    sample("glimpse_relay_packets_total", "counter", "Packets relayed",
+           relay.packets);
+    sample("glimpse_relay_bytes_total", "counter", "Bytes relayed",
+           relay.bytes);
+    sample("glimpse_relay_dropped_packets_total", "counter",
+           "Packets dropped for want of a destination or over the room's "
+           "byte rate",
+           relay.dropped);
+    sample("glimpse_relay_rejected_packets_total", "counter",
+           "Packets from an address a relay port is not bound to",
+           relay.rejected);
+    sample("glimpse_relay_batches_total", "counter",
+           "recvmmsg calls that returned packets", relay.batches);
+  }
+
+  res->writeHeader("Content-Type", "text/plain; version=0.0.4")->end(body);
+}
+
+DebugController::DebugController(std::shared_ptr<ShardRouter> router)
+    : router_(router) {}
+
+void DebugController::handleSetupsGet(uWS::HttpResponse<false> *res,
+                                      uWS::HttpRequest *req) {
+  auto atLeast = std::chrono::milliseconds(queryNumber(req, "minMs", 1000));
+  auto request = std::make_shared<SetupsRequest>(SetupsRequest{
+      .res = res,
+      .limit = queryNumber(req, "limit", 50),
+      .pendingShards = router_->size(),
+  });
+  res->onAborted([request]() { request->aborted = true; });
+
+  auto origin = router_->current();
+  for (std::size_t shard = 0; shard < router_->size(); ++shard) {
+    router_->post(shard, [this, origin, atLeast,
+                          request](RoomManager &roomManager) {
+      std::vector<CallTimeline> found;
+      roomManager.collectSlowSetups(atLeast, found);
+      router_->run(origin, [request, found = std::move(found)]() {
+        request->setups.insert(request->setups.end(), found.begin(),
+                               found.end());
+        if (--request->pendingShards == 0 and not request->aborted) {
+          respondSetups(*request);
+        }
+      });
+    });
+  }
+}
+
+RoomController::RoomController(std::shared_ptr<ShardRouter> router,
+                               std::shared_ptr<Cluster> cluster,
+                               std::shared_ptr<Admission> admission)
+    : Controller(admission), router_(router), cluster_(cluster) {}
+
+void RoomController::respondFromShard(uWS::HttpResponse<false> *res,
+                                      PostBody &body, const RoomCall &call,
+                                      std::string_view errorContext) {
+  if (not admission_->admitUser(call.user.id)) {
+    res->cork([res]() { respondThrottled(res); });
+    return;
+  }
+  auto origin = router_->current();
+  auto start = metrics::Clock::now();
+  PostBodyPool::local().hold(&body);
+  // The response object belongs to the thread that received the request
+  auto respond = [this, body = &body, operation = call.operation,
+                  userId = call.user.id, subject = call.subject, start,
+                  errorContext](RoomCallResult result) {
+    std::array<char, 64> buffer;
+    std::string error;
+    if (not result.succeeded) {
+      error = fmt::format("{}: {}", errorContext, result.error);
+      logging::limited(failedRequestLog, spdlog::level::err,
+                       "{} (user={}, id={})", error, userId, subject);
+      metrics::requestFailed(metrics::Transport::HTTP, operation);
+    }
+    metrics::recordRequest(metrics::Transport::HTTP, operation,
+                           metrics::Clock::now() - start);
+    if (not body->aborted) {
+      auto *res = body->res;
+      // Captured by reference as one pointer, which uWS stores inline
+      auto write = [&]() {
+        if (result.succeeded) {
+          res->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
+              ->end(responseBody(operation, result.id, buffer));
+        } else {
+          respondError(res, error);
+        }
+      };
+      res->cork([&write]() { write(); });
+    }
+    PostBodyPool::local().release(body);
+  };
+
+  // New rooms are owned by the thread and node that created them
+  bool creates = call.operation == metrics::Operation::CREATE_ROOM;
+  if (cluster_ and not creates and not cluster_->ring().owns(call.subject)) {
+    cluster_->call(call, std::move(respond));
+    return;
+  }
+  auto shard = creates ? origin : router_->shardOf(call.subject);
+  router_->post(shard, [this, origin, call, respond = std::move(respond)](
+                           RoomManager &roomManager) mutable {
+    router_->run(origin, [respond = std::move(respond),
+                          result = runRoomCall(roomManager, call)]() mutable {
+      respond(std::move(result));
+    });
+  });
+}
+
+void RoomController::rejectInvalid(uWS::HttpResponse<false> *res,
+                                   metrics::Operation operation,
+                                   std::string_view reason,
+                                   std::string_view userId) {
+  metrics::requestFailed(metrics::Transport::HTTP, operation);
+  logging::limited(invalidRequestLog, spdlog::level::err,
+                   "Invalid payload: {} (user={})", reason, userId);
+  res->cork([this, res, reason]() {
+    respondError(res, fmt::format("Invalid payload: {}", reason));
+  });
+}
+
+void RoomController::rejectFailed(uWS::HttpResponse<false> *res,
+                                  metrics::Operation operation,
+                                  std::string_view errorContext,
+                                  std::string_view reason,
+                                  std::string_view userId) {
+  metrics::requestFailed(metrics::Transport::HTTP, operation);
+  logging::limited(failedRequestLog, spdlog::level::err, "{}: {} (user={})",
+                   errorContext, reason, userId);
+  res->cork([this, res, errorContext, reason]() {
+    respondError(res, fmt::format("{}: {}", errorContext, reason));
+  });
+}
 
 void RoomController::handleCreateNewRoomPost(uWS::HttpResponse<false> *res,
                                              uWS::HttpRequest *req) {
-  handlePost(res, req, [this](auto *res, auto *, auto body) {
+  handlePost(res, req, [this](auto *res, PostBody &body) {
+    CreateNewRoomRequestPayload payload{};
     try {
-      auto j = nlohmann::json::parse(*body);
-      auto payload = j.template get<CreateNewRoomRequestPayload>();
-      auto roomId =
-          roomManager_->createNewRoom({payload.userId, payload.username});
-      CreateNewRoomResponsePayload response = {roomId};
-      nlohmann::json responseJ = response;
-
-      res->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
-          ->end(responseJ.dump());
+      payload = parsePayload<CreateNewRoomRequestPayload>(body.data);
+
+      respondFromShard(res, body,
+                       {.operation = metrics::Operation::CREATE_ROOM,
+                        .subject = Id(),
+                        .user = {.id = parseIdOrNil(payload.userId),
+                                 .name = std::string(payload.username)},
+                        .group = payload.group},
+                       "Could not create room");
     } catch (const nlohmann::json::exception &e) {
-      auto errMsg = fmt::format("Invalid payload: {}", e.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
+      rejectInvalid(res, metrics::Operation::CREATE_ROOM, e.what(),
+                    payload.userId);
     }
   });
 };
 
 void RoomController::handleJoinRoomPost(uWS::HttpResponse<false> *res,
                                         uWS::HttpRequest *req) {
-  handlePost(res, req, [this](auto *res, auto *, auto body) {
+  handlePost(res, req, [this](auto *res, PostBody &body) {
+    JoinRoomRequestPayload payload{};
     try {
-      auto j = nlohmann::json::parse(*body);
-      JoinRoomRequestPayload payload = j.template get<JoinRoomRequestPayload>();
+      payload = parsePayload<JoinRoomRequestPayload>(body.data);
 
       if (payload.roomId.empty() or payload.userId.empty() or
           payload.username.empty()) {
-        throw std::runtime_error("empty payload fields");
+        rejectInvalid(res, metrics::Operation::JOIN_ROOM,
+                      "empty payload fields", payload.userId);
+        return;
       }
 
       // Client will receive a join room request id in the response
       // Once the join room request is approved, it will receive
       // approval event with the id in web socket
-      auto requestId = roomManager_->joinRoom(
-          {payload.userId, payload.username}, payload.roomId);
-
-      JoinRoomResponsePayload response = {requestId};
-      nlohmann::json responseJ = response;
-
-      res->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
-          ->end(responseJ.dump());
+      respondFromShard(res, body,
+                       {.operation = metrics::Operation::JOIN_ROOM,
+                        .subject = parseIdOrNil(payload.roomId),
+                        .user = {.id = parseIdOrNil(payload.userId),
+                                 .name = std::string(payload.username)}},
+                       "Could not join room");
     } catch (const nlohmann::json::exception &e) {
-      auto errMsg = fmt::format("Invalid payload: {}", e.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
-    } catch (std::exception &err) {
-      auto errMsg = fmt::format("Could not join room: {}", err.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
+      rejectInvalid(res, metrics::Operation::JOIN_ROOM, e.what(),
+                    payload.userId);
+    } catch (const std::exception &e) {
+      rejectFailed(res, metrics::Operation::JOIN_ROOM, "Could not join room",
+                   e.what(), payload.userId);
     }
   });
 };
 
 void RoomController::handleApproveJoinRoomPost(uWS::HttpResponse<false> *res,
                                                uWS::HttpRequest *req) {
-  handlePost(res, req, [this](auto *res, auto *, auto body) {
+  handlePost(res, req, [this](auto *res, PostBody &body) {
+    ApproveJoinRoomRequestPayload payload{};
     try {
-      auto j = nlohmann::json::parse(*body);
-      auto payload = j.template get<ApproveJoinRoomRequestPayload>();
+      payload = parsePayload<ApproveJoinRoomRequestPayload>(body.data);
 
       if (payload.requestId.empty() or payload.userId.empty()) {
-        throw std::runtime_error("empty payload field");
+        rejectInvalid(res, metrics::Operation::APPROVE_JOIN_REQUEST,
+                      "empty payload field", payload.userId);
+        return;
       }
 
-      roomManager_->approveJoinRoomRequest(payload.requestId, payload.userId);
-
-      res->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
-          ->end("{}");
+      respondFromShard(res, body,
+                       {.operation = metrics::Operation::APPROVE_JOIN_REQUEST,
+                        .subject = parseIdOrNil(payload.requestId),
+                        .user = {.id = parseIdOrNil(payload.userId),
+                                 .name = {}}},
+                       "Could not approve join room");
     } catch (const nlohmann::json::exception &e) {
-      auto errMsg = fmt::format("Invalid payload: {}", e.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
-    } catch (std::exception &err) {
-      auto errMsg = fmt::format("Could not approve join room: {}", err.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
+      rejectInvalid(res, metrics::Operation::APPROVE_JOIN_REQUEST, e.what(),
+                    payload.userId);
+    } catch (const std::exception &e) {
+      rejectFailed(res, metrics::Operation::APPROVE_JOIN_REQUEST,
+                   "Could not approve join room", e.what(), payload.userId);
     }
   });
 }
 
 void RoomController::handleDenyJoinRoomPost(uWS::HttpResponse<false> *res,
                                             uWS::HttpRequest *req) {
-  handlePost(res, req, [this](auto *res, auto *, auto body) {
+  handlePost(res, req, [this](auto *res, PostBody &body) {
+    DenyJoinRoomRequestPayload payload{};
     try {
-      auto j = nlohmann::json::parse(*body);
-      auto payload = j.template get<DenyJoinRoomRequestPayload>();
+      payload = parsePayload<DenyJoinRoomRequestPayload>(body.data);
 
       if (payload.requestId.empty() or payload.userId.empty()) {
-        throw std::runtime_error("empty payload field");
+        rejectInvalid(res, metrics::Operation::DENY_JOIN_REQUEST,
+                      "empty payload field", payload.userId);
+        return;
       }
 
-      roomManager_->denyJoinRoomRequest(payload.requestId, payload.userId);
-
-      res->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
-          ->end("{}");
+      respondFromShard(res, body,
+                       {.operation = metrics::Operation::DENY_JOIN_REQUEST,
+                        .subject = parseIdOrNil(payload.requestId),
+                        .user = {.id = parseIdOrNil(payload.userId),
+                                 .name = {}}},
+                       "Could not join room");
     } catch (const nlohmann::json::exception &e) {
-      auto errMsg = fmt::format("Invalid payload: {}", e.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
-    } catch (std::exception &err) {
-      auto errMsg = fmt::format("Could not join room: {}", err.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
+      rejectInvalid(res, metrics::Operation::DENY_JOIN_REQUEST, e.what(),
+                    payload.userId);
+    } catch (const std::exception &e) {
+      rejectFailed(res, metrics::Operation::DENY_JOIN_REQUEST,
+                   "Could not join room", e.what(), payload.userId);
     }
   });
 }
 
 void RoomController::handleSDPPost(uWS::HttpResponse<false> *res,
                                    uWS::HttpRequest *req) {
-  handlePost(res, req, [this](auto *res, auto *, auto body) {
+  handlePost(res, req, [this](auto *res, PostBody &body) {
+    SDPExchangePayload payload{};
     try {
-      auto j = nlohmann::json::parse(*body);
-      auto payload = j.template get<SDPExchangePayload>();
+      payload = parsePayload<SDPExchangePayload>(body.data);
 
       if (payload.sdp.empty() or payload.userId.empty()) {
-        throw std::runtime_error("empty payload field");
+        rejectInvalid(res, metrics::Operation::SDP, "empty payload field",
+                      payload.userId);
+        return;
       }
 
-      roomManager_->exchangeSDPMessage(payload.roomId, payload.userId,
-                                       payload.sdp);
-
-      res->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
-          ->end("{}");
+      respondFromShard(res, body,
+                       {.operation = metrics::Operation::SDP,
+                        .subject = parseIdOrNil(payload.roomId),
+                        .user = {.id = parseIdOrNil(payload.userId),
+                                 .name = {}},
+                        .toUserId = parseIdOrNil(payload.toUserId),
+                        .text = payload.sdp},
+                       "Could not exchange sdp");
     } catch (const nlohmann::json::exception &e) {
-      auto errMsg = fmt::format("Invalid payload: {}", e.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
-    } catch (std::exception &err) {
-      auto errMsg = fmt::format("Could not exchange sdp: {}", err.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
+      rejectInvalid(res, metrics::Operation::SDP, e.what(), payload.userId);
+    } catch (const std::exception &e) {
+      rejectFailed(res, metrics::Operation::SDP, "Could not exchange sdp",
+                   e.what(), payload.userId);
     }
   });
 };
 
 void RoomController::handleICEPost(uWS::HttpResponse<false> *res,
                                    uWS::HttpRequest *req) {
-  handlePost(res, req, [this](auto *res, auto *, auto body) {
+  handlePost(res, req, [this](auto *res, PostBody &body) {
+    ICEExchangePayload payload{};
     try {
-      auto j = nlohmann::json::parse(*body);
-      auto payload = j.template get<ICEExchangePayload>();
+      payload = parsePayload<ICEExchangePayload>(body.data);
 
       if (payload.ice.empty() or payload.userId.empty()) {
-        throw std::runtime_error("empty payload field");
+        rejectInvalid(res, metrics::Operation::ICE, "empty payload field",
+                      payload.userId);
+        return;
       }
 
-      roomManager_->exchangeICEMessage(payload.roomId, payload.userId,
-                                       payload.ice);
-
-      res->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
-          ->end("{}");
+      respondFromShard(res, body,
+                       {.operation = metrics::Operation::ICE,
+                        .subject = parseIdOrNil(payload.roomId),
+                        .user = {.id = parseIdOrNil(payload.userId),
+                                 .name = {}},
+                        .toUserId = parseIdOrNil(payload.toUserId),
+                        .text = payload.ice},
+                       "Could not exchange ice");
     } catch (const nlohmann::json::exception &e) {
-      auto errMsg = fmt::format("Invalid payload: {}", e.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
-    } catch (std::exception &err) {
-      auto errMsg = fmt::format("Could not exchange ice: {}", err.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
+      rejectInvalid(res, metrics::Operation::ICE, e.what(), payload.userId);
+    } catch (const std::exception &e) {
+      rejectFailed(res, metrics::Operation::ICE, "Could not exchange ice",
+                   e.what(), payload.userId);
     }
   });
 };
 
 void RoomController::handleEndRoomPost(uWS::HttpResponse<false> *res,
                                        uWS::HttpRequest *req) {
-  handlePost(res, req, [this](auto *res, auto *, auto body) {
+  handlePost(res, req, [this](auto *res, PostBody &body) {
+    EndRoomRequestPayload payload{};
     try {
-      auto j = nlohmann::json::parse(*body);
-      auto payload = j.template get<EndRoomRequestPayload>();
+      payload = parsePayload<EndRoomRequestPayload>(body.data);
 
       if (payload.userId.empty()) {
-        throw std::runtime_error("empty payload field");
+        rejectInvalid(res, metrics::Operation::END_ROOM, "empty payload field",
+                      payload.userId);
+        return;
       }
 
-      roomManager_->endRoom(payload.roomId, payload.userId);
-
-      res->writeHeader("Access-Control-Allow-Origin", ALLOWED_ORIGIN)
-          ->end("{}");
+      respondFromShard(res, body,
+                       {.operation = metrics::Operation::END_ROOM,
+                        .subject = parseIdOrNil(payload.roomId),
+                        .user = {.id = parseIdOrNil(payload.userId),
+                                 .name = {}}},
+                       "Could not end room");
     } catch (const nlohmann::json::exception &e) {
-      auto errMsg = fmt::format("Invalid payload: {}", e.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
-    } catch (std::exception &err) {
-      auto errMsg = fmt::format("Could not end room: {}", err.what());
-      spdlog::error(errMsg);
-      res->cork([this, res, errMsg]() { respondError(res, errMsg); });
+      rejectInvalid(res, metrics::Operation::END_ROOM, e.what(),
+                    payload.userId);
+    } catch (const std::exception &e) {
+      rejectFailed(res, metrics::Operation::END_ROOM, "Could not end room",
+                   e.what(), payload.userId);
     }
   });
 };
 
+namespace {
+// Wire form of a WsRequest
+struct WsRequestEnvelope {
+  WsMessage::Type type;
+  std::string_view id;
+  JsonRawValue payload;
+
+  static constexpr auto JSON_FIELDS =
+      std::make_tuple(jsonField("type", &WsRequestEnvelope::type),
+                      jsonOptionalField("id", &WsRequestEnvelope::id),
+                      jsonField("payload", &WsRequestEnvelope::payload));
+};
+
+// Throws if `message` is not a valid request envelope
+WsRequest parseWsRequest(std::string_view message) {
+  // uWS only lends the frame for the duration of the handler
+  auto frame = std::make_shared<std::string>(message);
+
+  WsRequestEnvelope envelope;
+  if (tryParseJsonInPlace(*frame, envelope)) {
+    return {.type = envelope.type,
+            .id = std::string(envelope.id),
+            .payload = envelope.payload,
+            .frame = std::move(frame)};
+  }
+
+  auto j = nlohmann::json::parse(*frame);
+  WsRequest request = {.type = j.at("type").get<WsMessage::Type>()};
+  if (j.contains("id")) {
+    request.id = j.at("id").get<std::string>();
+  }
+  request.frame = std::make_shared<std::string>(j.at("payload").dump());
+  request.payload = {request.frame->data(),
+                     request.frame->data() + request.frame->size()};
+  return request;
+}
+}  // namespace
+
+WsController::WsController(std::shared_ptr<ShardRouter> router,
+                           std::shared_ptr<WsManager> wsManager,
+                           std::shared_ptr<Cluster> cluster,
+                           std::shared_ptr<Admission> admission)
+    : Controller(admission),
+      router_(router),
+      wsManager_(wsManager),
+      cluster_(cluster) {}
+
 void WsController::handleWsRouteUpgrade(uWS::HttpResponse<false> *res,
                                         uWS::HttpRequest *req,
                                         us_socket_context_t *context) {
-  auto userId = std::string(req->getQuery("userId"));
+  if (not admission_->admitAddress(res->getRemoteAddressAsText())) {
+    respondThrottled(res);
+    return;
+  }
+  auto userIdText = req->getQuery("userId");
   auto userName = std::string(req->getQuery("username"));
 
-  if (userId.empty() or userName.empty()) {
-    spdlog::error("Missing queries");
+  if (userIdText.empty() or userName.empty()) {
+    logging::limited(invalidRequestLog, spdlog::level::err,
+                     "Rejected WebSocket upgrade: missing queries");
     res->writeStatus(HTTP_STATUS_400)->end("Missing queries");
     return;
   }
 
-  res->template upgrade<User>(
-      {.id = userId, .name = userName}, req->getHeader("sec-websocket-key"),
-      req->getHeader("sec-websocket-protocol"),
-      req->getHeader("sec-websocket-extensions"), context);
+  auto userId = parseIdOrNil(userIdText);
+  if (userId.isNil()) {
+    logging::limited(invalidRequestLog, spdlog::level::err,
+                     "Rejected WebSocket upgrade: invalid user id {}",
+                     userIdText);
+    res->writeStatus(HTTP_STATUS_400)->end("Invalid userId");
+    return;
+  }
+  if (not admission_->admitUser(userId)) {
+    respondThrottled(res);
+    return;
+  }
+
+  // Clients able to resume ask with ?resume=, a token from a previous
+  // SESSION and the number of the last frame they got resume it
+  auto resume = req->getQuery("resume");
+  bool resumable = wsManager_->resume().enabled() and not resume.empty();
+  Id resumeToken = resumable ? parseIdOrNil(resume) : Id();
+  uint64_t resumeAfter = 0;
+  auto lastSeq = req->getQuery("lastSeq");
+  std::from_chars(lastSeq.data(), lastSeq.data() + lastSeq.size(),
+                  resumeAfter);
+
+  // With compression on, uWS accepts permessage-deflate whenever the client
+  // offers it
+  auto extensions = req->getHeader("sec-websocket-extensions");
+  bool deflate = extensions.find("permessage-deflate") != extensions.npos;
+  res->template upgrade<WsSessionData>(
+      {.user = {.id = userId, .name = userName},
+       .deflate = deflate,
+       .resumable = resumable,
+       .resumeToken = resumeToken,
+       .resumeAfter = resumeAfter},
+      req->getHeader("sec-websocket-key"),
+      req->getHeader("sec-websocket-protocol"), extensions, context);
+}
+
+void WsController::handleWsMessage(WsSession *ws, std::string_view message,
+                                   uWS::OpCode) {
+  auto received = metrics::Clock::now();
+  WsRequest request;
+  try {
+    metrics::ScopedTimer timer(metrics::Latency::JSON_PARSE);
+    request = parseWsRequest(message);
+  } catch (std::exception &err) {
+    logging::limited(invalidRequestLog, spdlog::level::err,
+                     "Invalid message: {} (user={})", err.what(),
+                     ws->getUserData()->user.id);
+    wsManager_->sendWsMessage(
+        ws, {.type = WsMessage::ERROR, .payload = "Invalid message"});
+    return;
+  }
+  request.received = received;
+  metrics::messageReceived(request.type);
+
+  switch (request.type) {
+    case WsMessage::PING:
+      wsManager_->sendWsMessage(ws, {.type = WsMessage::PONG, .payload = ""});
+      break;
+    case WsMessage::PONG:
+      wsManager_->sendWsMessage(ws, {.type = WsMessage::PING, .payload = ""});
+      break;
+    case WsMessage::JOIN_ROOM:
+      handleJoinRoom(ws, request);
+      break;
+    case WsMessage::APPROVE_JOIN_REQUEST:
+      handleApproveJoinRequest(ws, request);
+      break;
+    case WsMessage::DENY_JOIN_REQUEST:
+      handleDenyJoinRequest(ws, request);
+      break;
+    case WsMessage::SDP:
+      handleSDP(ws, request);
+      break;
+    case WsMessage::ICE:
+      handleICE(ws, request);
+      break;
+    case WsMessage::END_ROOM:
+      handleEndRoom(ws, request);
+      break;
+    case WsMessage::OPEN_RELAY:
+      handleOpenRelay(ws, request);
+      break;
+    default:
+      logging::limited(invalidRequestLog, spdlog::level::err,
+                       "Received unsupported message type {} (user={})",
+                       static_cast<int>(request.type),
+                       ws->getUserData()->user.id);
+  }
+}
+
+template <typename T>
+std::optional<T> WsController::parseRequestPayload(WsSession *ws,
+                                                   WsRequest &request) {
+  metrics::ScopedTimer timer(metrics::Latency::JSON_PARSE);
+  T payload;
+  if (tryParseJsonInPlace(request.payload.begin, request.payload.end,
+                          payload)) {
+    return payload;
+  }
+
+  try {
+    auto buffer = std::make_shared<std::string>(request.payload.begin,
+                                                request.payload.end);
+    payload = parseJsonInPlace<T>(*buffer);
+    request.frame = std::move(buffer);
+    return payload;
+  } catch (const nlohmann::json::exception &e) {
+    sendError(ws, request, "Invalid payload", e.what());
+    return std::nullopt;
+  }
+}
+
+void WsController::sendError(WsSession *ws, const WsRequest &request,
+                             std::string_view errorContext,
+                             std::string_view reason) {
+  metrics::requestFailed(metrics::Transport::WS, operationOf(request.type));
+  logging::limited(invalidRequestLog, spdlog::level::err, "{}: {} (user={})",
+                   errorContext, reason, ws->getUserData()->user.id);
+  wsManager_->sendWsMessage(
+      ws, {.type = WsMessage::ERROR,
+           .payload = fmt::format("{}: {}", errorContext, reason),
+           .id = request.id});
+}
+
+void WsController::respondFromShard(WsSession *ws, const WsRequest &request,
+                                    const RoomCall &call,
+                                    std::string_view errorContext) {
+  // A call setup trickles dozens of candidates over the socket, only calls
+  // that change a room take a token
+  bool changesRoom = call.operation != metrics::Operation::SDP and
+                     call.operation != metrics::Operation::ICE;
+  if (changesRoom and not admission_->admitUser(call.user.id)) {
+    wsManager_->sendWsMessage(ws, {.type = WsMessage::ERROR,
+                                   .payload = std::string(THROTTLED_MESSAGE),
+                                   .id = request.id});
+    return;
+  }
+
+  // The answer goes through the session registry, the socket may be gone or
+  // owned by another thread by the time the call is done
+  auto respond = [wsManager = wsManager_, userId = ws->getUserData()->user.id,
+                  id = request.id, operation = call.operation,
+                  received = request.received, subject = call.subject,
+                  errorContext](RoomCallResult result) {
+    WsMessage answer = {.type = WsMessage::RESPONSE, .payload = "", .id = id};
+    if (not result.succeeded) {
+      answer.type = WsMessage::ERROR;
+      answer.payload = fmt::format("{}: {}", errorContext, result.error);
+      logging::limited(failedRequestLog, spdlog::level::err,
+                       "{} (user={}, id={})",
+                       std::get<std::string>(answer.payload), userId, subject);
+      metrics::requestFailed(metrics::Transport::WS, operation);
+    } else if (operation == metrics::Operation::JOIN_ROOM) {
+      // The join request id, see handleJoinRoomPost
+      answer.payload = result.id.toString();
+    }
+    if (answer.type == WsMessage::ERROR or not answer.id.empty()) {
+      wsManager->sendMessageIfOnline(userId, answer);
+    }
+    metrics::recordRequest(metrics::Transport::WS, operation,
+                           metrics::Clock::now() - received);
+  };
+
+  if (cluster_ and not cluster_->ring().owns(call.subject)) {
+    cluster_->call(call, std::move(respond));
+    return;
+  }
+  router_->post(router_->shardOf(call.subject),
+                [call, frame = request.frame, respond = std::move(respond)](
+                    RoomManager &roomManager) {
+                  respond(runRoomCall(roomManager, call));
+                });
+}
+
+void WsController::handleJoinRoom(WsSession *ws, WsRequest &request) {
+  auto payload = parseRequestPayload<WsJoinRoomRequest>(ws, request);
+  if (not payload) {
+    return;
+  }
+  if (payload->roomId.empty()) {
+    sendError(ws, request, "Could not join room", "empty payload field");
+    return;
+  }
+
+  respondFromShard(ws, request,
+                   {.operation = metrics::Operation::JOIN_ROOM,
+                    .subject = parseIdOrNil(payload->roomId),
+                    .user = ws->getUserData()->user},
+                   "Could not join room");
+}
+
+void WsController::handleApproveJoinRequest(WsSession *ws,
+                                            WsRequest &request) {
+  auto payload = parseRequestPayload<WsJoinRequestDecision>(ws, request);
+  if (not payload) {
+    return;
+  }
+  if (payload->requestId.empty()) {
+    sendError(ws, request, "Could not approve join room",
+              "empty payload field");
+    return;
+  }
+
+  respondFromShard(ws, request,
+                   {.operation = metrics::Operation::APPROVE_JOIN_REQUEST,
+                    .subject = parseIdOrNil(payload->requestId),
+                    .user = ws->getUserData()->user},
+                   "Could not approve join room");
+}
+
+void WsController::handleDenyJoinRequest(WsSession *ws, WsRequest &request) {
+  auto payload = parseRequestPayload<WsJoinRequestDecision>(ws, request);
+  if (not payload) {
+    return;
+  }
+  if (payload->requestId.empty()) {
+    sendError(ws, request, "Could not deny join room", "empty payload field");
+    return;
+  }
+
+  respondFromShard(ws, request,
+                   {.operation = metrics::Operation::DENY_JOIN_REQUEST,
+                    .subject = parseIdOrNil(payload->requestId),
+                    .user = ws->getUserData()->user},
+                   "Could not deny join room");
+}
+
+void WsController::handleSDP(WsSession *ws, WsRequest &request) {
+  auto payload = parseRequestPayload<WsSDPExchangeRequest>(ws, request);
+  if (not payload) {
+    return;
+  }
+  if (payload->sdp.empty()) {
+    sendError(ws, request, "Could not exchange sdp", "empty payload field");
+    return;
+  }
+
+  respondFromShard(ws, request,
+                   {.operation = metrics::Operation::SDP,
+                    .subject = parseIdOrNil(payload->roomId),
+                    .user = ws->getUserData()->user,
+                    .toUserId = parseIdOrNil(payload->toUserId),
+                    .text = payload->sdp},
+                   "Could not exchange sdp");
+}
+
+void WsController::handleICE(WsSession *ws, WsRequest &request) {
+  auto payload = parseRequestPayload<WsICEExchangeRequest>(ws, request);
+  if (not payload) {
+    return;
+  }
+  if (payload->ice.empty()) {
+    sendError(ws, request, "Could not exchange ice", "empty payload field");
+    return;
+  }
+
+  respondFromShard(ws, request,
+                   {.operation = metrics::Operation::ICE,
+                    .subject = parseIdOrNil(payload->roomId),
+                    .user = ws->getUserData()->user,
+                    .toUserId = parseIdOrNil(payload->toUserId),
+                    .text = payload->ice},
+                   "Could not exchange ice");
+}
+
+void WsController::handleEndRoom(WsSession *ws, WsRequest &request) {
+  auto payload = parseRequestPayload<WsEndRoomRequest>(ws, request);
+  if (not payload) {
+    return;
+  }
+
+  respondFromShard(ws, request,
+                   {.operation = metrics::Operation::END_ROOM,
+                    .subject = parseIdOrNil(payload->roomId),
+                    .user = ws->getUserData()->user},
+                   "Could not end room");
+}
+
+void WsController::handleOpenRelay(WsSession *ws, WsRequest &request) {
+  auto payload = parseRequestPayload<WsOpenRelayRequest>(ws, request);
+  if (not payload) {
+    return;
+  }
+
+  respondFromShard(ws, request,
+                   {.operation = metrics::Operation::OPEN_RELAY,
+                    .subject = parseIdOrNil(payload->roomId),
+                    .user = ws->getUserData()->user,
+                    .toUserId = parseIdOrNil(payload->toUserId)},
+                   "Could not open relay");
 }
 }  // namespace glimpse
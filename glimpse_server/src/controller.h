@@ -3,15 +3,32 @@
 #include <libusockets.h>
 #include <uwebsockets/App.h>
 
-#include <functional>
 #include <memory>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
 #include <string_view>
-
+#include <tuple>
+
+#include "admission.h"
+#include "cluster.h"
+#include "id.h"
+#include "media_relay.h"
+#include "metrics.h"
+#include "payload_parser.h"
+#include "post_body.h"
 #include "room_manager.h"
+#include "session_registry.h"
+#include "shard.h"
+#include "stun_server.h"
+#include "ws_manager.h"
+#include "ws_message.h"
 
 namespace glimpse {
 
+// Request payloads are parsed with parseJsonInPlace(), their strings are
+// views into the request body.
+
 struct ErrorResponsePayload {
   std::string message;
 
@@ -19,86 +36,191 @@ struct ErrorResponsePayload {
 };
 
 struct CreateNewRoomRequestPayload {
-  std::string userId;
-  std::string username;
+  std::string_view userId;
+  std::string_view username;
+  // Admits more than one guest, see isGroupRoom()
+  bool group = false;
+
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("userId", &CreateNewRoomRequestPayload::userId),
+      jsonField("username", &CreateNewRoomRequestPayload::username),
+      jsonOptionalField("group", &CreateNewRoomRequestPayload::group));
+};
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(CreateNewRoomRequestPayload, userId, username);
+struct JoinRoomRequestPayload {
+  std::string_view userId;
+  std::string_view username;
+  std::string_view roomId;
+
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("userId", &JoinRoomRequestPayload::userId),
+      jsonField("username", &JoinRoomRequestPayload::username),
+      jsonField("roomId", &JoinRoomRequestPayload::roomId));
 };
 
-struct CreateNewRoomResponsePayload {
-  std::string roomId;
+struct ApproveJoinRoomRequestPayload {
+  std::string_view userId;
+  std::string_view requestId;
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(CreateNewRoomResponsePayload, roomId);
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("userId", &ApproveJoinRoomRequestPayload::userId),
+      jsonField("requestId", &ApproveJoinRoomRequestPayload::requestId));
 };
 
-struct JoinRoomRequestPayload {
-  std::string userId;
-  std::string username;
-  std::string roomId;
+struct DenyJoinRoomRequestPayload {
+  std::string_view userId;
+  std::string_view requestId;
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(JoinRoomRequestPayload, userId, username,
-                                 roomId);
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("userId", &DenyJoinRoomRequestPayload::userId),
+      jsonField("requestId", &DenyJoinRoomRequestPayload::requestId));
 };
 
-struct JoinRoomResponsePayload {
-  std::string requestId;
+struct EndRoomRequestPayload {
+  std::string_view userId;
+  std::string_view roomId;
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(JoinRoomResponsePayload, requestId);
+  static constexpr auto JSON_FIELDS =
+      std::make_tuple(jsonField("userId", &EndRoomRequestPayload::userId),
+                      jsonField("roomId", &EndRoomRequestPayload::roomId));
 };
 
-struct ApproveJoinRoomRequestPayload {
-  std::string userId;
-  std::string requestId;
+// `toUserId` names the recipient, it may be left out in a room of two
+struct SDPExchangePayload {
+  std::string_view userId;
+  std::string_view roomId;
+  std::string_view sdp;
+  std::string_view toUserId;
+
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("userId", &SDPExchangePayload::userId),
+      jsonField("roomId", &SDPExchangePayload::roomId),
+      jsonField("sdp", &SDPExchangePayload::sdp),
+      jsonOptionalField("toUserId", &SDPExchangePayload::toUserId));
+};
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(ApproveJoinRoomRequestPayload, userId,
-                                 requestId);
+// `toUserId` names the recipient, it may be left out in a room of two
+struct ICEExchangePayload {
+  std::string_view userId;
+  std::string_view roomId;
+  std::string_view ice;
+  std::string_view toUserId;
+
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("userId", &ICEExchangePayload::userId),
+      jsonField("roomId", &ICEExchangePayload::roomId),
+      jsonField("ice", &ICEExchangePayload::ice),
+      jsonOptionalField("toUserId", &ICEExchangePayload::toUserId));
 };
 
-struct DenyJoinRoomRequestPayload {
-  std::string userId;
-  std::string requestId;
+constexpr std::string_view ALLOWED_ORIGIN = "*";
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(DenyJoinRoomRequestPayload, userId, requestId);
+constexpr std::string_view HTTP_STATUS_200 = "200 Ok";
+constexpr std::string_view HTTP_STATUS_400 = "400 Bad Request";
+constexpr std::string_view HTTP_STATUS_413 = "413 Payload Too Large";
+constexpr std::string_view HTTP_STATUS_429 = "429 Too Many Requests";
+
+// Bodies of the answers to requests turned away before they were read
+constexpr std::string_view TOO_LARGE_BODY =
+    R"({"message":"Request body too large"})";
+constexpr std::string_view THROTTLED_BODY =
+    R"({"message":"Too many requests, retry later"})";
+// The same refusal as an ERROR frame over the WebSocket
+constexpr std::string_view THROTTLED_MESSAGE =
+    "Too many requests, retry later";
+
+// Client request received over the WebSocket, {"type":N,"id":...,
+// "payload":{...}}. The optional id is echoed in the answer, the requesting
+// user is the one owning the socket. `frame` owns the payload and every view
+// parsed out of it. `received` is when the message was read off the socket.
+struct WsRequest {
+  WsMessage::Type type;
+  std::string id{};
+  JsonRawValue payload{};
+  std::shared_ptr<std::string> frame{};
+  metrics::Clock::time_point received{};
 };
 
-struct EndRoomRequestPayload {
-  std::string userId;
-  std::string roomId;
+struct WsJoinRoomRequest {
+  std::string_view roomId;
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(EndRoomRequestPayload, userId, roomId);
+  static constexpr auto JSON_FIELDS =
+      std::make_tuple(jsonField("roomId", &WsJoinRoomRequest::roomId));
 };
 
-struct SDPExchangePayload {
-  std::string userId;
-  std::string roomId;
-  std::string sdp;
+// Payload of both APPROVE_JOIN_REQUEST and DENY_JOIN_REQUEST
+struct WsJoinRequestDecision {
+  std::string_view requestId;
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(SDPExchangePayload, userId, roomId, sdp);
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("requestId", &WsJoinRequestDecision::requestId));
 };
 
-struct ICEExchangePayload {
-  std::string userId;
-  std::string roomId;
-  std::string ice;
+struct WsEndRoomRequest {
+  std::string_view roomId;
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(ICEExchangePayload, userId, roomId, ice);
+  static constexpr auto JSON_FIELDS =
+      std::make_tuple(jsonField("roomId", &WsEndRoomRequest::roomId));
 };
 
-constexpr std::string_view ALLOWED_ORIGIN = "*";
+struct WsSDPExchangeRequest {
+  std::string_view roomId;
+  std::string_view sdp;
+  std::string_view toUserId;
 
-constexpr std::string_view HTTP_STATUS_200 = "200 Ok";
-constexpr std::string_view HTTP_STATUS_400 = "400 Bad Request";
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("roomId", &WsSDPExchangeRequest::roomId),
+      jsonField("sdp", &WsSDPExchangeRequest::sdp),
+      jsonOptionalField("toUserId", &WsSDPExchangeRequest::toUserId));
+};
+
+struct WsICEExchangeRequest {
+  std::string_view roomId;
+  std::string_view ice;
+  std::string_view toUserId;
+
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("roomId", &WsICEExchangeRequest::roomId),
+      jsonField("ice", &WsICEExchangeRequest::ice),
+      jsonOptionalField("toUserId", &WsICEExchangeRequest::toUserId));
+};
+
+// `toUserId` names the peer, it may be left out in a room of two
+struct WsOpenRelayRequest {
+  std::string_view roomId;
+  std::string_view toUserId;
+
+  static constexpr auto JSON_FIELDS = std::make_tuple(
+      jsonField("roomId", &WsOpenRelayRequest::roomId),
+      jsonOptionalField("toUserId", &WsOpenRelayRequest::toUserId));
+};
 
 class Controller {
  protected:
-  void handlePost(
-      uWS::HttpResponse<false> *res, uWS::HttpRequest *req,
-      std::function<void(uWS::HttpResponse<false> *res, uWS::HttpRequest *req,
-                         std::shared_ptr<std::string> body)>
-          bodyHandler);
+  explicit Controller(std::shared_ptr<Admission> admission = nullptr)
+      : admission_(admission) {}
+
+  // Receives the body of a POST into a buffer of PostBodyPool::local() and
+  // calls `handler(res, PostBody&)` once it is complete, unless the client
+  // went away. A handler answering later holds the body in the pool until
+  // then. Requests from an address over the rate limit of `admission_`, and
+  // bodies over MAX_POST_BODY_SIZE, are turned away.
+  template <typename Handler>
+  void handlePost(uWS::HttpResponse<false> *res, uWS::HttpRequest *req,
+                  Handler handler);
 
   void respondError(uWS::HttpResponse<false> *res,
                     const std::string &errorMessage);
+  static void respondThrottled(uWS::HttpResponse<false> *res);
+  static void respondTooLarge(uWS::HttpResponse<false> *res);
+
+  // Null for controllers whose requests are not rate limited
+  std::shared_ptr<Admission> admission_;
+
+ private:
+  // Checks the address and the announced length, then takes a body from
+  // the pool. Null when the request was already answered.
+  PostBody *beginPost(uWS::HttpResponse<false> *res, uWS::HttpRequest *req);
 };
 
 class RootController : Controller {
@@ -107,9 +229,31 @@ class RootController : Controller {
   void handleOption(uWS::HttpResponse<false> *res, uWS::HttpRequest *req);
 };
 
+// Serves GET /metrics in the Prometheus text format
+class MetricsController : Controller {
+ public:
+  // `cluster` is null when the server runs alone, `stunServer` when there
+  // is no embedded STUN server and `relay` when media is not relayed
+  MetricsController(std::shared_ptr<WsManager> wsManager,
+                    std::shared_ptr<Cluster> cluster,
+                    std::shared_ptr<StunServer> stunServer,
+                    std::shared_ptr<MediaRelay> relay);
+  void handleGet(uWS::HttpResponse<false> *res, uWS::HttpRequest *req);
+
+ private:
+  std::shared_ptr<WsManager> wsManager_;
+  std::shared_ptr<Cluster> cluster_;
+  std::shared_ptr<StunServer> stunServer_;
+  std::shared_ptr<MediaRelay> relay_;
+};
+
 class RoomController : Controller {
  public:
-  RoomController(std::shared_ptr<RoomManager> roomManager);
+  // `cluster` is null when the server runs alone. `admission` belongs to
+  // the event loop the controller serves.
+  RoomController(std::shared_ptr<ShardRouter> router,
+                 std::shared_ptr<Cluster> cluster,
+                 std::shared_ptr<Admission> admission);
   void handleCreateNewRoomPost(uWS::HttpResponse<false> *res,
                                uWS::HttpRequest *req);
   void handleJoinRoomPost(uWS::HttpResponse<false> *res, uWS::HttpRequest *req);
@@ -122,13 +266,114 @@ class RoomController : Controller {
   void handleEndRoomPost(uWS::HttpResponse<false> *res, uWS::HttpRequest *req);
 
  private:
-  std::shared_ptr<RoomManager> roomManager_;
+  // Runs `call` on the shard that owns its subject, forwarding it to the
+  // node that does in a cluster, and writes the result (or the error
+  // prefixed with `errorContext`) back on the calling thread. The round trip
+  // is recorded under the call's operation, failures are logged with its
+  // subject. `body` holds the strings `call` views and is held until the
+  // response is written. Calls by a user over the rate limit are turned
+  // away.
+  void respondFromShard(uWS::HttpResponse<false> *res, PostBody &body,
+                        const RoomCall &call, std::string_view errorContext);
+  // Answer requests that never reach a shard with 400 and "Invalid payload:
+  // `reason`", or "`errorContext`: `reason`" when they could not be handled.
+  // Logged with the user the request names, if any.
+  void rejectInvalid(uWS::HttpResponse<false> *res,
+                     metrics::Operation operation, std::string_view reason,
+                     std::string_view userId);
+  void rejectFailed(uWS::HttpResponse<false> *res,
+                    metrics::Operation operation,
+                    std::string_view errorContext, std::string_view reason,
+                    std::string_view userId);
+
+  std::shared_ptr<ShardRouter> router_;
+  std::shared_ptr<Cluster> cluster_;
+};
+
+// Serves GET /debug/setups: the call setups that recently finished on any
+// shard of this node and took at least `minMs` milliseconds (default 1000)
+// or never got an answer, newest first and at most `limit` (default 50).
+class DebugController : Controller {
+ public:
+  explicit DebugController(std::shared_ptr<ShardRouter> router);
+  void handleSetupsGet(uWS::HttpResponse<false> *res, uWS::HttpRequest *req);
+
+ private:
+  std::shared_ptr<ShardRouter> router_;
 };
 
 class WsController : Controller {
  public:
+  WsController(std::shared_ptr<ShardRouter> router,
+               std::shared_ptr<WsManager> wsManager,
+               std::shared_ptr<Cluster> cluster,
+               std::shared_ptr<Admission> admission);
+  // Upgrades are rate limited by address and by user. The session resumes
+  // the one named by ?resume= and ?lastSeq= if it can, see ResumeOptions.
   void handleWsRouteUpgrade(uWS::HttpResponse<false> *res,
                             uWS::HttpRequest *req,
                             us_socket_context_t *context);
+  void handleWsMessage(WsSession *ws, std::string_view message,
+                       uWS::OpCode opCode);
+
+ private:
+  void handleJoinRoom(WsSession *ws, WsRequest &request);
+  void handleApproveJoinRequest(WsSession *ws, WsRequest &request);
+  void handleDenyJoinRequest(WsSession *ws, WsRequest &request);
+  void handleSDP(WsSession *ws, WsRequest &request);
+  void handleICE(WsSession *ws, WsRequest &request);
+  void handleEndRoom(WsSession *ws, WsRequest &request);
+  void handleOpenRelay(WsSession *ws, WsRequest &request);
+
+  // Parses the request payload into T. On failure the sender gets an ERROR
+  // and nullopt is returned.
+  template <typename T>
+  std::optional<T> parseRequestPayload(WsSession *ws, WsRequest &request);
+  // Answers the sender with an ERROR "`errorContext`: `reason`"
+  void sendError(WsSession *ws, const WsRequest &request,
+                 std::string_view errorContext, std::string_view reason);
+
+  // Runs `call` where RoomController would and answers the sender with a
+  // RESPONSE carrying its result, or an ERROR prefixed with `errorContext`.
+  // Successful requests without an id are not answered. Failures are
+  // logged with the sender and the call's subject. `request.frame` holds
+  // the strings `call` views. Calls that change a room are turned away when
+  // the sender is over the rate limit, SDP and ICE are not.
+  void respondFromShard(WsSession *ws, const WsRequest &request,
+                        const RoomCall &call, std::string_view errorContext);
+
+  std::shared_ptr<ShardRouter> router_;
+  std::shared_ptr<WsManager> wsManager_;
+  std::shared_ptr<Cluster> cluster_;
 };
+
+template <typename Handler>
+void Controller::handlePost(uWS::HttpResponse<false> *res,
+                            uWS::HttpRequest *req, Handler handler) {
+  // uWS::MoveOnlyFunction stores callables of up to two pointers inline, the
+  // callbacks below must not need more
+  static_assert(sizeof(Handler) <= sizeof(void *));
+  auto *body = beginPost(res, req);
+  if (body == nullptr) {
+    return;
+  }
+  res->onAborted([body]() {
+    body->aborted = true;
+    // A received body is released by the call it started
+    if (not body->received) {
+      PostBodyPool::local().release(body);
+    }
+  });
+  res->onData([body, handler](std::string_view chunk, bool isLast) {
+    if (not PostBodyPool::append(*body, chunk, isLast)) {
+      return;
+    }
+    if (body->overflowed) {
+      respondTooLarge(body->res);
+    } else {
+      handler(body->res, *body);
+    }
+    PostBodyPool::local().release(body);
+  });
+}
 };  // namespace glimpse
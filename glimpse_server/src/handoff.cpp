@@ -0,0 +1,480 @@
+#include "handoff.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_set>
+#include <utility>
+
+#include "id.h"
+#include "wire.h"
+
+namespace glimpse {
+namespace {
+using wire::put;
+using wire::putId;
+using wire::putRequest;
+using wire::putUser;
+using wire::Reader;
+
+// Bumped whenever a message changes, processes only hand over to their own
+// version
+constexpr uint32_t PROTOCOL_VERSION = 1;
+
+enum class Kind : uint8_t { REQUEST = 1, HANDOFF, ACK, RELEASED };
+
+constexpr std::size_t MESSAGE_HEADER_SIZE = sizeof(Kind) + sizeof(uint32_t);
+// Enough for millions of rooms, anything longer is garbage
+constexpr uint32_t MAX_BODY_SIZE = 1u << 30;
+constexpr std::size_t MAX_FDS = 2;
+// How long either side waits for the other before giving up, freezing the
+// shards and flushing the room store take far less
+constexpr timeval PEER_TIMEOUT = {.tv_sec = 10, .tv_usec = 0};
+// How long the old process waits for the ACK, the new one loads the room
+// store and binds its sockets first
+constexpr timeval SETUP_TIMEOUT = {.tv_sec = 60, .tv_usec = 0};
+constexpr int LISTEN_BACKLOG = 512;
+
+void closeAll(std::span<const int> fds) {
+  for (auto fd : fds) {
+    ::close(fd);
+  }
+}
+
+sockaddr_un unixAddress(const std::filesystem::path& path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  const auto& text = path.native();
+  if (text.size() >= sizeof address.sun_path) {
+    throw HandoffError("handoff socket path is too long");
+  }
+  std::memcpy(address.sun_path, text.c_str(), text.size() + 1);
+  return address;
+}
+
+void setPeerTimeout(int fd) {
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &PEER_TIMEOUT,
+               sizeof PEER_TIMEOUT);
+  ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &PEER_TIMEOUT,
+               sizeof PEER_TIMEOUT);
+}
+
+bool writeAll(int fd, const char* data, std::size_t size) {
+  while (size > 0) {
+    auto written = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= static_cast<std::size_t>(written);
+  }
+  return true;
+}
+
+bool readAll(int fd, char* data, std::size_t size) {
+  while (size > 0) {
+    auto received = ::recv(fd, data, size, 0);
+    if (received < 0 and errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return false;
+    }
+    data += received;
+    size -= static_cast<std::size_t>(received);
+  }
+  return true;
+}
+
+// Sends one message, `fds` along with its first byte
+bool sendMessage(int fd, Kind kind, std::string_view body,
+                 std::span<const int> fds = {}) {
+  std::string frame;
+  frame.reserve(MESSAGE_HEADER_SIZE + body.size());
+  put(frame, kind);
+  put(frame, static_cast<uint32_t>(body.size()));
+  frame.append(body);
+
+  iovec vector = {.iov_base = frame.data(), .iov_len = frame.size()};
+  msghdr message{};
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int) * MAX_FDS)>
+      control{};
+  if (not fds.empty()) {
+    message.msg_control = control.data();
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    auto* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+  }
+  ssize_t sent;
+  do {
+    sent = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+  } while (sent < 0 and errno == EINTR);
+  if (sent < 0) {
+    return false;
+  }
+  return writeAll(fd, frame.data() + sent,
+                  frame.size() - static_cast<std::size_t>(sent));
+}
+
+// Receives one message and the descriptors sent along, which the caller
+// owns. Closes them and returns false if the message is cut short.
+bool receiveMessage(int fd, Kind& kind, std::string& body,
+                    std::vector<int>& fds) {
+  std::array<char, MESSAGE_HEADER_SIZE> header;
+  iovec vector = {.iov_base = header.data(), .iov_len = header.size()};
+  msghdr message{};
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int) * MAX_FDS)>
+      control{};
+  message.msg_control = control.data();
+  message.msg_controllen = control.size();
+  ssize_t received;
+  do {
+    received = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 and errno == EINTR);
+  if (received <= 0) {
+    return false;
+  }
+  for (auto* item = CMSG_FIRSTHDR(&message); item != nullptr;
+       item = CMSG_NXTHDR(&message, item)) {
+    if (item->cmsg_level == SOL_SOCKET and item->cmsg_type == SCM_RIGHTS) {
+      auto count = (item->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      auto first = fds.size();
+      fds.resize(first + count);
+      std::memcpy(&fds[first], CMSG_DATA(item), sizeof(int) * count);
+    }
+  }
+
+  auto rest = header.size() - static_cast<std::size_t>(received);
+  bool ok = (message.msg_flags & MSG_CTRUNC) == 0 and
+            readAll(fd, header.data() + received, rest);
+  Reader reader(header.data(), header.data() + header.size());
+  kind = reader.get<Kind>();
+  auto size = reader.get<uint32_t>();
+  if (ok and size <= MAX_BODY_SIZE) {
+    body.resize(size);
+    ok = readAll(fd, body.data(), size);
+  }
+  if (not ok or size > MAX_BODY_SIZE) {
+    closeAll(fds);
+    fds.clear();
+    return false;
+  }
+  return true;
+}
+
+std::string encodeRooms(const std::vector<StoredRooms>& shards) {
+  std::string out;
+  std::size_t roomCount = 0;
+  std::size_t requestCount = 0;
+  for (const auto& shard : shards) {
+    roomCount += shard.rooms.size();
+    requestCount += shard.requests.size();
+  }
+  put(out, static_cast<uint32_t>(roomCount));
+  for (const auto& shard : shards) {
+    for (const auto& room : shard.rooms) {
+      putId(out, room.id);
+      put(out, static_cast<uint32_t>(room.participants.size()));
+      for (const auto& participant : room.participants) {
+        putUser(out, participant);
+      }
+    }
+  }
+  put(out, static_cast<uint32_t>(requestCount));
+  for (const auto& shard : shards) {
+    for (const auto& request : shard.requests) {
+      putRequest(out, request);
+    }
+  }
+  return out;
+}
+
+// Regroups the rooms by the shard owning them here, as RoomStore::load()
+// does. Throws HandoffError if they do not decode.
+std::vector<StoredRooms> decodeRooms(Reader& reader, std::size_t shardCount) {
+  std::vector<StoredRooms> shards(shardCount);
+  std::unordered_set<Id, IdHash> roomIds;
+  auto roomCount = reader.get<uint32_t>();
+  for (uint32_t i = 0; i < roomCount and reader.ok(); ++i) {
+    StoredRoom room = {.id = reader.getId(), .participants = {}};
+    auto participantCount = reader.get<uint32_t>();
+    for (uint32_t j = 0; j < participantCount and reader.ok(); ++j) {
+      room.participants.push_back(reader.getUser());
+    }
+    if (room.participants.empty()) {
+      continue;
+    }
+    roomIds.insert(room.id);
+    shards[shardOfId(room.id, shardCount)].rooms.push_back(std::move(room));
+  }
+  // A request is served by the shard of its id and needs its room there,
+  // which a different thread count may have broken
+  auto requestCount = reader.get<uint32_t>();
+  for (uint32_t i = 0; i < requestCount and reader.ok(); ++i) {
+    auto request = reader.getRequest();
+    auto shard = shardOfId(request.requestId, shardCount);
+    if (roomIds.contains(request.roomId) and
+        shardOfId(request.roomId, shardCount) == shard) {
+      shards[shard].requests.push_back(std::move(request));
+    }
+  }
+  if (not reader.ok() or not reader.atEnd()) {
+    throw HandoffError("could not decode the handed over rooms");
+  }
+  return shards;
+}
+
+// Owns a descriptor for the scope
+struct FdGuard {
+  int fd;
+  ~FdGuard() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+};
+}  // namespace
+
+int listenTcp(int port) {
+  // Dual-stack where IPv6 is available, as uSockets listens
+  int family = AF_INET6;
+  int fd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 and errno == EAFNOSUPPORT) {
+    family = AF_INET;
+    fd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  }
+  if (fd < 0) {
+    throw HandoffError("could not create the listening socket");
+  }
+
+  sockaddr_storage address{};
+  socklen_t addressSize = 0;
+  if (family == AF_INET6) {
+    int zero = 0;
+    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof zero);
+    auto& v6 = reinterpret_cast<sockaddr_in6&>(address);
+    v6.sin6_family = AF_INET6;
+    v6.sin6_addr = in6addr_any;
+    v6.sin6_port = htons(static_cast<uint16_t>(port));
+    addressSize = sizeof v6;
+  } else {
+    auto& v4 = reinterpret_cast<sockaddr_in&>(address);
+    v4.sin_family = AF_INET;
+    v4.sin_addr.s_addr = htonl(INADDR_ANY);
+    v4.sin_port = htons(static_cast<uint16_t>(port));
+    addressSize = sizeof v4;
+  }
+  int one = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&address), addressSize) <
+          0 or
+      ::listen(fd, LISTEN_BACKLOG) < 0) {
+    spdlog::error("Could not listen on port {}: {}", port,
+                  std::strerror(errno));
+    ::close(fd);
+    throw HandoffError("could not listen on the port");
+  }
+  return fd;
+}
+
+std::optional<Handoff> takeOver(const std::filesystem::path& path,
+                                 std::size_t shardCount) {
+  auto address = unixAddress(path);
+  FdGuard connection{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+  if (connection.fd < 0) {
+    throw HandoffError("could not create the handoff socket");
+  }
+  if (::connect(connection.fd, reinterpret_cast<const sockaddr*>(&address),
+                sizeof address) < 0) {
+    if (errno == ENOENT or errno == ECONNREFUSED) {
+      return std::nullopt;
+    }
+    spdlog::error("Could not connect to {}: {}", path.native(),
+                  std::strerror(errno));
+    throw HandoffError("could not connect to the running process");
+  }
+  setPeerTimeout(connection.fd);
+
+  std::string body;
+  put(body, PROTOCOL_VERSION);
+  if (not sendMessage(connection.fd, Kind::REQUEST, body)) {
+    throw HandoffError("could not ask the running process to hand over");
+  }
+  Kind kind;
+  std::vector<int> fds;
+  if (not receiveMessage(connection.fd, kind, body, fds)) {
+    throw HandoffError("the running process did not hand over");
+  }
+  Handoff handoff;
+  try {
+    Reader reader(body.data(), body.data() + body.size());
+    bool hasStun = reader.get<uint8_t>() != 0;
+    if (kind != Kind::HANDOFF or fds.size() != (hasStun ? 2u : 1u)) {
+      throw HandoffError("unexpected handoff message");
+    }
+    handoff.rooms = decodeRooms(reader, shardCount);
+  } catch (const HandoffError&) {
+    closeAll(fds);
+    throw;
+  }
+  handoff.listenFd = fds[0];
+  handoff.stunFd = fds.size() > 1 ? fds[1] : -1;
+  handoff.connection = std::exchange(connection.fd, -1);
+  return handoff;
+}
+
+void confirmHandoff(Handoff& handoff) {
+  FdGuard connection{std::exchange(handoff.connection, -1)};
+  if (not sendMessage(connection.fd, Kind::ACK, {})) {
+    throw HandoffError("could not confirm the handoff");
+  }
+  // Once acknowledged the old process goes on with or without us, only
+  // its STUN server still needs to let go
+  Kind kind;
+  std::string body;
+  std::vector<int> fds;
+  if (not receiveMessage(connection.fd, kind, body, fds) or
+      kind != Kind::RELEASED) {
+    closeAll(fds);
+    spdlog::warn("The old process did not confirm it stopped its STUN "
+                 "server, carrying on");
+  }
+}
+
+HandoffServer::HandoffServer(std::filesystem::path path, int listenFd,
+                             int stunFd, HandoffCallbacks callbacks)
+    : listenFd_(listenFd), stunFd_(stunFd), callbacks_(std::move(callbacks)) {
+  auto address = unixAddress(path);
+  fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    throw HandoffError("could not create the handoff socket");
+  }
+  // What is left there belongs to the process this one took over from,
+  // which does not serve it anymore
+  std::error_code ignored;
+  std::filesystem::remove(path, ignored);
+  if (::bind(fd_, reinterpret_cast<const sockaddr*>(&address),
+             sizeof address) < 0 or
+      ::listen(fd_, 1) < 0) {
+    spdlog::error("Could not listen on {}: {}", path.native(),
+                  std::strerror(errno));
+    ::close(fd_);
+    throw HandoffError("could not listen on the handoff socket");
+  }
+  wakeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  spdlog::info("Handing over to a new process on {}", path.native());
+  thread_ = std::thread([this]() { run(); });
+}
+
+HandoffServer::~HandoffServer() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  uint64_t one = 1;
+  [[maybe_unused]] auto written = ::write(wakeFd_, &one, sizeof one);
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  ::close(fd_);
+  ::close(wakeFd_);
+}
+
+void HandoffServer::wait() {
+  std::unique_lock lock(mutex_);
+  handedOverChanged_.wait(lock, [this]() { return handedOver_; });
+}
+
+void HandoffServer::run() {
+  std::array<pollfd, 2> watched{};
+  watched[0] = {.fd = fd_, .events = POLLIN, .revents = 0};
+  watched[1] = {.fd = wakeFd_, .events = POLLIN, .revents = 0};
+  while (true) {
+    ::poll(watched.data(), watched.size(), -1);
+    {
+      std::lock_guard lock(mutex_);
+      if (stopping_) {
+        return;
+      }
+    }
+    FdGuard connection{::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC)};
+    if (connection.fd < 0) {
+      continue;
+    }
+    setPeerTimeout(connection.fd);
+    if (serve(connection.fd)) {
+      std::lock_guard lock(mutex_);
+      handedOver_ = true;
+      handedOverChanged_.notify_all();
+      return;
+    }
+  }
+}
+
+bool HandoffServer::serve(int connection) {
+  Kind kind;
+  std::string body;
+  std::vector<int> fds;
+  if (not receiveMessage(connection, kind, body, fds) or
+      kind != Kind::REQUEST) {
+    closeAll(fds);
+    spdlog::warn("Ignored an invalid handoff request");
+    return false;
+  }
+  closeAll(fds);
+  Reader request(body.data(), body.data() + body.size());
+  if (request.get<uint32_t>() != PROTOCOL_VERSION) {
+    spdlog::error("Refused to hand over to a process of another version");
+    return false;
+  }
+
+  spdlog::info("A new process takes over, handing over");
+  body.clear();
+  put(body, static_cast<uint8_t>(stunFd_ >= 0));
+  body += encodeRooms(callbacks_.release());
+  std::vector<int> handed = {listenFd_};
+  if (stunFd_ >= 0) {
+    handed.push_back(stunFd_);
+  }
+  bool sent = sendMessage(connection, Kind::HANDOFF, body, handed);
+  ::setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &SETUP_TIMEOUT,
+               sizeof SETUP_TIMEOUT);
+  if (not sent or not receiveMessage(connection, kind, body, fds) or
+      kind != Kind::ACK) {
+    closeAll(fds);
+    spdlog::error("The new process did not take over, carrying on");
+    callbacks_.resume();
+    return false;
+  }
+
+  callbacks_.handedOver();
+  if (not sendMessage(connection, Kind::RELEASED, {})) {
+    spdlog::warn("Could not tell the new process to go ahead");
+  }
+  return true;
+}
+}  // namespace glimpse
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "room_store.h"
+
+namespace glimpse {
+
+class HandoffError : public std::exception {
+ public:
+  HandoffError(const char* message) : msg_(message) {}
+
+  virtual const char* what() const noexcept override { return msg_; }
+
+ private:
+  const char* msg_;
+};
+
+// Hot restart. A new process connects to the Unix socket of the one it
+// replaces, which stops accepting, freezes its rooms, writes out its room
+// store and hands over its listening socket, its STUN socket and the rooms.
+// Connections keep queueing in the listening socket's backlog meanwhile,
+// none is refused. The new process sets up everything that can fail before
+// it acknowledges; the old process then closes its sessions over a drain
+// window, and the clients reconnect to the new one:
+//
+//   new  REQUEST   protocol version
+//   old  HANDOFF   sockets (SCM_RIGHTS), the rooms and join requests
+//   new  ACK       it takes over, the old process rolls back without
+//   old  RELEASED  it stopped its STUN server
+//
+// Each message is a kind byte and a length-prefixed body in the wire
+// encoding.
+struct Handoff {
+  // Listening socket of the HTTP and WebSocket port
+  int listenFd = -1;
+  // UDP socket of the STUN server, -1 if the old process ran none
+  int stunFd = -1;
+  // Frozen rooms and join requests, grouped by the shard owning them in
+  // this process
+  std::vector<StoredRooms> rooms;
+  // Connection to the old process, which waits for confirmHandoff() and
+  // rolls back if it is closed instead
+  int connection = -1;
+};
+
+// Listening TCP socket on `port`, dual-stack where IPv6 is available, for
+// a process that has nobody to take over from. Throws HandoffError if the
+// port cannot be bound.
+int listenTcp(int port);
+
+// Receives the sockets and rooms of the process listening on `path`.
+// Returns std::nullopt if there is none. Throws HandoffError if the handoff
+// fails, the old process then carries on.
+std::optional<Handoff> takeOver(const std::filesystem::path& path,
+                                 std::size_t shardCount);
+
+// Tells the old process this one takes over, once everything that can fail
+// is set up, and waits until it let go of the STUN socket. Closes the
+// connection. Throws HandoffError if the old process cannot be told, it
+// then carries on.
+void confirmHandoff(Handoff& handoff);
+
+struct HandoffCallbacks {
+  // Stops accepting, freezes the rooms and writes out the room store for
+  // the new process to load, returns the rooms by shard
+  std::function<std::vector<StoredRooms>()> release;
+  // The new process did not take over, take the room store back, accept
+  // and change rooms again
+  std::function<void()> resume;
+  // The new process took over. Stops the STUN server it takes over next,
+  // before it is told to go ahead.
+  std::function<void()> handedOver;
+};
+
+// Serves one handoff to the process replacing this one, on a thread of its
+// own. Requests that fail are rolled back and the next one is served.
+class HandoffServer {
+ public:
+  // Listens on `path`, replacing any socket left there. `listenFd` and
+  // `stunFd` stay owned by the caller, `stunFd` may be -1. Throws
+  // HandoffError if it cannot listen.
+  HandoffServer(std::filesystem::path path, int listenFd, int stunFd,
+                HandoffCallbacks callbacks);
+  ~HandoffServer();
+
+  HandoffServer(const HandoffServer&) = delete;
+  HandoffServer& operator=(const HandoffServer&) = delete;
+
+  // Blocks until a process took over
+  void wait();
+
+ private:
+  void run();
+  // Returns whether the connected process took over
+  bool serve(int connection);
+
+  int fd_;
+  int wakeFd_;
+  int listenFd_;
+  int stunFd_;
+  HandoffCallbacks callbacks_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable handedOverChanged_;
+  bool handedOver_ = false;
+  bool stopping_ = false;
+};
+}  // namespace glimpse
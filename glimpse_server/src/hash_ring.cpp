@@ -0,0 +1,51 @@
+#include "hash_ring.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+namespace glimpse {
+namespace {
+// FNV-1a followed by the splitmix64 finalizer, names differ in a few
+// characters only
+uint64_t hashName(std::string_view name, uint64_t seed) {
+  uint64_t hash = 14695981039346656037ull ^ seed;
+  for (auto c : name) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+  }
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111eb;
+  hash ^= hash >> 31;
+  return hash;
+}
+}  // namespace
+
+HashRing::HashRing(std::vector<std::string> members, std::size_t self)
+    : members_(std::move(members)), self_(self) {
+  if (self_ >= members_.size()) {
+    throw std::invalid_argument("node index is not in the member list");
+  }
+  points_.reserve(members_.size() * POINTS_PER_NODE);
+  for (std::size_t node = 0; node < members_.size(); ++node) {
+    fingerprint_ = hashName(members_[node], fingerprint_);
+    for (std::size_t i = 0; i < POINTS_PER_NODE; ++i) {
+      points_.emplace_back(hashName(members_[node], i), node);
+    }
+  }
+  std::ranges::sort(points_);
+}
+
+std::size_t HashRing::ownerOf(const Id& id) const {
+  auto position = static_cast<uint64_t>(IdHash{}(id));
+  auto point = std::ranges::lower_bound(
+      points_, position, {}, &std::pair<uint64_t, std::size_t>::first);
+  // Past the last position the ring wraps around
+  return point == points_.end() ? points_.front().second : point->second;
+}
+
+const std::string& HashRing::member(std::size_t node) const {
+  return members_.at(node);
+}
+}  // namespace glimpse
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "id.h"
+
+namespace glimpse {
+
+// Consistent hashing of ids onto the nodes of a cluster. Every node is
+// placed on the ring at POINTS_PER_NODE positions derived from its name,
+// and an id belongs to the node of the first position at or after the id's
+// hash. Adding or removing a member only moves the ids next to its own
+// positions, the others keep their owner.
+class HashRing {
+ public:
+  static constexpr std::size_t POINTS_PER_NODE = 64;
+
+  // `members` names every node, in the same order on all of them. `self`
+  // is the index of the calling node.
+  HashRing(std::vector<std::string> members, std::size_t self);
+
+  std::size_t ownerOf(const Id& id) const;
+  bool owns(const Id& id) const { return ownerOf(id) == self_; }
+
+  std::size_t self() const { return self_; }
+  std::size_t size() const { return members_.size(); }
+  const std::string& member(std::size_t node) const;
+  // Hash of the member list, equal on nodes that agree on it
+  uint64_t fingerprint() const { return fingerprint_; }
+
+ private:
+  std::vector<std::string> members_;
+  std::size_t self_;
+  uint64_t fingerprint_ = 0;
+  // Sorted by position
+  std::vector<std::pair<uint64_t, std::size_t>> points_;
+};
+}  // namespace glimpse
@@ -0,0 +1,147 @@
+#include "id.h"
+
+#include <sys/random.h>
+
+#include <cerrno>
+#include <system_error>
+
+namespace glimpse {
+namespace {
+constexpr char HEX_DIGITS[] = "0123456789abcdef";
+
+// Random words fetched per getrandom() call, 256 ids
+constexpr std::size_t RANDOM_BATCH = 512;
+
+// Offsets of the dashes in the text form
+constexpr std::array<std::size_t, 4> DASHES = {8, 13, 18, 23};
+
+int hexValue(char c) {
+  if (c >= '0' and c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' and c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' and c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// Finalizer of splitmix64. User ids come from clients, so the table hash
+// mixes every bit rather than trusting them to be random.
+uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111eb;
+  x ^= x >> 31;
+  return x;
+}
+}  // namespace
+
+std::optional<Id> Id::parse(std::string_view text) {
+  if (text.size() != TEXT_LENGTH) {
+    return std::nullopt;
+  }
+
+  uint64_t words[2] = {0, 0};
+  std::size_t digits = 0;
+  for (std::size_t i = 0; i < TEXT_LENGTH; ++i) {
+    if (i == DASHES[0] or i == DASHES[1] or i == DASHES[2] or
+        i == DASHES[3]) {
+      if (text[i] != '-') {
+        return std::nullopt;
+      }
+      continue;
+    }
+    auto value = hexValue(text[i]);
+    if (value < 0) {
+      return std::nullopt;
+    }
+    auto& word = words[digits++ / 16];
+    word = word << 4 | static_cast<uint64_t>(value);
+  }
+  return Id(words[0], words[1]);
+}
+
+std::array<char, Id::TEXT_LENGTH> Id::text() const {
+  std::array<char, TEXT_LENGTH> out;
+  std::size_t digit = 0;
+  for (std::size_t i = 0; i < TEXT_LENGTH; ++i) {
+    if (i == DASHES[0] or i == DASHES[1] or i == DASHES[2] or
+        i == DASHES[3]) {
+      out[i] = '-';
+      continue;
+    }
+    auto word = digit < 16 ? high_ : low_;
+    auto shift = 60 - 4 * (digit % 16);
+    out[i] = HEX_DIGITS[(word >> shift) & 0xf];
+    ++digit;
+  }
+  return out;
+}
+
+std::string Id::toString() const {
+  auto out = text();
+  return std::string(out.data(), out.size());
+}
+
+std::size_t IdHash::operator()(const Id& id) const {
+  return mix(id.high() ^ mix(id.low()));
+}
+
+Id randomId() {
+  // Kernel randomness, fetched for many ids at once to spare the system
+  // calls
+  thread_local std::array<uint64_t, RANDOM_BATCH> batch;
+  thread_local std::size_t next = RANDOM_BATCH;
+  if (next + 2 > RANDOM_BATCH) {
+    auto* out = reinterpret_cast<char*>(batch.data());
+    std::size_t filled = 0;
+    while (filled < sizeof batch) {
+      auto got = ::getrandom(out + filled, sizeof batch - filled, 0);
+      if (got < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::generic_category(), "getrandom");
+      }
+      filled += static_cast<std::size_t>(got);
+    }
+    next = 0;
+  }
+
+  auto high = batch[next++];
+  auto low = batch[next++];
+  // Version 4, variant 1, as boost::uuids::random_generator produced
+  high = (high & ~uint64_t{0xf000}) | 0x4000;
+  low = (low & ~(uint64_t{0x3} << 62)) | uint64_t{0x2} << 62;
+  return Id(high, low);
+}
+
+Id newShardedId(std::size_t shard, std::size_t shardCount) {
+  auto id = randomId();
+
+  uint64_t head = id.high() >> 32;
+  head = head - head % shardCount + shard;
+  if (head > UINT32_MAX) {
+    head -= shardCount;
+  }
+  return Id(head << 32 | (id.high() & UINT32_MAX), id.low());
+}
+
+std::size_t shardOfId(const Id& id, std::size_t shardCount) {
+  return (id.high() >> 32) % shardCount;
+}
+
+void to_json(nlohmann::json& j, const Id& id) { j = id.toString(); }
+
+void from_json(const nlohmann::json& j, Id& id) {
+  auto parsed = Id::parse(j.get<std::string>());
+  if (not parsed) {
+    throw nlohmann::json::type_error::create(302, "id must be a UUID", &j);
+  }
+  id = *parsed;
+}
+}  // namespace glimpse
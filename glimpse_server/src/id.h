@@ -0,0 +1,75 @@
+#pragma once
+
+#include <fmt/format.h>
+
+#include <array>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace glimpse {
+
+// 128-bit identifier of rooms, join requests and users. Its text form is the
+// canonical lowercase UUID, 8-4-4-4-12 hex digits; ids are only converted to
+// and from text at the JSON boundary.
+class Id {
+ public:
+  static constexpr std::size_t TEXT_LENGTH = 36;
+
+  // The nil id, which is never minted and never matches anything stored
+  constexpr Id() = default;
+  constexpr Id(uint64_t high, uint64_t low) : high_(high), low_(low) {}
+
+  // Accepts the canonical text form in either case, nothing else
+  static std::optional<Id> parse(std::string_view text);
+
+  uint64_t high() const { return high_; }
+  uint64_t low() const { return low_; }
+  bool isNil() const { return high_ == 0 and low_ == 0; }
+
+  std::array<char, TEXT_LENGTH> text() const;
+  std::string toString() const;
+
+  friend constexpr auto operator<=>(const Id&, const Id&) = default;
+
+ private:
+  uint64_t high_ = 0;
+  uint64_t low_ = 0;
+};
+
+struct IdHash {
+  std::size_t operator()(const Id& id) const;
+};
+
+// Random version 4 UUID from the kernel's CSPRNG. Room and request ids
+// work as capabilities, they must not be predictable from earlier ones.
+// Throws std::system_error if the kernel refuses.
+Id randomId();
+
+// Mints a room/request id whose owner is `shard`. The first 32 bits of the
+// id are adjusted so that they are congruent to the shard index, which lets
+// any thread find the owner of an id without a lookup table.
+Id newShardedId(std::size_t shard, std::size_t shardCount);
+
+// Returns the shard that owns `id`. Ids that were not minted by
+// newShardedId() (e.g. the nil id) still map to a valid shard.
+std::size_t shardOfId(const Id& id, std::size_t shardCount);
+
+void to_json(nlohmann::json& j, const Id& id);
+// Throws nlohmann::json::type_error like any other mistyped member
+void from_json(const nlohmann::json& j, Id& id);
+}  // namespace glimpse
+
+template <>
+struct fmt::formatter<glimpse::Id> : fmt::formatter<std::string_view> {
+  template <typename FormatContext>
+  auto format(const glimpse::Id& id, FormatContext& ctx) const {
+    auto text = id.text();
+    return fmt::formatter<std::string_view>::format(
+        std::string_view(text.data(), text.size()), ctx);
+  }
+};
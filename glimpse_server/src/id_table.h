@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "id.h"
+#include "object_pool.h"
+
+namespace glimpse {
+
+// Open-addressing map from Id to records kept in an ObjectPool. Slots hold
+// the key next to a pointer to its record, so a lookup probes one flat
+// array and touches a record only on a hit. Records stay where they are
+// when the table grows: pointers returned by find() and tryEmplace() remain
+// valid until the record is erased.
+//
+// Linear probing with backward-shift deletion, at most three quarters full.
+template <typename T>
+class IdTable {
+ public:
+  IdTable() : slots_(MIN_CAPACITY) {}
+  ~IdTable() { clear(); }
+
+  IdTable(const IdTable&) = delete;
+  IdTable& operator=(const IdTable&) = delete;
+
+  T* find(const Id& id) {
+    for (auto i = home(id);; i = next(i)) {
+      auto& slot = slots_[i];
+      if (slot.record == nullptr) {
+        return nullptr;
+      }
+      if (slot.key == id) {
+        return slot.record;
+      }
+    }
+  }
+
+  bool contains(const Id& id) { return find(id) != nullptr; }
+
+  // Returns the record of `id` and whether it was created from `args`
+  template <typename... Args>
+  std::pair<T*, bool> tryEmplace(const Id& id, Args&&... args) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+      rehash(slots_.size() * 2);
+    }
+    auto i = home(id);
+    for (; slots_[i].record != nullptr; i = next(i)) {
+      if (slots_[i].key == id) {
+        return {slots_[i].record, false};
+      }
+    }
+    slots_[i] = {id, pool_.create(std::forward<Args>(args)...)};
+    ++size_;
+    return {slots_[i].record, true};
+  }
+
+  // `id` may refer into the record being erased
+  bool erase(const Id& id) {
+    auto hole = home(id);
+    for (;; hole = next(hole)) {
+      if (slots_[hole].record == nullptr) {
+        return false;
+      }
+      if (slots_[hole].key == id) {
+        break;
+      }
+    }
+    auto* record = slots_[hole].record;
+
+    // Pull back every later entry of the cluster whose home is not between
+    // the hole and itself, so probes never stop early at the hole
+    auto mask = slots_.size() - 1;
+    for (auto i = next(hole); slots_[i].record != nullptr; i = next(i)) {
+      auto distance = (i - home(slots_[i].key)) & mask;
+      if (distance >= ((i - hole) & mask)) {
+        slots_[hole] = slots_[i];
+        hole = i;
+      }
+    }
+    slots_[hole] = {};
+    --size_;
+    pool_.destroy(record);
+    return true;
+  }
+
+  // Calls `fn(const Id&, T&)` for every record. `fn` must not insert or
+  // erase.
+  template <typename Fn>
+  void forEach(Fn&& fn) {
+    for (auto& slot : slots_) {
+      if (slot.record != nullptr) {
+        fn(slot.key, *slot.record);
+      }
+    }
+  }
+
+  void clear() {
+    for (auto& slot : slots_) {
+      if (slot.record != nullptr) {
+        pool_.destroy(slot.record);
+        slot = {};
+      }
+    }
+    size_ = 0;
+  }
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+ private:
+  static constexpr std::size_t MIN_CAPACITY = 16;
+
+  struct Slot {
+    Id key;
+    T* record = nullptr;
+  };
+
+  std::size_t home(const Id& id) const {
+    return IdHash{}(id) & (slots_.size() - 1);
+  }
+  std::size_t next(std::size_t i) const {
+    return (i + 1) & (slots_.size() - 1);
+  }
+
+  void rehash(std::size_t capacity) {
+    std::vector<Slot> old(capacity);
+    old.swap(slots_);
+    for (const auto& slot : old) {
+      if (slot.record != nullptr) {
+        auto i = home(slot.key);
+        while (slots_[i].record != nullptr) {
+          i = next(i);
+        }
+        slots_[i] = slot;
+      }
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::size_t size_ = 0;
+  ObjectPool<T> pool_;
+};
+}  // namespace glimpse
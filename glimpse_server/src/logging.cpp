@@ -0,0 +1,57 @@
+#include "logging.h"
+
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+namespace glimpse::logging {
+namespace {
+std::atomic<uint64_t> totalSuppressed{0};
+
+int64_t nowNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+}  // namespace
+
+void initAsync(const LoggingOptions& options) {
+  // A single writer keeps the records of each thread in order
+  spdlog::init_thread_pool(options.queueSize, 1);
+  auto logger =
+      spdlog::create_async_nb<spdlog::sinks::stdout_color_sink_mt>("glimpse");
+  spdlog::set_default_logger(logger);
+  spdlog::flush_on(spdlog::level::err);
+  spdlog::flush_every(options.flushInterval);
+}
+
+void shutdown() { spdlog::shutdown(); }
+
+uint64_t droppedRecords() {
+  auto pool = spdlog::thread_pool();
+  return pool ? pool->overrun_counter() : 0;
+}
+
+uint64_t suppressedRecords() {
+  return totalSuppressed.load(std::memory_order_relaxed);
+}
+
+bool RateLimit::allow(uint64_t& suppressed) {
+  // Racing threads may both start a window or let one record too many
+  // through, which is fine for a log
+  auto now = nowNanoseconds();
+  auto start = windowStart_.load(std::memory_order_relaxed);
+  if (now - start >= interval_ and
+      windowStart_.compare_exchange_strong(start, now,
+                                           std::memory_order_relaxed)) {
+    written_.store(0, std::memory_order_relaxed);
+  }
+
+  if (written_.fetch_add(1, std::memory_order_relaxed) < burst_) {
+    suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+  suppressed_.fetch_add(1, std::memory_order_relaxed);
+  totalSuppressed.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+}  // namespace glimpse::logging
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace glimpse::logging {
+
+struct LoggingOptions {
+  // Records waiting for the writer thread. Once it is full the oldest
+  // waiting record is overwritten, a loop never blocks on the log.
+  std::size_t queueSize = 8192;
+  std::chrono::seconds flushInterval{1};
+};
+
+// Replaces the default logger with an asynchronous one. spdlog::info() and
+// friends then only format the message on the calling thread and push it
+// onto a bounded queue; a dedicated thread adds the pattern and writes it
+// to stdout. Must be called before the event-loop threads start.
+void initAsync(const LoggingOptions& options = {});
+// Writes out what is still queued and stops the writer thread
+void shutdown();
+
+// Records overwritten because the queue was full
+uint64_t droppedRecords();
+// Records held back by a RateLimit, all call sites together
+uint64_t suppressedRecords();
+
+// Lets `burst` records through per `interval` and holds back the rest, for
+// call sites a misbehaving client can trigger in a loop. One instance per
+// call site, shared by all threads.
+class RateLimit {
+ public:
+  constexpr RateLimit(uint32_t burst = 10,
+                      std::chrono::seconds interval = std::chrono::seconds(1))
+      : burst_(burst),
+        interval_(std::chrono::duration_cast<std::chrono::nanoseconds>(interval)
+                      .count()) {}
+
+  // Whether a record may be written now. `suppressed` receives the number
+  // held back since the previous one was let through.
+  bool allow(uint64_t& suppressed);
+
+ private:
+  uint32_t burst_;
+  int64_t interval_;
+  std::atomic<int64_t> windowStart_{0};
+  std::atomic<uint32_t> written_{0};
+  std::atomic<uint64_t> suppressed_{0};
+};
+
+// spdlog::log() behind `limit`. The first record after some were held back
+// is followed by their count.
+template <typename... Args>
+void limited(RateLimit& limit, spdlog::level::level_enum level,
+             spdlog::format_string_t<Args...> format, Args&&... args) {
+  if (not spdlog::should_log(level)) {
+    return;
+  }
+  uint64_t suppressed = 0;
+  if (not limit.allow(suppressed)) {
+    return;
+  }
+  spdlog::log(level, format, std::forward<Args>(args)...);
+  if (suppressed > 0) {
+    spdlog::log(level, "({} similar messages suppressed)", suppressed);
+  }
+}
+}  // namespace glimpse::logging
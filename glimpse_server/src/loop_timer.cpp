@@ -0,0 +1,39 @@
+#include "loop_timer.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace glimpse {
+LoopTimer::LoopTimer(uWS::Loop* loop, std::function<void()> onTimeout)
+    : onTimeout_(std::move(onTimeout)) {
+  // Fallthrough: a pending timer alone does not keep the loop running
+  timer_ = us_create_timer(reinterpret_cast<us_loop_t*>(loop), 1,
+                           sizeof(LoopTimer*));
+  *static_cast<LoopTimer**>(us_timer_ext(timer_)) = this;
+}
+
+LoopTimer::~LoopTimer() { us_timer_close(timer_); }
+
+void LoopTimer::start(std::chrono::milliseconds delay,
+                      std::chrono::milliseconds repeat) {
+  pending_ = true;
+  repeating_ = repeat.count() > 0;
+  // A zero delay would disarm the timer
+  auto ms = std::max<int>(1, static_cast<int>(delay.count()));
+  us_timer_set(timer_, handleTimeout, ms, static_cast<int>(repeat.count()));
+}
+
+void LoopTimer::stop() {
+  pending_ = false;
+  repeating_ = false;
+  us_timer_set(timer_, handleTimeout, 0, 0);
+}
+
+bool LoopTimer::isPending() const { return pending_; }
+
+void LoopTimer::handleTimeout(us_timer_t* timer) {
+  auto* self = *static_cast<LoopTimer**>(us_timer_ext(timer));
+  self->pending_ = self->repeating_;
+  self->onTimeout_();
+}
+}  // namespace glimpse
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <libusockets.h>
+#include <uwebsockets/Loop.h>
+
+#include <chrono>
+#include <functional>
+
+namespace glimpse {
+
+// Timer on a uWS event loop. It must be created, used and destroyed
+// on the thread running that loop; `onTimeout` runs on that thread too.
+class LoopTimer {
+ public:
+  LoopTimer(uWS::Loop* loop, std::function<void()> onTimeout);
+  ~LoopTimer();
+
+  LoopTimer(const LoopTimer&) = delete;
+  LoopTimer& operator=(const LoopTimer&) = delete;
+
+  // Fires after `delay`, then every `repeat` if it is not zero. Replaces
+  // any pending timeout.
+  void start(std::chrono::milliseconds delay,
+             std::chrono::milliseconds repeat = {});
+  void stop();
+  bool isPending() const;
+
+ private:
+  static void handleTimeout(us_timer_t* timer);
+
+  us_timer_t* timer_;
+  std::function<void()> onTimeout_;
+  bool pending_ = false;
+  bool repeating_ = false;
+};
+}  // namespace glimpse
@@ -1,79 +1,523 @@
 #include <spdlog/spdlog.h>
+#include <unistd.h>
 #include <uwebsockets/App.h>
 
-#include <functional>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <latch>
 #include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "acceptor.h"
+#include "admission.h"
+#include "cluster.h"
 #include "controller.h"
+#include "handoff.h"
+#include "hash_ring.h"
+#include "logging.h"
+#include "media_relay.h"
+#include "resume_log.h"
+#include "room_store.h"
+#include "shard.h"
+#include "stun_server.h"
 #include "ws_manager.h"
 
-constexpr int PORT = 8080;
+// Reads a non-negative integer from the environment, `fallback` if it is
+// unset or invalid
+std::size_t envSize(const char* name, std::size_t fallback) {
+  if (const char* env = std::getenv(name)) {
+    std::string_view value(env);
+    std::size_t result = 0;
+    auto [ptr, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), result);
+    if (ec == std::errc() and ptr == value.data() + value.size()) {
+      return result;
+    }
+    spdlog::error("Invalid {} value: {}", name, value);
+  }
+  return fallback;
+}
 
-int main() {
-  auto wsManager = std::make_shared<glimpse::WsManager>();
-  auto roomManager = std::make_shared<glimpse::RoomManager>(wsManager);
+// Number of event-loop threads, GLIMPSE_THREADS or one per core
+std::size_t eventLoopThreadCount() {
+  auto cores = std::max(1u, std::thread::hardware_concurrency());
+  auto count = envSize("GLIMPSE_THREADS", cores);
+  return count > 0 ? count : cores;
+}
+
+// Cluster membership, off unless GLIMPSE_CLUSTER_NODES is set. Throws
+// std::invalid_argument if GLIMPSE_CLUSTER_NODE is not one of the nodes.
+std::shared_ptr<const glimpse::HashRing> clusterRing() {
+  const char* nodes = std::getenv("GLIMPSE_CLUSTER_NODES");
+  if (nodes == nullptr or *nodes == '\0') {
+    return nullptr;
+  }
+  std::vector<std::string> members;
+  std::string_view list(nodes);
+  while (not list.empty()) {
+    auto comma = std::min(list.find(','), list.size());
+    if (comma > 0) {
+      members.emplace_back(list.substr(0, comma));
+    }
+    list.remove_prefix(std::min(comma + 1, list.size()));
+  }
+  return std::make_shared<const glimpse::HashRing>(
+      std::move(members), envSize("GLIMPSE_CLUSTER_NODE", 0));
+}
+
+// Compression of outgoing frames, GLIMPSE_WS_COMPRESSION is "off",
+// "shared" or "dedicated"
+glimpse::WsCompressionOptions wsCompressionOptions() {
+  glimpse::WsCompressionOptions options;
+  std::string_view mode = "shared";
+  if (const char* env = std::getenv("GLIMPSE_WS_COMPRESSION")) {
+    mode = env;
+  }
+  if (mode == "off") {
+    options.compressor = uWS::DISABLED;
+  } else if (mode == "dedicated") {
+    // Holds a few SDPs, enough for a group call's offers to share matches
+    options.compressor = uWS::DEDICATED_COMPRESSOR_32KB;
+  } else if (mode != "shared") {
+    spdlog::error("Invalid GLIMPSE_WS_COMPRESSION value: {}", mode);
+  }
+  options.minSize =
+      envSize("GLIMPSE_WS_COMPRESS_MIN_BYTES", options.minSize);
+  options.sampleInterval =
+      envSize("GLIMPSE_WS_COMPRESS_SAMPLE", options.sampleInterval);
+  return options;
+}
+
+// Session resume for clients that ask for it, on by default
+glimpse::ResumeOptions resumeOptions() {
+  glimpse::ResumeOptions options;
+  options.window = std::chrono::seconds(
+      envSize("GLIMPSE_RESUME_WINDOW", options.window.count()));
+  options.maxFrames = std::max<std::size_t>(
+      1, envSize("GLIMPSE_RESUME_FRAMES", options.maxFrames));
+  options.maxBytes = std::max<std::size_t>(
+      1, envSize("GLIMPSE_RESUME_BYTES", options.maxBytes));
+  return options;
+}
+
+// Rate limits of HTTP requests and WebSocket upgrades, per event loop
+glimpse::AdmissionOptions admissionOptions() {
+  glimpse::AdmissionOptions options;
+  auto rate = [](const char* rateName, const char* burstName,
+                 glimpse::TokenBucketRate& bucket) {
+    bucket.perSecond = static_cast<double>(
+        envSize(rateName, static_cast<std::size_t>(bucket.perSecond)));
+    bucket.burst = static_cast<double>(
+        envSize(burstName, static_cast<std::size_t>(bucket.burst)));
+  };
+  rate("GLIMPSE_ADDRESS_RATE", "GLIMPSE_ADDRESS_BURST", options.address);
+  rate("GLIMPSE_USER_RATE", "GLIMPSE_USER_BURST", options.user);
+  options.tableSize =
+      envSize("GLIMPSE_RATE_LIMIT_TABLE_SIZE", options.tableSize);
+  return options;
+}
+
+glimpse::RoomManagerOptions roomManagerOptions(
+    std::shared_ptr<const glimpse::HashRing> ring,
+    std::shared_ptr<glimpse::MediaRelay> relay) {
+  glimpse::RoomManagerOptions options;
+
+  // ICE coalescing, off unless GLIMPSE_ICE_BATCH_MS is set
+  auto& batching = options.iceBatching;
+  batching.window = std::chrono::milliseconds(
+      envSize("GLIMPSE_ICE_BATCH_MS", batching.window.count()));
+  batching.maxCandidates = std::max<std::size_t>(
+      1, envSize("GLIMPSE_ICE_BATCH_MAX", batching.maxCandidates));
+
+  auto& expiry = options.expiry;
+  expiry.unjoinedRoom = std::chrono::seconds(
+      envSize("GLIMPSE_UNJOINED_ROOM_TTL", expiry.unjoinedRoom.count()));
+  expiry.joinRequest = std::chrono::seconds(
+      envSize("GLIMPSE_JOIN_REQUEST_TTL", expiry.joinRequest.count()));
+  expiry.presenceCheck = std::chrono::seconds(
+      envSize("GLIMPSE_PRESENCE_CHECK_INTERVAL", expiry.presenceCheck.count()));
+  options.ring = std::move(ring);
+  if (const char* stunUrl = std::getenv("GLIMPSE_STUN_URL")) {
+    if (*stunUrl != '\0') {
+      options.iceServers.emplace_back(stunUrl);
+    }
+  }
+  options.relay = std::move(relay);
+  options.setupLogSize = std::max<std::size_t>(
+      1, envSize("GLIMPSE_SETUP_LOG_SIZE", options.setupLogSize));
+  return options;
+}
+
+void runEventLoop(std::size_t shard, int port,
+                  std::shared_ptr<glimpse::WsManager> wsManager,
+                  std::shared_ptr<glimpse::ShardRouter> router,
+                  std::shared_ptr<glimpse::Cluster> cluster,
+                  std::shared_ptr<glimpse::StunServer> stunServer,
+                  std::shared_ptr<glimpse::MediaRelay> relay,
+                  const glimpse::AdmissionOptions& admissionOptions,
+                  bool debugRoutes, glimpse::Acceptor* acceptor) {
+  // Each loop limits the requests of the connections it accepted
+  auto admission = std::make_shared<glimpse::Admission>(admissionOptions);
   glimpse::RootController rootController;
-  glimpse::RoomController roomController(roomManager);
-  glimpse::WsController wsController;
+  glimpse::MetricsController metricsController(wsManager, cluster, stunServer,
+                                               relay);
+  glimpse::RoomController roomController(router, cluster, admission);
+  glimpse::WsController wsController(router, wsManager, cluster, admission);
+  glimpse::DebugController debugController(router);
 
-  uWS::App()
-      .get("/", std::bind(&glimpse::RootController::handleGet, rootController,
-                          std::placeholders::_1, std::placeholders::_2))
+  uWS::App app;
+  // Room broadcasts are published through this thread's app
+  wsManager->attachApp(&app);
+  // Handlers call the controllers of this frame, which outlives the loop,
+  // without copying them
+  using Response = uWS::HttpResponse<false>;
+  using Request = uWS::HttpRequest;
+  auto room = [&roomController](auto handler) {
+    return [&roomController, handler](Response* res, Request* req) {
+      (roomController.*handler)(res, req);
+    };
+  };
+  // Debugging aids are off unless GLIMPSE_DEBUG_ROUTES is set
+  if (debugRoutes) {
+    app.get("/debug/setups",
+            [&debugController](Response* res, Request* req) {
+              debugController.handleSetupsGet(res, req);
+            });
+  }
+  app.get("/",
+          [&rootController](Response* res, Request* req) {
+            rootController.handleGet(res, req);
+          })
+      .get("/metrics",
+           [&metricsController](Response* res, Request* req) {
+             metricsController.handleGet(res, req);
+           })
       .options("/*",
-               std::bind(&glimpse::RootController::handleOption, rootController,
-                         std::placeholders::_1, std::placeholders::_2))
+               [&rootController](Response* res, Request* req) {
+                 rootController.handleOption(res, req);
+               })
       .post("/room",
-            std::bind(&glimpse::RoomController::handleCreateNewRoomPost,
-                      roomController, std::placeholders::_1,
-                      std::placeholders::_2))
-      .post("/room/join",
-            std::bind(&glimpse::RoomController::handleJoinRoomPost,
-                      roomController, std::placeholders::_1,
-                      std::placeholders::_2))
+            room(&glimpse::RoomController::handleCreateNewRoomPost))
+      .post("/room/join", room(&glimpse::RoomController::handleJoinRoomPost))
       .post("/room/join/approve",
-            std::bind(&glimpse::RoomController::handleApproveJoinRoomPost,
-                      roomController, std::placeholders::_1,
-                      std::placeholders::_2))
+            room(&glimpse::RoomController::handleApproveJoinRoomPost))
       .post("/room/join/deny",
-            std::bind(&glimpse::RoomController::handleDenyJoinRoomPost,
-                      roomController, std::placeholders::_1,
-                      std::placeholders::_2))
-      .post("/room/sdp",
-            std::bind(&glimpse::RoomController::handleSDPPost, roomController,
-                      std::placeholders::_1, std::placeholders::_2))
-      .post("/room/ice",
-            std::bind(&glimpse::RoomController::handleICEPost, roomController,
-                      std::placeholders::_1, std::placeholders::_2))
-      .post("/room/end", std::bind(&glimpse::RoomController::handleEndRoomPost,
-                                   roomController, std::placeholders::_1,
-                                   std::placeholders::_2))
-      .ws<glimpse::User>(
+            room(&glimpse::RoomController::handleDenyJoinRoomPost))
+      .post("/room/sdp", room(&glimpse::RoomController::handleSDPPost))
+      .post("/room/ice", room(&glimpse::RoomController::handleICEPost))
+      .post("/room/end", room(&glimpse::RoomController::handleEndRoomPost))
+      .ws<glimpse::WsSessionData>(
           "/ws",
-          {.compression = uWS::SHARED_COMPRESSOR,
+          {.compression = wsManager->compression().compressor,
            .maxPayloadLength = glimpse::WS_MAX_PAYLOAD_LENGTH,
            .idleTimeout = glimpse::WS_IDLE_TIMEOUT,
            .maxBackpressure = glimpse::WS_MAX_BACK_PRESSURE,
            /* Handlers */
-           .upgrade = std::bind(&glimpse::WsController::handleWsRouteUpgrade,
-                                wsController, std::placeholders::_1,
-                                std::placeholders::_2, std::placeholders::_3),
-           .open = std::bind(&glimpse::WsManager::handleWsOpen, wsManager,
-                             std::placeholders::_1),
-           .message = std::bind(&glimpse::WsManager::handleWsMessage, wsManager,
-                                std::placeholders::_1, std::placeholders::_2,
-                                std::placeholders::_3),
-           .drain =
-               [](auto* /*ws*/) {
-                 /* Check ws->getBufferedAmount() here */
+           .upgrade =
+               [&wsController](Response* res, Request* req,
+                               us_socket_context_t* context) {
+                 wsController.handleWsRouteUpgrade(res, req, context);
+               },
+           .open = [&wsManager](glimpse::WsSession* ws) {
+             wsManager->handleWsOpen(ws);
+           },
+           .message =
+               [&wsController](glimpse::WsSession* ws,
+                               std::string_view message, uWS::OpCode opCode) {
+                 wsController.handleWsMessage(ws, message, opCode);
                },
-           .close = std::bind(&glimpse::WsManager::handleWsClose, wsManager,
-                              std::placeholders::_1, std::placeholders::_2,
-                              std::placeholders::_3)})
-      .listen(PORT,
-              [](auto* socket) {
-                if (socket) {
-                  spdlog::info("Listening on port {}", PORT);
-                }
-              })
-      .run();
+           .drain = [&wsManager](glimpse::WsSession* ws) {
+             wsManager->handleWsDrain(ws);
+           },
+           .close = [&wsManager](glimpse::WsSession* ws, int code,
+                                 std::string_view message) {
+             wsManager->handleWsClose(ws, code, message);
+           }});
+
+  if (acceptor) {
+    // The listening socket outlives the process, see Handoff
+    acceptor->attach(shard, &app);
+  } else {
+    // Every thread listens on the same port. uSockets sets SO_REUSEPORT
+    // unless LIBUS_LISTEN_EXCLUSIVE_PORT is given, so the kernel spreads
+    // connections across the threads.
+    app.listen(port, [shard, port](auto* socket) {
+      if (socket) {
+        spdlog::info("Thread {} listening on port {}", shard, port);
+      } else {
+        spdlog::error("Thread {} failed to listen on port {}", shard, port);
+      }
+    });
+  }
+  app.run();
+}
+
+// Room persistence, off unless GLIMPSE_STATE_DIR is set
+std::shared_ptr<glimpse::RoomStore> roomStore(std::size_t shardCount) {
+  const char* directory = std::getenv("GLIMPSE_STATE_DIR");
+  if (directory == nullptr or *directory == '\0') {
+    return nullptr;
+  }
+  glimpse::RoomStoreOptions options;
+  options.directory = directory;
+  options.flushInterval = std::chrono::milliseconds(std::max<std::size_t>(
+      1, envSize("GLIMPSE_JOURNAL_FLUSH_MS", options.flushInterval.count())));
+  options.sync = envSize("GLIMPSE_JOURNAL_SYNC", options.sync) != 0;
+  return std::make_shared<glimpse::RoomStore>(options, shardCount);
+}
+
+// Embedded STUN server, off unless GLIMPSE_STUN_PORT is set. Takes over
+// `fd` if the process this one replaces handed over its socket. Throws
+// StunServerError if the port cannot be bound.
+std::shared_ptr<glimpse::StunServer> stunServer(int fd) {
+  auto port = envSize("GLIMPSE_STUN_PORT", 0);
+  if (port == 0 or port > UINT16_MAX) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return nullptr;
+  }
+  glimpse::StunServerOptions options;
+  options.port = static_cast<uint16_t>(port);
+  options.batchSize = std::max<std::size_t>(
+      1, envSize("GLIMPSE_STUN_BATCH", options.batchSize));
+  return std::make_shared<glimpse::StunServer>(options, fd);
+}
+
+// Media relay, off unless GLIMPSE_RELAY_HOST is set. Throws MediaRelayError
+// if the port range is invalid.
+std::shared_ptr<glimpse::MediaRelay> mediaRelay() {
+  const char* host = std::getenv("GLIMPSE_RELAY_HOST");
+  if (host == nullptr or *host == '\0') {
+    return nullptr;
+  }
+  glimpse::MediaRelayOptions options;
+  options.host = host;
+  options.minPort = static_cast<uint16_t>(std::min<std::size_t>(
+      UINT16_MAX, envSize("GLIMPSE_RELAY_MIN_PORT", options.minPort)));
+  options.maxPort = static_cast<uint16_t>(std::min<std::size_t>(
+      UINT16_MAX, envSize("GLIMPSE_RELAY_MAX_PORT", options.maxPort)));
+  options.threads = std::max<std::size_t>(
+      1, envSize("GLIMPSE_RELAY_THREADS", options.threads));
+  options.batchSize = std::max<std::size_t>(
+      1, envSize("GLIMPSE_RELAY_BATCH", options.batchSize));
+  options.roomByteRate = envSize("GLIMPSE_RELAY_ROOM_KBPS", 0) * 1000 / 8;
+  return std::make_shared<glimpse::MediaRelay>(options);
+}
+
+// Hot restart, off unless GLIMPSE_HANDOFF_SOCKET is set: the path of the
+// Unix socket a new process asks this one to hand over through
+std::optional<std::string> handoffPath() {
+  const char* path = std::getenv("GLIMPSE_HANDOFF_SOCKET");
+  if (path == nullptr or *path == '\0') {
+    return std::nullopt;
+  }
+  return path;
+}
+
+glimpse::logging::LoggingOptions loggingOptions() {
+  glimpse::logging::LoggingOptions options;
+  options.queueSize = std::max<std::size_t>(
+      1, envSize("GLIMPSE_LOG_QUEUE_SIZE", options.queueSize));
+  return options;
+}
+
+int main() {
+  glimpse::logging::initAsync(loggingOptions());
+
+  std::shared_ptr<const glimpse::HashRing> ring;
+  try {
+    ring = clusterRing();
+  } catch (const std::exception& e) {
+    spdlog::critical("Invalid cluster configuration: {}", e.what());
+    glimpse::logging::shutdown();
+    return 1;
+  }
+
+  auto port = static_cast<int>(envSize("GLIMPSE_PORT", 8080));
+  auto threadCount = eventLoopThreadCount();
+  auto wsManager = std::make_shared<glimpse::WsManager>(
+      threadCount, wsCompressionOptions(), resumeOptions());
+
+  // Takes the sockets and rooms of the running process if there is one,
+  // before anything binds the ports it holds or reads the room state it
+  // wrote out. It carries on until confirmHandoff() below.
+  auto hotRestart = handoffPath();
+  std::optional<glimpse::Handoff> handoff;
+  std::unique_ptr<glimpse::Acceptor> acceptor;
+  if (hotRestart) {
+    if (ring) {
+      spdlog::critical("Hot restart is not supported in a cluster");
+      glimpse::logging::shutdown();
+      return 1;
+    }
+    try {
+      handoff = glimpse::takeOver(*hotRestart, threadCount);
+      acceptor = std::make_unique<glimpse::Acceptor>(
+          handoff ? handoff->listenFd : glimpse::listenTcp(port), threadCount);
+    } catch (const std::exception& e) {
+      spdlog::critical("Could not take over: {}", e.what());
+      glimpse::logging::shutdown();
+      return 1;
+    }
+  }
+
+  auto store = roomStore(threadCount);
+  std::shared_ptr<glimpse::MediaRelay> relay;
+  try {
+    relay = mediaRelay();
+  } catch (const std::exception& e) {
+    spdlog::critical("Could not start the media relay: {}", e.what());
+    glimpse::logging::shutdown();
+    return 1;
+  }
+  auto router = std::make_shared<glimpse::ShardRouter>(
+      threadCount, wsManager, roomManagerOptions(ring, relay), store);
+  std::shared_ptr<glimpse::Cluster> cluster;
+  if (ring) {
+    try {
+      cluster = std::make_shared<glimpse::Cluster>(
+          ring, glimpse::NodeBusOptions(), wsManager, router);
+    } catch (const std::exception& e) {
+      spdlog::critical("Could not join the cluster: {}", e.what());
+      glimpse::logging::shutdown();
+      return 1;
+    }
+    wsManager->attachCluster(cluster.get());
+  }
+  std::shared_ptr<glimpse::StunServer> stun;
+  try {
+    stun = stunServer(handoff ? handoff->stunFd : -1);
+  } catch (const std::exception& e) {
+    spdlog::critical("Could not start the STUN server: {}", e.what());
+    glimpse::logging::shutdown();
+    return 1;
+  }
+  if (store) {
+    try {
+      router->restore(store->load());
+    } catch (const std::exception& e) {
+      spdlog::critical("Could not load the room state: {}", e.what());
+      glimpse::logging::shutdown();
+      return 1;
+    }
+  } else if (handoff) {
+    // With a store they are read from it instead, the old process flushed
+    // it before letting go
+    router->restore(std::move(handoff->rooms));
+  }
+  // Nothing fails from here on, the running process can let go
+  if (handoff) {
+    try {
+      glimpse::confirmHandoff(*handoff);
+    } catch (const std::exception& e) {
+      spdlog::critical("Could not take over: {}", e.what());
+      glimpse::logging::shutdown();
+      return 1;
+    }
+    spdlog::info("Took over from the running process");
+  }
+  if (store) {
+    store->start();
+  }
+
+  auto admission = admissionOptions();
+  bool debugRoutes = envSize("GLIMPSE_DEBUG_ROUTES", 0) != 0;
+  // All loops must be attached before any of them can forward work to another
+  std::latch attached(threadCount);
+  std::vector<std::thread> threads;
+  for (std::size_t shard = 0; shard < threadCount; ++shard) {
+    threads.emplace_back([shard, port, wsManager, router, cluster, stun, relay,
+                          debugRoutes, &admission, &attached,
+                          acceptor = acceptor.get()]() {
+      wsManager->attach(shard);
+      router->attach(shard);
+      attached.arrive_and_wait();
+      runEventLoop(shard, port, wsManager, router, cluster, stun, relay,
+                   admission, debugRoutes, acceptor);
+    });
+  }
+  if (stun) {
+    stun->start();
+  }
+  if (relay) {
+    relay->start();
+  }
+  // Frames from other nodes are handed to the loops
+  if (cluster) {
+    attached.wait();
+    cluster->start();
+  }
+
+  std::unique_ptr<glimpse::HandoffServer> handoffServer;
+  if (acceptor) {
+    acceptor->start();
+    glimpse::HandoffCallbacks callbacks = {
+        .release =
+            [acceptor = acceptor.get(), router, store]() {
+              acceptor->stop();
+              auto rooms = router->freeze();
+              if (store) {
+                store->stop();
+              }
+              return rooms;
+            },
+        .resume =
+            [acceptor = acceptor.get(), router, store]() {
+              if (store) {
+                store->restart();
+              }
+              router->thaw();
+              acceptor->start();
+            },
+        .handedOver =
+            [stun]() {
+              if (stun) {
+                stun->stop();
+              }
+            },
+    };
+    try {
+      handoffServer = std::make_unique<glimpse::HandoffServer>(
+          *hotRestart, acceptor->fd(), stun ? stun->fd() : -1,
+          std::move(callbacks));
+    } catch (const std::exception& e) {
+      spdlog::error("Could not serve hot restarts: {}", e.what());
+    }
+  }
+  if (handoffServer) {
+    // Once a new process took over, this one closes its sessions over the
+    // drain window and ends as soon as every loop closed its last ones
+    handoffServer->wait();
+    auto window = std::chrono::seconds(envSize("GLIMPSE_DRAIN_SECONDS", 30));
+    router->drain(window);
+    spdlog::info("Drained, shutting down");
+    acceptor->close();
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (stun) {
+    stun->stop();
+  }
+  if (relay) {
+    relay->stop();
+  }
+  if (cluster) {
+    cluster->stop();
+  }
+  if (store) {
+    store->stop();
+  }
+  glimpse::logging::shutdown();
 }
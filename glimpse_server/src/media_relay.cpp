@@ -0,0 +1,586 @@
+#include "media_relay.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <spdlog/spdlog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#include "logging.h"
+#include "metrics.h"
+#include "stun_server.h"
+
+namespace glimpse {
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Larger packets are truncated and dropped. WebRTC keeps its packets below
+// the usual MTU.
+constexpr std::size_t PACKET_SIZE = 1500;
+constexpr int MAX_EVENTS = 64;
+
+logging::RateLimit socketErrorLog;
+
+bool sameAddress(const sockaddr_storage& a, const sockaddr_storage& b) {
+  if (a.ss_family != b.ss_family) {
+    return false;
+  }
+  if (a.ss_family == AF_INET6) {
+    const auto& a6 = reinterpret_cast<const sockaddr_in6&>(a);
+    const auto& b6 = reinterpret_cast<const sockaddr_in6&>(b);
+    return a6.sin6_port == b6.sin6_port and
+           std::memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof a6.sin6_addr) ==
+               0;
+  }
+  const auto& a4 = reinterpret_cast<const sockaddr_in&>(a);
+  const auto& b4 = reinterpret_cast<const sockaddr_in&>(b);
+  return a4.sin_port == b4.sin_port and
+         a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+}
+
+// Non-blocking UDP socket bound to `port`, dual-stack where IPv6 is
+// available, or -1
+int openSocket(uint16_t port) {
+  int family = AF_INET6;
+  int fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 and errno == EAFNOSUPPORT) {
+    family = AF_INET;
+    fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+
+  sockaddr_storage address{};
+  socklen_t addressSize = 0;
+  if (family == AF_INET6) {
+    int zero = 0;
+    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof zero);
+    auto& v6 = reinterpret_cast<sockaddr_in6&>(address);
+    v6.sin6_family = AF_INET6;
+    v6.sin6_addr = in6addr_any;
+    v6.sin6_port = htons(port);
+    addressSize = sizeof v6;
+  } else {
+    auto& v4 = reinterpret_cast<sockaddr_in&>(address);
+    v4.sin_family = AF_INET;
+    v4.sin_addr.s_addr = htonl(INADDR_ANY);
+    v4.sin_port = htons(port);
+    addressSize = sizeof v4;
+  }
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&address), addressSize) <
+      0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+}  // namespace
+
+struct MediaRelay::Session {
+  // Bytes relayed for one room and its share of the byte rate, only used by
+  // the worker running the room's sessions
+  struct Room {
+    std::size_t sessions = 0;
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t dropped = 0;
+    double tokens = 0;
+    Clock::time_point refilled{};
+  };
+
+  struct Side {
+    Session* session;
+    Side* other;
+    uint16_t port = 0;
+    int fd = -1;
+    // Binds the port to whoever sends it, see MediaRelay
+    std::string token{};
+    // Where this side sends from, none until it sent the token
+    sockaddr_storage address{};
+    socklen_t addressSize = 0;
+  };
+
+  Session(const Id& roomId) : roomId(roomId) {
+    sides[0] = {.session = this, .other = &sides[1]};
+    sides[1] = {.session = this, .other = &sides[0]};
+  }
+
+  ~Session() {
+    for (auto& side : sides) {
+      if (side.fd >= 0) {
+        ::close(side.fd);
+      }
+    }
+  }
+
+  Session(const Session&) = delete;
+  Session& operator=(const Session&) = delete;
+
+  Id roomId;
+  std::array<Side, 2> sides;
+  Room* room = nullptr;
+};
+
+class MediaRelay::Worker {
+ public:
+  Worker(MediaRelay& relay)
+      : relay_(relay),
+        batchSize_(std::max<std::size_t>(1, relay.options_.batchSize)),
+        byteRate_(static_cast<double>(relay.options_.roomByteRate)),
+        packetBuffer_(batchSize_ * PACKET_SIZE),
+        from_(batchSize_),
+        receiveVectors_(batchSize_),
+        sendVectors_(batchSize_),
+        received_(batchSize_),
+        sending_(batchSize_) {
+    epollFd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    wakeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event wake = {.events = EPOLLIN, .data = {.ptr = nullptr}};
+    ::epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &wake);
+
+    // Packet i of a batch is read into slot i and sent from there
+    for (std::size_t i = 0; i < batchSize_; ++i) {
+      receiveVectors_[i] = {.iov_base = &packetBuffer_[i * PACKET_SIZE],
+                            .iov_len = PACKET_SIZE};
+      received_[i].msg_hdr.msg_name = &from_[i];
+      received_[i].msg_hdr.msg_iov = &receiveVectors_[i];
+      received_[i].msg_hdr.msg_iovlen = 1;
+    }
+  }
+
+  ~Worker() {
+    stop();
+    ::close(epollFd_);
+    ::close(wakeFd_);
+  }
+
+  void start() {
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  void stop() {
+    stopping_.store(true);
+    wake();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  // Hands `session` to the worker thread, which relays it from then on
+  void add(std::unique_ptr<Session> session) {
+    {
+      std::lock_guard lock(mutex_);
+      commands_.push_back({.added = std::move(session), .removed = nullptr});
+    }
+    wake();
+  }
+
+  // The worker thread closes `session` and releases its ports
+  void remove(Session* session) {
+    {
+      std::lock_guard lock(mutex_);
+      commands_.push_back({.added = nullptr, .removed = session});
+    }
+    wake();
+  }
+
+  metrics::LocalCounter packets;
+  metrics::LocalCounter bytes;
+  metrics::LocalCounter dropped;
+  metrics::LocalCounter rejected;
+  metrics::LocalCounter batches;
+
+ private:
+  struct Command {
+    std::unique_ptr<Session> added;
+    Session* removed;
+  };
+
+  void wake() {
+    uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(wakeFd_, &one, sizeof one);
+  }
+
+  void run() {
+    std::array<epoll_event, MAX_EVENTS> events;
+    while (not stopping_.load()) {
+      auto count = ::epoll_wait(epollFd_, events.data(), MAX_EVENTS, -1);
+      if (count < 0) {
+        if (errno != EINTR) {
+          logging::limited(socketErrorLog, spdlog::level::err,
+                           "Relay epoll_wait failed: {}",
+                           std::strerror(errno));
+        }
+        continue;
+      }
+      auto now = Clock::now();
+      bool woken = false;
+      for (int i = 0; i < count; ++i) {
+        auto* side = static_cast<Session::Side*>(events[i].data.ptr);
+        if (side == nullptr) {
+          woken = true;
+        } else {
+          relay(*side, now);
+        }
+      }
+      // Only after the events, which may point into a removed session
+      if (woken) {
+        runCommands(now);
+      }
+    }
+  }
+
+  void runCommands(Clock::time_point now) {
+    uint64_t value;
+    [[maybe_unused]] auto got = ::read(wakeFd_, &value, sizeof value);
+    std::vector<Command> commands;
+    {
+      std::lock_guard lock(mutex_);
+      commands.swap(commands_);
+    }
+    for (auto& command : commands) {
+      if (command.added) {
+        attach(std::move(command.added), now);
+      } else {
+        detach(command.removed);
+      }
+    }
+  }
+
+  void attach(std::unique_ptr<Session> session, Clock::time_point now) {
+    auto& room = rooms_[session->roomId];
+    if (room.sessions++ == 0) {
+      room.tokens = byteRate_;
+      room.refilled = now;
+    }
+    session->room = &room;
+    for (auto& side : session->sides) {
+      epoll_event event = {.events = EPOLLIN, .data = {.ptr = &side}};
+      ::epoll_ctl(epollFd_, EPOLL_CTL_ADD, side.fd, &event);
+    }
+    sessions_.push_back(std::move(session));
+  }
+
+  void detach(Session* session) {
+    auto found = std::ranges::find(sessions_, session,
+                                   &std::unique_ptr<Session>::get);
+    if (found == sessions_.end()) {
+      return;
+    }
+    for (auto& side : session->sides) {
+      ::epoll_ctl(epollFd_, EPOLL_CTL_DEL, side.fd, nullptr);
+      ::close(side.fd);
+      side.fd = -1;
+      relay_.releasePort(side.port);
+    }
+    auto* room = session->room;
+    if (--room->sessions == 0) {
+      spdlog::info("Relayed {} packets, {} bytes for room {}, {} dropped",
+                   room->packets, room->bytes, session->roomId,
+                   room->dropped);
+      rooms_.erase(session->roomId);
+    }
+    std::swap(*found, sessions_.back());
+    sessions_.pop_back();
+  }
+
+  // Within the room's byte rate, a second's worth of bytes may be sent at
+  // once
+  bool spend(Session::Room& room, std::size_t size, Clock::time_point now) {
+    if (byteRate_ == 0) {
+      return true;
+    }
+    if (room.refilled != now) {
+      auto elapsed = std::chrono::duration<double>(now - room.refilled);
+      room.tokens =
+          std::min(byteRate_, room.tokens + elapsed.count() * byteRate_);
+      room.refilled = now;
+    }
+    if (room.tokens < static_cast<double>(size)) {
+      return false;
+    }
+    room.tokens -= static_cast<double>(size);
+    return true;
+  }
+
+  // Binds `side` to `from` if `packet` is a Binding request carrying the
+  // side's token, and answers it. Such packets are not relayed.
+  static bool bind(Session::Side& side, const char* packet, std::size_t size,
+                   const sockaddr_storage& from, socklen_t fromSize) {
+    if (stunUsernameOf(packet, size) != side.token) {
+      return false;
+    }
+    side.address = from;
+    side.addressSize = fromSize;
+    // Clients retransmit until answered, a lost answer is not retried here
+    std::array<char, STUN_MAX_RESPONSE_SIZE> answer;
+    auto answerSize = answerStunRequest(packet, size, from, answer.data());
+    if (answerSize > 0) {
+      ::sendto(side.fd, answer.data(), answerSize, MSG_DONTWAIT,
+               reinterpret_cast<const sockaddr*>(&from), fromSize);
+    }
+    return true;
+  }
+
+  // Forwards one batch of what `side` received. The socket stays readable
+  // if there is more, so that busy ports take turns with the others.
+  void relay(Session::Side& side, Clock::time_point now) {
+    for (std::size_t i = 0; i < batchSize_; ++i) {
+      received_[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+    }
+    auto result = ::recvmmsg(side.fd, received_.data(), batchSize_,
+                             MSG_DONTWAIT, nullptr);
+    if (result <= 0) {
+      if (result < 0 and errno != EAGAIN and errno != EINTR) {
+        logging::limited(socketErrorLog, spdlog::level::err,
+                         "Relay recvmmsg failed: {}", std::strerror(errno));
+      }
+      return;
+    }
+    auto count = static_cast<std::size_t>(result);
+    batches.add();
+
+    auto& room = *side.session->room;
+    auto& other = *side.other;
+    std::size_t sendCount = 0;
+    uint64_t refused = 0;
+    uint64_t skipped = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+      const auto& header = received_[i].msg_hdr;
+      std::size_t size = received_[i].msg_len;
+      const auto* packet =
+          static_cast<const char*>(receiveVectors_[i].iov_base);
+      if (not(header.msg_flags & MSG_TRUNC) and
+          bind(side, packet, size, from_[i], header.msg_namelen)) {
+        continue;
+      }
+      if (side.addressSize == 0 or not sameAddress(side.address, from_[i])) {
+        ++refused;
+        continue;
+      }
+      if (other.addressSize == 0 or (header.msg_flags & MSG_TRUNC) or
+          not spend(room, size, now)) {
+        ++skipped;
+        continue;
+      }
+      sendVectors_[sendCount] = {.iov_base = receiveVectors_[i].iov_base,
+                                 .iov_len = size};
+      auto& out = sending_[sendCount].msg_hdr;
+      out.msg_name = &other.address;
+      out.msg_namelen = other.addressSize;
+      out.msg_iov = &sendVectors_[sendCount];
+      out.msg_iovlen = 1;
+      ++sendCount;
+    }
+
+    // Media tolerates loss, what the socket cannot take is dropped
+    std::size_t sent = 0;
+    uint64_t sentBytes = 0;
+    while (sent < sendCount) {
+      auto result = ::sendmmsg(other.fd, &sending_[sent], sendCount - sent, 0);
+      if (result > 0) {
+        for (auto end = sent + static_cast<std::size_t>(result); sent < end;
+             ++sent) {
+          sentBytes += sending_[sent].msg_len;
+        }
+      } else if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        break;
+      } else if (errno != EINTR) {
+        logging::limited(socketErrorLog, spdlog::level::err,
+                         "Relay sendmmsg failed: {}", std::strerror(errno));
+        ++sent;
+        ++skipped;
+      }
+    }
+    skipped += sendCount - std::min(sent, sendCount);
+
+    room.packets += sent;
+    room.bytes += sentBytes;
+    room.dropped += skipped;
+    packets.add(sent);
+    bytes.add(sentBytes);
+    dropped.add(skipped);
+    rejected.add(refused);
+  }
+
+  MediaRelay& relay_;
+  std::size_t batchSize_;
+  double byteRate_;
+  int epollFd_ = -1;
+  int wakeFd_ = -1;
+  std::thread thread_;
+  std::atomic<bool> stopping_ = false;
+
+  std::mutex mutex_;
+  std::vector<Command> commands_;
+
+  // Only used by the worker thread
+  std::vector<std::unique_ptr<Session>> sessions_;
+  std::unordered_map<Id, Session::Room, IdHash> rooms_;
+  std::vector<char> packetBuffer_;
+  std::vector<sockaddr_storage> from_;
+  std::vector<iovec> receiveVectors_;
+  std::vector<iovec> sendVectors_;
+  std::vector<mmsghdr> received_;
+  std::vector<mmsghdr> sending_;
+};
+
+MediaRelay::MediaRelay(MediaRelayOptions options) : options_(options) {
+  if (options_.minPort == 0 or options_.minPort > options_.maxPort) {
+    throw MediaRelayError("invalid relay port range");
+  }
+  for (uint32_t port = options_.minPort; port <= options_.maxPort; ++port) {
+    freePorts_.push_back(static_cast<uint16_t>(port));
+  }
+  auto threads = std::max<std::size_t>(1, options_.threads);
+  for (std::size_t i = 0; i < threads; ++i) {
+    workers_.push_back(std::make_unique<Worker>(*this));
+  }
+}
+
+MediaRelay::~MediaRelay() { stop(); }
+
+void MediaRelay::start() {
+  spdlog::info("Media relay on UDP ports {}-{}, {} threads", options_.minPort,
+               options_.maxPort, workers_.size());
+  for (auto& worker : workers_) {
+    worker->start();
+  }
+}
+
+void MediaRelay::stop() {
+  for (auto& worker : workers_) {
+    worker->stop();
+  }
+}
+
+RelayPorts MediaRelay::open(const Id& roomId, const Id& userId,
+                            const Id& peerId) {
+  std::lock_guard lock(mutex_);
+  auto& open = sessions_[roomId];
+  for (const auto& existing : open) {
+    if (existing.userId == userId and existing.peerId == peerId) {
+      return existing.ports;
+    }
+    if (existing.userId == peerId and existing.peerId == userId) {
+      return {.port = existing.ports.peerPort,
+              .peerPort = existing.ports.port,
+              .token = existing.ports.peerToken,
+              .peerToken = existing.ports.token};
+    }
+  }
+
+  auto session = std::make_unique<Session>(roomId);
+  for (auto& side : session->sides) {
+    side.token = randomId().toString();
+    side.fd = bindPort(side.port);
+    if (side.fd < 0) {
+      for (auto& bound : session->sides) {
+        if (bound.fd >= 0) {
+          ::close(bound.fd);
+          bound.fd = -1;
+          freePorts_.push_back(bound.port);
+        }
+      }
+      if (open.empty()) {
+        sessions_.erase(roomId);
+      }
+      throw MediaRelayError("no relay port available");
+    }
+  }
+
+  // The user sends to the first side and is relayed from the second
+  RelayPorts ports = {.port = session->sides[0].port,
+                      .peerPort = session->sides[1].port,
+                      .token = session->sides[0].token,
+                      .peerToken = session->sides[1].token};
+  open.push_back({.userId = userId,
+                  .peerId = peerId,
+                  .ports = ports,
+                  .session = session.get()});
+  workerOf(roomId).add(std::move(session));
+  sessionCount_.fetch_add(1, std::memory_order_relaxed);
+  return ports;
+}
+
+void MediaRelay::closeParticipant(const Id& roomId, const Id& userId) {
+  close(roomId, userId);
+}
+
+void MediaRelay::closeRoom(const Id& roomId) { close(roomId, Id()); }
+
+void MediaRelay::close(const Id& roomId, const Id& userId) {
+  std::lock_guard lock(mutex_);
+  auto found = sessions_.find(roomId);
+  if (found == sessions_.end()) {
+    return;
+  }
+  auto& worker = workerOf(roomId);
+  std::erase_if(found->second, [&](const OpenSession& open) {
+    if (not userId.isNil() and open.userId != userId and
+        open.peerId != userId) {
+      return false;
+    }
+    worker.remove(open.session);
+    sessionCount_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  });
+  if (found->second.empty()) {
+    sessions_.erase(found);
+  }
+}
+
+MediaRelayStats MediaRelay::stats() const {
+  MediaRelayStats stats = {
+      .sessions = sessionCount_.load(std::memory_order_relaxed),
+      .packets = 0,
+      .bytes = 0,
+      .dropped = 0,
+      .rejected = 0,
+      .batches = 0,
+  };
+  for (const auto& worker : workers_) {
+    stats.packets += worker->packets.load();
+    stats.bytes += worker->bytes.load();
+    stats.dropped += worker->dropped.load();
+    stats.rejected += worker->rejected.load();
+    stats.batches += worker->batches.load();
+  }
+  return stats;
+}
+
+MediaRelay::Worker& MediaRelay::workerOf(const Id& roomId) {
+  return *workers_[IdHash()(roomId) % workers_.size()];
+}
+
+int MediaRelay::bindPort(uint16_t& port) {
+  // A port taken by another process goes to the back and is tried again
+  // later
+  for (auto tries = freePorts_.size(); tries > 0; --tries) {
+    port = freePorts_.front();
+    freePorts_.pop_front();
+    int fd = openSocket(port);
+    if (fd >= 0) {
+      return fd;
+    }
+    freePorts_.push_back(port);
+  }
+  return -1;
+}
+
+void MediaRelay::releasePort(uint16_t port) {
+  std::lock_guard lock(mutex_);
+  freePorts_.push_back(port);
+}
+}  // namespace glimpse
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "id.h"
+
+namespace glimpse {
+
+class MediaRelayError : public std::exception {
+ public:
+  MediaRelayError(const char* message) : msg_(message) {}
+
+  virtual const char* what() const noexcept override { return msg_; }
+
+ private:
+  const char* msg_;
+};
+
+struct MediaRelayOptions {
+  // Address the participants send their media to, given to them in
+  // RELAY_READY
+  std::string host;
+  // Relay ports, two per session
+  uint16_t minPort = 40000;
+  uint16_t maxPort = 40999;
+  std::size_t threads = 1;
+  // Packets read and forwarded per system call
+  std::size_t batchSize = 64;
+  // Bytes per second the sessions of one room may relay together, 0 for no
+  // limit. Packets over the limit are dropped.
+  uint64_t roomByteRate = 0;
+};
+
+// Totals since start
+struct MediaRelayStats {
+  // Open sessions
+  uint64_t sessions;
+  uint64_t packets;
+  uint64_t bytes;
+  // Packets dropped because the other side has not sent anything yet, or
+  // over the room's byte rate
+  uint64_t dropped;
+  // Packets from another address than the one the port is bound to, or
+  // sent before it was bound
+  uint64_t rejected;
+  // recvmmsg calls that returned packets
+  uint64_t batches;
+};
+
+// The relay ports of a session, one for each side, and the tokens that
+// bind them
+struct RelayPorts {
+  // Where the user who opened the session sends to reach the peer
+  uint16_t port;
+  // Where the peer sends to reach that user
+  uint16_t peerPort;
+  std::string token;
+  std::string peerToken;
+};
+
+// Forwards UDP media between two participants of a room who cannot reach
+// each other directly, e.g. both behind symmetric NATs.
+//
+// A session has a port for each side, and each side a random token that
+// only its participant is told. A port belongs to the address that last
+// sent it a STUN Binding request with the token as USERNAME, which is
+// answered like the STUN server would and not relayed. Packets from there
+// are sent on to the other side from the other port, which the other side
+// sees as its peer's address; packets from anyone else are rejected. A
+// side whose NAT binding changed sends the token again.
+//
+// Sessions run on a pool of threads, all the sessions of a room on the same
+// one so that the room's bytes are counted and limited without sharing.
+// Each thread waits on the ports of its sessions with epoll, reads the
+// packets of a port with recvmmsg into preallocated buffers and sends them
+// with one sendmmsg from where they were read: nothing is copied or
+// allocated per packet.
+class MediaRelay {
+ public:
+  // Throws MediaRelayError if the port range is empty
+  MediaRelay(MediaRelayOptions options);
+  ~MediaRelay();
+
+  MediaRelay(const MediaRelay&) = delete;
+  MediaRelay& operator=(const MediaRelay&) = delete;
+
+  void start();
+  void stop();
+
+  const std::string& host() const { return options_.host; }
+
+  // Opens a session between `userId` and `peerId` in `roomId`, or returns
+  // the ports of the one they already have. Throws MediaRelayError if no
+  // port can be bound.
+  RelayPorts open(const Id& roomId, const Id& userId, const Id& peerId);
+  // Closes the sessions of `userId` in `roomId`
+  void closeParticipant(const Id& roomId, const Id& userId);
+  // Closes every session of `roomId`. Its relayed bytes are logged once the
+  // last one is gone.
+  void closeRoom(const Id& roomId);
+
+  MediaRelayStats stats() const;
+
+ private:
+  class Worker;
+  struct Session;
+
+  struct OpenSession {
+    Id userId;
+    Id peerId;
+    RelayPorts ports;
+    Session* session;
+  };
+
+  Worker& workerOf(const Id& roomId);
+  // Binds a free port, returns its socket or -1
+  int bindPort(uint16_t& port);
+  // Called by the workers once a port is closed
+  void releasePort(uint16_t port);
+  void close(const Id& roomId, const Id& userId);
+
+  MediaRelayOptions options_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  std::mutex mutex_;
+  // Least recently closed first, so that late packets of a session do not
+  // reach the next one
+  std::deque<uint16_t> freePorts_;
+  std::unordered_map<Id, std::vector<OpenSession>, IdHash> sessions_;
+  std::atomic<uint64_t> sessionCount_ = 0;
+};
+}  // namespace glimpse
@@ -0,0 +1,345 @@
+#include "metrics.h"
+
+#include <fmt/format.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace glimpse::metrics {
+namespace {
+struct ThreadMetrics {
+  std::array<LocalCounter, MESSAGE_TYPE_COUNT> received;
+  std::array<LocalCounter, MESSAGE_TYPE_COUNT> sent;
+  std::array<std::array<LocalCounter, OPERATION_COUNT>, TRANSPORT_COUNT>
+      failed;
+  std::array<std::atomic<int64_t>, GAUGE_COUNT> gauges{};
+  std::array<LocalCounter, COUNTER_COUNT> counters;
+  std::array<std::array<LatencyHistogram, OPERATION_COUNT>, TRANSPORT_COUNT>
+      requests;
+  std::array<LatencyHistogram, LATENCY_COUNT> latencies;
+  std::array<LatencyHistogram, SETUP_PHASE_COUNT> setupPhases;
+};
+
+// Blocks are never freed, a scrape may still be reading one whose thread
+// has exited
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadMetrics>> threads;
+};
+
+Registry& registry() {
+  static Registry instance;
+  return instance;
+}
+
+ThreadMetrics& local() {
+  thread_local ThreadMetrics* metrics = []() {
+    auto& registry = metrics::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    return registry.threads.emplace_back(std::make_unique<ThreadMetrics>())
+        .get();
+  }();
+  return *metrics;
+}
+
+constexpr std::array<std::string_view, TRANSPORT_COUNT> TRANSPORT_NAMES = {
+    "http", "ws"};
+
+constexpr std::array<std::string_view, OPERATION_COUNT> OPERATION_NAMES = {
+    "create_room", "join_room", "approve_join_request", "deny_join_request",
+    "sdp",         "ice",       "end_room",             "open_relay"};
+
+constexpr std::array<std::string_view, SETUP_PHASE_COUNT> SETUP_PHASE_NAMES = {
+    "join_request", "approval",   "room_ready", "offer",
+    "answer",       "candidates", "total"};
+
+constexpr std::array<std::string_view, MESSAGE_TYPE_COUNT> MESSAGE_TYPE_NAMES =
+    {"ping",
+     "pong",
+     "error",
+     "request_join_room",
+     "allow_join_room",
+     "deny_join_room",
+     "room_ready",
+     "room_end",
+     "sdp",
+     "ice",
+     "join_room",
+     "approve_join_request",
+     "deny_join_request",
+     "end_room",
+     "response",
+     "ice_batch",
+     "participant_joined",
+     "participant_left",
+     "open_relay",
+     "relay_ready",
+     "session"};
+
+// Exported bucket bounds, 2^10 ns (about 1 us) to 2^36 ns (about 69 s) in
+// steps of four. Each is a bucket boundary of LatencyHistogram, so the
+// cumulative counts are exact.
+constexpr int EXPORTED_MIN_EXPONENT = 10;
+constexpr int EXPORTED_MAX_EXPONENT = 36;
+constexpr int EXPORTED_EXPONENT_STEP = 2;
+
+template <typename Fn>
+void forEachThread(Fn&& fn) {
+  auto& registry = metrics::registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  for (const auto& thread : registry.threads) {
+    fn(*thread);
+  }
+}
+
+void writeHeader(std::string& out, std::string_view name,
+                 std::string_view type, std::string_view help) {
+  fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name,
+                 help, name, type);
+}
+
+void writeHistogram(std::string& out, std::string_view name,
+                    std::string_view labels,
+                    const LatencyHistogram::Snapshot& snapshot) {
+  auto inserter = std::back_inserter(out);
+  auto separator = labels.empty() ? "" : ",";
+  uint64_t cumulative = 0;
+  std::size_t bucket = 0;
+  for (int exponent = EXPORTED_MIN_EXPONENT;
+       exponent <= EXPORTED_MAX_EXPONENT; exponent += EXPORTED_EXPONENT_STEP) {
+    for (auto end = LatencyHistogram::bucketsBelow(exponent); bucket < end;
+         ++bucket) {
+      cumulative += snapshot.buckets[bucket];
+    }
+    fmt::format_to(inserter, "{}_bucket{{{}{}le=\"{:g}\"}} {}\n", name,
+                   labels, separator,
+                   static_cast<double>(uint64_t{1} << exponent) / 1e9,
+                   cumulative);
+  }
+  for (; bucket < LatencyHistogram::BUCKET_COUNT; ++bucket) {
+    cumulative += snapshot.buckets[bucket];
+  }
+  // The count is derived from the buckets so that both agree within a scrape
+  fmt::format_to(inserter, "{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels,
+                 separator, cumulative);
+  if (labels.empty()) {
+    fmt::format_to(inserter, "{}_sum {:g}\n{}_count {}\n", name,
+                   static_cast<double>(snapshot.sumNanoseconds) / 1e9, name,
+                   cumulative);
+  } else {
+    fmt::format_to(inserter, "{}_sum{{{}}} {:g}\n{}_count{{{}}} {}\n", name,
+                   labels, static_cast<double>(snapshot.sumNanoseconds) / 1e9,
+                   name, labels, cumulative);
+  }
+}
+
+void writeMessageCounters(
+    std::string& out, std::string_view name, std::string_view help,
+    std::array<LocalCounter, MESSAGE_TYPE_COUNT> ThreadMetrics::*member) {
+  std::array<uint64_t, MESSAGE_TYPE_COUNT> totals{};
+  forEachThread([&](const ThreadMetrics& thread) {
+    for (std::size_t i = 0; i < MESSAGE_TYPE_COUNT; ++i) {
+      totals[i] += (thread.*member)[i].load();
+    }
+  });
+
+  writeHeader(out, name, "counter", help);
+  for (std::size_t i = 0; i < MESSAGE_TYPE_COUNT; ++i) {
+    fmt::format_to(std::back_inserter(out), "{}{{type=\"{}\"}} {}\n", name,
+                   MESSAGE_TYPE_NAMES[i], totals[i]);
+  }
+}
+}  // namespace
+
+void messageReceived(WsMessage::Type type) {
+  if (static_cast<std::size_t>(type) < MESSAGE_TYPE_COUNT) {
+    local().received[type].add();
+  }
+}
+
+void messageSent(WsMessage::Type type, uint64_t count) {
+  if (static_cast<std::size_t>(type) < MESSAGE_TYPE_COUNT) {
+    local().sent[type].add(count);
+  }
+}
+
+void requestFailed(Transport transport, Operation operation) {
+  local().failed[std::size_t(transport)][std::size_t(operation)].add();
+}
+
+void recordRequest(Transport transport, Operation operation,
+                   Clock::duration duration) {
+  local()
+      .requests[std::size_t(transport)][std::size_t(operation)]
+      .record(duration);
+}
+
+void record(Latency latency, Clock::duration duration) {
+  local().latencies[std::size_t(latency)].record(duration);
+}
+
+void recordSetupPhase(SetupPhase phase, Clock::duration duration) {
+  local().setupPhases[std::size_t(phase)].record(duration);
+}
+
+std::string_view setupPhaseName(SetupPhase phase) {
+  return SETUP_PHASE_NAMES[std::size_t(phase)];
+}
+
+void add(Counter counter, uint64_t n) {
+  local().counters[std::size_t(counter)].add(n);
+}
+
+void setGauge(Gauge gauge, int64_t value) {
+  local().gauges[std::size_t(gauge)].store(value, std::memory_order_relaxed);
+}
+
+void addGauge(Gauge gauge, int64_t delta) {
+  auto& value = local().gauges[std::size_t(gauge)];
+  value.store(value.load(std::memory_order_relaxed) + delta,
+              std::memory_order_relaxed);
+}
+
+void writePrometheus(std::string& out) {
+  writeMessageCounters(out, "glimpse_ws_messages_received_total",
+                       "WebSocket messages received, by type",
+                       &ThreadMetrics::received);
+  writeMessageCounters(out, "glimpse_ws_messages_sent_total",
+                       "WebSocket messages written to sockets, by type",
+                       &ThreadMetrics::sent);
+
+  std::array<std::array<uint64_t, OPERATION_COUNT>, TRANSPORT_COUNT> failed{};
+  std::array<std::array<LatencyHistogram::Snapshot, OPERATION_COUNT>,
+             TRANSPORT_COUNT>
+      requests{};
+  std::array<LatencyHistogram::Snapshot, LATENCY_COUNT> latencies{};
+  std::array<LatencyHistogram::Snapshot, SETUP_PHASE_COUNT> setupPhases{};
+  std::array<int64_t, GAUGE_COUNT> gauges{};
+  std::array<uint64_t, COUNTER_COUNT> counters{};
+  forEachThread([&](const ThreadMetrics& thread) {
+    for (std::size_t t = 0; t < TRANSPORT_COUNT; ++t) {
+      for (std::size_t o = 0; o < OPERATION_COUNT; ++o) {
+        failed[t][o] += thread.failed[t][o].load();
+        thread.requests[t][o].addTo(requests[t][o]);
+      }
+    }
+    for (std::size_t i = 0; i < LATENCY_COUNT; ++i) {
+      thread.latencies[i].addTo(latencies[i]);
+    }
+    for (std::size_t i = 0; i < SETUP_PHASE_COUNT; ++i) {
+      thread.setupPhases[i].addTo(setupPhases[i]);
+    }
+    for (std::size_t i = 0; i < GAUGE_COUNT; ++i) {
+      gauges[i] += thread.gauges[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < COUNTER_COUNT; ++i) {
+      counters[i] += thread.counters[i].load();
+    }
+  });
+
+  auto inserter = std::back_inserter(out);
+  writeHeader(out, "glimpse_request_failures_total", "counter",
+              "Signaling requests answered with an error");
+  for (std::size_t t = 0; t < TRANSPORT_COUNT; ++t) {
+    for (std::size_t o = 0; o < OPERATION_COUNT; ++o) {
+      fmt::format_to(
+          inserter,
+          "glimpse_request_failures_total{{transport=\"{}\",operation=\"{}\"}} "
+          "{}\n",
+          TRANSPORT_NAMES[t], OPERATION_NAMES[o], failed[t][o]);
+    }
+  }
+
+  writeHeader(out, "glimpse_request_duration_seconds", "histogram",
+              "Time to answer signaling requests");
+  for (std::size_t t = 0; t < TRANSPORT_COUNT; ++t) {
+    for (std::size_t o = 0; o < OPERATION_COUNT; ++o) {
+      auto labels = fmt::format("transport=\"{}\",operation=\"{}\"",
+                                TRANSPORT_NAMES[t], OPERATION_NAMES[o]);
+      writeHistogram(out, "glimpse_request_duration_seconds", labels,
+                     requests[t][o]);
+    }
+  }
+
+  constexpr std::array<std::array<std::string_view, 2>, LATENCY_COUNT>
+      LATENCIES = {{
+          {"glimpse_ws_send_duration_seconds",
+           "WsManager::sendMessage, lookup to write or hand-off"},
+          {"glimpse_json_parse_duration_seconds",
+           "Parsing of request envelopes and payloads"},
+          {"glimpse_json_serialize_duration_seconds",
+           "Encoding of outgoing frames and response bodies"},
+          {"glimpse_ws_compress_duration_seconds",
+           "Writes of compressed frames, deflate included"},
+      }};
+  for (std::size_t i = 0; i < LATENCY_COUNT; ++i) {
+    auto [name, help] = LATENCIES[i];
+    writeHeader(out, name, "histogram", help);
+    writeHistogram(out, name, "", latencies[i]);
+  }
+
+  writeHeader(out, "glimpse_call_setup_phase_seconds", "histogram",
+              "Phases of call setups, from room creation to the last "
+              "candidate after the answer");
+  for (std::size_t i = 0; i < SETUP_PHASE_COUNT; ++i) {
+    auto labels = fmt::format("phase=\"{}\"", SETUP_PHASE_NAMES[i]);
+    writeHistogram(out, "glimpse_call_setup_phase_seconds", labels,
+                   setupPhases[i]);
+  }
+
+  constexpr std::array<std::array<std::string_view, 2>, GAUGE_COUNT> GAUGES =
+      {{
+          {"glimpse_rooms", "Open rooms"},
+          {"glimpse_join_requests", "Join requests waiting for the host"},
+          {"glimpse_ws_connections", "Open WebSocket connections"},
+      }};
+  for (std::size_t i = 0; i < GAUGE_COUNT; ++i) {
+    auto [name, help] = GAUGES[i];
+    writePrometheusSample(out, name, "gauge", help,
+                          static_cast<double>(gauges[i]));
+  }
+
+  constexpr std::array<std::array<std::string_view, 2>, COUNTER_COUNT>
+      COUNTERS = {{
+          {"glimpse_ws_compressed_frames_total",
+           "Frames sent with permessage-deflate"},
+          {"glimpse_ws_compressed_bytes_total",
+           "Size of the compressed frames before compression"},
+          {"glimpse_ws_compression_sampled_bytes_total",
+           "Size of the frames deflated to measure the ratio"},
+          {"glimpse_ws_compression_sampled_deflated_bytes_total",
+           "Size of the frames deflated to measure the ratio, once deflated"},
+          {"glimpse_throttled_by_address_total",
+           "Requests and upgrades over the rate limit of their address"},
+          {"glimpse_throttled_by_user_total",
+           "Requests and upgrades over the rate limit of their user"},
+          {"glimpse_ws_resumed_sessions_total",
+           "Sessions resumed by a reconnecting client"},
+          {"glimpse_ws_replayed_frames_total",
+           "Frames sent again to resumed sessions"},
+          {"glimpse_ws_failed_resumes_total",
+           "Resumes refused, the client had to start a new session"},
+      }};
+  for (std::size_t i = 0; i < COUNTER_COUNT; ++i) {
+    auto [name, help] = COUNTERS[i];
+    writePrometheusSample(out, name, "counter", help,
+                          static_cast<double>(counters[i]));
+  }
+  auto sampled = static_cast<double>(counters[std::size_t(
+      Counter::SAMPLED_BYTES)]);
+  auto deflated = static_cast<double>(counters[std::size_t(
+      Counter::SAMPLED_DEFLATED_BYTES)]);
+  writePrometheusSample(
+      out, "glimpse_ws_compression_ratio", "gauge",
+      "Size of the sampled frames over their deflated size, 0 before any",
+      deflated > 0 ? sampled / deflated : 0.0);
+}
+
+void writePrometheusSample(std::string& out, std::string_view name,
+                           std::string_view type, std::string_view help,
+                           double value) {
+  writeHeader(out, name, type, help);
+  fmt::format_to(std::back_inserter(out), "{} {}\n", name, value);
+}
+}  // namespace glimpse::metrics
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "ws_message.h"
+
+namespace glimpse::metrics {
+
+// Every thread records into its own block of counters and histograms, each
+// with a single writer: recording is a relaxed load and store, no lock and
+// no contended cache line. A scrape sums the blocks of all threads with
+// relaxed loads while the event loops keep running, so totals may be a few
+// events behind but never torn.
+
+using Clock = std::chrono::steady_clock;
+
+enum class Transport : std::size_t { HTTP, WS, COUNT };
+
+// Signaling operations, the label of the per-request metrics
+enum class Operation : std::size_t {
+  CREATE_ROOM,
+  JOIN_ROOM,
+  APPROVE_JOIN_REQUEST,
+  DENY_JOIN_REQUEST,
+  SDP,
+  ICE,
+  END_ROOM,
+  OPEN_RELAY,
+  COUNT,
+};
+
+enum class Latency : std::size_t {
+  // WsManager::sendMessage() and sendMessageIfOnline(), lookup to write or
+  // hand-off to the owner loop
+  WS_SEND,
+  // Request envelopes and payloads
+  JSON_PARSE,
+  // Outgoing frames and HTTP response bodies
+  JSON_SERIALIZE,
+  // Writes of frames sent with permessage-deflate, deflate included
+  WS_COMPRESS,
+  COUNT,
+};
+
+// Phases of setting up a call, between the events of a CallTimeline
+enum class SetupPhase : std::size_t {
+  // Room created until a guest asks to join
+  JOIN_REQUEST,
+  // Join request until the host approves it
+  APPROVAL,
+  // Approval until ROOM_READY is sent, the server's own share
+  ROOM_READY,
+  // ROOM_READY until the first SDP offer
+  OFFER,
+  // Offer until the other side's answer
+  ANSWER,
+  // Answer until the last candidate trickled after it
+  CANDIDATES,
+  // Join request until the answer and the candidates after it
+  TOTAL,
+  COUNT,
+};
+
+// Values owned by one thread, the exported gauge is the sum over threads
+enum class Gauge : std::size_t {
+  ROOMS,
+  JOIN_REQUESTS,
+  WS_CONNECTIONS,
+  COUNT,
+};
+
+// Totals since start, summed over threads
+enum class Counter : std::size_t {
+  // Frames sent with permessage-deflate and their size before compression
+  COMPRESSED_FRAMES,
+  COMPRESSED_BYTES,
+  // Frames deflated a second time to measure the ratio, see
+  // sampleCompression(), before and after
+  SAMPLED_BYTES,
+  SAMPLED_DEFLATED_BYTES,
+  // Requests and WebSocket upgrades turned away by Admission
+  THROTTLED_BY_ADDRESS,
+  THROTTLED_BY_USER,
+  // Sessions resumed with their token, the frames replayed to them, and
+  // resumes refused because the session expired or its frames were evicted
+  RESUMED_SESSIONS,
+  REPLAYED_FRAMES,
+  FAILED_RESUMES,
+  COUNT,
+};
+
+constexpr std::size_t TRANSPORT_COUNT = std::size_t(Transport::COUNT);
+constexpr std::size_t OPERATION_COUNT = std::size_t(Operation::COUNT);
+constexpr std::size_t LATENCY_COUNT = std::size_t(Latency::COUNT);
+constexpr std::size_t SETUP_PHASE_COUNT = std::size_t(SetupPhase::COUNT);
+constexpr std::size_t GAUGE_COUNT = std::size_t(Gauge::COUNT);
+constexpr std::size_t COUNTER_COUNT = std::size_t(Counter::COUNT);
+constexpr std::size_t MESSAGE_TYPE_COUNT = WsMessage::SESSION + 1;
+
+// Counter with a single writer, readable from any thread
+class LocalCounter {
+ public:
+  void add(uint64_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+  uint64_t load() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_{0};
+};
+
+// Log-linear histogram of nanosecond durations in the manner of HDR
+// histograms: 8 buckets per power of two, so any recorded value is known
+// within 12.5%, from 1 ns up to about 137 s. Single writer.
+class LatencyHistogram {
+ public:
+  static constexpr int SUB_BITS = 3;
+  static constexpr uint64_t SUB_COUNT = 1 << SUB_BITS;
+  static constexpr int MAX_EXPONENT = 37;
+  static constexpr uint64_t MAX_VALUE = (uint64_t{1} << MAX_EXPONENT) - 1;
+  static constexpr std::size_t BUCKET_COUNT =
+      SUB_COUNT * (MAX_EXPONENT - SUB_BITS + 1);
+
+  struct Snapshot {
+    std::array<uint64_t, BUCKET_COUNT> buckets{};
+    uint64_t sumNanoseconds = 0;
+  };
+
+  static std::size_t bucketOf(uint64_t nanoseconds) {
+    auto value = std::min(nanoseconds, MAX_VALUE);
+    auto width = static_cast<int>(std::bit_width(value));
+    auto shift = std::max(0, width - SUB_BITS - 1);
+    return SUB_COUNT * shift + (value >> shift);
+  }
+
+  // Number of buckets holding only values below 2^`exponent` ns
+  static constexpr std::size_t bucketsBelow(int exponent) {
+    return exponent <= SUB_BITS + 1 ? std::size_t{1} << exponent
+                                    : SUB_COUNT * (exponent - SUB_BITS + 1);
+  }
+
+  void record(Clock::duration duration) {
+    auto nanoseconds = static_cast<uint64_t>(std::max<int64_t>(
+        0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+               .count()));
+    buckets_[bucketOf(nanoseconds)].add();
+    sum_.add(nanoseconds);
+  }
+
+  void addTo(Snapshot& snapshot) const {
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+      snapshot.buckets[i] += buckets_[i].load();
+    }
+    snapshot.sumNanoseconds += sum_.load();
+  }
+
+ private:
+  std::array<LocalCounter, BUCKET_COUNT> buckets_;
+  LocalCounter sum_;
+};
+
+void messageReceived(WsMessage::Type type);
+// `count` recipients of one published message
+void messageSent(WsMessage::Type type, uint64_t count = 1);
+void requestFailed(Transport transport, Operation operation);
+void recordRequest(Transport transport, Operation operation,
+                   Clock::duration duration);
+void record(Latency latency, Clock::duration duration);
+void recordSetupPhase(SetupPhase phase, Clock::duration duration);
+void add(Counter counter, uint64_t n = 1);
+void setGauge(Gauge gauge, int64_t value);
+void addGauge(Gauge gauge, int64_t delta);
+
+// Records the time until it goes out of scope
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Latency latency)
+      : latency_(latency), start_(Clock::now()) {}
+  ~ScopedTimer() { record(latency_, Clock::now() - start_); }
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+ private:
+  Latency latency_;
+  Clock::time_point start_;
+};
+
+// Label of a setup phase, e.g. "approval"
+std::string_view setupPhaseName(SetupPhase phase);
+
+// Appends every metric above in the Prometheus text format
+void writePrometheus(std::string& out);
+
+// Appends a metric without labels, for values kept outside this module
+void writePrometheusSample(std::string& out, std::string_view name,
+                           std::string_view type, std::string_view help,
+                           double value);
+}  // namespace glimpse::metrics
@@ -0,0 +1,459 @@
+#include "node_bus.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <spdlog/spdlog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <string_view>
+#include <utility>
+
+#include "logging.h"
+#include "wire.h"
+
+namespace glimpse {
+namespace {
+// Sent first on every link: magic, member list fingerprint, node index
+constexpr std::string_view HELLO_MAGIC = "GLBUS001";
+constexpr std::size_t HELLO_SIZE = 20;
+// Anything larger means the stream is corrupt
+constexpr uint32_t MAX_FRAME_SIZE = 64 << 20;
+constexpr std::size_t READ_SIZE = 64 * 1024;
+
+// What an epoll event is about, in the upper half of its data
+enum Tag : uint64_t { WAKE = 1, LISTEN, LINK, INBOUND };
+
+uint64_t tagOf(Tag kind, uint64_t index) { return kind << 32 | index; }
+
+// A node that is down fails a connection attempt every reconnectInterval
+logging::RateLimit linkErrorLog{5, std::chrono::seconds(10)};
+}  // namespace
+
+NodeBus::Address NodeBus::resolve(const std::string& member, bool passive) {
+  auto colon = member.rfind(':');
+  if (colon == std::string::npos) {
+    spdlog::error("Cluster member {} is not host:port", member);
+    throw NodeBusError("invalid cluster member");
+  }
+  auto host = member.substr(0, colon);
+  auto port = member.substr(colon + 1);
+  if (host.size() >= 2 and host.front() == '[' and host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+
+  addrinfo hints{};
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  addrinfo* result = nullptr;
+  auto error = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (error != 0 or result == nullptr) {
+    spdlog::error("Could not resolve cluster member {}: {}", member,
+                  ::gai_strerror(error));
+    throw NodeBusError("invalid cluster member");
+  }
+  Address address{};
+  std::memcpy(&address.storage, result->ai_addr, result->ai_addrlen);
+  address.length = result->ai_addrlen;
+  ::freeaddrinfo(result);
+  return address;
+}
+
+NodeBus::NodeBus(std::shared_ptr<const HashRing> members,
+                 NodeBusOptions options, NodeBusHandler handler)
+    : members_(std::move(members)),
+      options_(options),
+      handler_(std::move(handler)) {
+  auto self = members_->self();
+  for (std::size_t node = 0; node < members_->size(); ++node) {
+    addresses_.push_back(resolve(members_->member(node), node == self));
+    links_.push_back(std::make_unique<Link>());
+  }
+
+  const auto& address = addresses_[self];
+  listenFd_ = ::socket(address.storage.ss_family,
+                       SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int one = 1;
+  if (listenFd_ < 0 or
+      ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) <
+          0 or
+      ::bind(listenFd_, reinterpret_cast<const sockaddr*>(&address.storage),
+             address.length) < 0 or
+      ::listen(listenFd_, SOMAXCONN) < 0) {
+    auto error = errno;
+    spdlog::error("Could not listen on {}: {}", members_->member(self),
+                  std::strerror(error));
+    if (listenFd_ >= 0) {
+      ::close(listenFd_);
+    }
+    throw NodeBusError("could not listen for cluster links");
+  }
+
+  wakeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  epollFd_ = ::epoll_create1(EPOLL_CLOEXEC);
+  watch(wakeFd_, EPOLLIN, tagOf(WAKE, 0));
+  watch(listenFd_, EPOLLIN, tagOf(LISTEN, 0));
+}
+
+NodeBus::~NodeBus() {
+  stop();
+  for (auto& link : links_) {
+    if (link->fd >= 0) {
+      ::close(link->fd);
+    }
+  }
+  for (auto& [fd, inbound] : inbound_) {
+    ::close(fd);
+  }
+  ::close(listenFd_);
+  ::close(wakeFd_);
+  ::close(epollFd_);
+}
+
+void NodeBus::start() { thread_ = std::thread([this]() { run(); }); }
+
+void NodeBus::stop() {
+  stopping_.store(true);
+  uint64_t one = 1;
+  [[maybe_unused]] auto written = ::write(wakeFd_, &one, sizeof one);
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+NodeBusStats NodeBus::stats() const {
+  return {
+      .connectedLinks = connectedLinks_.load(std::memory_order_relaxed),
+      .framesSent = framesSent_.load(std::memory_order_relaxed),
+      .bytesSent = bytesSent_.load(std::memory_order_relaxed),
+      .writes = writes_.load(std::memory_order_relaxed),
+      .framesReceived = framesReceived_.load(std::memory_order_relaxed),
+      .droppedFrames = droppedFrames_.load(std::memory_order_relaxed),
+  };
+}
+
+void NodeBus::wake() {
+  if (not woken_.exchange(true)) {
+    uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(wakeFd_, &one, sizeof one);
+  }
+}
+
+void NodeBus::watch(int fd, uint32_t events, uint64_t tag, bool modify) {
+  epoll_event event{};
+  event.events = events;
+  event.data.u64 = tag;
+  ::epoll_ctl(epollFd_, modify ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+}
+
+void NodeBus::run() {
+  std::array<epoll_event, 64> events;
+  while (not stopping_.load()) {
+    auto now = std::chrono::steady_clock::now();
+    bool anyDown = false;
+    for (std::size_t node = 0; node < links_.size(); ++node) {
+      auto& link = *links_[node];
+      if (node == members_->self() or link.fd >= 0) {
+        continue;
+      }
+      if (now >= link.retryAt) {
+        connect(node);
+      }
+      anyDown = anyDown or link.fd < 0;
+    }
+
+    auto timeout =
+        anyDown ? static_cast<int>(options_.reconnectInterval.count()) : -1;
+    auto count = ::epoll_wait(epollFd_, events.data(),
+                              static_cast<int>(events.size()), timeout);
+    for (int i = 0; i < count; ++i) {
+      auto tag = events[i].data.u64;
+      auto index = tag & UINT32_MAX;
+      auto flags = events[i].events;
+      switch (tag >> 32) {
+        case WAKE: {
+          uint64_t value = 0;
+          [[maybe_unused]] auto read = ::read(wakeFd_, &value, sizeof value);
+          // Frames queued from here on wake the thread again
+          woken_.store(false);
+          for (std::size_t node = 0; node < links_.size(); ++node) {
+            if (links_[node]->fd >= 0 and not links_[node]->connecting) {
+              flush(node);
+            }
+          }
+          break;
+        }
+        case LISTEN:
+          accept();
+          break;
+        case LINK: {
+          auto& link = *links_[index];
+          if (link.fd < 0) {
+            break;
+          }
+          if (link.connecting) {
+            int error = 0;
+            socklen_t length = sizeof error;
+            ::getsockopt(link.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error == 0 and not(flags & (EPOLLERR | EPOLLHUP))) {
+              established(index);
+              break;
+            }
+            logging::limited(linkErrorLog, spdlog::level::warn,
+                             "Could not connect to cluster node {} ({}): {}",
+                             index, members_->member(index),
+                             std::strerror(error));
+            closeLink(index);
+            break;
+          }
+          // Nothing is ever sent back on a link, readable means closed
+          if (flags & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            closeLink(index);
+          } else if (flags & EPOLLOUT) {
+            flush(index);
+          }
+          break;
+        }
+        case INBOUND:
+          receive(static_cast<int>(index));
+          break;
+      }
+    }
+  }
+}
+
+void NodeBus::connect(std::size_t node) {
+  auto& link = *links_[node];
+  const auto& address = addresses_[node];
+  link.retryAt = std::chrono::steady_clock::now() + options_.reconnectInterval;
+  int fd = ::socket(address.storage.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return;
+  }
+  // Frames are batched here already, Nagle would only delay them
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(&address.storage),
+                address.length) < 0 and
+      errno != EINPROGRESS) {
+    ::close(fd);
+    return;
+  }
+  link.fd = fd;
+  link.connecting = true;
+  watch(fd, EPOLLOUT, tagOf(LINK, node));
+}
+
+void NodeBus::established(std::size_t node) {
+  auto& link = *links_[node];
+  link.connecting = false;
+  watch(link.fd, EPOLLIN, tagOf(LINK, node), true);
+
+  link.writing.assign(HELLO_MAGIC);
+  wire::put(link.writing, members_->fingerprint());
+  wire::put(link.writing, static_cast<uint32_t>(members_->self()));
+  link.written = 0;
+  {
+    // Nothing can be queued between the greeting and the link going up
+    std::lock_guard lock(link.mutex);
+    link.pending.clear();
+    handler_.greet(node, link.pending);
+    link.connected = true;
+    ++link.generation;
+  }
+  connectedLinks_.fetch_add(1, std::memory_order_relaxed);
+  spdlog::info("Connected to cluster node {} ({})", node,
+               members_->member(node));
+  flush(node);
+}
+
+void NodeBus::flush(std::size_t node) {
+  auto& link = *links_[node];
+  while (true) {
+    if (link.written == link.writing.size()) {
+      link.writing.clear();
+      link.written = 0;
+      std::lock_guard lock(link.mutex);
+      if (link.pending.empty()) {
+        break;
+      }
+      // Both buffers keep their capacity, steady traffic allocates nothing
+      link.writing.swap(link.pending);
+    }
+
+    auto sent = ::send(link.fd, link.writing.data() + link.written,
+                       link.writing.size() - link.written, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        if (not link.waitingToWrite) {
+          link.waitingToWrite = true;
+          watch(link.fd, EPOLLIN | EPOLLOUT, tagOf(LINK, node), true);
+        }
+        return;
+      }
+      logging::limited(linkErrorLog, spdlog::level::warn,
+                       "Could not write to cluster node {}: {}", node,
+                       std::strerror(errno));
+      closeLink(node);
+      return;
+    }
+    writes_.fetch_add(1, std::memory_order_relaxed);
+    bytesSent_.fetch_add(static_cast<uint64_t>(sent),
+                         std::memory_order_relaxed);
+    link.written += static_cast<std::size_t>(sent);
+  }
+
+  if (link.waitingToWrite) {
+    link.waitingToWrite = false;
+    watch(link.fd, EPOLLIN, tagOf(LINK, node), true);
+  }
+}
+
+void NodeBus::closeLink(std::size_t node) {
+  auto& link = *links_[node];
+  ::close(link.fd);
+  link.fd = -1;
+  link.connecting = false;
+  link.waitingToWrite = false;
+  link.writing.clear();
+  link.written = 0;
+  link.retryAt = std::chrono::steady_clock::now() + options_.reconnectInterval;
+
+  bool wasConnected = false;
+  uint64_t generation = 0;
+  {
+    std::lock_guard lock(link.mutex);
+    wasConnected = link.connected;
+    link.connected = false;
+    link.pending.clear();
+    generation = link.generation;
+  }
+  if (wasConnected) {
+    connectedLinks_.fetch_sub(1, std::memory_order_relaxed);
+    spdlog::warn("Lost the link to cluster node {} ({})", node,
+                 members_->member(node));
+    handler_.linkDown(node, generation);
+  }
+}
+
+void NodeBus::accept() {
+  while (true) {
+    int fd = ::accept4(listenFd_, nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    inbound_.emplace(fd, Inbound{});
+    watch(fd, EPOLLIN, tagOf(INBOUND, static_cast<uint64_t>(fd)));
+  }
+}
+
+void NodeBus::receive(int fd) {
+  auto it = inbound_.find(fd);
+  if (it == inbound_.end()) {
+    return;
+  }
+  auto& inbound = it->second;
+  auto& buffer = inbound.buffer;
+  auto size = buffer.size();
+  buffer.resize(size + READ_SIZE);
+  auto received = ::read(fd, buffer.data() + size, READ_SIZE);
+  buffer.resize(size + static_cast<std::size_t>(
+                           std::max<ssize_t>(received, 0)));
+  if (received == 0 or
+      (received < 0 and errno != EAGAIN and errno != EINTR)) {
+    closeInbound(fd);
+    return;
+  }
+
+  if (inbound.node == SIZE_MAX) {
+    if (buffer.size() < HELLO_SIZE) {
+      return;
+    }
+    wire::Reader hello(buffer.data(), buffer.data() + HELLO_SIZE);
+    auto magic = hello.getBytes(HELLO_MAGIC.size());
+    auto fingerprint = hello.get<uint64_t>();
+    auto node = std::size_t{hello.get<uint32_t>()};
+    if (magic != HELLO_MAGIC or fingerprint != members_->fingerprint() or
+        node >= members_->size() or node == members_->self()) {
+      logging::limited(linkErrorLog, spdlog::level::err,
+                       "Rejected a cluster link: not a node of this cluster "
+                       "or configured with other members");
+      closeInbound(fd);
+      return;
+    }
+    // A node that reconnects may have left its previous link half open.
+    // Closing it first keeps the peer's state from going stale after the
+    // new link greeted us.
+    std::vector<int> previous;
+    for (const auto& [otherFd, other] : inbound_) {
+      if (otherFd != fd and other.node == node) {
+        previous.push_back(otherFd);
+      }
+    }
+    for (auto otherFd : previous) {
+      closeInbound(otherFd);
+    }
+    inbound.node = node;
+    buffer.erase(0, HELLO_SIZE);
+    spdlog::info("Cluster node {} ({}) connected", node,
+                 members_->member(node));
+  }
+
+  // Whole frames go to the handler, a partial one waits for the next read
+  std::size_t end = 0;
+  while (buffer.size() - end >= sizeof(uint32_t)) {
+    uint32_t length = 0;
+    std::memcpy(&length, buffer.data() + end, sizeof length);
+    if (length > MAX_FRAME_SIZE) {
+      logging::limited(linkErrorLog, spdlog::level::err,
+                       "Closing the link of cluster node {}: bad frame",
+                       inbound.node);
+      closeInbound(fd);
+      return;
+    }
+    if (buffer.size() - end - sizeof length < length) {
+      break;
+    }
+    end += sizeof length + length;
+    framesReceived_.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (end == 0) {
+    return;
+  }
+  std::string frames;
+  if (end == buffer.size()) {
+    frames.swap(buffer);
+  } else {
+    frames.assign(buffer, 0, end);
+    buffer.erase(0, end);
+  }
+  handler_.receive(inbound.node, std::move(frames));
+}
+
+void NodeBus::closeInbound(int fd) {
+  auto it = inbound_.find(fd);
+  if (it == inbound_.end()) {
+    return;
+  }
+  auto node = it->second.node;
+  ::close(fd);
+  inbound_.erase(it);
+  if (node != SIZE_MAX) {
+    spdlog::warn("Cluster node {} ({}) closed its link", node,
+                 members_->member(node));
+    handler_.peerDown(node);
+  }
+}
+}  // namespace glimpse
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "hash_ring.h"
+
+namespace glimpse {
+
+class NodeBusError : public std::exception {
+ public:
+  NodeBusError(const char* message) : msg_(message) {}
+
+  virtual const char* what() const noexcept override { return msg_; }
+
+ private:
+  const char* msg_;
+};
+
+struct NodeBusOptions {
+  // Delay between attempts to reach a node that is down
+  std::chrono::milliseconds reconnectInterval{500};
+  // Frames queued for a node that does not read them fast enough are
+  // dropped past this
+  std::size_t maxQueuedBytes = 32 << 20;
+};
+
+// Called by the bus thread, see NodeBus
+struct NodeBusHandler {
+  // A link to `node` was established. Appends, with NodeBus::appendFrame(),
+  // the frames the node must get before anything queued from now on.
+  std::function<void(std::size_t node, std::string& out)> greet;
+  // Whole frames from `node`, in the order it sent them, see
+  // NodeBus::forEachFrame()
+  std::function<void(std::size_t node, std::string frames)> receive;
+  // The link to `node` broke. Frames queued on it up to `generation`, see
+  // NodeBus::send(), may not have arrived.
+  std::function<void(std::size_t node, uint64_t generation)> linkDown;
+  // `node` closed its link to us, e.g. because it stopped
+  std::function<void(std::size_t node)> peerDown;
+};
+
+// Totals since start
+struct NodeBusStats {
+  uint64_t connectedLinks;
+  uint64_t framesSent;
+  uint64_t bytesSent;
+  // Write syscalls, frames sent per write tell how well they are batched
+  uint64_t writes;
+  uint64_t framesReceived;
+  uint64_t droppedFrames;
+};
+
+// Persistent TCP links between the nodes of a cluster. Each node connects
+// to every other one and only writes to the links it opened, so every
+// ordered pair of nodes has its own connection and frames between them
+// arrive in the order they were queued.
+//
+// Any thread may queue frames with send(); it encodes the frame into the
+// link's buffer under a short lock and wakes the bus thread if the buffer
+// was empty. The bus thread writes whatever accumulated in one syscall and
+// never waits for the peer: frames are pipelined, and a burst from the
+// event loops leaves in as few writes as the socket allows.
+//
+// Frames are length-prefixed byte strings, what they hold is up to the
+// handler. Links that break are retried every reconnectInterval.
+class NodeBus {
+ public:
+  // Listens on the address of `members.self()`. Throws NodeBusError if it
+  // cannot.
+  NodeBus(std::shared_ptr<const HashRing> members, NodeBusOptions options,
+          NodeBusHandler handler);
+  ~NodeBus();
+
+  NodeBus(const NodeBus&) = delete;
+  NodeBus& operator=(const NodeBus&) = delete;
+
+  // Starts the bus thread
+  void start();
+  void stop();
+
+  // Queues a frame for `node`, `encode(std::string&)` appends its body.
+  // Returns the generation of the link it was queued on, or 0 if it was
+  // dropped because the link is down or too far behind.
+  template <typename Encode>
+  uint64_t send(std::size_t node, Encode&& encode);
+
+  template <typename Encode>
+  static void appendFrame(std::string& out, Encode&& encode);
+  // Calls `visit(std::string_view body)` for every frame in `frames`
+  template <typename Visit>
+  static void forEachFrame(std::string_view frames, Visit&& visit);
+
+  NodeBusStats stats() const;
+
+ private:
+  // Outgoing link to one node
+  struct Link {
+    std::mutex mutex;
+    // Frames waiting for the bus thread
+    std::string pending;
+    bool connected = false;
+    // Incremented on every connection
+    uint64_t generation = 0;
+
+    // Owned by the bus thread
+    int fd = -1;
+    bool connecting = false;
+    bool waitingToWrite = false;
+    std::string writing;
+    std::size_t written = 0;
+    std::chrono::steady_clock::time_point retryAt{};
+  };
+
+  // Connection another node opened to us
+  struct Inbound {
+    // Unknown until the node introduced itself
+    std::size_t node = SIZE_MAX;
+    std::string buffer;
+  };
+
+  struct Address {
+    sockaddr_storage storage;
+    socklen_t length;
+  };
+
+  static Address resolve(const std::string& member, bool passive);
+
+  void wake();
+  void run();
+  void connect(std::size_t node);
+  void established(std::size_t node);
+  void flush(std::size_t node);
+  void closeLink(std::size_t node);
+  void accept();
+  void receive(int fd);
+  void closeInbound(int fd);
+  // Watches `fd` with `events`, `tag` tells the events apart in run()
+  void watch(int fd, uint32_t events, uint64_t tag, bool modify = false);
+
+  std::shared_ptr<const HashRing> members_;
+  NodeBusOptions options_;
+  NodeBusHandler handler_;
+  std::vector<Address> addresses_;
+  std::vector<std::unique_ptr<Link>> links_;
+  // Owned by the bus thread, by descriptor
+  std::unordered_map<int, Inbound> inbound_;
+
+  int listenFd_ = -1;
+  int wakeFd_ = -1;
+  int epollFd_ = -1;
+  std::thread thread_;
+  std::atomic<bool> stopping_ = false;
+  // Set while a wake-up is on its way, so that a burst signals once
+  std::atomic<bool> woken_ = false;
+
+  std::atomic<uint64_t> connectedLinks_ = 0;
+  std::atomic<uint64_t> framesSent_ = 0;
+  std::atomic<uint64_t> bytesSent_ = 0;
+  std::atomic<uint64_t> writes_ = 0;
+  std::atomic<uint64_t> framesReceived_ = 0;
+  std::atomic<uint64_t> droppedFrames_ = 0;
+};
+
+template <typename Encode>
+uint64_t NodeBus::send(std::size_t node, Encode&& encode) {
+  auto& link = *links_.at(node);
+  bool wasEmpty = false;
+  uint64_t generation = 0;
+  {
+    std::lock_guard lock(link.mutex);
+    if (not link.connected or
+        link.pending.size() >= options_.maxQueuedBytes) {
+      droppedFrames_.fetch_add(1, std::memory_order_relaxed);
+      return 0;
+    }
+    wasEmpty = link.pending.empty();
+    appendFrame(link.pending, std::forward<Encode>(encode));
+    generation = link.generation;
+  }
+  framesSent_.fetch_add(1, std::memory_order_relaxed);
+  if (wasEmpty) {
+    wake();
+  }
+  return generation;
+}
+
+template <typename Encode>
+void NodeBus::appendFrame(std::string& out, Encode&& encode) {
+  auto start = out.size();
+  out.append(sizeof(uint32_t), '\0');
+  encode(out);
+  auto length =
+      static_cast<uint32_t>(out.size() - start - sizeof(uint32_t));
+  std::memcpy(out.data() + start, &length, sizeof length);
+}
+
+template <typename Visit>
+void NodeBus::forEachFrame(std::string_view frames, Visit&& visit) {
+  while (frames.size() >= sizeof(uint32_t)) {
+    uint32_t length = 0;
+    std::memcpy(&length, frames.data(), sizeof length);
+    frames.remove_prefix(sizeof length);
+    visit(frames.substr(0, length));
+    frames.remove_prefix(std::min<std::size_t>(length, frames.size()));
+  }
+}
+}  // namespace glimpse
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace glimpse {
+
+// Slab allocator for records of one type. Storage is carved out of chunks of
+// CHUNK_SIZE records and recycled through an intrusive free list, so once
+// the pool has grown to its working set, create() and destroy() never touch
+// the heap. Records never move while they are alive.
+//
+// The pool does not track live records: its owner destroys them before the
+// pool goes away.
+template <typename T, std::size_t CHUNK_SIZE = 64>
+class ObjectPool {
+ public:
+  ObjectPool() = default;
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  template <typename... Args>
+  T* create(Args&&... args) {
+    if (free_ == nullptr) {
+      grow();
+    }
+    auto* storage = free_;
+    free_ = storage->next;
+    try {
+      return ::new (storage->bytes) T(std::forward<Args>(args)...);
+    } catch (...) {
+      storage->next = free_;
+      free_ = storage;
+      throw;
+    }
+  }
+
+  void destroy(T* record) {
+    record->~T();
+    auto* storage = reinterpret_cast<Storage*>(record);
+    storage->next = free_;
+    free_ = storage;
+  }
+
+ private:
+  union Storage {
+    Storage* next;
+    alignas(T) std::byte bytes[sizeof(T)];
+  };
+
+  void grow() {
+    auto& chunk = chunks_.emplace_back(std::make_unique<Storage[]>(CHUNK_SIZE));
+    // Hand out the chunk front to back
+    for (auto i = CHUNK_SIZE; i > 0; --i) {
+      chunk[i - 1].next = free_;
+      free_ = &chunk[i - 1];
+    }
+  }
+
+  std::vector<std::unique_ptr<Storage[]>> chunks_;
+  Storage* free_ = nullptr;
+};
+}  // namespace glimpse
@@ -0,0 +1,365 @@
+#include "payload_parser.h"
+
+#include <charconv>
+#include <cstdint>
+
+namespace glimpse {
+namespace {
+bool isWhitespace(char c) {
+  return c == ' ' or c == '\t' or c == '\n' or c == '\r';
+}
+
+bool isDigit(char c) { return c >= '0' and c <= '9'; }
+
+bool isContinuation(uint8_t byte, uint8_t low = 0x80, uint8_t high = 0xbf) {
+  return byte >= low and byte <= high;
+}
+
+int hexValue(char c) {
+  if (c >= '0' and c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' and c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' and c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+unsigned decodeHex4(const char* p) {
+  return static_cast<unsigned>(hexValue(p[0]) << 12 | hexValue(p[1]) << 8 |
+                               hexValue(p[2]) << 4 | hexValue(p[3]));
+}
+
+char* appendUtf8(char* out, unsigned codepoint) {
+  if (codepoint < 0x80) {
+    *out++ = static_cast<char>(codepoint);
+  } else if (codepoint < 0x800) {
+    *out++ = static_cast<char>(0xc0 | (codepoint >> 6));
+    *out++ = static_cast<char>(0x80 | (codepoint & 0x3f));
+  } else if (codepoint < 0x10000) {
+    *out++ = static_cast<char>(0xe0 | (codepoint >> 12));
+    *out++ = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+    *out++ = static_cast<char>(0x80 | (codepoint & 0x3f));
+  } else {
+    *out++ = static_cast<char>(0xf0 | (codepoint >> 18));
+    *out++ = static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
+    *out++ = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+    *out++ = static_cast<char>(0x80 | (codepoint & 0x3f));
+  }
+  return out;
+}
+}  // namespace
+
+JsonReader::JsonReader(char* begin, char* end) : pos_(begin), end_(end) {}
+
+void JsonReader::skipWhitespace() {
+  while (pos_ != end_ and isWhitespace(*pos_)) {
+    ++pos_;
+  }
+}
+
+bool JsonReader::consume(char c) {
+  skipWhitespace();
+  if (pos_ != end_ and *pos_ == c) {
+    ++pos_;
+    return true;
+  }
+  return false;
+}
+
+bool JsonReader::atEnd() {
+  skipWhitespace();
+  return pos_ == end_;
+}
+
+bool JsonReader::read(JsonStringSpan& out) {
+  if (not consume('"')) {
+    return false;
+  }
+  out = {.begin = pos_, .end = pos_, .escaped = false};
+
+  bool lowSurrogateExpected = false;
+  while (pos_ != end_) {
+    auto byte = static_cast<uint8_t>(*pos_);
+    if (lowSurrogateExpected and byte != '\\') {
+      return false;
+    }
+    if (byte == '"') {
+      out.end = pos_++;
+      return true;
+    }
+    if (byte == '\\') {
+      out.escaped = true;
+      ++pos_;
+      if (not readEscape(lowSurrogateExpected)) {
+        return false;
+      }
+    } else if (byte < 0x20) {
+      return false;
+    } else if (byte < 0x80) {
+      ++pos_;
+    } else if (not readUtf8Sequence()) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool JsonReader::readEscape(bool& lowSurrogateExpected) {
+  if (pos_ == end_) {
+    return false;
+  }
+  char c = *pos_++;
+  if (c != 'u') {
+    if (lowSurrogateExpected) {
+      return false;
+    }
+    return c == '"' or c == '\\' or c == '/' or c == 'b' or c == 'f' or
+           c == 'n' or c == 'r' or c == 't';
+  }
+
+  unsigned codepoint = 0;
+  if (not readHex4(codepoint)) {
+    return false;
+  }
+  bool isHigh = codepoint >= 0xd800 and codepoint <= 0xdbff;
+  bool isLow = codepoint >= 0xdc00 and codepoint <= 0xdfff;
+  if (lowSurrogateExpected != isLow) {
+    return false;
+  }
+  lowSurrogateExpected = isHigh;
+  return true;
+}
+
+bool JsonReader::readHex4(unsigned& out) {
+  if (end_ - pos_ < 4) {
+    return false;
+  }
+  for (int i = 0; i < 4; ++i) {
+    if (hexValue(pos_[i]) < 0) {
+      return false;
+    }
+  }
+  out = decodeHex4(pos_);
+  pos_ += 4;
+  return true;
+}
+
+// Well-formed UTF-8 as in RFC 3629, table 3-7 of the Unicode standard
+bool JsonReader::readUtf8Sequence() {
+  auto remaining = end_ - pos_;
+  auto at = [this](int i) { return static_cast<uint8_t>(pos_[i]); };
+  auto lead = at(0);
+
+  int length = 0;
+  bool valid = false;
+  if (lead >= 0xc2 and lead <= 0xdf) {
+    length = 2;
+    valid = remaining >= 2 and isContinuation(at(1));
+  } else if (lead >= 0xe0 and lead <= 0xef) {
+    length = 3;
+    auto low = lead == 0xe0 ? 0xa0 : 0x80;
+    auto high = lead == 0xed ? 0x9f : 0xbf;
+    valid = remaining >= 3 and isContinuation(at(1), low, high) and
+            isContinuation(at(2));
+  } else if (lead >= 0xf0 and lead <= 0xf4) {
+    length = 4;
+    auto low = lead == 0xf0 ? 0x90 : 0x80;
+    auto high = lead == 0xf4 ? 0x8f : 0xbf;
+    valid = remaining >= 4 and isContinuation(at(1), low, high) and
+            isContinuation(at(2)) and isContinuation(at(3));
+  }
+
+  pos_ += length;
+  return valid;
+}
+
+bool JsonReader::read(bool& out) {
+  skipWhitespace();
+  if (skipLiteral("true")) {
+    out = true;
+    return true;
+  }
+  if (skipLiteral("false")) {
+    out = false;
+    return true;
+  }
+  return false;
+}
+
+bool JsonReader::read(int& out) {
+  skipWhitespace();
+  auto* start = pos_;
+  if (not skipNumber()) {
+    return false;
+  }
+  // Only plain integers, anything nlohmann would have to convert is left to it
+  auto result = std::from_chars(start, pos_, out);
+  return result.ec == std::errc() and result.ptr == pos_;
+}
+
+bool JsonReader::read(JsonRawValue& out) {
+  skipWhitespace();
+  out.begin = pos_;
+  if (not skipValue(0)) {
+    return false;
+  }
+  out.end = pos_;
+  return true;
+}
+
+bool JsonReader::skipValue() {
+  skipWhitespace();
+  return skipValue(0);
+}
+
+bool JsonReader::skipValue(int depth) {
+  if (pos_ == end_ or depth > MAX_DEPTH) {
+    return false;
+  }
+
+  switch (*pos_) {
+    case '"': {
+      JsonStringSpan ignored;
+      return read(ignored);
+    }
+    case '{': {
+      ++pos_;
+      if (consume('}')) {
+        return true;
+      }
+      do {
+        JsonStringSpan key;
+        if (not read(key) or not consume(':')) {
+          return false;
+        }
+        skipWhitespace();
+        if (not skipValue(depth + 1)) {
+          return false;
+        }
+      } while (consume(','));
+      return consume('}');
+    }
+    case '[': {
+      ++pos_;
+      if (consume(']')) {
+        return true;
+      }
+      do {
+        skipWhitespace();
+        if (not skipValue(depth + 1)) {
+          return false;
+        }
+      } while (consume(','));
+      return consume(']');
+    }
+    case 't':
+      return skipLiteral("true");
+    case 'f':
+      return skipLiteral("false");
+    case 'n':
+      return skipLiteral("null");
+    default:
+      return skipNumber();
+  }
+}
+
+bool JsonReader::skipLiteral(std::string_view literal) {
+  if (std::string_view(pos_, end_ - pos_).starts_with(literal)) {
+    pos_ += literal.size();
+    return true;
+  }
+  return false;
+}
+
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+bool JsonReader::skipNumber() {
+  if (pos_ != end_ and *pos_ == '-') {
+    ++pos_;
+  }
+  if (pos_ == end_ or not isDigit(*pos_)) {
+    return false;
+  }
+  if (*pos_ == '0') {
+    ++pos_;
+  } else {
+    while (pos_ != end_ and isDigit(*pos_)) {
+      ++pos_;
+    }
+  }
+  if (pos_ != end_ and *pos_ == '.') {
+    ++pos_;
+    if (pos_ == end_ or not isDigit(*pos_)) {
+      return false;
+    }
+    while (pos_ != end_ and isDigit(*pos_)) {
+      ++pos_;
+    }
+  }
+  if (pos_ != end_ and (*pos_ == 'e' or *pos_ == 'E')) {
+    ++pos_;
+    if (pos_ != end_ and (*pos_ == '+' or *pos_ == '-')) {
+      ++pos_;
+    }
+    if (pos_ == end_ or not isDigit(*pos_)) {
+      return false;
+    }
+    while (pos_ != end_ and isDigit(*pos_)) {
+      ++pos_;
+    }
+  }
+  return true;
+}
+
+std::string_view unescapeInPlace(JsonStringSpan span) {
+  if (not span.escaped) {
+    return {span.begin, span.end};
+  }
+
+  char* in = span.begin;
+  char* out = span.begin;
+  while (in != span.end) {
+    if (*in != '\\') {
+      *out++ = *in++;
+      continue;
+    }
+    ++in;
+    switch (*in++) {
+      case 'b':
+        *out++ = '\b';
+        break;
+      case 'f':
+        *out++ = '\f';
+        break;
+      case 'n':
+        *out++ = '\n';
+        break;
+      case 'r':
+        *out++ = '\r';
+        break;
+      case 't':
+        *out++ = '\t';
+        break;
+      case 'u': {
+        auto codepoint = decodeHex4(in);
+        in += 4;
+        if (codepoint >= 0xd800 and codepoint <= 0xdbff) {
+          // Validated: a low surrogate escape follows
+          auto low = decodeHex4(in + 2);
+          in += 6;
+          codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+        }
+        out = appendUtf8(out, codepoint);
+        break;
+      }
+      default:
+        // '"', '\\' and '/' stand for themselves
+        *out++ = in[-1];
+    }
+  }
+  return {span.begin, out};
+}
+}  // namespace glimpse
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace glimpse {
+
+// Describes one member of a payload struct for parseJsonInPlace(). Payloads
+// list their fields in a static constexpr JSON_FIELDS tuple, in the same
+// order NLOHMANN_DEFINE_TYPE_INTRUSIVE would read them.
+template <typename T, typename V>
+struct JsonField {
+  std::string_view name;
+  V T::*member;
+  bool required = true;
+};
+
+template <typename T, typename V>
+constexpr JsonField<T, V> jsonField(std::string_view name, V T::*member) {
+  return {name, member};
+}
+
+// A member that keeps its default value when the key is absent
+template <typename T, typename V>
+constexpr JsonField<T, V> jsonOptionalField(std::string_view name,
+                                            V T::*member) {
+  return {name, member, false};
+}
+
+// Raw content of a JSON string, between the quotes
+struct JsonStringSpan {
+  char* begin = nullptr;
+  char* end = nullptr;
+  bool escaped = false;
+};
+
+// Unparsed JSON value, for members whose shape depends on other members.
+// Parse it with tryParseJsonInPlace(begin, end, out).
+struct JsonRawValue {
+  char* begin = nullptr;
+  char* end = nullptr;
+};
+
+// Validating, non-allocating JSON reader over a mutable buffer. It accepts
+// exactly what nlohmann::json::parse accepts (RFC 8259, UTF-8 checked); the
+// reader itself never modifies the buffer.
+class JsonReader {
+ public:
+  JsonReader(char* begin, char* end);
+
+  // Skips whitespace and consumes `c` if it is next
+  bool consume(char c);
+  // True if only whitespace is left
+  bool atEnd();
+
+  bool read(JsonStringSpan& out);
+  bool read(bool& out);
+  bool read(int& out);
+  bool read(JsonRawValue& out);
+  bool skipValue();
+
+ private:
+  static constexpr int MAX_DEPTH = 64;
+
+  void skipWhitespace();
+  bool skipValue(int depth);
+  bool skipNumber();
+  bool skipLiteral(std::string_view literal);
+  bool readEscape(bool& lowSurrogateExpected);
+  bool readUtf8Sequence();
+  bool readHex4(unsigned& out);
+
+  char* pos_;
+  char* end_;
+};
+
+// Decodes the escapes of a string validated by JsonReader in place and
+// returns the decoded content. Decoding only ever shrinks the string.
+std::string_view unescapeInPlace(JsonStringSpan span);
+
+namespace detail {
+template <typename T>
+constexpr std::size_t jsonFieldCount =
+    std::tuple_size_v<std::remove_cvref_t<decltype(T::JSON_FIELDS)>>;
+
+template <typename T, std::size_t... I>
+constexpr std::array<bool, sizeof...(I)> requiredJsonFields(
+    std::index_sequence<I...>) {
+  return {std::get<I>(T::JSON_FIELDS).required...};
+}
+
+template <typename V>
+bool readJsonValue(JsonReader& reader, V& out, JsonStringSpan& span) {
+  if constexpr (std::is_same_v<V, std::string_view>) {
+    return reader.read(span);
+  } else if constexpr (std::is_same_v<V, bool> or
+                       std::is_same_v<V, JsonRawValue>) {
+    return reader.read(out);
+  } else {
+    static_assert(std::is_enum_v<V> or std::is_same_v<V, int>);
+    int value = 0;
+    if (not reader.read(value)) {
+      return false;
+    }
+    out = static_cast<V>(value);
+    return true;
+  }
+}
+
+template <typename T, std::size_t... I>
+bool readJsonMember(std::string_view key, JsonReader& reader, T& out,
+                    std::array<JsonStringSpan, sizeof...(I)>& spans,
+                    std::array<bool, sizeof...(I)>& seen,
+                    std::index_sequence<I...>) {
+  bool matched = false;
+  bool ok = true;
+  (
+      [&]() {
+        const auto& field = std::get<I>(T::JSON_FIELDS);
+        if (not matched and key == field.name) {
+          matched = true;
+          seen[I] = true;
+          ok = readJsonValue(reader, out.*field.member, spans[I]);
+        }
+      }(),
+      ...);
+  return matched ? ok : reader.skipValue();
+}
+
+template <typename T, std::size_t... I>
+void unescapeJsonMembers(T& out,
+                         std::array<JsonStringSpan, sizeof...(I)>& spans,
+                         std::index_sequence<I...>) {
+  (
+      [&]() {
+        const auto& field = std::get<I>(T::JSON_FIELDS);
+        using V = std::remove_cvref_t<decltype(out.*field.member)>;
+        if constexpr (std::is_same_v<V, std::string_view>) {
+          out.*field.member = unescapeInPlace(spans[I]);
+        }
+      }(),
+      ...);
+}
+
+template <typename T, std::size_t... I>
+void readNlohmannMembers(const nlohmann::json& j, std::string& buffer, T& out,
+                         std::index_sequence<I...>) {
+  std::array<std::pair<std::size_t, std::size_t>, sizeof...(I)> ranges{};
+  std::string storage;
+  (
+      [&]() {
+        const auto& field = std::get<I>(T::JSON_FIELDS);
+        using V = std::remove_cvref_t<decltype(out.*field.member)>;
+        static_assert(not std::is_same_v<V, JsonRawValue>,
+                      "raw members need tryParseJsonInPlace");
+        if (not field.required and not j.contains(field.name)) {
+          return;
+        }
+        if constexpr (std::is_same_v<V, std::string_view>) {
+          auto value = j.at(field.name).template get<std::string>();
+          ranges[I] = {storage.size(), value.size()};
+          storage += value;
+        } else {
+          out.*field.member = j.at(field.name).template get<V>();
+        }
+      }(),
+      ...);
+
+  buffer = std::move(storage);
+  (
+      [&]() {
+        const auto& field = std::get<I>(T::JSON_FIELDS);
+        using V = std::remove_cvref_t<decltype(out.*field.member)>;
+        if constexpr (std::is_same_v<V, std::string_view>) {
+          auto [offset, length] = ranges[I];
+          out.*field.member = std::string_view(buffer).substr(offset, length);
+        }
+      }(),
+      ...);
+}
+}  // namespace detail
+
+// Single-pass parse of a JSON object into T. String members are views into
+// the buffer, with escapes decoded in place once the whole document has been
+// validated. Unknown keys are skipped, the last duplicate wins. Returns false
+// and leaves the buffer untouched if the fast path cannot handle the input.
+template <typename T>
+bool tryParseJsonInPlace(char* begin, char* end, T& out) {
+  constexpr auto fieldCount = detail::jsonFieldCount<T>;
+  constexpr auto indices = std::make_index_sequence<fieldCount>{};
+  std::array<JsonStringSpan, fieldCount> spans{};
+  std::array<bool, fieldCount> seen{};
+
+  JsonReader reader(begin, end);
+  if (not reader.consume('{')) {
+    return false;
+  }
+  if (not reader.consume('}')) {
+    do {
+      JsonStringSpan key;
+      // Escaped keys would have to be decoded before the document is known to
+      // be valid, leave those to the fallback
+      if (not reader.read(key) or key.escaped or not reader.consume(':')) {
+        return false;
+      }
+      if (not detail::readJsonMember(std::string_view(key.begin, key.end),
+                                     reader, out, spans, seen, indices)) {
+        return false;
+      }
+    } while (reader.consume(','));
+    if (not reader.consume('}')) {
+      return false;
+    }
+  }
+  if (not reader.atEnd()) {
+    return false;
+  }
+  constexpr auto required = detail::requiredJsonFields<T>(indices);
+  for (std::size_t i = 0; i < fieldCount; ++i) {
+    if (required[i] and not seen[i]) {
+      return false;
+    }
+  }
+
+  detail::unescapeJsonMembers(out, spans, indices);
+  return true;
+}
+
+template <typename T>
+bool tryParseJsonInPlace(std::string& buffer, T& out) {
+  return tryParseJsonInPlace(buffer.data(), buffer.data() + buffer.size(), out);
+}
+
+// Parses `buffer` into T, see tryParseJsonInPlace(). Input the fast path
+// rejects goes through nlohmann::json with the same accessors the
+// NLOHMANN_DEFINE_TYPE_INTRUSIVE from_json uses, so invalid payloads throw
+// exactly the exceptions and messages they did before. `buffer` must outlive
+// the returned views.
+template <typename T>
+T parseJsonInPlace(std::string& buffer) {
+  T out{};
+  if (tryParseJsonInPlace(buffer, out)) {
+    return out;
+  }
+
+  auto j = nlohmann::json::parse(buffer);
+  detail::readNlohmannMembers(
+      j, buffer, out, std::make_index_sequence<detail::jsonFieldCount<T>>{});
+  return out;
+}
+}  // namespace glimpse
@@ -0,0 +1,51 @@
+#include "post_body.h"
+
+namespace glimpse {
+
+PostBodyPool& PostBodyPool::local() {
+  thread_local PostBodyPool pool;
+  return pool;
+}
+
+PostBody* PostBodyPool::acquire(uWS::HttpResponse<false>* res) {
+  PostBody* body;
+  if (idle_.empty()) {
+    body = new PostBody();
+    // Small requests never grow the buffer
+    body->data.reserve(1024);
+  } else {
+    body = idle_.back().release();
+    idle_.pop_back();
+  }
+  body->res = res;
+  body->users = 1;
+  return body;
+}
+
+void PostBodyPool::release(PostBody* body) {
+  if (--body->users > 0) {
+    return;
+  }
+  if (idle_.size() >= MAX_IDLE) {
+    delete body;
+    return;
+  }
+  body->res = nullptr;
+  body->data.clear();
+  body->aborted = false;
+  body->received = false;
+  body->overflowed = false;
+  idle_.emplace_back(body);
+}
+
+bool PostBodyPool::append(PostBody& body, std::string_view chunk,
+                          bool isLast) {
+  if (body.data.size() + chunk.size() > MAX_POST_BODY_SIZE) {
+    body.overflowed = true;
+  } else if (not body.overflowed) {
+    body.data.append(chunk);
+  }
+  body.received = isLast;
+  return isLast;
+}
+}  // namespace glimpse
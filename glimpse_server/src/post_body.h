@@ -0,0 +1,63 @@
+#pragma once
+
+#include <uwebsockets/App.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace glimpse {
+
+// Largest POST body accepted, the same as a WebSocket message
+constexpr std::size_t MAX_POST_BODY_SIZE = 16 * 1024;
+
+// Body of an HTTP POST, from its first chunk until the response is written.
+// The RoomCall it carries views into `data`, so the body stays alive while
+// the call runs on another shard or node.
+struct PostBody {
+  uWS::HttpResponse<false>* res = nullptr;
+  std::string data;
+  // Holders of the body: the request while it is received, and the call
+  // it started until its response is written
+  uint32_t users = 0;
+  // The client went away, the response must not be written
+  bool aborted = false;
+  // The last chunk arrived
+  bool received = false;
+  // More than MAX_POST_BODY_SIZE was sent, the rest is discarded
+  bool overflowed = false;
+};
+
+// Recycles the PostBody records of one event loop together with their
+// buffers, so once the pool holds as many as the loop has requests in
+// flight, receiving a body does not allocate. Only used from its thread.
+class PostBodyPool {
+ public:
+  // Bodies kept for reuse, those released past it are freed
+  static constexpr std::size_t MAX_IDLE = 64;
+
+  PostBodyPool() = default;
+  PostBodyPool(const PostBodyPool&) = delete;
+  PostBodyPool& operator=(const PostBodyPool&) = delete;
+
+  // The calling thread's pool
+  static PostBodyPool& local();
+
+  // A body held once, by the request receiving it
+  PostBody* acquire(uWS::HttpResponse<false>* res);
+  void hold(PostBody* body) { ++body->users; }
+  // Returns the body to the pool once nobody holds it
+  void release(PostBody* body);
+
+  // Appends a chunk unless the body would exceed MAX_POST_BODY_SIZE, in
+  // which case it is marked overflowed. Returns whether the body is
+  // complete.
+  static bool append(PostBody& body, std::string_view chunk, bool isLast);
+
+ private:
+  std::vector<std::unique_ptr<PostBody>> idle_;
+};
+}  // namespace glimpse
@@ -0,0 +1,58 @@
+#include "resume_log.h"
+
+#include <algorithm>
+
+namespace glimpse {
+
+ResumeLog::ResumeLog(std::size_t maxFrames, std::size_t maxBytes)
+    : maxBytes_(maxBytes), entries_(std::max<std::size_t>(1, maxFrames)) {}
+
+void ResumeLog::append(WsMessage::Type type, std::string_view frame) {
+  ++nextSeq_;
+  if (frame.size() > maxBytes_) {
+    while (count_ > 0) {
+      evictOldest();
+    }
+    return;
+  }
+  if (bytes_.empty()) {
+    bytes_.resize(maxBytes_);
+  }
+
+  auto offset = end_;
+  if (offset + frame.size() > maxBytes_) {
+    // The rest of the ring is too short, frames past `end_` are from the
+    // previous lap and the oldest
+    while (count_ > 0 and entry(0).offset >= end_) {
+      evictOldest();
+    }
+    offset = 0;
+  }
+  // Then the oldest frames are the ones right after `offset`
+  while (count_ > 0 and (count_ == entries_.size() or
+                         (entry(0).offset < offset + frame.size() and
+                          entry(0).offset + entry(0).length > offset))) {
+    evictOldest();
+  }
+
+  std::copy(frame.begin(), frame.end(), bytes_.begin() + offset);
+  entries_[(head_ + count_) % entries_.size()] = {
+      static_cast<uint32_t>(offset), static_cast<uint32_t>(frame.size()),
+      type};
+  ++count_;
+  end_ = offset + frame.size();
+}
+
+bool ResumeLog::canReplayAfter(uint64_t seq) const {
+  // The kept frames are the last `count_` numbered
+  return seq <= lastSeq() and seq + count_ >= lastSeq();
+}
+
+void ResumeLog::evictOldest() {
+  head_ = (head_ + 1) % entries_.size();
+  if (--count_ == 0) {
+    head_ = 0;
+    end_ = 0;
+  }
+}
+}  // namespace glimpse
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "id.h"
+#include "ws_message.h"
+
+namespace glimpse {
+
+// Session resume, for clients that connect with ?resume=. A session that
+// closes is kept for `window`, a client reconnecting within it with the
+// session's token and the number of the last frame it received gets the
+// frames it missed instead of a new session.
+struct ResumeOptions {
+  // Zero disables resuming, ?resume= is then ignored
+  std::chrono::seconds window{30};
+  // Bounds of the frames kept per session, the oldest go first
+  std::size_t maxFrames = 64;
+  std::size_t maxBytes = 32 * 1024;
+
+  bool enabled() const { return window.count() > 0; }
+};
+
+// The last frames written to a session, numbered from 1 in the order they
+// were written. Frames are copied into one byte ring allocated with the
+// first of them, so appending does not allocate. Not thread-safe.
+class ResumeLog {
+ public:
+  ResumeLog(std::size_t maxFrames, std::size_t maxBytes);
+
+  // Numbers `frame` and keeps a copy, evicting the oldest frames it does
+  // not fit beside. A frame larger than the whole ring is numbered but
+  // evicts everything instead.
+  void append(WsMessage::Type type, std::string_view frame);
+
+  // Number of the last frame appended, 0 before any
+  uint64_t lastSeq() const { return nextSeq_ - 1; }
+  // Whether every frame after `seq` is still kept
+  bool canReplayAfter(uint64_t seq) const;
+  // Calls `write(type, frame)` for the frames after `seq`, oldest first.
+  // Views are valid until the next append. Requires canReplayAfter(seq).
+  template <typename Write>
+  void replayAfter(uint64_t seq, Write&& write) const;
+
+ private:
+  struct Entry {
+    uint32_t offset;
+    uint32_t length;
+    WsMessage::Type type;
+  };
+
+  const Entry& entry(std::size_t age) const {
+    return entries_[(head_ + age) % entries_.size()];
+  }
+  void evictOldest();
+
+  std::string bytes_;
+  std::size_t maxBytes_;
+  // Ring of the kept frames, the oldest at `head_`
+  std::vector<Entry> entries_;
+  std::size_t head_ = 0;
+  std::size_t count_ = 0;
+  // Where the next frame goes in `bytes_`, unless it has to wrap around
+  std::size_t end_ = 0;
+  uint64_t nextSeq_ = 1;
+};
+
+// What outlives the socket of a resumable session. Shared by the socket and
+// WsManager, the log is written from the thread of the socket owning it,
+// and from any thread while the session waits for its client to come back.
+struct ResumeState {
+  ResumeState(const Id& token, const ResumeOptions& options)
+      : token(token), log(options.maxFrames, options.maxBytes) {}
+
+  // Given to the client, which presents it to resume
+  const Id token;
+  std::mutex mutex;
+  // Guarded by `mutex`, as is `owner`
+  ResumeLog log;
+  // Generation of the socket whose frames go into the log, see
+  // WsSessionData. Bumped when another socket resumes the session.
+  uint64_t owner = 0;
+};
+
+template <typename Write>
+void ResumeLog::replayAfter(uint64_t seq, Write&& write) const {
+  auto skip = static_cast<std::size_t>(seq - (nextSeq_ - count_ - 1));
+  for (auto age = skip; age < count_; ++age) {
+    const auto& frame = entry(age);
+    write(frame.type, std::string_view(bytes_).substr(frame.offset,
+                                                      frame.length));
+  }
+}
+}  // namespace glimpse
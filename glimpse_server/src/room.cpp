@@ -1,17 +1,56 @@
 #include "room.h"
 
-#include <boost/uuid/random_generator.hpp>
-#include <boost/uuid/uuid_io.hpp>
-#include <utility>
+#include <algorithm>
+#include <cstdint>
 
 namespace glimpse {
-Room::Room(const std::string& id, const User& host)
-    : id_(id), host_(std::move(host)) {};
+// Right below the variant bits of the random half of the id
+constexpr uint64_t GROUP_MODE_BIT = uint64_t{1} << 61;
 
-std::string Room::getId() { return id_; }
-std::string Room::getHostId() { return host_.id; }
-std::string Room::getGuestId() { return guest_.id; }
+Id withGroupMode(const Id& roomId, bool group) {
+  auto low = group ? roomId.low() | GROUP_MODE_BIT
+                   : roomId.low() & ~GROUP_MODE_BIT;
+  return Id(roomId.high(), low);
+}
 
-void Room::setHost(const User& user) { host_ = std::move(user); }
-void Room::setGuest(const User& user) { guest_ = std::move(user); }
+bool isGroupRoom(const Id& roomId) {
+  return (roomId.low() & GROUP_MODE_BIT) != 0;
+}
+
+Room::Room(const Id& id, const User& host) : id_(id), participants_{host} {};
+
+const Id& Room::getId() const { return id_; }
+const Id& Room::getHostId() const { return participants_.front().id; }
+
+std::span<const User> Room::getParticipants() const { return participants_; }
+
+bool Room::hasParticipant(const Id& userId) const {
+  return not userId.isNil() and
+         std::ranges::any_of(participants_, [&userId](const User& user) {
+           return user.id == userId;
+         });
+}
+
+bool Room::isGroup() const { return isGroupRoom(id_); }
+
+bool Room::isFull() const {
+  return participants_.size() >= (isGroup() ? ROOM_MAX_PARTICIPANTS : 2);
+}
+
+bool Room::addParticipant(const User& user) {
+  if (hasParticipant(user.id)) {
+    return false;
+  }
+  participants_.push_back(user);
+  return true;
+}
+
+bool Room::removeParticipant(const Id& userId) {
+  if (userId == getHostId()) {
+    return false;
+  }
+  return std::erase_if(participants_, [&userId](const User& user) {
+           return user.id == userId;
+         }) > 0;
+}
 }  // namespace glimpse
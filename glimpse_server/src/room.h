@@ -1,22 +1,45 @@
-#include <string>
+#pragma once
 
+#include <cstddef>
+#include <span>
+#include <vector>
+
+#include "id.h"
 #include "user.h"
 
 namespace glimpse {
+
+// Most participants a group room admits, the host included
+constexpr std::size_t ROOM_MAX_PARTICIPANTS = 50;
+
+// Rooms are for two unless created as a group: approving someone into a
+// full room of two replaces its guest. The mode is a bit of the room id, so
+// it survives the store, handoffs and forwarding within the cluster.
+Id withGroupMode(const Id& roomId, bool group);
+bool isGroupRoom(const Id& roomId);
+
 class Room {
  public:
-  Room(const std::string& id, const User& host);
+  Room(const Id& id, const User& host);
 
-  std::string getId();
-  std::string getHostId();
-  std::string getGuestId();
+  const Id& getId() const;
+  const Id& getHostId() const;
+  // The host first, then everyone else in the order they were admitted
+  std::span<const User> getParticipants() const;
+  // The nil id is never a participant
+  bool hasParticipant(const Id& userId) const;
+  bool isGroup() const;
+  // Two participants for a room that is not a group
+  bool isFull() const;
 
-  void setHost(const User& user);
-  void setGuest(const User& user);
+  // Returns false if the user already is a participant
+  bool addParticipant(const User& user);
+  // Returns false if the user is not a participant. The host cannot be
+  // removed, the room is closed instead.
+  bool removeParticipant(const Id& userId);
 
  private:
-  std::string id_;
-  User host_;
-  User guest_;
+  Id id_;
+  std::vector<User> participants_;
 };
 }  // namespace glimpse
@@ -1,45 +1,277 @@
 #include "room_manager.h"
 
-#include <boost/uuid/random_generator.hpp>
-#include <boost/uuid/uuid_io.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "metrics.h"
+#include "shard.h"
 #include "ws_manager.h"
 
 namespace glimpse {
-RoomManager::RoomManager(std::shared_ptr<WsManager> wsManager)
-    : wsManager_(wsManager) {}
+namespace {
+constexpr std::chrono::seconds EXPIRY_TICK{1};
+// One hour of one second ticks, longer expiries take extra revolutions
+constexpr std::size_t EXPIRY_WHEEL_SLOTS = 3600;
+// Candidates trickle in for a while after the answer, the setup is
+// considered finished this long after it
+constexpr std::chrono::seconds SETUP_SETTLE_TIME{5};
+// Rooms are drained a share at a time, this often
+constexpr std::chrono::milliseconds DRAIN_TICK{250};
+// Close code and reason of the sockets drained for a restart, clients
+// reconnect to the process that took over
+constexpr int DRAIN_CLOSE_CODE = 1012;
+constexpr std::string_view DRAIN_CLOSE_REASON = "Service restart";
+}  // namespace
+
+RoomManager::RoomManager(std::shared_ptr<WsManager> wsManager,
+                         std::size_t shard, std::size_t shardCount,
+                         RoomManagerOptions options, RoomJournal* journal)
+    : wsManager_(wsManager),
+      journal_(journal),
+      shard_(shard),
+      shardCount_(shardCount),
+      iceBatching_(options.iceBatching),
+      expiry_(options.expiry),
+      ring_(options.ring),
+      iceServers_(std::move(options.iceServers)),
+      relay_(std::move(options.relay)),
+      expiries_(EXPIRY_WHEEL_SLOTS),
+      setupLog_(options.setupLogSize) {}
+
+void RoomManager::restore(StoredRooms stored) {
+  // Ids the member list now assigns to another node cannot be reached
+  // there, the clients start over. They are dropped from the store too.
+  std::size_t dropped = 0;
+  for (auto& restored : stored.rooms) {
+    if (ring_ and not ring_->owns(restored.id)) {
+      if (journal_ != nullptr) {
+        journal_->roomClosed(restored.id);
+      }
+      ++dropped;
+      continue;
+    }
+    const auto& participants = restored.participants;
+    auto* room =
+        rooms_.tryEmplace(restored.id, restored.id, participants.front()).first;
+    for (std::size_t i = 1; i < participants.size(); ++i) {
+      room->addParticipant(participants[i]);
+    }
+    // Expiries start over, everyone gets the time to reconnect
+    if (participants.size() == 1) {
+      scheduleExpiry(expiry_.unjoinedRoom,
+                     {.kind = Expiry::UNJOINED_ROOM, .id = restored.id});
+    }
+    scheduleExpiry(expiry_.presenceCheck,
+                   {.kind = Expiry::PRESENCE_CHECK, .id = restored.id});
+  }
+  for (auto& request : stored.requests) {
+    auto requestId = request.requestId;
+    if (ring_ and not ring_->owns(requestId)) {
+      if (journal_ != nullptr) {
+        journal_->requestRemoved(requestId);
+      }
+      ++dropped;
+      continue;
+    }
+    requests_.tryEmplace(requestId, std::move(request));
+    scheduleExpiry(expiry_.joinRequest,
+                   {.kind = Expiry::JOIN_REQUEST, .id = requestId});
+  }
+  if (dropped > 0) {
+    spdlog::warn("Dropped {} stored rooms and join requests of shard {} "
+                 "owned by another cluster node",
+                 dropped, shard_);
+  }
+}
+
+void RoomManager::attach(uWS::Loop* loop) {
+  loop_ = loop;
+  if (iceBatching_.enabled()) {
+    iceFlushTimer_ = std::make_unique<LoopTimer>(
+        loop, [this]() { flushAllICEMessages(); });
+  }
+
+  expiryTimer_ = std::make_unique<LoopTimer>(loop, [this]() {
+    // Frozen rooms belong to another process, their expiries wait in case
+    // they come back
+    if (frozen_) {
+      return;
+    }
+    expiries_.advance(
+        [this](Expiry&& expiry) { handleExpiry(std::move(expiry)); });
+  });
+  expiryTimer_->start(EXPIRY_TICK, EXPIRY_TICK);
+  publishSizes();
+}
+
+StoredRooms RoomManager::freeze() {
+  frozen_ = true;
+  StoredRooms frozen;
+  rooms_.forEach([&frozen](const Id&, Room& room) {
+    auto participants = room.getParticipants();
+    frozen.rooms.push_back(
+        {.id = room.getId(),
+         .participants = {participants.begin(), participants.end()}});
+  });
+  requests_.forEach(
+      [&frozen](const Id&, WsJoinRoomRequestPayload& request) {
+        frozen.requests.push_back(request);
+      });
+  return frozen;
+}
 
-std::string RoomManager::createNewRoom(const User& user) {
-  auto id = boost::uuids::to_string(boost::uuids::random_generator()());
-  rooms_.try_emplace(id, id, user);
-  // TODO: remove room if no one join after a while
+void RoomManager::thaw() { frozen_ = false; }
+
+void RoomManager::drain(std::chrono::milliseconds window,
+                        std::function<void()> done) {
+  rooms_.forEach([this](const Id& id, Room&) { draining_.push_back(id); });
+  auto ticks =
+      std::max<std::size_t>(1, static_cast<std::size_t>(window / DRAIN_TICK));
+  drainTimer_ = std::make_unique<LoopTimer>(
+      loop_, [this, ticks, done = std::move(done)]() mutable {
+        auto count = (draining_.size() + ticks - 1) / ticks;
+        for (; count > 0; --count) {
+          if (auto* room = rooms_.find(draining_.back())) {
+            wsManager_->closeSessions(room->getParticipants(), DRAIN_CLOSE_CODE,
+                                      DRAIN_CLOSE_REASON);
+          }
+          draining_.pop_back();
+        }
+        // Sockets of users in no room, or in a room another shard has not
+        // drained yet, go with the last share
+        if (--ticks == 0) {
+          wsManager_->closeLocalSessions(DRAIN_CLOSE_CODE, DRAIN_CLOSE_REASON);
+          drainTimer_->stop();
+          done();
+        }
+      });
+  drainTimer_->start(DRAIN_TICK, DRAIN_TICK);
+  spdlog::info("Draining {} rooms of shard {} over {} ms", draining_.size(),
+               shard_, window.count());
+}
+
+Id RoomManager::execute(const RoomCall& call) {
+  switch (call.operation) {
+    case metrics::Operation::CREATE_ROOM:
+      return createNewRoom(call.user, call.group);
+    case metrics::Operation::JOIN_ROOM:
+      return joinRoom(call.user, call.subject);
+    case metrics::Operation::APPROVE_JOIN_REQUEST:
+      approveJoinRoomRequest(call.subject, call.user.id);
+      break;
+    case metrics::Operation::DENY_JOIN_REQUEST:
+      denyJoinRoomRequest(call.subject, call.user.id);
+      break;
+    case metrics::Operation::SDP:
+      exchangeSDPMessage(call.subject, call.user.id, call.toUserId,
+                         call.text);
+      break;
+    case metrics::Operation::ICE:
+      exchangeICEMessage(call.subject, call.user.id, call.toUserId,
+                         call.text);
+      break;
+    case metrics::Operation::END_ROOM:
+      endRoom(call.subject, call.user.id);
+      break;
+    case metrics::Operation::OPEN_RELAY:
+      openRelay(call.subject, call.user.id, call.toUserId);
+      break;
+    case metrics::Operation::COUNT:
+      throw RoomManagerError("unknown operation");
+  }
+  return Id();
+}
+
+Id RoomManager::mintId(bool group) {
+  // A node owns about 1/N of the ids, so this takes N tries on average
+  auto id = withGroupMode(newShardedId(shard_, shardCount_), group);
+  while (ring_ and not ring_->owns(id)) {
+    id = withGroupMode(newShardedId(shard_, shardCount_), group);
+  }
   return id;
-};
+}
+
+Id RoomManager::createNewRoom(const User& user, bool group) {
+  checkNotFrozen();
+  if (user.id.isNil()) {
+    throw RoomManagerError("invalid user id");
+  }
 
-bool RoomManager::isRoomHost(const std::string& userId,
-                             const std::string& roomId) {
-  if (not rooms_.contains(roomId)) {
-    return false;
+  auto id = mintId(group);
+  rooms_.tryEmplace(id, id, user);
+  timelines_.tryEmplace(id, CallTimeline{.roomId = id})
+      .first->mark(CallTimeline::CREATED, metrics::Clock::now());
+  if (journal_ != nullptr) {
+    journal_->roomCreated(id, user);
   }
+  scheduleExpiry(expiry_.unjoinedRoom,
+                 {.kind = Expiry::UNJOINED_ROOM, .id = id});
+  scheduleExpiry(expiry_.presenceCheck,
+                 {.kind = Expiry::PRESENCE_CHECK, .id = id});
+  publishSizes();
+  return id;
+};
 
-  return rooms_.at(roomId).getHostId() == userId;
+bool RoomManager::isRoomHost(const Id& userId, const Id& roomId) {
+  auto* room = rooms_.find(roomId);
+  return room != nullptr and room->getHostId() == userId;
 };
 
-bool RoomManager::roomExists(const std::string& roomId) {
+bool RoomManager::roomExists(const Id& roomId) {
   return rooms_.contains(roomId);
 }
 
-std::string RoomManager::joinRoom(const User& user, const std::string& roomId) {
-  if (not rooms_.contains(roomId)) {
+const Id& RoomManager::recipientOf(const Room& room, const Id& fromUserId,
+                                   const Id& toUserId) {
+  if (not room.hasParticipant(fromUserId)) {
+    throw RoomManagerError("user is not in this room");
+  }
+
+  if (toUserId.isNil()) {
+    // Clients written for two-party rooms never name the recipient
+    auto participants = room.getParticipants();
+    if (participants.size() < 2) {
+      throw RoomManagerError("room has no other participant");
+    }
+    if (participants.size() > 2) {
+      throw RoomManagerError("recipient is required in a group room");
+    }
+    return participants[0].id == fromUserId ? participants[1].id
+                                            : participants[0].id;
+  }
+
+  if (toUserId == fromUserId or not room.hasParticipant(toUserId)) {
+    throw RoomManagerError("recipient is not in this room");
+  }
+  return toUserId;
+}
+
+Id RoomManager::joinRoom(const User& user, const Id& roomId) {
+  checkNotFrozen();
+  if (user.id.isNil()) {
+    throw RoomManagerError("invalid user id");
+  }
+  auto* room = rooms_.find(roomId);
+  if (room == nullptr) {
     throw RoomManagerError("room does not exit");
   }
+  // The host of a room of two may still replace the guest
+  if (room->isGroup() and room->isFull() and
+      not room->hasParticipant(user.id)) {
+    throw RoomManagerError("room is full");
+  }
 
-  auto joinRoomRequestId =
-      boost::uuids::to_string(boost::uuids::random_generator()());
+  // The request lives on the same shard as its room
+  auto joinRoomRequestId = mintId();
 
-  if (isRoomHost(user.id, roomId)) {
+  if (room->getHostId() == user.id) {
     // Host is allowed immediately
     WsJoinRoomResultPayload payload = {
         .requestId = joinRoomRequestId, .roomId = roomId, .approved = true};
@@ -56,143 +288,447 @@ std::string RoomManager::joinRoom(const User& user, const std::string& roomId) {
         .username = user.name,
     };
 
-    requests_.emplace(joinRoomRequestId, payload);
+    if (auto* setup = setupOf(roomId)) {
+      setup->mark(CallTimeline::JOIN_REQUESTED, metrics::Clock::now());
+    }
+    requests_.tryEmplace(joinRoomRequestId, payload);
+    if (journal_ != nullptr) {
+      journal_->requestAdded(payload);
+    }
+    publishSizes();
+    scheduleExpiry(expiry_.joinRequest,
+                   {.kind = Expiry::JOIN_REQUEST, .id = joinRoomRequestId});
     wsManager_->sendMessage(
-        rooms_.at(roomId).getHostId(),
+        room->getHostId(),
         {.type = WsMessage::REQUEST_JOIN_ROOM, .payload = payload});
   }
 
   return joinRoomRequestId;
 }
 
-void RoomManager::approveJoinRoomRequest(const std::string& requestId,
-                                         const std::string& hostId) {
-  if (not requests_.contains(requestId)) {
+void RoomManager::approveJoinRoomRequest(const Id& requestId,
+                                         const Id& hostId) {
+  checkNotFrozen();
+  auto approved = metrics::Clock::now();
+  auto* request = requests_.find(requestId);
+  if (request == nullptr) {
     throw RoomManagerError("request does not exist");
   }
-  auto roomId = requests_.at(requestId).roomId;
-  if (not rooms_.contains(roomId)) {
+  auto* room = rooms_.find(request->roomId);
+  if (room == nullptr) {
     throw RoomManagerError("room does not exist");
   }
 
-  if (not isRoomHost(hostId, roomId)) {
+  if (room->getHostId() != hostId) {
     throw RoomManagerError("user is not a host");
   }
 
-  rooms_.at(roomId).setGuest({
-      .id = requests_.at(requestId).userId,
-      .name = requests_.at(requestId).username,
-  });
-
-  WsJoinRoomResultPayload payload = {
-      .requestId = requestId, .roomId = roomId, .approved = true};
-  wsManager_->sendMessage(
-      requests_.at(requestId).userId,
-      {.type = WsMessage::ALLOW_JOIN_ROOM, .payload = payload});
-
-  WsRoomReadyPayload roomReadyPayload = {.roomId = roomId};
+  if (room->hasParticipant(request->userId)) {
+    throw RoomManagerError("user is already in this room");
+  }
+  // Approving someone into a full room of two replaces its guest
+  Id replaced;
+  if (room->isFull()) {
+    if (room->isGroup()) {
+      throw RoomManagerError("room is full");
+    }
+    replaced = room->getParticipants()[1].id;
+  }
 
-  wsManager_->sendMessage(
-      requests_.at(requestId).userId,
-      {.type = WsMessage::ROOM_READY, .payload = roomReadyPayload});
+  // The newcomer learns who is in the room in one corked write, everyone
+  // else about the newcomer. Throws before anything changed if the
+  // newcomer is not connected.
+  std::vector<WsOutgoingMessage> welcome;
+  welcome.reserve(room->getParticipants().size() + 2);
+  welcome.push_back(
+      {.userId = request->userId,
+       .message = {.type = WsMessage::ALLOW_JOIN_ROOM,
+                   .payload = WsJoinRoomResultPayload{
+                       .requestId = requestId,
+                       .roomId = room->getId(),
+                       .approved = true}}});
+  for (const auto& participant : room->getParticipants()) {
+    if (participant.id == replaced) {
+      continue;
+    }
+    welcome.push_back(
+        {.userId = request->userId,
+         .message = {.type = WsMessage::PARTICIPANT_JOINED,
+                     .payload = WsParticipantPayload{
+                         .roomId = room->getId(),
+                         .userId = participant.id,
+                         .username = participant.name}}});
+  }
+  // A call already under way was announced before the newcomer was in the
+  // room, they need its ICE servers as well
+  if (room->getParticipants().size() - (replaced.isNil() ? 0 : 1) >= 2) {
+    welcome.push_back(
+        {.userId = request->userId,
+         .message = {.type = WsMessage::ROOM_READY,
+                     .payload = WsRoomReadyPayload{
+                         .roomId = room->getId(), .iceServers = iceServers_}}});
+  }
+  wsManager_->sendMessages(welcome);
+  if (not replaced.isNil()) {
+    // The host learns that the guest left before the newcomer joins
+    auto guest = dismiss(*room, replaced);
+    wsManager_->publish(
+        room->getId(), room->getParticipants(),
+        {.type = WsMessage::PARTICIPANT_LEFT,
+         .payload = WsParticipantPayload{.roomId = room->getId(),
+                                         .userId = guest.id,
+                                         .username = guest.name}});
+  }
+  wsManager_->publish(
+      room->getId(), room->getParticipants(),
+      {.type = WsMessage::PARTICIPANT_JOINED,
+       .payload = WsParticipantPayload{.roomId = room->getId(),
+                                       .userId = request->userId,
+                                       .username = request->username}});
+  room->addParticipant({.id = request->userId, .name = request->username});
+  if (journal_ != nullptr) {
+    journal_->participantAdded(
+        room->getId(), {.id = request->userId, .name = request->username});
+    journal_->requestRemoved(requestId);
+  }
 
-  wsManager_->sendMessage(
-      hostId, {.type = WsMessage::ROOM_READY, .payload = roomReadyPayload});
+  // The call starts with the first guest, as it always did for two
+  if (room->getParticipants().size() == 2) {
+    wsManager_->publish(
+        room->getId(), room->getParticipants(),
+        {.type = WsMessage::ROOM_READY,
+         .payload = WsRoomReadyPayload{.roomId = room->getId(),
+                                       .iceServers = iceServers_}});
+    if (auto* setup = setupOf(room->getId())) {
+      setup->mark(CallTimeline::APPROVED, approved);
+      setup->mark(CallTimeline::ROOM_READY, metrics::Clock::now());
+    }
+  }
 
   requests_.erase(requestId);
+  publishSizes();
 };
 
-void RoomManager::denyJoinRoomRequest(const std::string& requestId,
-                                      const std::string& hostId) {
-  if (not requests_.contains(requestId)) {
+void RoomManager::denyJoinRoomRequest(const Id& requestId, const Id& hostId) {
+  checkNotFrozen();
+  auto* request = requests_.find(requestId);
+  if (request == nullptr) {
     throw RoomManagerError("request does not exist");
   }
-
-  auto roomId = requests_.at(requestId).roomId;
-
-  if (not rooms_.contains(roomId)) {
+  auto* room = rooms_.find(request->roomId);
+  if (room == nullptr) {
     throw RoomManagerError("room does not exist");
   }
 
-  if (not isRoomHost(hostId, roomId)) {
+  if (room->getHostId() != hostId) {
     throw RoomManagerError("user is not a host");
   }
 
   WsJoinRoomResultPayload payload = {
-      .requestId = requestId, .roomId = roomId, .approved = false};
+      .requestId = requestId, .roomId = room->getId(), .approved = false};
   wsManager_->sendMessage(
-      requests_.at(requestId).userId,
-      {.type = WsMessage::DENY_JOIN_ROOM, .payload = payload});
+      request->userId, {.type = WsMessage::DENY_JOIN_ROOM, .payload = payload});
 
   requests_.erase(requestId);
+  if (journal_ != nullptr) {
+    journal_->requestRemoved(requestId);
+  }
+  publishSizes();
 };
 
-void RoomManager::exchangeSDPMessage(const std::string& roomId,
-                                     const std::string& fromUserId,
-                                     const std::string& message) {
-  if (not rooms_.contains(roomId)) {
+void RoomManager::exchangeSDPMessage(const Id& roomId, const Id& fromUserId,
+                                     const Id& toUserId,
+                                     std::string_view message) {
+  auto* room = rooms_.find(roomId);
+  if (room == nullptr) {
     throw RoomManagerError("room does not exist");
   }
 
-  if (fromUserId != rooms_.at(roomId).getHostId() and
-      fromUserId != rooms_.at(roomId).getGuestId()) {
-    throw RoomManagerError("user is not in this room");
+  const auto& recipient = recipientOf(*room, fromUserId, toUserId);
+  // Candidates gathered before this description must not overtake it
+  flushICEMessages(recipient);
+  wsManager_->sendMessage(recipient, WsMessage::SDP, message, fromUserId);
+
+  auto* setup = setupOf(roomId);
+  if (setup == nullptr or not setup->has(CallTimeline::ROOM_READY)) {
+    return;
+  }
+  if (not setup->has(CallTimeline::OFFER)) {
+    setup->mark(CallTimeline::OFFER, metrics::Clock::now());
+    setup->offerer = fromUserId;
+  } else if (not setup->completed() and fromUserId != setup->offerer) {
+    setup->mark(CallTimeline::ANSWER, metrics::Clock::now());
+    scheduleExpiry(SETUP_SETTLE_TIME,
+                   {.kind = Expiry::SETUP_SETTLED, .id = roomId});
   }
+}
 
-  if (fromUserId == rooms_.at(roomId).getHostId()) {
-    wsManager_->sendMessage(rooms_.at(roomId).getGuestId(),
-                            {.type = WsMessage::SDP, .payload = message});
+void RoomManager::exchangeICEMessage(const Id& roomId, const Id& fromUserId,
+                                     const Id& toUserId,
+                                     std::string_view message) {
+  auto* room = rooms_.find(roomId);
+  if (room == nullptr) {
+    throw RoomManagerError("room does not exist");
+  }
+
+  const auto& recipient = recipientOf(*room, fromUserId, toUserId);
+  if (iceFlushTimer_) {
+    queueICEMessage(fromUserId, recipient, message);
   } else {
-    wsManager_->sendMessage(rooms_.at(roomId).getHostId(),
-                            {.type = WsMessage::SDP, .payload = message});
+    wsManager_->sendMessage(recipient, WsMessage::ICE, message, fromUserId);
+  }
+  if (auto* setup = setupOf(roomId);
+      setup != nullptr and setup->has(CallTimeline::ROOM_READY)) {
+    setup->mark(CallTimeline::LAST_CANDIDATE, metrics::Clock::now());
+  }
+}
+
+void RoomManager::queueICEMessage(const Id& fromUserId, const Id& toUserId,
+                                  std::string_view message) {
+  // Same error as an immediate send would give
+  if (not wsManager_->isUserOnline(toUserId)) {
+    throw WsManagerError("user is not connected");
+  }
+
+  auto& senders = *pendingICE_.tryEmplace(toUserId).first;
+  auto pending = std::ranges::find(senders, fromUserId,
+                                   &PendingCandidates::from);
+  if (pending == senders.end()) {
+    pending = senders.insert(pending, {.from = fromUserId});
+  }
+  pending->candidates.emplace_back(message);
+  if (pending->candidates.size() >= iceBatching_.maxCandidates) {
+    flushICEMessages(toUserId);
+  } else if (not iceFlushTimer_->isPending()) {
+    iceFlushTimer_->start(iceBatching_.window);
+  }
+}
+
+void RoomManager::flushICEMessages(const Id& toUserId) {
+  auto* pending = pendingICE_.find(toUserId);
+  if (pending == nullptr) {
+    return;
+  }
+  auto senders = std::move(*pending);
+  pendingICE_.erase(toUserId);
+  // One batch per sender, the recipient tells its connections apart by it
+  for (auto& [from, candidates] : senders) {
+    wsManager_->sendMessageIfOnline(toUserId,
+                                    {.type = WsMessage::ICE_BATCH,
+                                     .payload = std::move(candidates),
+                                     .from = from});
+  }
+}
+
+void RoomManager::flushAllICEMessages() {
+  pendingICE_.forEach(
+      [this](const Id& toUserId, std::vector<PendingCandidates>& senders) {
+        for (auto& [from, candidates] : senders) {
+          wsManager_->sendMessageIfOnline(toUserId,
+                                          {.type = WsMessage::ICE_BATCH,
+                                           .payload = std::move(candidates),
+                                           .from = from});
+        }
+      });
+  pendingICE_.clear();
+}
+
+void RoomManager::openRelay(const Id& roomId, const Id& fromUserId,
+                            const Id& toUserId) {
+  if (not relay_) {
+    throw RoomManagerError("media relay is disabled");
+  }
+  auto* room = rooms_.find(roomId);
+  if (room == nullptr) {
+    throw RoomManagerError("room does not exist");
+  }
+
+  const auto& recipient = recipientOf(*room, fromUserId, toUserId);
+  // Ports are only taken for peers that can be told about them
+  if (not wsManager_->isUserOnline(recipient)) {
+    throw WsManagerError("user is not connected");
   }
+  auto ports = relay_->open(roomId, fromUserId, recipient);
+  wsManager_->sendMessageIfOnline(
+      fromUserId, {.type = WsMessage::RELAY_READY,
+                   .payload = WsRelayPayload{.roomId = roomId,
+                                             .userId = recipient,
+                                             .host = relay_->host(),
+                                             .port = ports.port,
+                                             .token = ports.token}});
+  wsManager_->sendMessageIfOnline(
+      recipient, {.type = WsMessage::RELAY_READY,
+                  .payload = WsRelayPayload{.roomId = roomId,
+                                            .userId = fromUserId,
+                                            .host = relay_->host(),
+                                            .port = ports.peerPort,
+                                            .token = ports.peerToken}});
 }
 
-void RoomManager::exchangeICEMessage(const std::string& roomId,
-                                     const std::string& fromUserId,
-                                     const std::string& message) {
-  if (not rooms_.contains(roomId)) {
+void RoomManager::endRoom(const Id& roomId, const Id& userId) {
+  checkNotFrozen();
+  auto* room = rooms_.find(roomId);
+  if (room == nullptr) {
     throw RoomManagerError("room does not exist");
   }
 
-  if (fromUserId != rooms_.at(roomId).getHostId() and
-      fromUserId != rooms_.at(roomId).getGuestId()) {
+  if (not room->hasParticipant(userId)) {
     throw RoomManagerError("user is not in this room");
   }
 
-  if (fromUserId == rooms_.at(roomId).getHostId()) {
-    wsManager_->sendMessage(rooms_.at(roomId).getGuestId(),
-                            {.type = WsMessage::ICE, .payload = message});
+  if (userId == room->getHostId()) {
+    closeRoom(*room);
   } else {
-    wsManager_->sendMessage(rooms_.at(roomId).getHostId(),
-                            {.type = WsMessage::ICE, .payload = message});
+    leaveRoom(*room, userId);
   }
 }
 
-void RoomManager::endRoom(const std::string& roomId,
-                          const std::string& userId) {
-  if (not rooms_.contains(roomId)) {
-    throw RoomManagerError("room does not exist");
+void RoomManager::leaveRoom(Room& room, const Id& userId) {
+  auto leaver = dismiss(room, userId);
+  if (room.getParticipants().size() < 2) {
+    closeRoom(room);
+    return;
   }
+  wsManager_->publish(
+      room.getId(), room.getParticipants(),
+      {.type = WsMessage::PARTICIPANT_LEFT,
+       .payload = WsParticipantPayload{.roomId = room.getId(),
+                                       .userId = leaver.id,
+                                       .username = leaver.name}});
+}
 
-  if (not(rooms_.at(roomId).getHostId() == userId or
-          rooms_.at(roomId).getGuestId() == userId)) {
-    throw RoomManagerError("user is not a host nor a guest");
+User RoomManager::dismiss(Room& room, const Id& userId) {
+  pendingICE_.erase(userId);
+  auto leaver = *std::ranges::find(room.getParticipants(), userId, &User::id);
+  room.removeParticipant(userId);
+  if (journal_ != nullptr) {
+    journal_->participantRemoved(room.getId(), userId);
+  }
+  wsManager_->unsubscribe(room.getId(), {&leaver, 1});
+  if (relay_) {
+    relay_->closeParticipant(room.getId(), userId);
   }
 
-  WsRoomEndPayload payload = {.roomId = roomId};
+  // The leaver is done with the room either way
+  WsRoomEndPayload payload = {.roomId = room.getId()};
+  wsManager_->sendMessageIfOnline(
+      userId, {.type = WsMessage::ROOM_END, .payload = payload});
+  return leaver;
+}
 
-  if (wsManager_->isUserOnline(rooms_.at(roomId).getGuestId())) {
-    wsManager_->sendMessage(rooms_.at(roomId).getGuestId(),
-                            {.type = WsMessage::ROOM_END, .payload = payload});
+void RoomManager::closeRoom(Room& room) {
+  // Candidates for a call that is over are of no use to anyone
+  for (const auto& participant : room.getParticipants()) {
+    pendingICE_.erase(participant.id);
   }
 
-  if (wsManager_->isUserOnline(rooms_.at(roomId).getHostId())) {
-    wsManager_->sendMessage(rooms_.at(roomId).getHostId(),
-                            {.type = WsMessage::ROOM_END, .payload = payload});
+  WsRoomEndPayload payload = {.roomId = room.getId()};
+  wsManager_->publish(room.getId(), room.getParticipants(),
+                      {.type = WsMessage::ROOM_END, .payload = payload});
+  wsManager_->unsubscribe(room.getId(), room.getParticipants());
+  if (relay_) {
+    relay_->closeRoom(room.getId());
   }
 
-  rooms_.erase(roomId);
+  if (journal_ != nullptr) {
+    journal_->roomClosed(room.getId());
+  }
+  finishSetup(room.getId());
+  rooms_.erase(room.getId());
+  publishSizes();
+}
+
+void RoomManager::collectSlowSetups(metrics::Clock::duration atLeast,
+                                    std::vector<CallTimeline>& out) const {
+  setupLog_.collectSlow(atLeast, out);
+}
+
+void RoomManager::finishSetup(const Id& roomId) {
+  auto* setup = setupOf(roomId);
+  if (setup == nullptr) {
+    return;
+  }
+  // Rooms nobody asked to join had no call to set up
+  if (setup->has(CallTimeline::JOIN_REQUESTED)) {
+    setup->record();
+    setupLog_.push(*setup);
+  }
+  timelines_.erase(roomId);
+}
+
+void RoomManager::publishSizes() {
+  metrics::setGauge(metrics::Gauge::ROOMS, rooms_.size());
+  metrics::setGauge(metrics::Gauge::JOIN_REQUESTS, requests_.size());
+}
+
+void RoomManager::checkNotFrozen() const {
+  if (frozen_) {
+    throw RoomManagerError("server is restarting");
+  }
+}
+
+void RoomManager::scheduleExpiry(std::chrono::seconds delay, Expiry expiry) {
+  if (delay.count() > 0) {
+    expiries_.schedule(delay / EXPIRY_TICK, std::move(expiry));
+  }
+}
+
+// Expiries are never cancelled, each one checks that it still applies
+void RoomManager::handleExpiry(Expiry expiry) {
+  switch (expiry.kind) {
+    case Expiry::UNJOINED_ROOM: {
+      auto* room = rooms_.find(expiry.id);
+      if (room != nullptr and room->getParticipants().size() == 1) {
+        spdlog::info("Room {} expired, nobody joined", expiry.id);
+        closeRoom(*room);
+      }
+      break;
+    }
+
+    case Expiry::JOIN_REQUEST: {
+      auto* request = requests_.find(expiry.id);
+      if (request == nullptr) {
+        break;
+      }
+      // The guest is told as if the host had denied it
+      WsJoinRoomResultPayload payload = {.requestId = expiry.id,
+                                         .roomId = request->roomId,
+                                         .approved = false};
+      wsManager_->sendMessageIfOnline(
+          request->userId,
+          {.type = WsMessage::DENY_JOIN_ROOM, .payload = payload});
+      requests_.erase(expiry.id);
+      if (journal_ != nullptr) {
+        journal_->requestRemoved(expiry.id);
+      }
+      publishSizes();
+      break;
+    }
+
+    case Expiry::PRESENCE_CHECK: {
+      auto* room = rooms_.find(expiry.id);
+      if (room == nullptr) {
+        break;
+      }
+      auto anyoneOnline = std::ranges::any_of(
+          room->getParticipants(), [this](const User& participant) {
+            return wsManager_->isUserOnline(participant.id);
+          });
+      expiry.missedPresenceChecks =
+          anyoneOnline ? 0 : expiry.missedPresenceChecks + 1;
+      if (expiry.missedPresenceChecks >= 2) {
+        spdlog::info("Room {} expired, everyone left", expiry.id);
+        closeRoom(*room);
+        break;
+      }
+      scheduleExpiry(expiry_.presenceCheck, std::move(expiry));
+      break;
+    }
+
+    case Expiry::SETUP_SETTLED:
+      finishSetup(expiry.id);
+      break;
+  }
 }
 
 };  // namespace glimpse
@@ -1,11 +1,26 @@
 #pragma once
 
+#include <uwebsockets/Loop.h>
+
+#include <chrono>
+#include <cstddef>
 #include <exception>
+#include <functional>
 #include <memory>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <vector>
 
+#include "call_timeline.h"
+#include "hash_ring.h"
+#include "id.h"
+#include "id_table.h"
+#include "loop_timer.h"
+#include "media_relay.h"
+#include "metrics.h"
 #include "room.h"
+#include "room_store.h"
+#include "timer_wheel.h"
 #include "user.h"
 #include "ws_manager.h"
 
@@ -21,29 +36,198 @@ class RoomManagerError : public std::exception {
   const char* msg_;
 };
 
+// Coalescing of trickled ICE candidates. Candidates from the same sender to
+// the same recipient are held for up to `window` (or until `maxCandidates`
+// are pending) and sent as one ICE_BATCH frame. A zero window sends every
+// candidate on its own.
+struct IceBatching {
+  std::chrono::milliseconds window{0};
+  std::size_t maxCandidates = 16;
+
+  bool enabled() const { return window.count() > 0; }
+};
+
+// Lifetimes of rooms and join requests that nobody cleans up explicitly,
+// enforced on a one second tick. Zero disables an expiry.
+struct RoomExpiry {
+  // A room nobody was admitted to
+  std::chrono::seconds unjoinedRoom{10 * 60};
+  // A join request the host never answered
+  std::chrono::seconds joinRequest{2 * 60};
+  // Interval of presence checks. A room is closed once two checks in a row
+  // found all of its participants disconnected.
+  std::chrono::seconds presenceCheck{60};
+};
+
+struct RoomManagerOptions {
+  IceBatching iceBatching;
+  RoomExpiry expiry;
+  // Members of the cluster, if any. Rooms and join requests then only get
+  // ids this node owns, see Cluster.
+  std::shared_ptr<const HashRing> ring;
+  // Advertised to the participants in ROOM_READY, e.g. the URL of the
+  // embedded STUN server
+  std::vector<std::string> iceServers;
+  // Relays media between participants who ask for it, none if null
+  std::shared_ptr<MediaRelay> relay;
+  // Finished call setups kept for RoomManager::collectSlowSetups()
+  std::size_t setupLogSize = 128;
+};
+
+// A request to a RoomManager as a value, so that it can be forwarded to the
+// node owning the room, see Cluster
+struct RoomCall {
+  metrics::Operation operation;
+  // The room, or the join request to approve or deny. Unused when creating
+  // a room.
+  Id subject;
+  // Who asks. The name is only used to create or join a room.
+  User user;
+  // Recipient of SDP and ICE, may be nil in a room of two
+  Id toUserId{};
+  // SDP or ICE, must outlive the call
+  std::string_view text{};
+  // Whether a new room admits more than two, see isGroupRoom(). Rooms are
+  // created where asked, so this never crosses the cluster.
+  bool group = false;
+};
+
+// Owns the rooms and join requests of one shard. A RoomManager is only ever
+// used from the event-loop thread of its shard, so it needs no locking.
+//
+// A room holds its host and one guest, whom the host replaces by approving
+// someone else. A group room holds up to ROOM_MAX_PARTICIPANTS - 1 guests.
+// Admissions and departures are broadcast to the room, SDP and ICE go to
+// one participant and carry their sender.
 class RoomManager {
  public:
-  RoomManager(std::shared_ptr<WsManager> wsManager);
-
-  std::string createNewRoom(const User& user);
-  bool isRoomHost(const std::string& userId, const std::string& roomId);
-  bool roomExists(const std::string& roomId);
-  std::string joinRoom(const User& user, const std::string& roomId);
-  void approveJoinRoomRequest(const std::string& requestId,
-                              const std::string& userId);
-  void denyJoinRoomRequest(const std::string& requestId,
-                           const std::string& userId);
-  void exchangeSDPMessage(const std::string& roomId,
-                          const std::string& fromUserId,
-                          const std::string& message);
-  void exchangeICEMessage(const std::string& roomId,
-                          const std::string& fromUserId,
-                          const std::string& message);
-  void endRoom(const std::string& roomId, const std::string& userId);
+  // Mutations are recorded in `journal` if there is one
+  RoomManager(std::shared_ptr<WsManager> wsManager, std::size_t shard,
+              std::size_t shardCount, RoomManagerOptions options = {},
+              RoomJournal* journal = nullptr);
+
+  // Takes over rooms and join requests from an earlier run, see
+  // RoomStore::load(). Their participants reconnect as usual and are
+  // reached again as soon as their socket is open. Must be called before
+  // attach().
+  void restore(StoredRooms stored);
+  // Must be called from the shard's event-loop thread before it runs
+  void attach(uWS::Loop* loop);
+
+  // Hot restart, see Handoff. freeze() returns the rooms and join requests
+  // for the process taking over, which owns them from then on: creating,
+  // joining, approving, denying and ending fail with "server is
+  // restarting", and nothing expires. SDP and ICE are still relayed so that
+  // calls being set up finish. thaw() undoes it if the handoff failed.
+  StoredRooms freeze();
+  void thaw();
+  // Closes the sockets of the participants of the frozen rooms, a share of
+  // the rooms every tick so that they are all closed after `window`. The
+  // participants of a room are closed together and find each other again
+  // in the new process. The last tick closes every socket still open on
+  // the shard's loop, in a room or not, then calls `done`.
+  void drain(std::chrono::milliseconds window, std::function<void()> done);
+
+  // Runs `call` with the method it names, throwing what that throws.
+  // Returns the id of the room or join request it created, the nil id
+  // otherwise.
+  Id execute(const RoomCall& call);
+
+  Id createNewRoom(const User& user, bool group = false);
+  bool isRoomHost(const Id& userId, const Id& roomId);
+  bool roomExists(const Id& roomId);
+  Id joinRoom(const User& user, const Id& roomId);
+  void approveJoinRoomRequest(const Id& requestId, const Id& userId);
+  void denyJoinRoomRequest(const Id& requestId, const Id& userId);
+  // `toUserId` may be nil in a room of two, the message then goes to the
+  // other participant
+  void exchangeSDPMessage(const Id& roomId, const Id& fromUserId,
+                          const Id& toUserId, std::string_view message);
+  void exchangeICEMessage(const Id& roomId, const Id& fromUserId,
+                          const Id& toUserId, std::string_view message);
+  // Opens a media relay session between `fromUserId` and `toUserId` and
+  // tells both where to send, see MediaRelay. `toUserId` may be nil in a
+  // room of two.
+  void openRelay(const Id& roomId, const Id& fromUserId, const Id& toUserId);
+  // Closes the room when called by the host, otherwise the user leaves it.
+  // A room left with a single participant is closed.
+  void endRoom(const Id& roomId, const Id& userId);
+
+  // Appends the recent call setups of this shard that took at least
+  // `atLeast`, or never completed, see SetupLog
+  void collectSlowSetups(metrics::Clock::duration atLeast,
+                         std::vector<CallTimeline>& out) const;
 
  private:
+  struct Expiry {
+    enum Kind { UNJOINED_ROOM, JOIN_REQUEST, PRESENCE_CHECK, SETUP_SETTLED };
+
+    Kind kind;
+    Id id;
+    int missedPresenceChecks = 0;
+  };
+
+  // Candidates from one sender waiting for the next flush
+  struct PendingCandidates {
+    Id from;
+    std::vector<std::string> candidates{};
+  };
+
+  // Checks that `fromUserId` may send to `toUserId` in `room` and resolves
+  // a nil `toUserId`
+  static const Id& recipientOf(const Room& room, const Id& fromUserId,
+                               const Id& toUserId);
+
+  // Id for a new room or join request, owned by this shard and node
+  Id mintId(bool group = false);
+  // Exports the table sizes of this shard, see metrics::Gauge
+  void publishSizes();
+
+  // Timeline of the call setup in `roomId`, null once it finished
+  CallTimeline* setupOf(const Id& roomId) { return timelines_.find(roomId); }
+  // Records the phases of the room's call setup and moves it to the log
+  void finishSetup(const Id& roomId);
+
+  // Throws RoomManagerError once the rooms were handed over, see freeze()
+  void checkNotFrozen() const;
+
+  void scheduleExpiry(std::chrono::seconds delay, Expiry expiry);
+  void handleExpiry(Expiry expiry);
+  // Tells whoever is still connected that the room ended and drops it
+  void closeRoom(Room& room);
+  void leaveRoom(Room& room, const Id& userId);
+  // Takes `userId` out of `room` and tells them the room ended, leaving
+  // the others to be told
+  User dismiss(Room& room, const Id& userId);
+
+  void queueICEMessage(const Id& fromUserId, const Id& toUserId,
+                       std::string_view message);
+  void flushICEMessages(const Id& toUserId);
+  void flushAllICEMessages();
+
   std::shared_ptr<WsManager> wsManager_;
-  std::unordered_map<std::string, Room> rooms_;
-  std::unordered_map<std::string, WsJoinRoomRequestPayload> requests_;
+  RoomJournal* journal_;
+  std::size_t shard_;
+  std::size_t shardCount_;
+  IceBatching iceBatching_;
+  RoomExpiry expiry_;
+  std::shared_ptr<const HashRing> ring_;
+  std::vector<std::string> iceServers_;
+  std::shared_ptr<MediaRelay> relay_;
+  std::unique_ptr<LoopTimer> iceFlushTimer_;
+  std::unique_ptr<LoopTimer> expiryTimer_;
+  uWS::Loop* loop_ = nullptr;
+  bool frozen_ = false;
+  // Rooms whose participants drain() has yet to close
+  std::vector<Id> draining_;
+  std::unique_ptr<LoopTimer> drainTimer_;
+  TimerWheel<Expiry> expiries_;
+  // Candidates waiting for the next flush, by recipient
+  IdTable<std::vector<PendingCandidates>> pendingICE_;
+  IdTable<Room> rooms_;
+  IdTable<WsJoinRoomRequestPayload> requests_;
+  // Setups still going on, by room
+  IdTable<CallTimeline> timelines_;
+  SetupLog setupLog_;
 };
 }  // namespace glimpse
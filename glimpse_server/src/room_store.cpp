@@ -0,0 +1,642 @@
+#include "room_store.h"
+
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "logging.h"
+#include "wire.h"
+
+namespace glimpse {
+namespace {
+using wire::put;
+using wire::putId;
+using wire::putRequest;
+using wire::putUser;
+using wire::Reader;
+
+constexpr std::string_view SNAPSHOT_MAGIC = "GLSNAP01";
+constexpr std::string_view JOURNAL_MAGIC = "GLJRNL01";
+// Magic, then the generation
+constexpr std::size_t FILE_HEADER_SIZE = 16;
+// Body length, then its checksum
+constexpr std::size_t RECORD_HEADER_SIZE = 8;
+
+enum RecordKind : uint8_t {
+  ROOM_CREATED = 1,
+  PARTICIPANT_ADDED,
+  PARTICIPANT_REMOVED,
+  ROOM_CLOSED,
+  REQUEST_ADDED,
+  REQUEST_REMOVED,
+};
+
+// The writer thread retries a failing disk every flush
+logging::RateLimit writeErrorLog{1, std::chrono::seconds(10)};
+
+// FNV-1a, enough to tell a torn record from a whole one
+uint32_t checksum(const char* data, std::size_t size) {
+  uint32_t hash = 2166136261u;
+  for (std::size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+  }
+  return hash;
+}
+
+// Sinks for the wire encoders besides std::string
+struct SizeCounter {
+  std::size_t size = 0;
+
+  void append(const char*, std::size_t n) { size += n; }
+};
+
+struct MappedWriter {
+  char* position;
+
+  void append(const char* data, std::size_t n) {
+    std::memcpy(position, data, n);
+    position += n;
+  }
+};
+
+template <typename Out>
+void putFileHeader(Out& out, std::string_view magic, uint64_t generation) {
+  out.append(magic.data(), magic.size());
+  put(out, generation);
+}
+
+// Checks and skips the header of a file of `magic`
+bool getFileHeader(Reader& reader, std::string_view magic,
+                   uint64_t& generation) {
+  if (reader.getBytes(magic.size()) != magic) {
+    return false;
+  }
+  generation = reader.get<uint64_t>();
+  return reader.ok();
+}
+
+template <typename Encode>
+void appendRecord(std::string& out, RecordKind kind, Encode&& encode) {
+  auto start = out.size();
+  out.append(RECORD_HEADER_SIZE, '\0');
+  put(out, kind);
+  encode(out);
+  auto length = static_cast<uint32_t>(out.size() - start - RECORD_HEADER_SIZE);
+  auto sum = checksum(out.data() + start + RECORD_HEADER_SIZE, length);
+  std::memcpy(out.data() + start, &length, sizeof length);
+  std::memcpy(out.data() + start + sizeof length, &sum, sizeof sum);
+}
+
+// Records are applied the way RoomManager made them, a record that no
+// longer applies changes nothing
+template <typename State>
+bool applyRecord(Reader& record, State& state) {
+  auto kind = record.get<RecordKind>();
+  switch (kind) {
+    case ROOM_CREATED: {
+      auto roomId = record.getId();
+      auto host = record.getUser();
+      if (record.ok()) {
+        state.rooms[roomId] = {std::move(host)};
+      }
+      break;
+    }
+    case PARTICIPANT_ADDED: {
+      auto roomId = record.getId();
+      auto user = record.getUser();
+      auto room = state.rooms.find(roomId);
+      if (record.ok() and room != state.rooms.end() and
+          std::ranges::find(room->second, user.id, &User::id) ==
+              room->second.end()) {
+        room->second.push_back(std::move(user));
+      }
+      break;
+    }
+    case PARTICIPANT_REMOVED: {
+      auto roomId = record.getId();
+      auto userId = record.getId();
+      auto room = state.rooms.find(roomId);
+      if (record.ok() and room != state.rooms.end()) {
+        std::erase_if(room->second, [&userId](const User& user) {
+          return user.id == userId;
+        });
+      }
+      break;
+    }
+    case ROOM_CLOSED:
+      state.rooms.erase(record.getId());
+      break;
+    case REQUEST_ADDED: {
+      auto request = record.getRequest();
+      if (record.ok()) {
+        state.requests[request.requestId] = std::move(request);
+      }
+      break;
+    }
+    case REQUEST_REMOVED:
+      state.requests.erase(record.getId());
+      break;
+    default:
+      return false;
+  }
+  return record.ok() and record.atEnd();
+}
+
+// Applies the whole records in [begin, end) and returns how many bytes
+// they span. Replay stops at the first torn or corrupt record.
+template <typename State>
+std::size_t replayRecords(const char* begin, const char* end, State& state) {
+  auto* position = begin;
+  while (static_cast<std::size_t>(end - position) >= RECORD_HEADER_SIZE) {
+    uint32_t length = 0;
+    uint32_t sum = 0;
+    std::memcpy(&length, position, sizeof length);
+    std::memcpy(&sum, position + sizeof length, sizeof sum);
+    auto* body = position + RECORD_HEADER_SIZE;
+    if (static_cast<std::size_t>(end - body) < length or
+        checksum(body, length) != sum) {
+      break;
+    }
+    Reader record(body, body + length);
+    if (not applyRecord(record, state)) {
+      break;
+    }
+    position = body + length;
+  }
+  return static_cast<std::size_t>(position - begin);
+}
+
+template <typename Out, typename State>
+void encodeSnapshot(Out& out, const State& state, uint64_t generation) {
+  putFileHeader(out, SNAPSHOT_MAGIC, generation);
+  put(out, static_cast<uint32_t>(state.rooms.size()));
+  for (const auto& [roomId, participants] : state.rooms) {
+    putId(out, roomId);
+    put(out, static_cast<uint32_t>(participants.size()));
+    for (const auto& participant : participants) {
+      putUser(out, participant);
+    }
+  }
+  put(out, static_cast<uint32_t>(state.requests.size()));
+  for (const auto& [requestId, request] : state.requests) {
+    putRequest(out, request);
+  }
+}
+
+template <typename State>
+bool decodeSnapshot(const char* begin, const char* end, State& state,
+                    uint64_t& generation) {
+  Reader snapshot(begin, end);
+  if (not getFileHeader(snapshot, SNAPSHOT_MAGIC, generation)) {
+    return false;
+  }
+  auto roomCount = snapshot.get<uint32_t>();
+  for (uint32_t i = 0; i < roomCount and snapshot.ok(); ++i) {
+    auto roomId = snapshot.getId();
+    auto& participants = state.rooms[roomId];
+    auto participantCount = snapshot.get<uint32_t>();
+    for (uint32_t j = 0; j < participantCount and snapshot.ok(); ++j) {
+      participants.push_back(snapshot.getUser());
+    }
+  }
+  auto requestCount = snapshot.get<uint32_t>();
+  for (uint32_t i = 0; i < requestCount and snapshot.ok(); ++i) {
+    auto request = snapshot.getRequest();
+    state.requests[request.requestId] = std::move(request);
+  }
+  return snapshot.ok() and snapshot.atEnd();
+}
+
+void logError(std::string_view action, const std::filesystem::path& path) {
+  auto error = errno;
+  logging::limited(writeErrorLog, spdlog::level::err, "Could not {} {}: {}",
+                   action, path.string(), std::strerror(error));
+}
+
+// A file mapped read-only, empty if it does not exist
+class MappedFile {
+ public:
+  explicit MappedFile(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      if (errno != ENOENT) {
+        logError("open", path);
+        throw RoomStoreError("could not read the room store");
+      }
+      return;
+    }
+    struct stat status;
+    if (::fstat(fd, &status) == 0 and status.st_size > 0) {
+      size_ = static_cast<std::size_t>(status.st_size);
+      data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data_ == MAP_FAILED) {
+        data_ = nullptr;
+        size_ = 0;
+      }
+    }
+    ::close(fd);
+  }
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+    }
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* begin() const { return static_cast<const char*>(data_); }
+  const char* end() const { return begin() + size_; }
+  std::size_t size() const { return size_; }
+
+ private:
+  void* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+bool writeAll(int fd, const char* data, std::size_t size) {
+  while (size > 0) {
+    auto written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= static_cast<std::size_t>(written);
+  }
+  return true;
+}
+
+bool syncDirectory(const std::filesystem::path& directory) {
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  auto synced = ::fsync(fd) == 0;
+  ::close(fd);
+  return synced;
+}
+
+// Writes the snapshot next to `path` through a shared mapping and renames
+// it over `path` once it is on disk
+template <typename State>
+bool writeSnapshot(const std::filesystem::path& path, const State& state,
+                   uint64_t generation) {
+  SizeCounter counter;
+  encodeSnapshot(counter, state, generation);
+
+  auto temporary = path;
+  temporary += ".tmp";
+  int fd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0) {
+    logError("create", temporary);
+    return false;
+  }
+  if (::ftruncate(fd, static_cast<off_t>(counter.size)) < 0) {
+    logError("resize", temporary);
+    ::close(fd);
+    return false;
+  }
+  auto* map = ::mmap(nullptr, counter.size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    logError("map", temporary);
+    return false;
+  }
+  MappedWriter writer{static_cast<char*>(map)};
+  encodeSnapshot(writer, state, generation);
+  auto synced = ::msync(map, counter.size, MS_SYNC) == 0;
+  ::munmap(map, counter.size);
+  if (not synced) {
+    logError("write", temporary);
+    return false;
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporary, path, error);
+  if (error) {
+    errno = error.value();
+    logError("replace", path);
+    return false;
+  }
+  return syncDirectory(path.parent_path());
+}
+
+// Truncates the journal at `path` to an empty one of `generation`, returns
+// its descriptor open for appending or -1
+int startJournal(const std::filesystem::path& path, uint64_t generation,
+                 bool sync) {
+  int fd = ::open(path.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    logError("create", path);
+    return -1;
+  }
+  std::string header;
+  putFileHeader(header, JOURNAL_MAGIC, generation);
+  if (not writeAll(fd, header.data(), header.size()) or
+      (sync and ::fdatasync(fd) < 0)) {
+    logError("write", path);
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+}  // namespace
+
+void RoomJournal::roomCreated(const Id& roomId, const User& host) {
+  std::lock_guard lock(mutex_);
+  appendRecord(pending_, ROOM_CREATED, [&](std::string& out) {
+    putId(out, roomId);
+    putUser(out, host);
+  });
+}
+
+void RoomJournal::participantAdded(const Id& roomId, const User& user) {
+  std::lock_guard lock(mutex_);
+  appendRecord(pending_, PARTICIPANT_ADDED, [&](std::string& out) {
+    putId(out, roomId);
+    putUser(out, user);
+  });
+}
+
+void RoomJournal::participantRemoved(const Id& roomId, const Id& userId) {
+  std::lock_guard lock(mutex_);
+  appendRecord(pending_, PARTICIPANT_REMOVED, [&](std::string& out) {
+    putId(out, roomId);
+    putId(out, userId);
+  });
+}
+
+void RoomJournal::roomClosed(const Id& roomId) {
+  std::lock_guard lock(mutex_);
+  appendRecord(pending_, ROOM_CLOSED,
+               [&](std::string& out) { putId(out, roomId); });
+}
+
+void RoomJournal::requestAdded(const WsJoinRoomRequestPayload& request) {
+  std::lock_guard lock(mutex_);
+  appendRecord(pending_, REQUEST_ADDED,
+               [&](std::string& out) { putRequest(out, request); });
+}
+
+void RoomJournal::requestRemoved(const Id& requestId) {
+  std::lock_guard lock(mutex_);
+  appendRecord(pending_, REQUEST_REMOVED,
+               [&](std::string& out) { putId(out, requestId); });
+}
+
+RoomStore::RoomStore(RoomStoreOptions options, std::size_t shardCount)
+    : options_(std::move(options)) {
+  for (std::size_t i = 0; i < shardCount; ++i) {
+    journals_.push_back(std::make_unique<RoomJournal>());
+  }
+}
+
+RoomStore::~RoomStore() {
+  stop();
+  for (auto& journal : journals_) {
+    if (journal->fd_ >= 0) {
+      ::close(journal->fd_);
+    }
+  }
+}
+
+RoomJournal& RoomStore::journal(std::size_t shard) {
+  return *journals_.at(shard);
+}
+
+std::filesystem::path RoomStore::journalPath(std::size_t shard) const {
+  return options_.directory / fmt::format("shard-{}.journal", shard);
+}
+
+std::filesystem::path RoomStore::snapshotPath(std::size_t shard) const {
+  return options_.directory / fmt::format("shard-{}.snapshot", shard);
+}
+
+std::vector<StoredRooms> RoomStore::load() {
+  auto start = std::chrono::steady_clock::now();
+  std::filesystem::create_directories(options_.directory);
+
+  // Every shard an earlier run had, whatever their number was
+  RoomJournal::State merged;
+  uint64_t generation = 0;
+  for (const auto& entry :
+       std::filesystem::directory_iterator(options_.directory)) {
+    const auto& path = entry.path();
+    auto name = path.filename().string();
+    if (not name.starts_with("shard-") or
+        path.extension() != ".snapshot") {
+      continue;
+    }
+
+    RoomJournal::State state;
+    uint64_t snapshotGeneration = 0;
+    MappedFile snapshot(path);
+    if (not decodeSnapshot(snapshot.begin(), snapshot.end(), state,
+                           snapshotGeneration)) {
+      spdlog::error("Ignoring unreadable room snapshot {}", path.string());
+      continue;
+    }
+    auto journalFile = path;
+    journalFile.replace_extension(".journal");
+    MappedFile journal(journalFile);
+    Reader header(journal.begin(), journal.end());
+    uint64_t journalGeneration = 0;
+    if (getFileHeader(header, JOURNAL_MAGIC, journalGeneration) and
+        journalGeneration == snapshotGeneration) {
+      auto replayed =
+          replayRecords(header.position(), journal.end(), state);
+      if (FILE_HEADER_SIZE + replayed < journal.size()) {
+        spdlog::warn("Ignoring the torn end of {}", journalFile.string());
+      }
+    }
+
+    generation = std::max(generation, snapshotGeneration);
+    for (auto& [roomId, participants] : state.rooms) {
+      merged.rooms.insert_or_assign(roomId, std::move(participants));
+    }
+    for (auto& [requestId, request] : state.requests) {
+      merged.requests.insert_or_assign(requestId, std::move(request));
+    }
+  }
+
+  std::vector<StoredRooms> stored(journals_.size());
+  std::size_t roomCount = 0;
+  for (auto& [roomId, participants] : merged.rooms) {
+    if (participants.empty()) {
+      continue;
+    }
+    auto shard = shardOfId(roomId, journals_.size());
+    journals_[shard]->state_.rooms.emplace(roomId, participants);
+    stored[shard].rooms.push_back(
+        {.id = roomId, .participants = std::move(participants)});
+    ++roomCount;
+  }
+  // A request is served by the shard of its id and needs its room there,
+  // which a different thread count may have broken
+  std::size_t requestCount = 0;
+  for (auto& [requestId, request] : merged.requests) {
+    auto& state = journals_[shardOfId(requestId, journals_.size())]->state_;
+    if (state.rooms.contains(request.roomId)) {
+      state.requests.emplace(requestId, request);
+      stored[shardOfId(requestId, journals_.size())].requests.push_back(
+          std::move(request));
+      ++requestCount;
+    }
+  }
+
+  // Fresh files first, so that a crash in between loses nothing
+  for (std::size_t shard = 0; shard < journals_.size(); ++shard) {
+    auto& journal = *journals_[shard];
+    journal.generation_ = generation + 1;
+    if (not writeSnapshot(snapshotPath(shard), journal.state_,
+                          journal.generation_)) {
+      throw RoomStoreError("could not write a room snapshot");
+    }
+    journal.fd_ =
+        startJournal(journalPath(shard), journal.generation_, options_.sync);
+    if (journal.fd_ < 0) {
+      throw RoomStoreError("could not start a room journal");
+    }
+  }
+  removeOtherFiles();
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  spdlog::info("Restored {} rooms and {} join requests from {} in {} ms",
+               roomCount, requestCount, options_.directory.string(),
+               elapsed.count());
+  return stored;
+}
+
+void RoomStore::start() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = false;
+  }
+  writer_ = std::thread([this]() { run(); });
+}
+
+void RoomStore::stop() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  if (writer_.joinable()) {
+    writer_.join();
+  }
+}
+
+void RoomStore::restart() {
+  // A snapshot that cannot be written now is retried by the writer, the
+  // journal counts as broken until then
+  for (std::size_t shard = 0; shard < journals_.size(); ++shard) {
+    compact(*journals_[shard], shard);
+  }
+  removeOtherFiles();
+  spdlog::info("Rewrote the room state in {}", options_.directory.string());
+  start();
+}
+
+void RoomStore::removeOtherFiles() {
+  std::vector<std::filesystem::path> other;
+  for (const auto& entry :
+       std::filesystem::directory_iterator(options_.directory)) {
+    const auto& path = entry.path();
+    if (not path.filename().string().starts_with("shard-")) {
+      continue;
+    }
+    bool current = false;
+    for (std::size_t shard = 0; shard < journals_.size(); ++shard) {
+      current = current or path == snapshotPath(shard) or
+                path == journalPath(shard);
+    }
+    if (not current) {
+      other.push_back(path);
+    }
+  }
+  for (const auto& path : other) {
+    std::error_code error;
+    std::filesystem::remove(path, error);
+  }
+}
+
+void RoomStore::run() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    wake_.wait_for(lock, options_.flushInterval,
+                   [this]() { return stopping_; });
+    auto stopping = stopping_;
+    lock.unlock();
+    for (std::size_t shard = 0; shard < journals_.size(); ++shard) {
+      flush(*journals_[shard], shard);
+    }
+    if (stopping) {
+      return;
+    }
+    lock.lock();
+  }
+}
+
+void RoomStore::flush(RoomJournal& journal, std::size_t shard) {
+  {
+    std::lock_guard lock(journal.mutex_);
+    journal.writing_.swap(journal.pending_);
+  }
+  auto broken = journal.fd_ < 0;
+  if (journal.writing_.empty() and not broken) {
+    return;
+  }
+
+  replayRecords(journal.writing_.data(),
+                journal.writing_.data() + journal.writing_.size(),
+                journal.state_);
+  if (not broken) {
+    if (writeAll(journal.fd_, journal.writing_.data(),
+                 journal.writing_.size()) and
+        (not options_.sync or ::fdatasync(journal.fd_) == 0)) {
+      journal.journalBytes_ += journal.writing_.size();
+    } else {
+      // The journal may end in a torn record now, nothing after it would
+      // be replayed. The snapshot taken below covers it all.
+      logError("write", journalPath(shard));
+      broken = true;
+    }
+  }
+  journal.writing_.clear();
+
+  if (broken or journal.journalBytes_ >= options_.compactBytes) {
+    compact(journal, shard);
+  }
+}
+
+void RoomStore::compact(RoomJournal& journal, std::size_t shard) {
+  if (journal.fd_ >= 0) {
+    ::close(journal.fd_);
+    journal.fd_ = -1;
+  }
+  // Retried on the next flush until the disk cooperates
+  auto generation = journal.generation_ + 1;
+  if (not writeSnapshot(snapshotPath(shard), journal.state_, generation)) {
+    return;
+  }
+  journal.generation_ = generation;
+  journal.fd_ = startJournal(journalPath(shard), generation, options_.sync);
+  journal.journalBytes_ = 0;
+}
+}  // namespace glimpse
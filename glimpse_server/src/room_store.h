@@ -0,0 +1,149 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "id.h"
+#include "user.h"
+#include "ws_message.h"
+
+namespace glimpse {
+
+class RoomStoreError : public std::exception {
+ public:
+  RoomStoreError(const char* message) : msg_(message) {}
+
+  virtual const char* what() const noexcept override { return msg_; }
+
+ private:
+  const char* msg_;
+};
+
+struct StoredRoom {
+  Id id;
+  // The host first, as Room::getParticipants()
+  std::vector<User> participants;
+};
+
+// Rooms and join requests of one shard as an earlier run left them
+struct StoredRooms {
+  std::vector<StoredRoom> rooms;
+  std::vector<WsJoinRoomRequestPayload> requests;
+};
+
+struct RoomStoreOptions {
+  std::filesystem::path directory;
+  // How often queued records are written out, at most what a crash loses
+  std::chrono::milliseconds flushInterval{10};
+  // fdatasync() every write, so that a machine crash loses no more than a
+  // process crash
+  bool sync = true;
+  // A shard's journal is compacted into its snapshot once it grows past
+  // this
+  std::size_t compactBytes = 4 << 20;
+};
+
+// Append-only log of the room and join request mutations of one shard. Its
+// methods are called from the shard's event-loop thread and only encode the
+// record into a buffer; RoomStore's writer thread writes the buffers out in
+// batches.
+class RoomJournal {
+ public:
+  void roomCreated(const Id& roomId, const User& host);
+  void participantAdded(const Id& roomId, const User& user);
+  void participantRemoved(const Id& roomId, const Id& userId);
+  void roomClosed(const Id& roomId);
+  void requestAdded(const WsJoinRoomRequestPayload& request);
+  void requestRemoved(const Id& requestId);
+
+ private:
+  friend class RoomStore;
+
+  // What the journal and snapshot files hold, kept by the writer thread to
+  // take snapshots without involving the event loop
+  struct State {
+    std::unordered_map<Id, std::vector<User>, IdHash> rooms;
+    std::unordered_map<Id, WsJoinRoomRequestPayload, IdHash> requests;
+  };
+
+  std::mutex mutex_;
+  // Records waiting for the writer thread
+  std::string pending_;
+
+  // Owned by the writer thread
+  State state_;
+  int fd_ = -1;
+  uint64_t generation_ = 0;
+  std::size_t journalBytes_ = 0;
+  std::string writing_;
+};
+
+// Persists the rooms of every shard under one directory so that a restarted
+// server carries on with them. Each shard has a snapshot, written through a
+// memory mapping and replaced atomically, and a journal of the records since
+// that snapshot:
+//
+//   shard-N.snapshot  header, then every room and join request
+//   shard-N.journal   header, then length-prefixed, checksummed records
+//
+// Both headers carry a generation. A journal is only replayed on top of the
+// snapshot of the same generation, and a torn record at its end is ignored.
+// Files are in host byte order, they are not meant to move between
+// machines.
+class RoomStore {
+ public:
+  RoomStore(RoomStoreOptions options, std::size_t shardCount);
+  // Stops the writer thread, writing out what is still queued
+  ~RoomStore();
+
+  RoomStore(const RoomStore&) = delete;
+  RoomStore& operator=(const RoomStore&) = delete;
+
+  // Reads what earlier runs left and starts every shard on fresh files
+  // holding it. Rooms and requests are regrouped by the shard that owns
+  // them now, the thread count may have changed. Must be called once,
+  // before start().
+  std::vector<StoredRooms> load();
+  // Starts the writer thread, again after stop() too
+  void start();
+  // Stops it, writing out what is still queued
+  void stop();
+  // Takes the files back from a process that loaded them, then gave up
+  // without taking over, see Handoff: every shard starts on fresh files of
+  // its own state again, the files of other shards are removed and the
+  // writer thread restarts. Must be called after stop().
+  void restart();
+
+  RoomJournal& journal(std::size_t shard);
+
+ private:
+  void run();
+  // Writes out the journal's pending records, compacting it when due
+  void flush(RoomJournal& journal, std::size_t shard);
+  // Writes a snapshot of the journal's state and starts an empty journal of
+  // the next generation
+  void compact(RoomJournal& journal, std::size_t shard);
+  // Removes the files of shards this run does not have, and leftover
+  // temporaries
+  void removeOtherFiles();
+  std::filesystem::path journalPath(std::size_t shard) const;
+  std::filesystem::path snapshotPath(std::size_t shard) const;
+
+  RoomStoreOptions options_;
+  std::vector<std::unique_ptr<RoomJournal>> journals_;
+  std::thread writer_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+};
+}  // namespace glimpse
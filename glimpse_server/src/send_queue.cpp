@@ -0,0 +1,105 @@
+#include "send_queue.h"
+
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace glimpse {
+namespace {
+bool isICE(WsMessage::Type type) {
+  return type == WsMessage::ICE or type == WsMessage::ICE_BATCH;
+}
+
+// Bytes a payload holds on to, close enough to its encoded size
+std::size_t payloadBytes(const WsPayload& payload) {
+  return std::visit(
+      [](const auto& value) -> std::size_t {
+        using T = std::decay_t<decltype(value)>;
+        if constexpr (std::is_same_v<T, std::string>) {
+          return value.size();
+        } else if constexpr (std::is_same_v<T, std::vector<std::string>>) {
+          std::size_t bytes = 0;
+          for (const auto& candidate : value) {
+            bytes += candidate.size();
+          }
+          return bytes;
+        } else {
+          return sizeof(T);
+        }
+      },
+      payload);
+}
+
+// Turns an ICE or ICE_BATCH message into the candidates it carries
+std::vector<std::string> takeCandidates(WsMessage& message) {
+  if (message.type == WsMessage::ICE) {
+    std::vector<std::string> candidates;
+    candidates.push_back(std::move(std::get<std::string>(message.payload)));
+    return candidates;
+  }
+  return std::move(std::get<std::vector<std::string>>(message.payload));
+}
+}  // namespace
+
+DropPolicy dropPolicyOf(WsMessage::Type type) {
+  switch (type) {
+    case WsMessage::PING:
+    case WsMessage::PONG:
+      return DropPolicy::DROP;
+    case WsMessage::ICE:
+    case WsMessage::ICE_BATCH:
+      return DropPolicy::COALESCE;
+    default:
+      return DropPolicy::KEEP;
+  }
+}
+
+SendQueue::SendQueue(std::size_t maxBytes) : maxBytes_(maxBytes) {}
+
+SendQueue::PushResult SendQueue::push(WsMessage message) {
+  auto policy = dropPolicyOf(message.type);
+  if (policy == DropPolicy::DROP) {
+    return PushResult::DROPPED;
+  }
+
+  auto bytes = payloadBytes(message.payload);
+  if (bytes_ + bytes > maxBytes_) {
+    return policy == DropPolicy::KEEP ? PushResult::OVERFLOW
+                                      : PushResult::DROPPED;
+  }
+  bytes_ += bytes;
+
+  // Candidates a peer trickled while the socket was blocked go out as one
+  // batch
+  if (policy == DropPolicy::COALESCE and not messages_.empty() and
+      isICE(messages_.back().type) and messages_.back().from == message.from) {
+    auto& tail = messages_.back();
+    auto candidates = takeCandidates(tail);
+    for (auto& candidate : takeCandidates(message)) {
+      candidates.push_back(std::move(candidate));
+    }
+    tail = {.type = WsMessage::ICE_BATCH,
+            .payload = std::move(candidates),
+            .from = message.from};
+    return PushResult::COALESCED;
+  }
+
+  messages_.push_back(std::move(message));
+  return PushResult::QUEUED;
+}
+
+WsMessage SendQueue::pop() {
+  auto message = std::move(messages_.front());
+  messages_.pop_front();
+  bytes_ -= payloadBytes(message.payload);
+  return message;
+}
+
+bool SendQueue::empty() const { return messages_.empty(); }
+
+std::size_t SendQueue::size() const { return messages_.size(); }
+
+std::size_t SendQueue::bytes() const { return bytes_; }
+}  // namespace glimpse
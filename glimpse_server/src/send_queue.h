@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+
+#include "ws_message.h"
+
+namespace glimpse {
+
+// What happens to a message that cannot be written right away
+enum class DropPolicy {
+  // Keepalives, pointless once they are late
+  DROP,
+  // ICE candidates, merged with candidates of the same peer queued right
+  // before them and dropped when the queue is full
+  COALESCE,
+  // SDP, room state and answers to requests. Never dropped, a session that
+  // overflows its queue with these is closed instead.
+  KEEP,
+};
+
+DropPolicy dropPolicyOf(WsMessage::Type type);
+
+// Messages waiting for a socket's backpressure to clear, bounded by the
+// size of their payloads. Only used from the socket's event loop.
+class SendQueue {
+ public:
+  enum class PushResult { QUEUED, COALESCED, DROPPED, OVERFLOW };
+
+  explicit SendQueue(std::size_t maxBytes);
+
+  PushResult push(WsMessage message);
+  WsMessage pop();
+
+  bool empty() const;
+  std::size_t size() const;
+  std::size_t bytes() const;
+
+ private:
+  std::size_t maxBytes_;
+  std::size_t bytes_ = 0;
+  std::deque<WsMessage> messages_;
+};
+}  // namespace glimpse
@@ -0,0 +1,157 @@
+#include "session_registry.h"
+
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+namespace glimpse {
+SessionRegistry::SessionRegistry(std::size_t loopCount)
+    : stripes_(new std::atomic<const Snapshot*>[STRIPE_COUNT]),
+      readers_(new Reader[loopCount]),
+      readerCount_(loopCount) {
+  for (std::size_t i = 0; i < STRIPE_COUNT; ++i) {
+    stripes_[i].store(new Snapshot{std::vector<Slot>(8), 0},
+                      std::memory_order_relaxed);
+  }
+}
+
+SessionRegistry::~SessionRegistry() {
+  for (std::size_t i = 0; i < STRIPE_COUNT; ++i) {
+    auto* snapshot = stripes_[i].load(std::memory_order_relaxed);
+    for (const auto& slot : snapshot->slots) {
+      delete slot.entry;
+    }
+    delete snapshot;
+  }
+}
+
+std::size_t SessionRegistry::size() const {
+  return size_.load(std::memory_order_relaxed);
+}
+
+void SessionRegistry::attach(std::size_t loopIndex) {
+  auto& reader = readers_[loopIndex];
+  reader.loop = uWS::Loop::get();
+  reader.epoch.store(epoch_.load());
+  // A loop holds no snapshot pointers once an iteration is done
+  reader.loop->addPostHandler(
+      this, [this, loopIndex](uWS::Loop*) { quiescent(loopIndex); });
+}
+
+std::optional<WsSessionRef> SessionRegistry::find(const Id& userId) const {
+  auto hash = IdHash{}(userId);
+  const auto* snapshot =
+      stripes_[hash % STRIPE_COUNT].load(std::memory_order_acquire);
+  if (const auto* entry = lookup(*snapshot, hash, userId)) {
+    return entry->session;
+  }
+  return std::nullopt;
+}
+
+void SessionRegistry::insert(const Id& userId, WsSessionRef session) {
+  auto hash = IdHash{}(userId);
+  auto stripe = hash % STRIPE_COUNT;
+  auto* added = new Entry{userId, session};
+
+  std::lock_guard<std::mutex> lock(writeMutex_);
+  const auto* current = stripes_[stripe].load(std::memory_order_relaxed);
+  const auto* removed = lookup(*current, hash, userId);
+  publish(stripe, rebuild(*current, removed, added), removed);
+  if (removed == nullptr) {
+    size_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void SessionRegistry::erase(const Id& userId, const WsSession* ws) {
+  auto hash = IdHash{}(userId);
+  auto stripe = hash % STRIPE_COUNT;
+
+  std::lock_guard<std::mutex> lock(writeMutex_);
+  const auto* current = stripes_[stripe].load(std::memory_order_relaxed);
+  const auto* removed = lookup(*current, hash, userId);
+  if (removed == nullptr or removed->session.ws != ws) {
+    return;
+  }
+  publish(stripe, rebuild(*current, removed, nullptr), removed);
+  size_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+const SessionRegistry::Entry* SessionRegistry::lookup(
+    const Snapshot& snapshot, std::size_t hash, const Id& userId) {
+  auto mask = snapshot.slots.size() - 1;
+  // Stripes are selected by the low bits, probe with the high ones
+  for (auto i = (hash >> 6) & mask;; i = (i + 1) & mask) {
+    const auto& slot = snapshot.slots[i];
+    if (slot.entry == nullptr) {
+      return nullptr;
+    }
+    if (slot.hash == hash and slot.entry->userId == userId) {
+      return slot.entry;
+    }
+  }
+}
+
+SessionRegistry::Snapshot* SessionRegistry::rebuild(const Snapshot& current,
+                                                    const Entry* removed,
+                                                    const Entry* added) {
+  auto size = current.size - (removed ? 1 : 0) + (added ? 1 : 0);
+  auto capacity = std::max<std::size_t>(8, std::bit_ceil(size * 2));
+  auto* snapshot = new Snapshot{std::vector<Slot>(capacity), size};
+
+  auto place = [snapshot, mask = capacity - 1](const Slot& slot) {
+    auto i = (slot.hash >> 6) & mask;
+    while (snapshot->slots[i].entry != nullptr) {
+      i = (i + 1) & mask;
+    }
+    snapshot->slots[i] = slot;
+  };
+
+  for (const auto& slot : current.slots) {
+    if (slot.entry != nullptr and slot.entry != removed) {
+      place(slot);
+    }
+  }
+  if (added) {
+    place({IdHash{}(added->userId), added});
+  }
+  return snapshot;
+}
+
+void SessionRegistry::publish(std::size_t stripe, Snapshot* snapshot,
+                              const Entry* removedEntry) {
+  const auto* old = stripes_[stripe].exchange(snapshot);
+  auto retiredAt = epoch_.fetch_add(1) + 1;
+  retired_.push_back({std::unique_ptr<const Snapshot>(old),
+                      std::unique_ptr<const Entry>(removedEntry), retiredAt});
+  reclaim();
+}
+
+void SessionRegistry::reclaim() {
+  auto safeEpoch = UINT64_MAX;
+  for (std::size_t i = 0; i < readerCount_; ++i) {
+    safeEpoch = std::min(safeEpoch, readers_[i].epoch.load());
+  }
+
+  std::erase_if(retired_, [safeEpoch](const Retired& retired) {
+    return retired.epoch <= safeEpoch;
+  });
+
+  if (retired_.size() < NUDGE_THRESHOLD or
+      nudgedAt_ >= retired_.front().epoch) {
+    return;
+  }
+  // An idle loop never reaches a quiescent point on its own, wake the ones
+  // that hold back reclamation with an empty task.
+  auto oldest = retired_.front().epoch;
+  nudgedAt_ = retired_.back().epoch;
+  for (std::size_t i = 0; i < readerCount_; ++i) {
+    if (readers_[i].epoch.load() < oldest and readers_[i].loop) {
+      readers_[i].loop->defer([]() {});
+    }
+  }
+}
+
+void SessionRegistry::quiescent(std::size_t loopIndex) {
+  readers_[loopIndex].epoch.store(epoch_.load());
+}
+}  // namespace glimpse
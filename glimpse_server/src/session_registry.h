@@ -0,0 +1,129 @@
+#pragma once
+#include <uwebsockets/Loop.h>
+#include <uwebsockets/WebSocket.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "id.h"
+#include "resume_log.h"
+#include "send_queue.h"
+#include "user.h"
+
+namespace glimpse {
+// Bound for the messages a session queues while it is backpressured
+constexpr std::size_t WS_SEND_QUEUE_MAX_BYTES = 256 * 1024;
+
+// Per-socket state kept by uWS
+struct WsSessionData {
+  User user;
+  SendQueue sendQueue{WS_SEND_QUEUE_MAX_BYTES};
+  // Set once the socket is closed or being closed, nothing is sent after
+  bool closing = false;
+  // The client offered permessage-deflate, see WsCompressionOptions
+  bool deflate = false;
+  // The client connected with ?resume=, to resume the session with
+  // `resumeToken` after the frame numbered `resumeAfter`. A nil token
+  // starts a new session.
+  bool resumable = false;
+  Id resumeToken{};
+  uint64_t resumeAfter = 0;
+  // Set on open for resumable sessions, the socket's frames are logged
+  // while `resumeGeneration` is the state's owner
+  std::shared_ptr<ResumeState> resume{};
+  uint64_t resumeGeneration = 0;
+};
+
+using WsSession = uWS::WebSocket<false, true, WsSessionData>;
+
+// A connected session and the event loop its socket belongs to. The socket
+// may only be written to from that loop's thread.
+struct WsSessionRef {
+  WsSession* ws;
+  uWS::Loop* loop;
+};
+
+// Maps user ids to their session. Lookups are wait-free and may run on any
+// event-loop thread: the table is split into stripes, and each stripe is an
+// immutable open-addressing snapshot published through one atomic pointer.
+// Writers (socket open/close) copy the stripe they change, publish the copy
+// and retire the old snapshot until every loop has passed a quiescent point
+// (the end of a loop iteration), so readers never take a lock.
+class SessionRegistry {
+ public:
+  SessionRegistry(std::size_t loopCount);
+  ~SessionRegistry();
+
+  SessionRegistry(const SessionRegistry&) = delete;
+  SessionRegistry& operator=(const SessionRegistry&) = delete;
+
+  // Must be called once from each event-loop thread before it reads
+  void attach(std::size_t loopIndex);
+
+  std::optional<WsSessionRef> find(const Id& userId) const;
+  void insert(const Id& userId, WsSessionRef session);
+  // Removes the user only if the entry still belongs to `ws`
+  void erase(const Id& userId, const WsSession* ws);
+  // Number of connected users
+  std::size_t size() const;
+
+ private:
+  struct Entry {
+    Id userId;
+    WsSessionRef session;
+  };
+
+  struct Slot {
+    std::size_t hash;
+    const Entry* entry;
+  };
+
+  // Immutable once published. Capacity is a power of two and at most half
+  // full, so probes are short and always hit an empty slot.
+  struct Snapshot {
+    std::vector<Slot> slots;
+    std::size_t size;
+  };
+
+  struct Retired {
+    std::unique_ptr<const Snapshot> snapshot;
+    std::unique_ptr<const Entry> entry;
+    uint64_t epoch;
+  };
+
+  struct alignas(64) Reader {
+    std::atomic<uint64_t> epoch{0};
+    uWS::Loop* loop = nullptr;
+  };
+
+  static constexpr std::size_t STRIPE_COUNT = 64;
+  static constexpr std::size_t NUDGE_THRESHOLD = 64;
+
+  static const Entry* lookup(const Snapshot& snapshot, std::size_t hash,
+                             const Id& userId);
+  // Builds a copy of `current` with `removed` dropped and `added` inserted
+  static Snapshot* rebuild(const Snapshot& current, const Entry* removed,
+                           const Entry* added);
+
+  void publish(std::size_t stripe, Snapshot* snapshot,
+               const Entry* removedEntry);
+  void reclaim();
+  void quiescent(std::size_t loopIndex);
+
+  std::unique_ptr<std::atomic<const Snapshot*>[]> stripes_;
+  std::unique_ptr<Reader[]> readers_;
+  std::size_t readerCount_;
+
+  std::atomic<uint64_t> epoch_{1};
+  // Serializes writers only, readers never take it
+  std::mutex writeMutex_;
+  std::vector<Retired> retired_;
+  uint64_t nudgedAt_ = 0;
+  std::atomic<std::size_t> size_{0};
+};
+}  // namespace glimpse
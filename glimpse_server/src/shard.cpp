@@ -0,0 +1,70 @@
+#include "shard.h"
+
+#include <latch>
+
+namespace glimpse {
+
+thread_local std::size_t ShardRouter::current_ = SIZE_MAX;
+
+ShardRouter::ShardRouter(std::size_t shardCount,
+                         std::shared_ptr<WsManager> wsManager,
+                         RoomManagerOptions options,
+                         std::shared_ptr<RoomStore> store)
+    : shards_(shardCount), store_(store) {
+  for (std::size_t i = 0; i < shardCount; ++i) {
+    shards_[i].roomManager = std::make_unique<RoomManager>(
+        wsManager, i, shardCount, options,
+        store ? &store->journal(i) : nullptr);
+  }
+}
+
+void ShardRouter::restore(std::vector<StoredRooms> stored) {
+  for (std::size_t i = 0; i < stored.size() and i < shards_.size(); ++i) {
+    shards_[i].roomManager->restore(std::move(stored[i]));
+  }
+}
+
+void ShardRouter::attach(std::size_t index) {
+  current_ = index;
+  auto& shard = shards_.at(index);
+  shard.loop = uWS::Loop::get();
+  shard.roomManager->attach(shard.loop);
+}
+
+std::vector<StoredRooms> ShardRouter::freeze() {
+  std::vector<StoredRooms> frozen(shards_.size());
+  std::latch done(static_cast<std::ptrdiff_t>(shards_.size()));
+  for (std::size_t i = 0; i < shards_.size(); ++i) {
+    post(i, [&frozen, &done, i](RoomManager& roomManager) {
+      frozen[i] = roomManager.freeze();
+      done.count_down();
+    });
+  }
+  done.wait();
+  return frozen;
+}
+
+void ShardRouter::thaw() {
+  for (std::size_t i = 0; i < shards_.size(); ++i) {
+    post(i, [](RoomManager& roomManager) { roomManager.thaw(); });
+  }
+}
+
+void ShardRouter::drain(std::chrono::milliseconds window) {
+  std::latch done(static_cast<std::ptrdiff_t>(shards_.size()));
+  for (std::size_t i = 0; i < shards_.size(); ++i) {
+    post(i, [window, &done](RoomManager& roomManager) {
+      roomManager.drain(window, [&done]() { done.count_down(); });
+    });
+  }
+  done.wait();
+}
+
+std::size_t ShardRouter::size() const { return shards_.size(); }
+
+std::size_t ShardRouter::current() const { return current_; }
+
+std::size_t ShardRouter::shardOf(const Id& id) const {
+  return shardOfId(id, shards_.size());
+}
+}  // namespace glimpse
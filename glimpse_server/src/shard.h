@@ -0,0 +1,90 @@
+#pragma once
+
+#include <uwebsockets/Loop.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "id.h"
+#include "room_manager.h"
+#include "room_store.h"
+#include "ws_manager.h"
+
+namespace glimpse {
+
+// A shard is one event-loop thread together with the room state it owns.
+// Rooms and join requests are only ever touched from their owner thread.
+struct Shard {
+  uWS::Loop *loop = nullptr;
+  std::unique_ptr<RoomManager> roomManager;
+};
+
+class ShardRouter {
+ public:
+  // Room state is persisted in `store` if there is one
+  ShardRouter(std::size_t shardCount, std::shared_ptr<WsManager> wsManager,
+              RoomManagerOptions options = {},
+              std::shared_ptr<RoomStore> store = nullptr);
+
+  // Hands the state RoomStore::load() found to the shards, before any of
+  // them runs
+  void restore(std::vector<StoredRooms> stored);
+
+  // Binds the calling thread's event loop to shard `index`. Must be called
+  // once from every event-loop thread before it starts accepting requests.
+  void attach(std::size_t index);
+
+  std::size_t size() const;
+  // Index of the shard owned by the calling thread
+  std::size_t current() const;
+  std::size_t shardOf(const Id &id) const;
+
+  // Runs `task` on the event loop of `shard`. Runs inline when the caller
+  // already is that shard, otherwise forwards it with uWS::Loop::defer.
+  // May be called from any thread once every shard is attached.
+  template <typename Task>
+  void run(std::size_t shard, Task &&task);
+
+  // Runs `task(RoomManager&)` against the room state owned by `shard`.
+  template <typename Task>
+  void post(std::size_t shard, Task &&task);
+
+  // RoomManager::freeze() on every shard, returning what each froze. Must
+  // be called from a thread that runs no shard, it waits for all of them.
+  std::vector<StoredRooms> freeze();
+  // RoomManager::thaw() on every shard, without waiting
+  void thaw();
+  // RoomManager::drain() on every shard, returning once all of them closed
+  // their last sockets. Must be called from a thread that runs no shard.
+  void drain(std::chrono::milliseconds window);
+
+ private:
+  // SIZE_MAX on threads that run no shard, such as the cluster bus thread:
+  // run() always defers from them
+  static thread_local std::size_t current_;
+
+  std::vector<Shard> shards_;
+  std::shared_ptr<RoomStore> store_;
+};
+
+template <typename Task>
+void ShardRouter::run(std::size_t shard, Task &&task) {
+  if (shard == current_) {
+    task();
+    return;
+  }
+  shards_.at(shard).loop->defer(std::forward<Task>(task));
+}
+
+template <typename Task>
+void ShardRouter::post(std::size_t shard, Task &&task) {
+  auto *roomManager = shards_.at(shard).roomManager.get();
+  run(shard, [roomManager, task = std::forward<Task>(task)]() mutable {
+    task(*roomManager);
+  });
+}
+}  // namespace glimpse
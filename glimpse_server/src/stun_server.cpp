@@ -0,0 +1,451 @@
+#include "stun_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "logging.h"
+
+namespace glimpse {
+namespace {
+constexpr std::size_t HEADER_SIZE = 20;
+constexpr uint32_t MAGIC_COOKIE = 0x2112A442;
+constexpr uint32_t FINGERPRINT_XOR = 0x5354554e;
+
+enum MessageType : uint16_t {
+  BINDING_REQUEST = 0x0001,
+  BINDING_SUCCESS = 0x0101,
+  BINDING_ERROR = 0x0111,
+};
+
+enum Attribute : uint16_t {
+  USERNAME = 0x0006,
+  MESSAGE_INTEGRITY = 0x0008,
+  ERROR_CODE = 0x0009,
+  UNKNOWN_ATTRIBUTES = 0x000A,
+  REALM = 0x0014,
+  NONCE = 0x0015,
+  XOR_MAPPED_ADDRESS = 0x0020,
+  PRIORITY = 0x0024,
+  USE_CANDIDATE = 0x0025,
+  FINGERPRINT = 0x8028,
+};
+
+constexpr std::string_view UNKNOWN_ATTRIBUTE_REASON = "Unknown Attribute";
+// Attributes listed in a 420 answer, the rest are left out
+constexpr std::size_t MAX_UNKNOWN_ATTRIBUTES = 8;
+// Larger datagrams are truncated and fail the length check
+constexpr std::size_t DATAGRAM_SIZE = 1500;
+
+logging::RateLimit socketErrorLog;
+
+uint16_t load16(const char* in) {
+  uint16_t value;
+  std::memcpy(&value, in, sizeof value);
+  return ntohs(value);
+}
+
+uint32_t load32(const char* in) {
+  uint32_t value;
+  std::memcpy(&value, in, sizeof value);
+  return ntohl(value);
+}
+
+void store16(char* out, uint16_t value) {
+  value = htons(value);
+  std::memcpy(out, &value, sizeof value);
+}
+
+void store32(char* out, uint32_t value) {
+  value = htonl(value);
+  std::memcpy(out, &value, sizeof value);
+}
+
+uint32_t fingerprintOf(const char* message, std::size_t size) {
+  auto crc = ::crc32(0, reinterpret_cast<const Bytef*>(message),
+                     static_cast<uInt>(size));
+  return static_cast<uint32_t>(crc) ^ FINGERPRINT_XOR;
+}
+
+// Writes an attribute header, returns where its value goes
+char* putAttribute(char* out, uint16_t type, uint16_t length) {
+  store16(out, type);
+  store16(out + 2, length);
+  return out + 4;
+}
+
+// Zeroes the padding of a value of `length` bytes at `value`, returns the
+// end of the attribute
+char* pad(char* value, std::size_t length) {
+  auto padded = (length + 3) & ~std::size_t(3);
+  std::memset(value + length, 0, padded - length);
+  return value + padded;
+}
+
+// Attributes a Binding request may carry that are comprehension-required,
+// see RFC 5389 section 15 and RFC 8445. They are not acted upon: this
+// server does not authenticate.
+bool isKnown(uint16_t type) {
+  switch (type) {
+    case USERNAME:
+    case MESSAGE_INTEGRITY:
+    case REALM:
+    case NONCE:
+    case PRIORITY:
+    case USE_CANDIDATE:
+      return true;
+    default:
+      // 0x8000 and above are comprehension-optional
+      return type >= 0x8000;
+  }
+}
+
+// XOR-MAPPED-ADDRESS of `from`, with IPv4-mapped IPv6 addresses given as
+// IPv4. `key` is the magic cookie followed by the transaction id. Returns
+// nullptr for other address families.
+char* putMappedAddress(char* out, const sockaddr_storage& from,
+                       const char* key) {
+  const char* address = nullptr;
+  std::size_t addressSize = 0;
+  uint16_t port = 0;
+  uint8_t family = 0;
+  if (from.ss_family == AF_INET) {
+    const auto& v4 = reinterpret_cast<const sockaddr_in&>(from);
+    address = reinterpret_cast<const char*>(&v4.sin_addr);
+    addressSize = 4;
+    port = ntohs(v4.sin_port);
+    family = 0x01;
+  } else if (from.ss_family == AF_INET6) {
+    const auto& v6 = reinterpret_cast<const sockaddr_in6&>(from);
+    address = reinterpret_cast<const char*>(&v6.sin6_addr);
+    addressSize = 16;
+    if (IN6_IS_ADDR_V4MAPPED(&v6.sin6_addr)) {
+      address += 12;
+      addressSize = 4;
+    }
+    port = ntohs(v6.sin6_port);
+    family = addressSize == 4 ? 0x01 : 0x02;
+  } else {
+    return nullptr;
+  }
+
+  auto* value = putAttribute(out, XOR_MAPPED_ADDRESS,
+                             static_cast<uint16_t>(4 + addressSize));
+  value[0] = 0;
+  value[1] = static_cast<char>(family);
+  store16(value + 2, port ^ static_cast<uint16_t>(MAGIC_COOKIE >> 16));
+  for (std::size_t i = 0; i < addressSize; ++i) {
+    value[4 + i] = static_cast<char>(address[i] ^ key[i]);
+  }
+  return value + 4 + addressSize;
+}
+
+// ERROR-CODE 420 and UNKNOWN-ATTRIBUTES
+char* putUnknownAttributes(char* out, const uint16_t* unknown,
+                           std::size_t count) {
+  auto reasonSize = UNKNOWN_ATTRIBUTE_REASON.size();
+  auto* value = putAttribute(out, ERROR_CODE,
+                             static_cast<uint16_t>(4 + reasonSize));
+  value[0] = 0;
+  value[1] = 0;
+  value[2] = 4;
+  value[3] = 20;
+  std::memcpy(value + 4, UNKNOWN_ATTRIBUTE_REASON.data(), reasonSize);
+  out = pad(value, 4 + reasonSize);
+
+  value = putAttribute(out, UNKNOWN_ATTRIBUTES,
+                       static_cast<uint16_t>(2 * count));
+  for (std::size_t i = 0; i < count; ++i) {
+    store16(value + 2 * i, unknown[i]);
+  }
+  return pad(value, 2 * count);
+}
+}  // namespace
+
+std::size_t answerStunRequest(const char* request, std::size_t size,
+                              const sockaddr_storage& from, char* response) {
+  // The two leading zero bits, the method and the class are all in the
+  // type, a Binding request is one value
+  if (size < HEADER_SIZE or load16(request) != BINDING_REQUEST or
+      load32(request + 4) != MAGIC_COOKIE) {
+    return 0;
+  }
+  auto length = load16(request + 2);
+  if (length % 4 != 0 or HEADER_SIZE + length != size) {
+    return 0;
+  }
+
+  std::array<uint16_t, MAX_UNKNOWN_ATTRIBUTES> unknown;
+  std::size_t unknownCount = 0;
+  bool fingerprint = false;
+  for (auto offset = HEADER_SIZE; offset < size;) {
+    if (size - offset < 4) {
+      return 0;
+    }
+    auto type = load16(request + offset);
+    std::size_t valueSize = load16(request + offset + 2);
+    auto padded = (valueSize + 3) & ~std::size_t(3);
+    if (size - offset - 4 < padded) {
+      return 0;
+    }
+    if (type == FINGERPRINT) {
+      // Always last, over the message up to it
+      if (valueSize != 4 or offset + 8 != size or
+          load32(request + offset + 4) != fingerprintOf(request, offset)) {
+        return 0;
+      }
+      fingerprint = true;
+    } else if (not isKnown(type) and unknownCount < unknown.size()) {
+      unknown[unknownCount++] = type;
+    }
+    offset += 4 + padded;
+  }
+
+  // Same magic cookie and transaction id
+  std::memcpy(response, request, HEADER_SIZE);
+  auto* out = response + HEADER_SIZE;
+  if (unknownCount > 0) {
+    store16(response, BINDING_ERROR);
+    out = putUnknownAttributes(out, unknown.data(), unknownCount);
+  } else {
+    store16(response, BINDING_SUCCESS);
+    out = putMappedAddress(out, from, request + 4);
+    if (out == nullptr) {
+      return 0;
+    }
+  }
+
+  // The length covers the fingerprint before it is computed
+  std::size_t answerSize = out - response + (fingerprint ? 8 : 0);
+  store16(response + 2, static_cast<uint16_t>(answerSize - HEADER_SIZE));
+  if (fingerprint) {
+    auto* value = putAttribute(out, FINGERPRINT, 4);
+    store32(value, fingerprintOf(response, out - response));
+  }
+  return answerSize;
+}
+
+std::string_view stunUsernameOf(const char* request, std::size_t size) {
+  if (size < HEADER_SIZE or load16(request) != BINDING_REQUEST or
+      load32(request + 4) != MAGIC_COOKIE or
+      HEADER_SIZE + load16(request + 2) != size) {
+    return {};
+  }
+  for (auto offset = HEADER_SIZE; size - offset >= 4;) {
+    auto type = load16(request + offset);
+    std::size_t valueSize = load16(request + offset + 2);
+    if (size - offset - 4 < valueSize) {
+      return {};
+    }
+    if (type == USERNAME) {
+      return {request + offset + 4, valueSize};
+    }
+    offset += 4 + ((valueSize + 3) & ~std::size_t(3));
+    if (offset > size) {
+      return {};
+    }
+  }
+  return {};
+}
+
+StunServer::StunServer(StunServerOptions options, int fd)
+    : options_(options) {
+  wakeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd >= 0) {
+    fd_ = fd;
+    return;
+  }
+
+  // Dual-stack where IPv6 is available, IPv4 clients then appear as
+  // IPv4-mapped addresses
+  int family = AF_INET6;
+  fd_ = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0 and errno == EAFNOSUPPORT) {
+    family = AF_INET;
+    fd_ = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  }
+
+  sockaddr_storage address{};
+  socklen_t addressSize = 0;
+  if (family == AF_INET6) {
+    auto& v6 = reinterpret_cast<sockaddr_in6&>(address);
+    v6.sin6_family = AF_INET6;
+    v6.sin6_addr = in6addr_any;
+    v6.sin6_port = htons(options_.port);
+    addressSize = sizeof v6;
+  } else {
+    auto& v4 = reinterpret_cast<sockaddr_in&>(address);
+    v4.sin_family = AF_INET;
+    v4.sin_addr.s_addr = htonl(INADDR_ANY);
+    v4.sin_port = htons(options_.port);
+    addressSize = sizeof v4;
+  }
+
+  int zero = 0;
+  // A burst of call setups must not overflow the default buffer
+  int bufferSize = 4 << 20;
+  if (fd_ >= 0) {
+    if (family == AF_INET6) {
+      ::setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof zero);
+    }
+    ::setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof bufferSize);
+  }
+  if (fd_ < 0 or
+      ::bind(fd_, reinterpret_cast<const sockaddr*>(&address), addressSize) <
+          0) {
+    auto error = errno;
+    spdlog::error("Could not bind STUN port {}: {}", options_.port,
+                  std::strerror(error));
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+    ::close(wakeFd_);
+    throw StunServerError("could not bind the STUN port");
+  }
+}
+
+StunServer::~StunServer() {
+  stop();
+  ::close(fd_);
+  ::close(wakeFd_);
+}
+
+void StunServer::start() {
+  spdlog::info("STUN server listening on UDP port {}", options_.port);
+  thread_ = std::thread([this]() { run(); });
+}
+
+void StunServer::stop() {
+  stopping_.store(true);
+  uint64_t one = 1;
+  [[maybe_unused]] auto written = ::write(wakeFd_, &one, sizeof one);
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+StunServerStats StunServer::stats() const {
+  return {
+      .requests = requests_.load(std::memory_order_relaxed),
+      .errors = errors_.load(std::memory_order_relaxed),
+      .ignored = ignored_.load(std::memory_order_relaxed),
+      .batches = batches_.load(std::memory_order_relaxed),
+      .requestsPerSecond = requestsPerSecond_.load(std::memory_order_relaxed),
+  };
+}
+
+void StunServer::run() {
+  auto batchSize = std::max<std::size_t>(1, options_.batchSize);
+  // Datagram i is read into slot i and answered from answer slot i
+  std::vector<char> datagrams(batchSize * DATAGRAM_SIZE);
+  std::vector<char> answers(batchSize * STUN_MAX_RESPONSE_SIZE);
+  std::vector<sockaddr_storage> peers(batchSize);
+  std::vector<iovec> datagramVectors(batchSize);
+  std::vector<iovec> answerVectors(batchSize);
+  std::vector<mmsghdr> received(batchSize);
+  std::vector<mmsghdr> sending(batchSize);
+  for (std::size_t i = 0; i < batchSize; ++i) {
+    datagramVectors[i] = {.iov_base = &datagrams[i * DATAGRAM_SIZE],
+                          .iov_len = DATAGRAM_SIZE};
+    received[i].msg_hdr.msg_name = &peers[i];
+    received[i].msg_hdr.msg_iov = &datagramVectors[i];
+    received[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  std::array<pollfd, 2> watched{};
+  watched[0] = {.fd = fd_, .events = POLLIN, .revents = 0};
+  watched[1] = {.fd = wakeFd_, .events = POLLIN, .revents = 0};
+  auto nextSecond = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  uint64_t requestsAtSecond = 0;
+  while (not stopping_.load()) {
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        nextSecond - std::chrono::steady_clock::now());
+    ::poll(watched.data(), watched.size(),
+           static_cast<int>(std::max<int64_t>(0, timeout.count())));
+
+    auto now = std::chrono::steady_clock::now();
+    if (now >= nextSecond) {
+      auto requests = requests_.load(std::memory_order_relaxed);
+      requestsPerSecond_.store(requests - requestsAtSecond,
+                               std::memory_order_relaxed);
+      requestsAtSecond = requests;
+      nextSecond = std::max(nextSecond + std::chrono::seconds(1),
+                            now + std::chrono::milliseconds(1));
+    }
+
+    // A full batch means more datagrams are waiting
+    auto count = batchSize;
+    while (count == batchSize) {
+      for (auto& message : received) {
+        message.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+      }
+      auto result = ::recvmmsg(fd_, received.data(), batchSize, MSG_DONTWAIT,
+                               nullptr);
+      if (result <= 0) {
+        if (result < 0 and errno != EAGAIN and errno != EINTR) {
+          logging::limited(socketErrorLog, spdlog::level::err,
+                           "STUN recvmmsg failed: {}", std::strerror(errno));
+        }
+        break;
+      }
+      count = static_cast<std::size_t>(result);
+      batches_.fetch_add(1, std::memory_order_relaxed);
+
+      std::size_t answerCount = 0;
+      uint64_t answered = 0;
+      uint64_t rejected = 0;
+      for (std::size_t i = 0; i < count; ++i) {
+        auto* answer = &answers[i * STUN_MAX_RESPONSE_SIZE];
+        auto size = answerStunRequest(&datagrams[i * DATAGRAM_SIZE],
+                                      received[i].msg_len, peers[i], answer);
+        if (size == 0) {
+          continue;
+        }
+        if (load16(answer) == BINDING_ERROR) {
+          ++rejected;
+        } else {
+          ++answered;
+        }
+        answerVectors[answerCount] = {.iov_base = answer, .iov_len = size};
+        auto& header = sending[answerCount].msg_hdr;
+        header.msg_name = &peers[i];
+        header.msg_namelen = received[i].msg_hdr.msg_namelen;
+        header.msg_iov = &answerVectors[answerCount];
+        header.msg_iovlen = 1;
+        ++answerCount;
+      }
+
+      // Clients retransmit, an answer the socket cannot take is dropped
+      for (std::size_t sent = 0; sent < answerCount;) {
+        auto result = ::sendmmsg(fd_, &sending[sent], answerCount - sent, 0);
+        if (result > 0) {
+          sent += static_cast<std::size_t>(result);
+        } else if (errno == EAGAIN or errno == EWOULDBLOCK) {
+          break;
+        } else if (errno != EINTR) {
+          // Skip the answer that failed, e.g. to an unreachable network
+          logging::limited(socketErrorLog, spdlog::level::err,
+                           "STUN sendmmsg failed: {}", std::strerror(errno));
+          ++sent;
+        }
+      }
+
+      requests_.fetch_add(answered, std::memory_order_relaxed);
+      errors_.fetch_add(rejected, std::memory_order_relaxed);
+      ignored_.fetch_add(count - answered - rejected,
+                         std::memory_order_relaxed);
+    }
+  }
+}
+}  // namespace glimpse
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string_view>
+#include <thread>
+
+namespace glimpse {
+
+class StunServerError : public std::exception {
+ public:
+  StunServerError(const char* message) : msg_(message) {}
+
+  virtual const char* what() const noexcept override { return msg_; }
+
+ private:
+  const char* msg_;
+};
+
+// Largest answer answerStunRequest() writes
+constexpr std::size_t STUN_MAX_RESPONSE_SIZE = 128;
+
+// Answers a STUN (RFC 5389) datagram from `from`. Returns the size of the
+// answer written to `response`, or 0 if the datagram must be ignored: not
+// STUN, malformed, or anything but a Binding request.
+//
+// A request without attributes, which is what browsers send when gathering
+// server-reflexive candidates, is answered straight from its header. Other
+// requests have their attributes checked; unknown comprehension-required
+// ones get a 420 error, and a FINGERPRINT is answered with one.
+std::size_t answerStunRequest(const char* request, std::size_t size,
+                              const sockaddr_storage& from, char* response);
+
+// The USERNAME of a STUN Binding request, empty if the datagram is not one
+// or has none. The datagram is only walked as far as the attribute.
+std::string_view stunUsernameOf(const char* request, std::size_t size);
+
+struct StunServerOptions {
+  uint16_t port = 3478;
+  // Datagrams read and answered per system call
+  std::size_t batchSize = 64;
+};
+
+// Totals since start
+struct StunServerStats {
+  // Binding requests answered with the mapped address
+  uint64_t requests;
+  // Requests answered with an error
+  uint64_t errors;
+  // Datagrams ignored, see answerStunRequest()
+  uint64_t ignored;
+  // recvmmsg calls that returned datagrams, requests per batch tell how
+  // well the load is batched
+  uint64_t batches;
+  // Binding requests answered during the last full second
+  uint64_t requestsPerSecond;
+};
+
+// STUN binding responder, so that clients find their server-reflexive
+// address without an outside STUN server.
+//
+// A single thread owns the UDP socket. It waits for it to become readable,
+// then drains it with recvmmsg, answers every datagram of the batch into a
+// preallocated buffer and sends the answers with one sendmmsg. Nothing is
+// kept between datagrams and nothing is allocated per datagram.
+class StunServer {
+ public:
+  // Binds the port, IPv6 and IPv4 when the host allows. Throws
+  // StunServerError if it cannot. Takes over `fd` instead if given, a UDP
+  // socket bound by the process this one replaces, see Handoff.
+  StunServer(StunServerOptions options, int fd = -1);
+  ~StunServer();
+
+  StunServer(const StunServer&) = delete;
+  StunServer& operator=(const StunServer&) = delete;
+
+  void start();
+  void stop();
+
+  StunServerStats stats() const;
+  // The UDP socket, handed to the process replacing this one
+  int fd() const { return fd_; }
+
+ private:
+  void run();
+
+  StunServerOptions options_;
+  int fd_ = -1;
+  int wakeFd_ = -1;
+  std::thread thread_;
+  std::atomic<bool> stopping_ = false;
+
+  std::atomic<uint64_t> requests_ = 0;
+  std::atomic<uint64_t> errors_ = 0;
+  std::atomic<uint64_t> ignored_ = 0;
+  std::atomic<uint64_t> batches_ = 0;
+  std::atomic<uint64_t> requestsPerSecond_ = 0;
+};
+}  // namespace glimpse
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace glimpse {
+
+// Hashed timing wheel. Items are bucketed by the tick they are due on, so
+// advancing one tick only visits the items of one slot. As long as delays
+// are shorter than the wheel, that is exactly the items expiring now; longer
+// delays wrap around and are visited once per revolution.
+//
+// Items cannot be cancelled. Owners check on expiry whether the item still
+// applies, which keeps scheduling allocation free once the slots have grown.
+template <typename T>
+class TimerWheel {
+ public:
+  explicit TimerWheel(std::size_t slotCount) : slots_(slotCount) {}
+
+  // Due after `delayTicks` calls to advance(), at least one
+  void schedule(std::size_t delayTicks, T item) {
+    delayTicks = std::max<std::size_t>(delayTicks, 1);
+    auto slot = (current_ + delayTicks) % slots_.size();
+    auto rounds = (delayTicks - 1) / slots_.size();
+    slots_[slot].push_back({rounds, std::move(item)});
+    ++size_;
+  }
+
+  // Moves one tick forward and calls `onExpired(T&&)` for every item due.
+  // `onExpired` may schedule new items.
+  template <typename OnExpired>
+  void advance(OnExpired&& onExpired) {
+    current_ = (current_ + 1) % slots_.size();
+
+    // Items scheduled by the callbacks may land in this very slot
+    std::vector<Entry> due;
+    due.swap(slots_[current_]);
+    for (auto& entry : due) {
+      if (entry.rounds > 0) {
+        --entry.rounds;
+        slots_[current_].push_back(std::move(entry));
+        continue;
+      }
+      --size_;
+      onExpired(std::move(entry.item));
+    }
+
+    // Give the slot its storage back for the next revolution
+    if (slots_[current_].empty()) {
+      due.clear();
+      slots_[current_].swap(due);
+    }
+  }
+
+  std::size_t size() const { return size_; }
+
+ private:
+  struct Entry {
+    std::size_t rounds;
+    T item;
+  };
+
+  std::vector<std::vector<Entry>> slots_;
+  std::size_t current_ = 0;
+  std::size_t size_ = 0;
+};
+}  // namespace glimpse
@@ -1,13 +1,13 @@
 #pragma once
 
-#include <boost/uuid/random_generator.hpp>
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_io.hpp>
+#include <string>
+
+#include "id.h"
 
 namespace glimpse {
 
 struct User {
-  std::string id;
+  Id id;
   std::string name;
 };
 }  // namespace glimpse
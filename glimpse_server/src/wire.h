@@ -0,0 +1,267 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "id.h"
+#include "user.h"
+#include "ws_message.h"
+
+// Binary encoding shared by the room store files and the links between
+// cluster nodes. Integers are in host byte order, the encoding is not meant
+// to cross machines of different endianness.
+namespace glimpse::wire {
+
+// Encoders write to any sink with append(const char*, std::size_t), such as
+// std::string
+template <typename Out, typename T>
+void put(Out& out, const T& value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof value);
+}
+
+template <typename Out>
+void putId(Out& out, const Id& id) {
+  put(out, id.high());
+  put(out, id.low());
+}
+
+template <typename Out>
+void putString(Out& out, std::string_view value) {
+  put(out, static_cast<uint32_t>(value.size()));
+  out.append(value.data(), value.size());
+}
+
+template <typename Out>
+void putUser(Out& out, const User& user) {
+  putId(out, user.id);
+  putString(out, user.name);
+}
+
+template <typename Out>
+void putRequest(Out& out, const WsJoinRoomRequestPayload& request) {
+  putId(out, request.requestId);
+  putId(out, request.roomId);
+  putUser(out, {.id = request.userId, .name = request.username});
+}
+
+template <typename Out>
+void putPayload(Out& out, const std::string& payload) {
+  putString(out, payload);
+}
+
+template <typename Out>
+void putPayload(Out& out, const std::vector<std::string>& payload) {
+  put(out, static_cast<uint32_t>(payload.size()));
+  for (const auto& item : payload) {
+    putString(out, item);
+  }
+}
+
+template <typename Out>
+void putPayload(Out& out, const WsJoinRoomResultPayload& payload) {
+  putId(out, payload.requestId);
+  putId(out, payload.roomId);
+  put(out, static_cast<uint8_t>(payload.approved));
+}
+
+template <typename Out>
+void putPayload(Out& out, const WsJoinRoomRequestPayload& payload) {
+  putRequest(out, payload);
+}
+
+template <typename Out>
+void putPayload(Out& out, const WsRoomReadyPayload& payload) {
+  putId(out, payload.roomId);
+  putPayload(out, payload.iceServers);
+}
+
+template <typename Out>
+void putPayload(Out& out, const WsRoomEndPayload& payload) {
+  putId(out, payload.roomId);
+}
+
+template <typename Out>
+void putPayload(Out& out, const WsParticipantPayload& payload) {
+  putId(out, payload.roomId);
+  putUser(out, {.id = payload.userId, .name = payload.username});
+}
+
+template <typename Out>
+void putPayload(Out& out, const WsRelayPayload& payload) {
+  putId(out, payload.roomId);
+  putId(out, payload.userId);
+  putString(out, payload.host);
+  put(out, payload.port);
+  putString(out, payload.token);
+}
+
+template <typename Out>
+void putPayload(Out& out, const WsSessionPayload& payload) {
+  putId(out, payload.token);
+  put(out, static_cast<uint8_t>(payload.resumed));
+  put(out, payload.seq);
+}
+
+template <typename Out>
+void putMessage(Out& out, const WsMessage& message) {
+  put(out, static_cast<int32_t>(message.type));
+  putString(out, message.id);
+  putId(out, message.from);
+  put(out, static_cast<uint8_t>(message.payload.index()));
+  std::visit([&out](const auto& payload) { putPayload(out, payload); },
+             message.payload);
+}
+
+// Bounds-checked decoding; once a read runs past the end every further
+// read returns a default value and ok() is false
+class Reader {
+ public:
+  Reader(const char* begin, const char* end) : position_(begin), end_(end) {}
+
+  bool ok() const { return ok_; }
+  bool atEnd() const { return position_ == end_; }
+  const char* position() const { return position_; }
+
+  template <typename T>
+  T get() {
+    T value{};
+    if (not take(sizeof value)) {
+      return value;
+    }
+    std::memcpy(&value, position_ - sizeof value, sizeof value);
+    return value;
+  }
+
+  // The next `size` bytes, valid as long as the decoded buffer
+  std::string_view getBytes(std::size_t size) {
+    if (not take(size)) {
+      return {};
+    }
+    return {position_ - size, size};
+  }
+
+  Id getId() {
+    auto high = get<uint64_t>();
+    auto low = get<uint64_t>();
+    return Id(high, low);
+  }
+
+  std::string_view getStringView() { return getBytes(get<uint32_t>()); }
+
+  std::string getString() { return std::string(getStringView()); }
+
+  std::vector<std::string> getStrings() {
+    auto count = get<uint32_t>();
+    std::vector<std::string> items;
+    for (uint32_t i = 0; i < count and ok_; ++i) {
+      items.push_back(getString());
+    }
+    return items;
+  }
+
+  User getUser() {
+    auto id = getId();
+    return {.id = id, .name = getString()};
+  }
+
+  WsJoinRoomRequestPayload getRequest() {
+    auto requestId = getId();
+    auto roomId = getId();
+    auto user = getUser();
+    return {.requestId = requestId,
+            .roomId = roomId,
+            .userId = user.id,
+            .username = std::move(user.name)};
+  }
+
+  WsMessage getMessage() {
+    static_assert(std::variant_size_v<WsPayload> == 9,
+                  "every payload type needs a case below");
+    WsMessage message = {.type = static_cast<WsMessage::Type>(get<int32_t>()),
+                         .payload = std::string()};
+    message.id = getString();
+    message.from = getId();
+    switch (get<uint8_t>()) {
+      case 0:
+        message.payload = getString();
+        break;
+      case 1: {
+        auto requestId = getId();
+        auto roomId = getId();
+        message.payload = WsJoinRoomResultPayload{
+            .requestId = requestId,
+            .roomId = roomId,
+            .approved = get<uint8_t>() != 0,
+        };
+        break;
+      }
+      case 2:
+        message.payload = getRequest();
+        break;
+      case 3: {
+        auto roomId = getId();
+        message.payload = WsRoomReadyPayload{.roomId = roomId,
+                                             .iceServers = getStrings()};
+        break;
+      }
+      case 4:
+        message.payload = WsRoomEndPayload{.roomId = getId()};
+        break;
+      case 5:
+        message.payload = getStrings();
+        break;
+      case 6: {
+        auto roomId = getId();
+        auto user = getUser();
+        message.payload =
+            WsParticipantPayload{.roomId = roomId,
+                                 .userId = user.id,
+                                 .username = std::move(user.name)};
+        break;
+      }
+      case 7: {
+        auto roomId = getId();
+        auto userId = getId();
+        auto host = getString();
+        auto port = get<uint16_t>();
+        message.payload = WsRelayPayload{.roomId = roomId,
+                                         .userId = userId,
+                                         .host = std::move(host),
+                                         .port = port,
+                                         .token = getString()};
+        break;
+      }
+      case 8: {
+        auto token = getId();
+        auto resumed = get<uint8_t>() != 0;
+        message.payload = WsSessionPayload{
+            .token = token, .resumed = resumed, .seq = get<uint64_t>()};
+        break;
+      }
+      default:
+        ok_ = false;
+    }
+    return message;
+  }
+
+ private:
+  bool take(std::size_t size) {
+    if (not ok_ or static_cast<std::size_t>(end_ - position_) < size) {
+      ok_ = false;
+      return false;
+    }
+    position_ += size;
+    return true;
+  }
+
+  const char* position_;
+  const char* end_;
+  bool ok_ = true;
+};
+}  // namespace glimpse::wire
@@ -0,0 +1,77 @@
+#include "ws_compression.h"
+
+#include <zlib.h>
+
+#include <vector>
+
+#include "metrics.h"
+
+namespace glimpse {
+namespace {
+// Raw deflate of a whole frame with a sync flush, as permessage-deflate
+// sends it
+class Deflater {
+ public:
+  Deflater() {
+    ready_ = ::deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15,
+                            8, Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+  ~Deflater() {
+    if (ready_) {
+      ::deflateEnd(&stream_);
+    }
+  }
+
+  Deflater(const Deflater&) = delete;
+  Deflater& operator=(const Deflater&) = delete;
+
+  // Compressed size of `frame`, 0 if zlib failed
+  std::size_t deflatedSize(std::string_view frame) {
+    if (not ready_) {
+      return 0;
+    }
+    output_.resize(::deflateBound(&stream_, frame.size()) + 16);
+    stream_.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(frame.data()));
+    stream_.avail_in = static_cast<uInt>(frame.size());
+    stream_.next_out = output_.data();
+    stream_.avail_out = static_cast<uInt>(output_.size());
+    auto result = ::deflate(&stream_, Z_SYNC_FLUSH);
+    auto size = output_.size() - stream_.avail_out;
+    ::deflateReset(&stream_);
+    // The 00 00 ff ff ending the flush is not sent
+    return result == Z_OK and size >= 4 ? size - 4 : 0;
+  }
+
+  std::size_t sampled = 0;
+
+ private:
+  z_stream stream_{};
+  bool ready_ = false;
+  std::vector<Bytef> output_;
+};
+}  // namespace
+
+bool worthCompressing(const WsCompressionOptions& options,
+                      WsMessage::Type type, std::size_t size) {
+  if (options.compressor == uWS::DISABLED or size < options.minSize) {
+    return false;
+  }
+  return type == WsMessage::SDP or type == WsMessage::ICE_BATCH;
+}
+
+void sampleCompression(const WsCompressionOptions& options,
+                       std::string_view frame) {
+  if (options.sampleInterval == 0) {
+    return;
+  }
+  thread_local Deflater deflater;
+  if (deflater.sampled++ % options.sampleInterval != 0) {
+    return;
+  }
+  if (auto deflated = deflater.deflatedSize(frame); deflated > 0) {
+    metrics::add(metrics::Counter::SAMPLED_BYTES, frame.size());
+    metrics::add(metrics::Counter::SAMPLED_DEFLATED_BYTES, deflated);
+  }
+}
+}  // namespace glimpse
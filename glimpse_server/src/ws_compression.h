@@ -0,0 +1,40 @@
+#pragma once
+
+#include <uwebsockets/App.h>
+
+#include <cstddef>
+#include <string_view>
+
+#include "ws_message.h"
+
+namespace glimpse {
+
+// Which outgoing WebSocket frames are sent with permessage-deflate
+struct WsCompressionOptions {
+  // Compressor of the sockets: uWS::DISABLED, uWS::SHARED_COMPRESSOR, which
+  // compresses every frame on its own, or one of the
+  // uWS::DEDICATED_COMPRESSOR_* sizes, which keeps a sliding window per
+  // socket so that a frame can refer to the ones sent before it
+  uWS::CompressOptions compressor = uWS::SHARED_COMPRESSOR;
+  // Smallest frame worth compressing
+  std::size_t minSize = 1024;
+  // One compressed frame in `sampleInterval` is deflated a second time to
+  // measure the compression ratio, 0 never
+  std::size_t sampleInterval = 64;
+};
+
+// Whether a frame of `type` and `size` bytes is worth compressing. Only SDP
+// and batches of candidates are: long, repetitive text. Everything else is
+// a short JSON object that deflate shrinks by a few bytes at best, for the
+// cost of running it.
+bool worthCompressing(const WsCompressionOptions& options,
+                      WsMessage::Type type, std::size_t size);
+
+// Deflates one `frame` in `options.sampleInterval` sent compressed by this
+// thread, on its own as the shared compressor does, and records both sizes
+// under metrics::Counter. uWS does not tell how large the frames it
+// compressed were. A dedicated compressor does at least as well, as it
+// also finds matches in earlier frames.
+void sampleCompression(const WsCompressionOptions& options,
+                       std::string_view frame);
+}  // namespace glimpse
@@ -2,74 +2,717 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
 #include <exception>
-#include <mutex>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "WebSocketProtocol.h"
+#include "cluster.h"
+#include "logging.h"
+#include "metrics.h"
+#include "ws_message_encoder.h"
 
 namespace glimpse {
+namespace {
+// App of the calling event-loop thread, see WsManager::attachApp()
+thread_local uWS::TemplatedApp<false> *threadApp = nullptr;
+// Sockets open on the calling event-loop thread, see closeLocalSessions()
+thread_local std::unordered_set<WsSession *> threadSessions;
+
+// A reconnect storm would otherwise log every open and close
+logging::RateLimit sessionLog{20};
+logging::RateLimit slowSessionLog;
+}  // namespace
+
+WsManager::WsManager(std::size_t loopCount, WsCompressionOptions compression,
+                     ResumeOptions resume)
+    : wsSessions_(loopCount), compression_(compression), resume_(resume) {}
+
+void WsManager::attach(std::size_t loopIndex) { wsSessions_.attach(loopIndex); }
+
+void WsManager::attachApp(uWS::TemplatedApp<false> *app) { threadApp = app; }
+
+void WsManager::attachCluster(Cluster *cluster) { cluster_ = cluster; }
+
 void WsManager::handleWsOpen(WsSession *ws) {
-  spdlog::info("User {} connected to ws manager", ws->getUserData()->id);
-  {
-    std::lock_guard<std::mutex> lock(sessionsMutex_);
-    wsSessions_.emplace(ws->getUserData()->id, ws);
+  logging::limited(sessionLog, spdlog::level::info,
+                   "User {} connected to ws manager",
+                   ws->getUserData()->user.id);
+  bool wasOnline = false;
+  if (ws->getUserData()->resumable) {
+    wasOnline = openResumable(ws);
+  } else {
+    wsSessions_.insert(ws->getUserData()->user.id, {ws, uWS::Loop::get()});
+  }
+  threadSessions.insert(ws);
+  metrics::addGauge(metrics::Gauge::WS_CONNECTIONS, 1);
+  if (cluster_ and not wasOnline) {
+    cluster_->sessionOpened(ws->getUserData()->user.id);
   }
 };
 
 void WsManager::handleWsClose(WsSession *ws, int code,
                               std::string_view message) {
-  spdlog::info("User {} disconnected from ws manager, code: {}, msg: {}",
-               ws->getUserData()->id, code, message);
-  {
-    std::lock_guard<std::mutex> lock(sessionsMutex_);
-    wsSessions_.erase(ws->getUserData()->id);
+  auto *data = ws->getUserData();
+  logging::limited(sessionLog, spdlog::level::info,
+                   "User {} disconnected from ws manager, code: {}, msg: {}",
+                   data->user.id, code, message);
+  data->closing = true;
+  threadSessions.erase(ws);
+  // Whatever is still queued goes away with the socket, or into the log of
+  // its parked session
+  queuedMessages_.fetch_sub(data->sendQueue.size(), std::memory_order_relaxed);
+  queuedBytes_.fetch_sub(data->sendQueue.bytes(), std::memory_order_relaxed);
+
+  bool parked = data->resume and parkResumable(ws);
+  if (not parked) {
+    // The user may already have reconnected through another socket
+    wsSessions_.erase(data->user.id, ws);
+  }
+  metrics::addGauge(metrics::Gauge::WS_CONNECTIONS, -1);
+  if (cluster_ and not parked) {
+    cluster_->sessionClosed(data->user.id);
+  }
+}
+
+void WsManager::handleWsDrain(WsSession *ws) {
+  auto &queue = ws->getUserData()->sendQueue;
+  ws->cork([this, ws, &queue]() {
+    while (not queue.empty() and
+           ws->getBufferedAmount() < WS_SEND_QUEUE_THRESHOLD) {
+      auto bytes = queue.bytes();
+      auto message = queue.pop();
+      queuedMessages_.fetch_sub(1, std::memory_order_relaxed);
+      queuedBytes_.fetch_sub(bytes - queue.bytes(), std::memory_order_relaxed);
+
+      writeFrame(ws, message.type, encodeFrame(message));
+    }
+  });
+}
+
+void WsManager::sendWsMessage(WsSession *ws, const WsMessage &message) {
+  if (isBackpressured(ws)) {
+    enqueue(ws, message);
+    return;
+  }
+  writeFrame(ws, message.type, encodeFrame(message));
+}
+
+void WsManager::sendWsMessage(WsSession *ws, WsMessage::Type type,
+                              std::string_view payload, const Id &from) {
+  if (isBackpressured(ws)) {
+    enqueue(ws, {.type = type, .payload = std::string(payload), .from = from});
+    return;
+  }
+  writeFrame(ws, type, encodeFrame(type, payload, from));
+}
+
+std::size_t WsManager::sessionCount() const { return wsSessions_.size(); }
+
+WsSendQueueStats WsManager::sendQueueStats() const {
+  return {
+      .queuedMessages = queuedMessages_.load(std::memory_order_relaxed),
+      .queuedBytes = queuedBytes_.load(std::memory_order_relaxed),
+      .coalescedMessages = coalescedMessages_.load(std::memory_order_relaxed),
+      .droppedMessages = droppedMessages_.load(std::memory_order_relaxed),
+      .closedSessions = closedSessions_.load(std::memory_order_relaxed),
+  };
+}
+
+bool WsManager::isBackpressured(WsSession *ws) {
+  // Once something is queued, later messages queue behind it to keep order
+  return not ws->getUserData()->sendQueue.empty() or
+         ws->getBufferedAmount() >= WS_SEND_QUEUE_THRESHOLD;
+}
+
+void WsManager::enqueue(WsSession *ws, WsMessage message) {
+  auto *data = ws->getUserData();
+  if (data->closing) {
+    return;
+  }
+
+  auto &queue = data->sendQueue;
+  auto size = queue.size();
+  auto bytes = queue.bytes();
+  switch (queue.push(std::move(message))) {
+    case SendQueue::PushResult::QUEUED:
+      break;
+    case SendQueue::PushResult::COALESCED:
+      coalescedMessages_.fetch_add(1, std::memory_order_relaxed);
+      break;
+    case SendQueue::PushResult::DROPPED:
+      droppedMessages_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    case SendQueue::PushResult::OVERFLOW:
+      // The client cannot keep up with messages that must not be lost, let
+      // it reconnect rather than buffer for it without bound
+      logging::limited(slowSessionLog, spdlog::level::warn,
+                       "Closing ws of user {}: send queue full ({} messages)",
+                       data->user.id, queue.size());
+      closedSessions_.fetch_add(1, std::memory_order_relaxed);
+      ws->end(1008, "Send queue full");
+      return;
+  }
+  queuedMessages_.fetch_add(queue.size() - size, std::memory_order_relaxed);
+  queuedBytes_.fetch_add(queue.bytes() - bytes, std::memory_order_relaxed);
+}
+
+std::string_view WsManager::encodeFrame(const WsMessage &message) {
+  metrics::ScopedTimer timer(metrics::Latency::JSON_SERIALIZE);
+  auto &frame = threadEncodeBuffer();
+  encodeWsMessage(frame, message);
+  return frame;
+}
+
+std::string_view WsManager::encodeFrame(WsMessage::Type type,
+                                        std::string_view payload,
+                                        const Id &from) {
+  metrics::ScopedTimer timer(metrics::Latency::JSON_SERIALIZE);
+  auto &frame = threadEncodeBuffer();
+  encodeWsMessage(frame, type, payload, from);
+  return frame;
+}
+
+void WsManager::writeFrame(WsSession *ws, WsMessage::Type type,
+                           std::string_view frame) {
+  if (ws->getUserData()->closing) {
+    return;
   }
+  // A dropped frame never reached the client and must not take a sequence
+  // number, the client counts the frames it received
+  if (sendFrame(ws, type, frame)) {
+    logFrame(ws, type, frame);
+  }
+}
+
+bool WsManager::sendFrame(WsSession *ws, WsMessage::Type type,
+                          std::string_view frame) {
+  auto status = WsSession::SUCCESS;
+  if (ws->getUserData()->deflate and
+      worthCompressing(compression_, type, frame.size())) {
+    {
+      metrics::ScopedTimer timer(metrics::Latency::WS_COMPRESS);
+      status = ws->send(frame, uWS::OpCode::TEXT, true);
+    }
+    metrics::add(metrics::Counter::COMPRESSED_FRAMES);
+    metrics::add(metrics::Counter::COMPRESSED_BYTES, frame.size());
+    sampleCompression(compression_, frame);
+  } else {
+    status = ws->send(frame, uWS::OpCode::TEXT);
+  }
+  if (status == WsSession::DROPPED) {
+    droppedMessages_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  metrics::messageSent(type);
+  return true;
 }
 
-void WsManager::handleWsMessage(WsSession *ws, std::string_view message,
-                                uWS::OpCode) {
-  try {
-    auto j = nlohmann::json::parse(message);
-    auto wsMessage = j.template get<WsMessage>();
+void WsManager::logFrame(WsSession *ws, WsMessage::Type type,
+                         std::string_view frame) {
+  auto *data = ws->getUserData();
+  if (not data->resume) {
+    return;
+  }
+  std::lock_guard lock(data->resume->mutex);
+  if (data->resume->owner == data->resumeGeneration) {
+    data->resume->log.append(type, frame);
+  }
+}
 
-    if (wsMessage.type == WsMessage::Type::PING) {
-      WsMessage pongMsg = {.type = WsMessage::PONG, .payload = ""};
-      sendWsMessage(ws, pongMsg);
-    } else if (wsMessage.type == WsMessage::Type::PONG) {
-      WsMessage pingMsg = {.type = WsMessage::PING, .payload = ""};
-      sendWsMessage(ws, pingMsg);
+bool WsManager::openResumable(WsSession *ws) {
+  auto *data = ws->getUserData();
+  const auto &userId = data->user.id;
+  std::shared_ptr<ResumeState> state;
+  bool resumed = false;
+  bool wasParked = false;
+  std::vector<Id> expired;
+  {
+    std::lock_guard lock(resumeMutex_);
+    expireParked(metrics::Clock::now(), expired);
+    auto it = resumables_.find(userId);
+    if (it != resumables_.end()) {
+      wasParked = it->second.parked();
+      auto &found = *it->second.state;
+      if (not data->resumeToken.isNil() and found.token == data->resumeToken) {
+        std::lock_guard stateLock(found.mutex);
+        resumed = found.log.canReplayAfter(data->resumeAfter);
+      }
+    }
+    if (resumed) {
+      state = it->second.state;
     } else {
-      spdlog::error("Received unsupported message type: {}",
-                    static_cast<int>(wsMessage.type));
+      // A session parked for the user ends here
+      if (wasParked) {
+        expired.push_back(userId);
+      }
+      wasParked = false;
+      state = std::make_shared<ResumeState>(randomId(), resume_);
     }
-  } catch (std::exception &err) {
-    spdlog::error("Failed to handel ws message: {}", err.what());
-    WsMessage errMsg = {.type = WsMessage::ERROR, .payload = "Invalid message"};
-    sendWsMessage(ws, errMsg);
+    resumables_[userId] = {.state = state};
+    // Before the state is taken over below, so that a sender finding it
+    // no longer parked finds the socket
+    wsSessions_.insert(userId, {ws, uWS::Loop::get()});
+  }
+  endParked(expired);
+  if (not data->resumeToken.isNil() and not resumed) {
+    metrics::add(metrics::Counter::FAILED_RESUMES);
   }
-};
 
-void WsManager::sendWsMessage(WsSession *ws, const WsMessage &message) {
-  ws->send(nlohmann::json(message).dump(), uWS::OpCode::TEXT);
+  data->resume = state;
+  std::lock_guard lock(state->mutex);
+  // Frames of a socket this one replaces are no longer logged, those it
+  // logged until now are replayed
+  data->resumeGeneration = ++state->owner;
+  auto seq = resumed ? data->resumeAfter : state->log.lastSeq();
+  sendFrame(ws, WsMessage::SESSION,
+            encodeFrame({.type = WsMessage::SESSION,
+                         .payload = WsSessionPayload{.token = state->token,
+                                                     .resumed = resumed,
+                                                     .seq = seq}}));
+  if (resumed) {
+    std::size_t replayed = 0;
+    ws->cork([&]() {
+      state->log.replayAfter(
+          seq, [this, ws, &replayed](auto type, std::string_view frame) {
+            sendFrame(ws, type, frame);
+            ++replayed;
+          });
+    });
+    metrics::add(metrics::Counter::RESUMED_SESSIONS);
+    metrics::add(metrics::Counter::REPLAYED_FRAMES, replayed);
+  }
+  return wasParked;
 }
 
-void WsManager::sendMessage(const std::string &userId,
-                            const WsMessage &message) {
+bool WsManager::parkResumable(WsSession *ws) {
+  auto *data = ws->getUserData();
+  const auto &userId = data->user.id;
+  std::lock_guard lock(resumeMutex_);
+  auto it = resumables_.find(userId);
+  // Replaced by a new session
+  if (it == resumables_.end() or it->second.state != data->resume) {
+    return false;
+  }
+  std::lock_guard stateLock(data->resume->mutex);
+  // Taken over by a socket that resumed the session
+  if (data->resume->owner != data->resumeGeneration) {
+    return false;
+  }
+  // Replaced by a socket that did not ask to resume
+  auto session = wsSessions_.find(userId);
+  if (not session or session->ws != ws) {
+    resumables_.erase(it);
+    return false;
+  }
+
+  auto &queue = data->sendQueue;
+  while (not queue.empty()) {
+    auto message = queue.pop();
+    data->resume->log.append(message.type, encodeFrame(message));
+  }
+  auto now = metrics::Clock::now();
+  it->second.parkedAt = now;
+  parked_.emplace_back(userId, now);
+  wsSessions_.erase(userId, ws);
+  return true;
+}
+
+void WsManager::dropResumable(WsSession *ws) {
+  auto *data = ws->getUserData();
+  if (not data->resume) {
+    return;
+  }
   {
-    std::lock_guard<std::mutex> lock(sessionsMutex_);
-    if (not wsSessions_.contains(userId)) {
-      throw WsManagerError("user is not connected");
+    std::lock_guard lock(resumeMutex_);
+    auto it = resumables_.find(data->user.id);
+    std::lock_guard stateLock(data->resume->mutex);
+    // Unless a socket that resumed the session owns it now
+    if (it != resumables_.end() and it->second.state == data->resume and
+        data->resume->owner == data->resumeGeneration) {
+      resumables_.erase(it);
     }
+  }
+  data->resume.reset();
+}
 
-    sendWsMessage(wsSessions_.at(userId), message);
+bool WsManager::appendToParked(const Id &userId, const WsMessage &message) {
+  if (not resume_.enabled()) {
+    return false;
   }
+  bool appended = false;
+  std::vector<Id> expired;
+  {
+    std::lock_guard lock(resumeMutex_);
+    expireParked(metrics::Clock::now(), expired);
+    auto it = resumables_.find(userId);
+    if (it != resumables_.end() and it->second.parked()) {
+      auto &state = *it->second.state;
+      std::lock_guard stateLock(state.mutex);
+      state.log.append(message.type, encodeFrame(message));
+      appended = true;
+    }
+  }
+  endParked(expired);
+  return appended;
 }
 
-bool WsManager::isUserOnline(const std::string &userId) {
+bool WsManager::isParked(const Id &userId) {
+  if (not resume_.enabled()) {
+    return false;
+  }
+  bool parked = false;
+  std::vector<Id> expired;
   {
-    std::lock_guard<std::mutex> lock(sessionsMutex_);
-    return wsSessions_.contains(userId);
+    std::lock_guard lock(resumeMutex_);
+    expireParked(metrics::Clock::now(), expired);
+    auto it = resumables_.find(userId);
+    parked = it != resumables_.end() and it->second.parked();
   }
+  endParked(expired);
+  return parked;
 }
 
+void WsManager::expireParked(metrics::Clock::time_point now,
+                             std::vector<Id> &expired) {
+  while (not parked_.empty() and
+         now - parked_.front().second >= resume_.window) {
+    auto [userId, parkedAt] = parked_.front();
+    parked_.pop_front();
+    // The session may have been resumed, and parked again, since
+    auto it = resumables_.find(userId);
+    if (it != resumables_.end() and it->second.parkedAt == parkedAt) {
+      resumables_.erase(it);
+      expired.push_back(userId);
+    }
+  }
+}
+
+void WsManager::endParked(const std::vector<Id> &users) {
+  if (cluster_) {
+    for (const auto &userId : users) {
+      cluster_->sessionClosed(userId);
+    }
+  }
+}
+
+template <typename Write, typename MakeMessage>
+bool WsManager::deliver(const Id &userId, Write &&write,
+                        MakeMessage &&makeMessage) {
+  metrics::ScopedTimer timer(metrics::Latency::WS_SEND);
+  auto session = wsSessions_.find(userId);
+  if (not session) {
+    if (not resume_.enabled()) {
+      return false;
+    }
+    if (appendToParked(userId, makeMessage())) {
+      return true;
+    }
+    // A session being resumed registers its socket before it is unparked
+    session = wsSessions_.find(userId);
+    if (not session) {
+      return false;
+    }
+  }
+
+  auto [ws, loop] = *session;
+  if (loop == uWS::Loop::get()) {
+    write(ws);
+    return true;
+  }
+
+  // The socket belongs to another event loop, only that thread may write to
+  // it. The task owns a copy of the message, and the session is re-checked
+  // there as it may have closed in the meantime. A resumable session may
+  // have been parked or resumed elsewhere, the message follows it.
+  loop->defer([this, userId, ws, message = makeMessage()]() {
+    auto session = wsSessions_.find(userId);
+    if (session and session->ws == ws) {
+      sendWsMessage(ws, message);
+    } else if (resume_.enabled()) {
+      sendLocalMessage(userId, message);
+    }
+  });
+  return true;
+}
+
+bool WsManager::forward(const Id &userId, const WsMessage &message) {
+  return cluster_ != nullptr and cluster_->sendMessage(userId, message);
+}
+
+void WsManager::sendMessage(const Id &userId, const WsMessage &message) {
+  if (not sendMessageIfOnline(userId, message)) {
+    throw WsManagerError("user is not connected");
+  }
+}
+
+void WsManager::sendMessage(const Id &userId, WsMessage::Type type,
+                            std::string_view payload, const Id &from) {
+  auto sent = deliver(
+      userId,
+      [this, type, payload, &from](WsSession *ws) {
+        sendWsMessage(ws, type, payload, from);
+      },
+      [type, payload, &from]() {
+        return WsMessage{
+            .type = type, .payload = std::string(payload), .from = from};
+      });
+  if (not sent and cluster_) {
+    sent = forward(userId, {.type = type,
+                            .payload = std::string(payload),
+                            .from = from});
+  }
+  if (not sent) {
+    throw WsManagerError("user is not connected");
+  }
+}
+
+bool WsManager::sendMessageIfOnline(const Id &userId,
+                                    const WsMessage &message) {
+  return sendLocalMessage(userId, message) or forward(userId, message);
+}
+
+bool WsManager::sendLocalMessage(const Id &userId, const WsMessage &message) {
+  return deliver(
+      userId, [this, &message](WsSession *ws) { sendWsMessage(ws, message); },
+      [&message]() { return message; });
+}
+
+bool WsManager::isUserOnline(const Id &userId) {
+  return wsSessions_.find(userId).has_value() or isParked(userId) or
+         (cluster_ and cluster_->nodeOf(userId).has_value());
+}
+
+void WsManager::sendMessages(std::span<const WsOutgoingMessage> messages) {
+  // Recipients in order of first appearance, a transition has only a few
+  std::vector<std::pair<Id, WsSessionRef>> recipients;
+  recipients.reserve(messages.size());
+  // Connected to other nodes
+  std::vector<Id> remote;
+  // With their session parked
+  std::vector<Id> parked;
+  for (const auto &outgoing : messages) {
+    auto seen = std::ranges::any_of(recipients, [&](const auto &recipient) {
+      return recipient.first == outgoing.userId;
+    });
+    if (seen or std::ranges::find(remote, outgoing.userId) != remote.end() or
+        std::ranges::find(parked, outgoing.userId) != parked.end()) {
+      continue;
+    }
+    if (auto session = wsSessions_.find(outgoing.userId)) {
+      recipients.emplace_back(outgoing.userId, *session);
+    } else if (cluster_ and cluster_->nodeOf(outgoing.userId)) {
+      remote.push_back(outgoing.userId);
+    } else if (isParked(outgoing.userId)) {
+      parked.push_back(outgoing.userId);
+    } else {
+      throw WsManagerError("user is not connected");
+    }
+  }
+
+  // Messages to one node share a link, they arrive in order
+  for (const auto &outgoing : messages) {
+    if (std::ranges::find(remote, outgoing.userId) != remote.end()) {
+      forward(outgoing.userId, outgoing.message);
+    } else if (std::ranges::find(parked, outgoing.userId) != parked.end()) {
+      // Resumed since, or not
+      sendLocalMessage(outgoing.userId, outgoing.message);
+    }
+  }
+
+  for (auto [userId, session] : recipients) {
+    auto [ws, loop] = session;
+    if (loop == uWS::Loop::get()) {
+      ws->cork([this, ws, userId, &messages]() {
+        for (const auto &outgoing : messages) {
+          if (outgoing.userId == userId) {
+            sendWsMessage(ws, outgoing.message);
+          }
+        }
+      });
+      continue;
+    }
+
+    // Same as deliver(), with all of the recipient's messages in one task
+    std::vector<WsMessage> batch;
+    for (const auto &outgoing : messages) {
+      if (outgoing.userId == userId) {
+        batch.push_back(outgoing.message);
+      }
+    }
+    loop->defer([this, userId, ws, batch = std::move(batch)]() {
+      auto session = wsSessions_.find(userId);
+      if (not session or session->ws != ws) {
+        if (resume_.enabled()) {
+          for (const auto &message : batch) {
+            sendLocalMessage(userId, message);
+          }
+        }
+        return;
+      }
+      ws->cork([this, ws, &batch]() {
+        for (const auto &message : batch) {
+          sendWsMessage(ws, message);
+        }
+      });
+    });
+  }
+}
+
+template <typename Apply>
+std::vector<Id> WsManager::forEachLoop(std::span<const User> members,
+                                       Apply &&apply) {
+  // Loops in order of first appearance, a room spans only a few
+  std::vector<std::pair<uWS::Loop *, std::vector<TopicMember>>> loops;
+  std::vector<Id> absent;
+  for (const auto &member : members) {
+    auto session = wsSessions_.find(member.id);
+    if (not session) {
+      absent.push_back(member.id);
+      continue;
+    }
+    auto it = std::ranges::find(loops, session->loop,
+                                &decltype(loops)::value_type::first);
+    if (it == loops.end()) {
+      it = loops.insert(it, {session->loop, {}});
+    }
+    it->second.push_back({member.id, session->ws});
+  }
+
+  for (auto &[loop, loopMembers] : loops) {
+    if (loop == uWS::Loop::get()) {
+      apply(loopMembers);
+    } else {
+      loop->defer([apply, loopMembers = std::move(loopMembers)]() {
+        apply(loopMembers);
+      });
+    }
+  }
+  return absent;
+}
+
+bool WsManager::isCurrent(const TopicMember &member) {
+  // A deferred task may run after the socket closed or was replaced
+  auto session = wsSessions_.find(member.userId);
+  return session and session->ws == member.ws and
+         not member.ws->getUserData()->closing;
+}
+
+void WsManager::publish(const Id &roomId, std::span<const User> members,
+                        const WsMessage &message) {
+  auto absent = publishLocal(roomId, members, message);
+  if (cluster_ and not absent.empty()) {
+    cluster_->publish(roomId, absent, message);
+  }
+}
+
+std::vector<Id> WsManager::publishLocal(const Id &roomId,
+                                        std::span<const User> members,
+                                        const WsMessage &message) {
+  metrics::ScopedTimer timer(metrics::Latency::WS_SEND);
+  // Serialized once for every loop and subscriber. The message itself is
+  // kept for members whose SendQueue it has to join.
+  auto frame = std::make_shared<const std::string>(encodeFrame(message));
+  auto absent = forEachLoop(members, [this, roomId, message, frame](
+                                const std::vector<TopicMember> &loopMembers) {
+    publishOnLoop(roomId, loopMembers, message, *frame);
+  });
+  std::erase_if(absent, [this, &message](const Id &userId) {
+    return appendToParked(userId, message);
+  });
+  return absent;
+}
+
+void WsManager::publishOnLoop(const Id &roomId,
+                              const std::vector<TopicMember> &members,
+                              const WsMessage &message,
+                              std::string_view frame) {
+  auto text = roomId.text();
+  std::string_view topic(text.data(), text.size());
+
+  // A socket with messages waiting in its SendQueue gets the broadcast
+  // queued behind them instead, it must not overtake them
+  std::vector<WsSession *> held;
+  // Subscribers whose frames are logged for resuming
+  std::vector<WsSession *> logged;
+  for (const auto &member : members) {
+    if (not isCurrent(member)) {
+      // Parked or resumed by another socket meanwhile
+      if (resume_.enabled()) {
+        sendLocalMessage(member.userId, message);
+      }
+      continue;
+    }
+    if (isBackpressured(member.ws)) {
+      member.ws->unsubscribe(topic);
+      enqueue(member.ws, message);
+      held.push_back(member.ws);
+    } else {
+      member.ws->subscribe(topic);
+      if (member.ws->getUserData()->resume) {
+        logged.push_back(member.ws);
+      }
+    }
+  }
+
+  for (auto *ws : logged) {
+    logFrame(ws, message.type, frame);
+  }
+  auto recipients = threadApp->numSubscribers(topic);
+  if (recipients > 0 and threadApp->publish(topic, frame, uWS::OpCode::TEXT)) {
+    metrics::messageSent(message.type, recipients);
+  }
+  for (auto *ws : held) {
+    ws->subscribe(topic);
+  }
+}
+
+void WsManager::unsubscribe(const Id &roomId, std::span<const User> members) {
+  auto absent = unsubscribeLocal(roomId, members);
+  if (cluster_ and not absent.empty()) {
+    cluster_->unsubscribe(roomId, absent);
+  }
+}
+
+std::vector<Id> WsManager::unsubscribeLocal(const Id &roomId,
+                                            std::span<const User> members) {
+  return forEachLoop(
+      members, [this, roomId](const std::vector<TopicMember> &loopMembers) {
+        auto text = roomId.text();
+        std::string_view topic(text.data(), text.size());
+        for (const auto &member : loopMembers) {
+          if (isCurrent(member)) {
+            member.ws->unsubscribe(topic);
+          }
+        }
+      });
+}
+
+void WsManager::closeSessions(std::span<const User> members, int code,
+                              std::string_view reason) {
+  forEachLoop(members, [this, code, reason = std::string(reason)](
+                           const std::vector<TopicMember> &loopMembers) {
+    for (const auto &member : loopMembers) {
+      if (isCurrent(member)) {
+        dropResumable(member.ws);
+        member.ws->end(code, reason);
+      }
+    }
+  });
+}
+
+void WsManager::closeLocalSessions(int code, std::string_view reason) {
+  // Each close takes its socket out of the set
+  std::vector<WsSession *> open(threadSessions.begin(), threadSessions.end());
+  for (auto *ws : open) {
+    if (not ws->getUserData()->closing) {
+      dropResumable(ws);
+      ws->end(code, reason);
+    }
+  }
+}
 };  // namespace glimpse
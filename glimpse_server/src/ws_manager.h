@@ -1,73 +1,37 @@
 #pragma once
+#include <uwebsockets/App.h>
+#include <uwebsockets/Loop.h>
 #include <uwebsockets/WebSocket.h>
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <mutex>
-#include <nlohmann/json.hpp>
+#include <span>
+#include <string_view>
 #include <unordered_map>
-#include <variant>
+#include <utility>
+#include <vector>
 
+#include "id.h"
+#include "metrics.h"
+#include "resume_log.h"
+#include "session_registry.h"
 #include "user.h"
+#include "ws_compression.h"
+#include "ws_message.h"
 
 namespace glimpse {
-using WsSession = uWS::WebSocket<false, true, glimpse::User>;
+
+class Cluster;
 
 constexpr uint32_t WS_MAX_PAYLOAD_LENGTH = 16 * 1024;       // kB
 constexpr uint32_t WS_IDLE_TIMEOUT = 10;                    // second
 constexpr uint32_t WS_MAX_BACK_PRESSURE = 1 * 1024 * 1024;  // kB
-
-struct WsJoinRoomResultPayload {
-  std::string requestId;
-  std::string roomId;
-  bool approved;
-
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsJoinRoomResultPayload, requestId, roomId,
-                                 approved);
-};
-
-struct WsJoinRoomRequestPayload {
-  std::string requestId;
-  std::string roomId;
-  std::string userId;
-  std::string username;
-
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsJoinRoomRequestPayload, requestId, roomId,
-                                 username, userId);
-};
-
-struct WsRoomReadyPayload {
-  std::string roomId;
-
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsRoomReadyPayload, roomId);
-};
-
-struct WsRoomEndPayload {
-  std::string roomId;
-
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsRoomEndPayload, roomId);
-};
-
-using WsPayload =
-    std::variant<std::string, WsJoinRoomResultPayload, WsJoinRoomRequestPayload,
-                 WsRoomReadyPayload, WsRoomEndPayload>;
-
-struct WsMessage {
-  enum Type : int {
-    PING,
-    PONG,
-    ERROR,
-    REQUEST_JOIN_ROOM,
-    ALLOW_JOIN_ROOM,
-    DENY_JOIN_ROOM,
-    ROOM_READY,
-    ROOM_END,
-    SDP,
-    ICE,
-  };
-
-  Type type;
-  WsPayload payload;
-};
+// Bytes buffered by uWS for a socket past which messages wait in its
+// SendQueue instead, see DropPolicy
+constexpr uint32_t WS_SEND_QUEUE_THRESHOLD = 64 * 1024;
 
 class WsManagerError : public std::exception {
  public:
@@ -79,62 +43,197 @@ class WsManagerError : public std::exception {
   const char* msg_;
 };
 
+// One message of a batch, see WsManager::sendMessages()
+struct WsOutgoingMessage {
+  Id userId;
+  WsMessage message;
+};
+
+// Totals over all sessions
+struct WsSendQueueStats {
+  // Currently waiting for backpressure to clear
+  uint64_t queuedMessages;
+  uint64_t queuedBytes;
+  // Since start
+  uint64_t coalescedMessages;
+  uint64_t droppedMessages;
+  uint64_t closedSessions;
+};
+
+// Shared by all event-loop threads. Sessions are registered by the thread
+// that accepted them; messages for a session owned by another thread are
+// serialized here and forwarded to the owner loop with uWS::Loop::defer.
+//
+// Rooms are uWS topics. Broadcasts to a room are serialized once and handed
+// to uWS pub/sub on every loop owning a participant's socket, which fans
+// them out to the subscribed sockets of that loop.
+//
+// With a Cluster attached, users connected to other nodes count as
+// connected: their messages and broadcasts are forwarded to their node.
+//
+// The session of a client that connected with ?resume= is parked when its
+// socket closes, see ResumeOptions. Its user counts as connected until the
+// window passes, and messages for them go into the session's ResumeLog.
 class WsManager {
  public:
+  WsManager(std::size_t loopCount, WsCompressionOptions compression = {},
+            ResumeOptions resume = {});
+
+  // Must be called once from each event-loop thread before it runs
+  void attach(std::size_t loopIndex);
+  // Must be called from each event-loop thread with its app, before the
+  // app accepts connections
+  void attachApp(uWS::TemplatedApp<false>* app);
+  // Must be called before any event loop runs, `cluster` must outlive the
+  // loops
+  void attachCluster(Cluster* cluster);
+
+  const WsCompressionOptions& compression() const { return compression_; }
+  const ResumeOptions& resume() const { return resume_; }
+
   void handleWsOpen(WsSession* ws);
   void handleWsClose(WsSession* ws, int code, std::string_view message);
-  void handleWsMessage(WsSession* ws, std::string_view message,
-                       uWS::OpCode opCode);
+  // Writes queued messages once the socket's backpressure has cleared
+  void handleWsDrain(WsSession* ws);
 
-  void sendMessage(const std::string& userId, const WsMessage& message);
-  bool isUserOnline(const std::string& userId);
+  // Sends to a socket owned by the calling thread. While the socket is
+  // backpressured the message is queued, coalesced or dropped according to
+  // its DropPolicy.
+  void sendWsMessage(WsSession* ws, const WsMessage& message);
+  void sendWsMessage(WsSession* ws, WsMessage::Type type,
+                     std::string_view payload, const Id& from);
+
+  WsSendQueueStats sendQueueStats() const;
+  // Number of connected users
+  std::size_t sessionCount() const;
+
+  // Throws WsManagerError if the user is not connected
+  void sendMessage(const Id& userId, const WsMessage& message);
+  // Relays a string payload such as SDP or ICE sent by user `from`,
+  // escaping it straight from `payload` into the outgoing frame
+  void sendMessage(const Id& userId, WsMessage::Type type,
+                   std::string_view payload, const Id& from);
+  // Looks the user up once and sends if connected, returns whether it did
+  bool sendMessageIfOnline(const Id& userId, const WsMessage& message);
+  // Same, for users connected to this node only. Used for messages
+  // forwarded by another node.
+  bool sendLocalMessage(const Id& userId, const WsMessage& message);
+  bool isUserOnline(const Id& userId);
+
+  // Sends the messages of one state transition. Each recipient's socket is
+  // corked once and gets all of its messages, in order, in a single write.
+  // Throws WsManagerError before sending anything if a recipient is not
+  // connected.
+  void sendMessages(std::span<const WsOutgoingMessage> messages);
+
+  // Sends `message` to every connected member of room `roomId`, subscribing
+  // their sockets to the room topic first if needed. Messages sent to a
+  // member before are not overtaken.
+  void publish(const Id& roomId, std::span<const User> members,
+               const WsMessage& message);
+  // Unsubscribes the sockets of `members` from the room topic
+  void unsubscribe(const Id& roomId, std::span<const User> members);
+  // Same as publish() and unsubscribe() for the members connected to this
+  // node, returns the others
+  std::vector<Id> publishLocal(const Id& roomId, std::span<const User> members,
+                               const WsMessage& message);
+  std::vector<Id> unsubscribeLocal(const Id& roomId,
+                                   std::span<const User> members);
+
+  // Closes the sockets `members` have on this node with `code` and
+  // `reason`, each from its own loop. Both are for a hot restart: the
+  // sessions are not parked, the process taking over could not resume them.
+  void closeSessions(std::span<const User> members, int code,
+                     std::string_view reason);
+  // Closes every socket of the calling event loop, whether its user is in
+  // a room or not
+  void closeLocalSessions(int code, std::string_view reason);
 
  private:
-  void sendWsMessage(WsSession* ws, const WsMessage& message);
+  // A member's socket as found when a room operation started
+  struct TopicMember {
+    Id userId;
+    WsSession* ws;
+  };
+
+  bool isBackpressured(WsSession* ws);
+  void enqueue(WsSession* ws, WsMessage message);
+  // Encodes into the thread's buffer, valid until the next encode
+  std::string_view encodeFrame(const WsMessage& message);
+  std::string_view encodeFrame(WsMessage::Type type, std::string_view payload,
+                               const Id& from);
+  // Sends the frame, then logs it if the session is resumable and uWS did
+  // not drop it
+  void writeFrame(WsSession* ws, WsMessage::Type type, std::string_view frame);
+  // Returns false if uWS dropped the frame
+  bool sendFrame(WsSession* ws, WsMessage::Type type, std::string_view frame);
+  void logFrame(WsSession* ws, WsMessage::Type type, std::string_view frame);
+
+  // Registers a socket opened with ?resume=, taking over the session it
+  // resumes if any, and sends it SESSION and the frames it missed. Returns
+  // whether it resumed a parked session, whose user never went offline.
+  bool openResumable(WsSession* ws);
+  // Parks the session of a closing socket with the messages still queued
+  // for it, unless another socket took it over. Returns whether it did.
+  bool parkResumable(WsSession* ws);
+  // Ends the socket's session for good, so that closing it parks nothing
+  void dropResumable(WsSession* ws);
+  // Appends the message to the log of the user's parked session, returns
+  // false if there is none
+  bool appendToParked(const Id& userId, const WsMessage& message);
+  bool isParked(const Id& userId);
+  // Drops the parked sessions older than the window, adding their users to
+  // `expired`. Requires resumeMutex_.
+  void expireParked(metrics::Clock::time_point now, std::vector<Id>& expired);
+  // The users of sessions that ended while parked went offline
+  void endParked(const std::vector<Id>& users);
+
+  // Calls `write(ws)` if the user's socket belongs to the calling thread,
+  // otherwise sends `makeMessage()` from the socket's own loop. Returns false
+  // if the user is not connected.
+  template <typename Write, typename MakeMessage>
+  bool deliver(const Id& userId, Write&& write, MakeMessage&& makeMessage);
+  // Sends to the node the user is connected to, if another one
+  bool forward(const Id& userId, const WsMessage& message);
+
+  // Calls `apply(members)` with the connected `members` whose socket belongs
+  // to the same loop, on that loop: inline for the calling thread's own
+  // loop, through uWS::Loop::defer for the others. Returns the members not
+  // connected to this node.
+  template <typename Apply>
+  std::vector<Id> forEachLoop(std::span<const User> members, Apply&& apply);
+  void publishOnLoop(const Id& roomId, const std::vector<TopicMember>& members,
+                     const WsMessage& message, std::string_view frame);
+  // Whether `member`'s socket is still open and registered for its user
+  bool isCurrent(const TopicMember& member);
 
  private:
-  std::mutex sessionsMutex_;
-  std::unordered_map<std::string, WsSession*> wsSessions_;
-};
-}  // namespace glimpse
+  // A resumable session, parked since `parkedAt` once its socket closed
+  struct Resumable {
+    std::shared_ptr<ResumeState> state;
+    metrics::Clock::time_point parkedAt{};
 
-NLOHMANN_JSON_NAMESPACE_BEGIN
-
-template <>
-struct adl_serializer<glimpse::WsMessage> {
-  static void to_json(json& j, const glimpse::WsMessage& msg) {
-    j["type"] = msg.type;
-    std::visit([&j](const auto& v) { j["payload"] = v; }, msg.payload);
-  }
-
-  static void from_json(const json& j, glimpse::WsMessage& msg) {
-    msg.type = j.at("type").get<glimpse::WsMessage::Type>();
-    switch (j.at("type").get<glimpse::WsMessage::Type>()) {
-      case glimpse::WsMessage::Type::REQUEST_JOIN_ROOM: {
-        msg.payload = j.at("payload").get<glimpse::WsJoinRoomResultPayload>();
-        break;
-      }
-      case glimpse::WsMessage::Type::ALLOW_JOIN_ROOM:
-      case glimpse::WsMessage::Type::DENY_JOIN_ROOM: {
-        msg.payload = j.at("payload").get<glimpse::WsJoinRoomResultPayload>();
-        break;
-      }
-
-      case glimpse::WsMessage::Type::ROOM_READY: {
-        msg.payload = j.at("payload").get<glimpse::WsRoomReadyPayload>();
-        break;
-      }
-
-      case glimpse::WsMessage::Type::ROOM_END: {
-        msg.payload = j.at("payload").get<glimpse::WsRoomEndPayload>();
-        break;
-      }
-
-      default: {
-        msg.payload = j.at("payload").get<std::string>();
-      }
-    }
-  }
-};
+    bool parked() const { return parkedAt != metrics::Clock::time_point(); }
+  };
 
-NLOHMANN_JSON_NAMESPACE_END
+  SessionRegistry wsSessions_;
+  Cluster* cluster_ = nullptr;
+  WsCompressionOptions compression_;
+  ResumeOptions resume_;
+
+  // Taken when resumable sessions open, close or get a message while
+  // parked, never for sessions that are not resumable. A socket is
+  // registered and unregistered under it, so whoever finds no socket for a
+  // user finds their session parked if it is. Taken before a state's mutex.
+  std::mutex resumeMutex_;
+  std::unordered_map<Id, Resumable, IdHash> resumables_;
+  // Parked sessions in the order they expire
+  std::deque<std::pair<Id, metrics::Clock::time_point>> parked_;
+
+  std::atomic<uint64_t> queuedMessages_ = 0;
+  std::atomic<uint64_t> queuedBytes_ = 0;
+  std::atomic<uint64_t> coalescedMessages_ = 0;
+  std::atomic<uint64_t> droppedMessages_ = 0;
+  std::atomic<uint64_t> closedSessions_ = 0;
+};
+}  // namespace glimpse
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "id.h"
+
+namespace glimpse {
+
+struct WsJoinRoomResultPayload {
+  Id requestId;
+  Id roomId;
+  bool approved;
+
+  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsJoinRoomResultPayload, requestId, roomId,
+                                 approved);
+};
+
+struct WsJoinRoomRequestPayload {
+  Id requestId;
+  Id roomId;
+  Id userId;
+  std::string username;
+
+  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsJoinRoomRequestPayload, requestId, roomId,
+                                 username, userId);
+};
+
+struct WsRoomReadyPayload {
+  Id roomId;
+  // STUN and TURN URLs the participants can gather candidates from, left
+  // out of the JSON when empty
+  std::vector<std::string> iceServers{};
+
+  NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(WsRoomReadyPayload, roomId,
+                                              iceServers);
+};
+
+struct WsRoomEndPayload {
+  Id roomId;
+
+  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsRoomEndPayload, roomId);
+};
+
+// Payload of PARTICIPANT_JOINED and PARTICIPANT_LEFT
+struct WsParticipantPayload {
+  Id roomId;
+  Id userId;
+  std::string username;
+
+  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsParticipantPayload, roomId, userId,
+                                 username);
+};
+
+// Payload of RELAY_READY: the peer `userId` is reached through `host` and
+// `port` of the media relay, once a STUN Binding request with `token` as
+// its USERNAME was sent there from where the media comes from
+struct WsRelayPayload {
+  Id roomId;
+  Id userId;
+  std::string host;
+  uint16_t port;
+  std::string token;
+
+  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsRelayPayload, roomId, userId, host, port,
+                                 token);
+};
+
+// Payload of SESSION: the token to resume the session with, whether it
+// resumed one, and the number of the last frame sent before, the frames
+// that follow are numbered from the next
+struct WsSessionPayload {
+  Id token;
+  bool resumed;
+  uint64_t seq;
+
+  NLOHMANN_DEFINE_TYPE_INTRUSIVE(WsSessionPayload, token, resumed, seq);
+};
+
+using WsPayload =
+    std::variant<std::string, WsJoinRoomResultPayload, WsJoinRoomRequestPayload,
+                 WsRoomReadyPayload, WsRoomEndPayload,
+                 std::vector<std::string>, WsParticipantPayload,
+                 WsRelayPayload, WsSessionPayload>;
+
+struct WsMessage {
+  enum Type : int {
+    PING,
+    PONG,
+    ERROR,
+    REQUEST_JOIN_ROOM,
+    ALLOW_JOIN_ROOM,
+    DENY_JOIN_ROOM,
+    ROOM_READY,
+    ROOM_END,
+    SDP,
+    ICE,
+    // Requests sent by clients, answered with RESPONSE or ERROR
+    JOIN_ROOM,
+    APPROVE_JOIN_REQUEST,
+    DENY_JOIN_REQUEST,
+    END_ROOM,
+    RESPONSE,
+    // Several ICE candidates for the same peer, see IceBatching
+    ICE_BATCH,
+    // Published to a room when someone is admitted or leaves
+    PARTICIPANT_JOINED,
+    PARTICIPANT_LEFT,
+    // Request for a media relay session with another participant, answered
+    // with RELAY_READY to both of them, see MediaRelay
+    OPEN_RELAY,
+    RELAY_READY,
+    // First frame of a session opened with ?resume=, not numbered itself,
+    // see ResumeOptions
+    SESSION,
+  };
+
+  Type type;
+  WsPayload payload;
+  // Id of the client request this message answers, empty otherwise
+  std::string id{};
+  // Sender of a relayed SDP, ICE or ICE_BATCH, the nil id otherwise
+  Id from{};
+};
+}  // namespace glimpse
+
+NLOHMANN_JSON_NAMESPACE_BEGIN
+
+template <>
+struct adl_serializer<glimpse::WsMessage> {
+  static void to_json(json& j, const glimpse::WsMessage& msg) {
+    j["type"] = msg.type;
+    if (not msg.id.empty()) {
+      j["id"] = msg.id;
+    }
+    if (not msg.from.isNil()) {
+      j["from"] = msg.from;
+    }
+    std::visit([&j](const auto& v) { j["payload"] = v; }, msg.payload);
+  }
+
+  static void from_json(const json& j, glimpse::WsMessage& msg) {
+    msg.type = j.at("type").get<glimpse::WsMessage::Type>();
+    if (j.contains("from")) {
+      msg.from = j.at("from").get<glimpse::Id>();
+    }
+    switch (j.at("type").get<glimpse::WsMessage::Type>()) {
+      case glimpse::WsMessage::Type::REQUEST_JOIN_ROOM: {
+        msg.payload = j.at("payload").get<glimpse::WsJoinRoomResultPayload>();
+        break;
+      }
+      case glimpse::WsMessage::Type::ALLOW_JOIN_ROOM:
+      case glimpse::WsMessage::Type::DENY_JOIN_ROOM: {
+        msg.payload = j.at("payload").get<glimpse::WsJoinRoomResultPayload>();
+        break;
+      }
+
+      case glimpse::WsMessage::Type::ROOM_READY: {
+        msg.payload = j.at("payload").get<glimpse::WsRoomReadyPayload>();
+        break;
+      }
+
+      case glimpse::WsMessage::Type::ROOM_END: {
+        msg.payload = j.at("payload").get<glimpse::WsRoomEndPayload>();
+        break;
+      }
+
+      case glimpse::WsMessage::Type::PARTICIPANT_JOINED:
+      case glimpse::WsMessage::Type::PARTICIPANT_LEFT: {
+        msg.payload = j.at("payload").get<glimpse::WsParticipantPayload>();
+        break;
+      }
+
+      case glimpse::WsMessage::Type::RELAY_READY: {
+        msg.payload = j.at("payload").get<glimpse::WsRelayPayload>();
+        break;
+      }
+
+      case glimpse::WsMessage::Type::SESSION: {
+        msg.payload = j.at("payload").get<glimpse::WsSessionPayload>();
+        break;
+      }
+
+      case glimpse::WsMessage::Type::ICE_BATCH: {
+        msg.payload = j.at("payload").get<std::vector<std::string>>();
+        break;
+      }
+
+      default: {
+        msg.payload = j.at("payload").get<std::string>();
+      }
+    }
+  }
+};
+
+NLOHMANN_JSON_NAMESPACE_END
@@ -0,0 +1,216 @@
+#include "ws_message_encoder.h"
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <variant>
+#include <vector>
+
+namespace glimpse {
+namespace {
+// Characters that JSON requires to be escaped: control characters, '"' and
+// '\\'. Everything else, including non-ASCII UTF-8, is copied as is.
+constexpr std::array<bool, 256> NEEDS_ESCAPE = []() {
+  std::array<bool, 256> table{};
+  for (int c = 0; c < 0x20; ++c) {
+    table[c] = true;
+  }
+  table['"'] = true;
+  table['\\'] = true;
+  return table;
+}();
+
+constexpr char HEX_DIGITS[] = "0123456789abcdef";
+
+void appendEscaped(std::string& out, char c) {
+  switch (c) {
+    case '"':
+      out.append("\\\"");
+      break;
+    case '\\':
+      out.append("\\\\");
+      break;
+    case '\b':
+      out.append("\\b");
+      break;
+    case '\f':
+      out.append("\\f");
+      break;
+    case '\n':
+      out.append("\\n");
+      break;
+    case '\r':
+      out.append("\\r");
+      break;
+    case '\t':
+      out.append("\\t");
+      break;
+    default: {
+      auto byte = static_cast<uint8_t>(c);
+      char escaped[] = {'\\', 'u', '0', '0', HEX_DIGITS[byte >> 4],
+                        HEX_DIGITS[byte & 0xf]};
+      out.append(escaped, sizeof(escaped));
+    }
+  }
+}
+
+void appendHeader(std::string& out, WsMessage::Type type, std::string_view id,
+                  const Id& from) {
+  char digits[16];
+  auto result =
+      std::to_chars(digits, digits + sizeof(digits), static_cast<int>(type));
+  out.append("{\"type\":");
+  out.append(digits, result.ptr);
+  if (not id.empty()) {
+    out.append(",\"id\":");
+    appendJsonString(out, id);
+  }
+  if (not from.isNil()) {
+    auto text = from.text();
+    out.append(",\"from\":");
+    appendJsonString(out, std::string_view(text.data(), text.size()));
+  }
+  out.append(",\"payload\":");
+}
+
+void appendField(std::string& out, std::string_view key,
+                 std::string_view value) {
+  out.push_back('"');
+  out.append(key);
+  out.append("\":");
+  appendJsonString(out, value);
+}
+
+void appendField(std::string& out, std::string_view key, const Id& value) {
+  auto text = value.text();
+  appendField(out, key, std::string_view(text.data(), text.size()));
+}
+
+void appendPayload(std::string& out, const std::string& payload) {
+  appendJsonString(out, payload);
+}
+
+void appendPayload(std::string& out, const std::vector<std::string>& payload) {
+  out.push_back('[');
+  for (std::size_t i = 0; i < payload.size(); ++i) {
+    if (i != 0) {
+      out.push_back(',');
+    }
+    appendJsonString(out, payload[i]);
+  }
+  out.push_back(']');
+}
+
+void appendPayload(std::string& out, const WsJoinRoomResultPayload& payload) {
+  out.push_back('{');
+  appendField(out, "requestId", payload.requestId);
+  out.push_back(',');
+  appendField(out, "roomId", payload.roomId);
+  out.append(payload.approved ? ",\"approved\":true}" : ",\"approved\":false}");
+}
+
+void appendPayload(std::string& out, const WsJoinRoomRequestPayload& payload) {
+  out.push_back('{');
+  appendField(out, "requestId", payload.requestId);
+  out.push_back(',');
+  appendField(out, "roomId", payload.roomId);
+  out.push_back(',');
+  appendField(out, "userId", payload.userId);
+  out.push_back(',');
+  appendField(out, "username", payload.username);
+  out.push_back('}');
+}
+
+void appendPayload(std::string& out, const WsRoomReadyPayload& payload) {
+  out.push_back('{');
+  appendField(out, "roomId", payload.roomId);
+  if (not payload.iceServers.empty()) {
+    out.append(",\"iceServers\":");
+    appendPayload(out, payload.iceServers);
+  }
+  out.push_back('}');
+}
+
+void appendPayload(std::string& out, const WsRoomEndPayload& payload) {
+  out.push_back('{');
+  appendField(out, "roomId", payload.roomId);
+  out.push_back('}');
+}
+
+void appendPayload(std::string& out, const WsParticipantPayload& payload) {
+  out.push_back('{');
+  appendField(out, "roomId", payload.roomId);
+  out.push_back(',');
+  appendField(out, "userId", payload.userId);
+  out.push_back(',');
+  appendField(out, "username", payload.username);
+  out.push_back('}');
+}
+
+void appendPayload(std::string& out, const WsRelayPayload& payload) {
+  out.push_back('{');
+  appendField(out, "roomId", payload.roomId);
+  out.push_back(',');
+  appendField(out, "userId", payload.userId);
+  out.push_back(',');
+  appendField(out, "host", payload.host);
+  char digits[8];
+  auto result = std::to_chars(digits, digits + sizeof(digits), payload.port);
+  out.append(",\"port\":");
+  out.append(digits, result.ptr);
+  out.push_back(',');
+  appendField(out, "token", payload.token);
+  out.push_back('}');
+}
+
+void appendPayload(std::string& out, const WsSessionPayload& payload) {
+  out.push_back('{');
+  appendField(out, "token", payload.token);
+  out.append(payload.resumed ? ",\"resumed\":true" : ",\"resumed\":false");
+  char digits[20];
+  auto result = std::to_chars(digits, digits + sizeof(digits), payload.seq);
+  out.append(",\"seq\":");
+  out.append(digits, result.ptr);
+  out.push_back('}');
+}
+}  // namespace
+
+void appendJsonString(std::string& out, std::string_view value) {
+  // Most payloads need no or very few escapes, reserve for the common case
+  out.reserve(out.size() + value.size() + 2);
+  out.push_back('"');
+
+  const char* runStart = value.data();
+  const char* end = value.data() + value.size();
+  for (const char* p = runStart; p != end; ++p) {
+    if (NEEDS_ESCAPE[static_cast<uint8_t>(*p)]) {
+      out.append(runStart, p);
+      appendEscaped(out, *p);
+      runStart = p + 1;
+    }
+  }
+  out.append(runStart, end);
+
+  out.push_back('"');
+}
+
+void encodeWsMessage(std::string& out, const WsMessage& message) {
+  appendHeader(out, message.type, message.id, message.from);
+  std::visit([&out](const auto& payload) { appendPayload(out, payload); },
+             message.payload);
+  out.push_back('}');
+}
+
+void encodeWsMessage(std::string& out, WsMessage::Type type,
+                     std::string_view payload, const Id& from) {
+  appendHeader(out, type, {}, from);
+  appendJsonString(out, payload);
+  out.push_back('}');
+}
+
+std::string& threadEncodeBuffer() {
+  thread_local std::string buffer;
+  buffer.clear();
+  return buffer;
+}
+}  // namespace glimpse
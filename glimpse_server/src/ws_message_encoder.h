@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "ws_message.h"
+
+namespace glimpse {
+
+// Writes the wire form of a message, {"type":N,"id":...,"from":...,
+// "payload":...} with "id" and "from" only present when set, straight into
+// `out` without building a JSON DOM. Payload strings are escaped in a
+// single pass from the caller's buffer.
+// Strings are expected to be valid UTF-8, which holds for everything that
+// came in through the JSON parser.
+void encodeWsMessage(std::string& out, const WsMessage& message);
+void encodeWsMessage(std::string& out, WsMessage::Type type,
+                     std::string_view payload, const Id& from = {});
+
+// Appends `value` as a quoted JSON string
+void appendJsonString(std::string& out, std::string_view value);
+
+// Buffer reused by every encode on the calling thread. Its content is only
+// valid until the next call.
+std::string& threadEncodeBuffer();
+}  // namespace glimpse
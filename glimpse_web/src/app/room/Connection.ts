@@ -1,4 +1,3 @@
-import { exchangeICE, exchangeSDP } from "@/utils/api";
 import { proxy } from "valtio";
 
 export enum WsMessageType {
@@ -12,6 +11,17 @@ export enum WsMessageType {
   RoomEnd,
   SDP,
   ICE,
+  JoinRoom,
+  ApproveJoinRequest,
+  DenyJoinRequest,
+  EndRoom,
+  Response,
+  ICEBatch,
+  ParticipantJoined,
+  ParticipantLeft,
+  OpenRelay,
+  RelayReady,
+  Session,
 }
 
 export enum WsConnectionState {
@@ -36,6 +46,23 @@ type JoinRoomRequest = {
   username: string;
 };
 
+type PendingRequest = {
+  resolve: (payload: any) => void;
+  reject: (error: Error) => void;
+};
+
+// Used when the server announces no ICE servers of its own
+const DEFAULT_ICE_SERVERS: RTCIceServer[] = [
+  { urls: "stun:stun.l.google.com:19302" },
+];
+
+// Backoff between attempts to resume a dropped session
+const RECONNECT_DELAY_MS = 500;
+const RECONNECT_MAX_DELAY_MS = 8000;
+// Close code of a server handing over to a new process, which cannot
+// resume the session
+const SERVICE_RESTART_CODE = 1012;
+
 type State = {
   wsConnectionState: WsConnectionState;
   peerConnectionState: PeerConnectionState;
@@ -48,6 +75,17 @@ class Connection {
   private _peerConnection: RTCPeerConnection | null = null;
   private _pendingICEs: string[] = [];
   private _mediaStream: MediaStream | null = null;
+  private _nextRequestId = 0;
+  private _pendingRequests = new Map<string, PendingRequest>();
+  private _iceServers: RTCIceServer[] = DEFAULT_ICE_SERVERS;
+  private _url = "";
+  // The session the server numbers its frames in, see the SESSION message.
+  // A dropped connection resumes it after the last frame received.
+  private _resumeToken: string | null = null;
+  private _lastSeq = 0;
+  private _reconnectAttempts = 0;
+  private _resuming = false;
+  private _closing = false;
 
   public state = proxy<State>({
     wsConnectionState: WsConnectionState.Disconnected,
@@ -69,55 +107,115 @@ class Connection {
   public async connect(url: string) {
     if (this._connection) {
       this._connection.close();
+      this.rejectPendingRequests();
     }
     if (this._peerConnection) {
       this._peerConnection.close();
     }
-    this.state.wsConnectionState = WsConnectionState.Connecting;
+    this._url = url;
+    this._resumeToken = null;
+    this._lastSeq = 0;
     this.state.peerConnectionState = PeerConnectionState.Waiting;
+    return this.open(`${url}&resume=1`);
+  }
+
+  private open(url: string) {
+    this._closing = false;
+    this.state.wsConnectionState = WsConnectionState.Connecting;
     return new Promise<void>((resolve, reject) => {
-      this._connection = new WebSocket(url);
-      this._connection.onmessage = (event) => {
+      const connection = new WebSocket(url);
+      this._connection = connection;
+      connection.onmessage = (event) => {
         this.onMessage(JSON.parse(event.data));
       };
-      this._connection.onclose = () => {
+      connection.onclose = (event) => {
+        // Replaced by connect()
+        if (this._connection !== connection) {
+          return;
+        }
         console.log("Disconnected from server");
         this.state.wsConnectionState = WsConnectionState.Disconnected;
         this._connection = null;
+        this.rejectPendingRequests();
+        if (this._resumeToken && !this._closing) {
+          this.reconnect(event.code !== SERVICE_RESTART_CODE);
+        }
       };
-      this._connection.onerror = () => {
-        this._connection = null;
-      };
-      this._connection.onopen = () => {
+      connection.onopen = () => {
         console.log("Connected to server");
         this.state.wsConnectionState = WsConnectionState.Connected;
+        this._reconnectAttempts = 0;
         resolve();
       };
       // timeout after 5 seconds
       setTimeout(() => {
-        if (
-          this._connection &&
-          this._connection.readyState !== WebSocket.OPEN
-        ) {
+        if (connection.readyState !== WebSocket.OPEN) {
           reject("Failed to connect to server");
-          this._connection.close();
-          this._connection = null;
+          connection.close();
         }
       }, 5000);
     });
   }
 
+  // Resumes the session with ?resume= and ?lastSeq=, the server replays the
+  // frames the client missed meanwhile. Without `resume`, a new session
+  // starts.
+  private reconnect(resume: boolean) {
+    const delay = Math.min(
+      RECONNECT_MAX_DELAY_MS,
+      RECONNECT_DELAY_MS * 2 ** this._reconnectAttempts++,
+    );
+    setTimeout(() => {
+      if (this._connection || this._closing || !this._resumeToken) {
+        return;
+      }
+      this._resuming = resume;
+      if (!resume) {
+        console.log("Starting a new session after a server restart");
+        this.open(`${this._url}&resume=1`).catch((error) =>
+          console.error(error),
+        );
+        return;
+      }
+      console.log("Resuming session after frame", this._lastSeq);
+      this.open(
+        `${this._url}&resume=${this._resumeToken}&lastSeq=${this._lastSeq}`,
+      ).catch((error) => console.error(error));
+    }, delay);
+  }
+
+  private rejectPendingRequests() {
+    this._pendingRequests.forEach((request) =>
+      request.reject(new Error("Disconnected from server")),
+    );
+    this._pendingRequests.clear();
+  }
+
   public send(message: any) {
     if (this._connection) {
       this._connection.send(JSON.stringify(message));
     }
   }
 
+  // Sends a request answered by the server with a Response or an Error
+  // carrying the same id
+  public request(type: WsMessageType, payload: object): Promise<any> {
+    if (!this._connection) {
+      return Promise.reject(new Error("Not connected to server"));
+    }
+    const id = `${++this._nextRequestId}`;
+    return new Promise((resolve, reject) => {
+      this._pendingRequests.set(id, { resolve, reject });
+      this.send({ type, id, payload });
+    });
+  }
+
   public setJoinRoomRequestId(requestId: string) {
     this._joinRoomRequestId = requestId;
   }
 
   public close() {
+    this._closing = true;
     if (this._connection) {
       this._connection.close();
     }
@@ -126,6 +224,31 @@ class Connection {
   private async onMessage(message: any) {
     console.log("Received message", message);
 
+    // Every frame after SESSION is numbered, SESSION itself tells where the
+    // count stands
+    if (message.type === WsMessageType.Session) {
+      this._resumeToken = message.payload.token;
+      this._lastSeq = message.payload.seq;
+      if (this._resuming && !message.payload.resumed) {
+        console.error("Session could not be resumed");
+      }
+      this._resuming = false;
+      return;
+    }
+    this._lastSeq++;
+
+    const request =
+      message.id !== undefined && this._pendingRequests.get(message.id);
+    if (request) {
+      this._pendingRequests.delete(message.id);
+      if (message.type === WsMessageType.Error) {
+        request.reject(new Error(message.payload));
+      } else {
+        request.resolve(message.payload);
+      }
+      return;
+    }
+
     switch (message.type) {
       case WsMessageType.RequestJoinRoom:
         if (this.isHost) {
@@ -153,6 +276,11 @@ class Connection {
       case WsMessageType.RoomReady:
         if (message.payload.roomId === this.roomId) {
           console.log("Room is ready");
+          const urls: string[] = message.payload.iceServers ?? [];
+          this._iceServers =
+            urls.length !== 0
+              ? urls.map((url) => ({ urls: url }))
+              : DEFAULT_ICE_SERVERS;
           this.state.peerConnectionState = PeerConnectionState.Connecting;
           console.log(this.isHost);
           if (this.isHost) {
@@ -163,11 +291,11 @@ class Connection {
         break;
 
       case WsMessageType.ICE:
-        if (!this._peerConnection || !this._peerConnection.remoteDescription) {
-          this._pendingICEs.push(message.payload);
-        } else {
-          this._peerConnection.addIceCandidate(JSON.parse(message.payload));
-        }
+        this.addRemoteICE(message.payload);
+        break;
+
+      case WsMessageType.ICEBatch:
+        message.payload.forEach((ice: string) => this.addRemoteICE(ice));
         break;
 
       case WsMessageType.SDP:
@@ -188,16 +316,11 @@ class Connection {
           const answer = await (
             this._peerConnection as unknown as RTCPeerConnection
           ).createAnswer();
-          const userId = window.localStorage.getItem("userId");
-          if (!userId) {
-            console.error("Missing userId");
-            return;
-          }
           if (!this.roomId) {
             console.error("Missing roomId");
             return;
           }
-          exchangeSDP(this.roomId, userId, JSON.stringify(answer));
+          this.sendSDP(this.roomId, JSON.stringify(answer));
           (
             this._peerConnection as unknown as RTCPeerConnection
           ).setLocalDescription(answer);
@@ -215,6 +338,10 @@ class Connection {
           }
         }
         break;
+      case WsMessageType.Error:
+        console.error("Server error", message.payload);
+        break;
+
       case WsMessageType.RoomEnd:
         if (message.payload.roomId === this.roomId) {
           console.log("Room has ended");
@@ -232,26 +359,25 @@ class Connection {
     }
   }
 
+  addRemoteICE(ice: string) {
+    if (!this._peerConnection || !this._peerConnection.remoteDescription) {
+      this._pendingICEs.push(ice);
+    } else {
+      this._peerConnection.addIceCandidate(JSON.parse(ice));
+    }
+  }
+
   createPeerConnection() {
     this._peerConnection = new RTCPeerConnection({
-      iceServers: [{ urls: "stun:stun.l.google.com:19302" }],
+      iceServers: this._iceServers,
     });
     this._peerConnection.onicecandidate = (event) => {
       if (event.candidate) {
-        const userId = window.localStorage.getItem("userId");
-        if (!userId) {
-          console.error("Missing userId");
-          return;
-        }
         if (!this.roomId) {
           console.error("Missing roomId");
           return;
         }
-        exchangeICE(
-          this.roomId,
-          userId,
-          JSON.stringify(event.candidate.toJSON()),
-        );
+        this.sendICE(this.roomId, JSON.stringify(event.candidate.toJSON()));
       }
     };
     this._peerConnection.onconnectionstatechange = () => {
@@ -267,17 +393,12 @@ class Connection {
       if (this._peerConnection?.remoteDescription) {
         return;
       }
-      const userId = window.localStorage.getItem("userId");
       const offer = await this._peerConnection?.createOffer();
-      if (!userId) {
-        console.error("Missing userId");
-        return;
-      }
       if (!this.roomId) {
         console.error("Missing roomId");
         return;
       }
-      exchangeSDP(this.roomId, userId, JSON.stringify(offer));
+      this.sendSDP(this.roomId, JSON.stringify(offer));
       this._peerConnection?.setLocalDescription(offer);
     };
 
@@ -294,6 +415,15 @@ class Connection {
     };
   }
 
+  // SDP and ICE are fire-and-forget, the server only answers them on error
+  sendSDP(roomId: string, sdp: string) {
+    this.send({ type: WsMessageType.SDP, payload: { roomId, sdp } });
+  }
+
+  sendICE(roomId: string, ice: string) {
+    this.send({ type: WsMessageType.ICE, payload: { roomId, ice } });
+  }
+
   async setUpVideo() {
     try {
       this._mediaStream = await navigator.mediaDevices.getUserMedia({
@@ -6,14 +6,9 @@ import {
   connection,
   PeerConnectionState,
   WsConnectionState,
+  WsMessageType,
 } from "./Connection";
-import {
-  approveJoinRoom,
-  denyJoinRoom,
-  endRoom,
-  joinRoom,
-  serverWsUrl,
-} from "@/utils/api";
+import { serverWsUrl } from "@/utils/api";
 import { useSnapshot } from "valtio";
 import MiniVideo from "./MiniVideo";
 import MainVideo from "./MainVideo";
@@ -27,12 +22,13 @@ export default function ConnectionContainer() {
 
   const handleApproveJoinRoom = () => {
     try {
-      const userId = window.localStorage.getItem("userId");
       const requestId = connection.state.joinRoomRequest?.requestId;
-      if (!userId || !requestId) {
-        throw new Error("missing userId or requestId");
+      if (!requestId) {
+        throw new Error("missing requestId");
       }
-      approveJoinRoom(userId, requestId);
+      connection
+        .request(WsMessageType.ApproveJoinRequest, { requestId })
+        .catch((err: Error) => console.error(err.message));
     } catch (error) {
       console.error((error as Error).message);
     }
@@ -40,12 +36,13 @@ export default function ConnectionContainer() {
 
   const handleDenyJoinRoom = () => {
     try {
-      const userId = window.localStorage.getItem("userId");
       const requestId = connection.state.joinRoomRequest?.requestId;
-      if (!userId || !requestId) {
-        throw new Error("missing userId or requestId");
+      if (!requestId) {
+        throw new Error("missing requestId");
       }
-      denyJoinRoom(userId, requestId);
+      connection
+        .request(WsMessageType.DenyJoinRequest, { requestId })
+        .catch((err: Error) => console.error(err.message));
       connection.state.peerConnectionState = PeerConnectionState.Waiting;
     } catch (error) {
       console.error((error as Error).message);
@@ -54,11 +51,12 @@ export default function ConnectionContainer() {
 
   const handleEndRoom = () => {
     try {
-      const userId = window.localStorage.getItem("userId");
-      if (!userId || !roomId) {
-        throw new Error("missing userId or roomId");
+      if (!roomId) {
+        throw new Error("missing roomId");
       }
-      endRoom(roomId, userId);
+      connection
+        .request(WsMessageType.EndRoom, { roomId })
+        .catch((err: Error) => console.error(err.message));
     } catch (error) {
       console.error((error as Error).message);
     }
@@ -74,8 +72,10 @@ export default function ConnectionContainer() {
     connection
       .connect(`${serverWsUrl}/ws?&userId=${userId}&username=${username}`)
       .then(async () => {
-        const response = await joinRoom(username, userId, roomId);
-        connection.setJoinRoomRequestId(response.requestId);
+        const requestId = await connection.request(WsMessageType.JoinRoom, {
+          roomId,
+        });
+        connection.setJoinRoomRequestId(requestId);
       })
       .catch((err: Error) => {
         console.error(err);